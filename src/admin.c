@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+#define SERVER_IP "127.0.0.1"   // Admin commands are only accepted from the server's host
+#define ADMIN_PORT 8090         // Server port for admin commands
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in server_addr; // Server address
+    int sock; // Socket descriptor
+    message_t msg;
+
+    if (argc != 2 || strcmp(argv[1], "stats") != 0) {
+        fprintf(stderr, "Usage: %s stats\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(ADMIN_PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection Failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    msg.type = MSG_STATS;
+    if (send(sock, &msg, sizeof(message_t), 0) != sizeof(message_t)) {
+        perror("send");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) { // Print the report until the empty frame that ends it
+        if (recv(sock, &msg, sizeof(message_t), MSG_WAITALL) != sizeof(message_t)) {
+            perror("recv");
+            close(sock);
+            exit(EXIT_FAILURE);
+        }
+        if (msg.type != MSG_STATS) {
+            fprintf(stderr, "Unexpected message type %d\n", msg.type);
+            close(sock);
+            exit(EXIT_FAILURE);
+        }
+        msg.data[BUFFER_SIZE - 1] = '\0';
+        if (msg.data[0] == '\0') {
+            break;
+        }
+        fputs(msg.data, stdout);
+    }
+
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+
+#include "admission.h"
+
+// Function to tell whether entry a leaves before entry b
+static int before(const admission_queue_t *queue, const admission_entry_t *a, const admission_entry_t *b) {
+    if (!queue->fifo && a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return a->seq < b->seq;
+}
+
+int admission_push(admission_queue_t *queue, uint64_t deadline, uint64_t since, void *order) {
+    if (queue->count == queue->size) {
+        uint32_t size = queue->size ? queue->size * 2 : 16;
+        admission_entry_t *heap = realloc(queue->heap, size * sizeof(admission_entry_t));
+        if (heap == NULL) {
+            return -1;
+        }
+        queue->heap = heap;
+        queue->size = size;
+    }
+
+    admission_entry_t entry = {deadline, queue->seq++, since, order};
+    uint32_t i = queue->count++;
+    while (i > 0) {     // Sift up
+        uint32_t parent = (i - 1) / 2;
+        if (!before(queue, &entry, &queue->heap[parent])) {
+            break;
+        }
+        queue->heap[i] = queue->heap[parent];
+        i = parent;
+    }
+    queue->heap[i] = entry;
+    return 0;
+}
+
+void *admission_pop(admission_queue_t *queue, uint64_t *deadline, uint64_t *since) {
+    if (queue->count == 0) {
+        return NULL;
+    }
+    admission_entry_t top = queue->heap[0];
+    admission_entry_t last = queue->heap[--queue->count];
+    uint32_t i = 0;
+    for (;;) {      // Sift the last entry down from the root
+        uint32_t child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count && before(queue, &queue->heap[child + 1], &queue->heap[child])) {
+            child++;
+        }
+        if (!before(queue, &queue->heap[child], &last)) {
+            break;
+        }
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    if (queue->count > 0) {
+        queue->heap[i] = last;
+    }
+    if (deadline != NULL) {
+        *deadline = top.deadline;
+    }
+    if (since != NULL) {
+        *since = top.since;
+    }
+    return top.order;
+}
+
+void admission_free(admission_queue_t *queue) {
+    free(queue->heap);
+    queue->heap = NULL;
+    queue->count = 0;
+    queue->size = 0;
+}
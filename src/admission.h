@@ -0,0 +1,31 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+// Admission queue in front of one restaurant's kitchen. Orders the kitchen has
+// no room for wait here and leave earliest deadline first, so an order that
+// must be ready soon is not stuck behind orders that can wait; orders with the
+// same deadline leave in arrival order. A queue with fifo set ignores the
+// deadlines, for comparison. Callers serialize access.
+
+typedef struct {
+    uint64_t deadline;          // Milliseconds since the epoch the order should be ready by
+    uint64_t seq;               // Arrival number, breaks deadline ties
+    uint64_t since;             // When the order was queued, in the caller's clock
+    void *order;
+} admission_entry_t;
+
+typedef struct {
+    admission_entry_t *heap;    // Binary min-heap on deadline then arrival
+    uint32_t count;
+    uint32_t size;
+    uint64_t seq;
+    int fifo;                   // Leave in arrival order instead
+} admission_queue_t;
+
+int admission_push(admission_queue_t *queue, uint64_t deadline, uint64_t since, void *order);  // -1 when out of memory
+void *admission_pop(admission_queue_t *queue, uint64_t *deadline, uint64_t *since);     // Earliest order, NULL when empty
+void admission_free(admission_queue_t *queue);     // Orders still queued are the caller's to release first
+
+#endif
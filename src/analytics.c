@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "analytics.h"
+
+#define QUEUE_SIZE 4096             // Ring slots, a power of two
+#define BUCKET_SECONDS 10           // Width of a window bucket
+#define BUCKETS 360                 // One hour of buckets per restaurant
+#define TOP_COUNTERS 64             // Space-Saving counters, bounds the error of item counts
+#define DRAIN_INTERVAL_US 50000     // Aggregator wakes up this often
+
+typedef struct {
+    uint32_t time;              // Seconds since the epoch
+    uint8_t restaurant;
+    uint16_t item;
+    uint32_t price_cents;
+} event_t;                      // Order accepted on the order path
+
+typedef struct {
+    uint32_t start;             // First second of the bucket, stale buckets are reset before use
+    uint32_t orders;
+    uint64_t revenue_cents;
+} bucket_t;
+
+typedef struct {
+    uint32_t key;               // Restaurant id << 16 | item
+    uint32_t count;             // Upper bound of the item's orders
+    uint32_t error;             // Count inherited from the item it replaced
+} counter_t;
+
+static event_t queue[QUEUE_SIZE];
+static uint32_t queue_head = 0;     // Next slot to write, advanced by the producer
+static uint32_t queue_tail = 0;     // Next slot to read, advanced by the aggregator
+static uint64_t dropped = 0;        // Events lost to a full ring, producer only
+
+static bucket_t buckets[ANALYTICS_RESTAURANTS][BUCKETS];
+static counter_t counters[TOP_COUNTERS];
+static uint32_t counter_count = 0;
+static uint64_t events_seen = 0;
+static pthread_mutex_t analytics_mutex = PTHREAD_MUTEX_INITIALIZER;    // Guards the aggregates, never taken by the producer
+
+// Function to queue an order event without locking
+int analytics_record(uint8_t restaurant, uint16_t item, uint32_t price_cents) {
+    uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return -1;  // Analytics fall behind rather than slowing orders down
+    }
+    event_t *event = &queue[head & (QUEUE_SIZE - 1)];
+    event->time = (uint32_t)time(NULL);
+    event->restaurant = restaurant;
+    event->item = item;
+    event->price_cents = price_cents;
+    __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function to count an item in the Space-Saving sketch
+static void count_item(uint32_t key) {
+    uint32_t smallest = 0;
+    for (uint32_t i = 0; i < counter_count; i++) {
+        if (counters[i].key == key) {
+            counters[i].count++;
+            return;
+        }
+        if (counters[i].count < counters[smallest].count) {
+            smallest = i;
+        }
+    }
+    if (counter_count < TOP_COUNTERS) {
+        counters[counter_count++] = (counter_t){key, 1, 0};
+        return;
+    }
+    // Evict the least counted item, the newcomer inherits its count as error
+    counters[smallest].key = key;
+    counters[smallest].error = counters[smallest].count;
+    counters[smallest].count++;
+}
+
+// Function to fold an event into the windows and the sketch, caller holds analytics_mutex
+static void aggregate(const event_t *event) {
+    if (event->restaurant >= ANALYTICS_RESTAURANTS) {
+        return;
+    }
+    uint32_t start = event->time - event->time % BUCKET_SECONDS;
+    bucket_t *bucket = &buckets[event->restaurant][(start / BUCKET_SECONDS) % BUCKETS];
+    if (bucket->start != start) {   // Left over from an hour ago
+        bucket->start = start;
+        bucket->orders = 0;
+        bucket->revenue_cents = 0;
+    }
+    bucket->orders++;
+    bucket->revenue_cents += event->price_cents;
+    count_item((uint32_t)event->restaurant << 16 | event->item);
+    events_seen++;
+}
+
+// Function to drain the ring into the aggregates
+static void *aggregator(void *arg) {
+    while (1) {
+        uint32_t tail = queue_tail;
+        uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+        if (tail != head) {
+            pthread_mutex_lock(&analytics_mutex);
+            for (; tail != head; tail++) {
+                aggregate(&queue[tail & (QUEUE_SIZE - 1)]);
+            }
+            pthread_mutex_unlock(&analytics_mutex);
+            __atomic_store_n(&queue_tail, tail, __ATOMIC_RELEASE);     // Hand the slots back to the producer
+        }
+        usleep(DRAIN_INTERVAL_US);
+    }
+    return NULL;
+}
+
+int analytics_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, aggregator, NULL) != 0) {
+        perror("analytics thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function to sum a restaurant's buckets that start in [from, to), caller holds analytics_mutex
+static void window(int restaurant, uint32_t from, uint32_t to, uint32_t *orders, uint64_t *revenue_cents) {
+    *orders = 0;
+    *revenue_cents = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        const bucket_t *bucket = &buckets[restaurant][i];
+        if (bucket->orders > 0 && bucket->start >= from && bucket->start < to) {
+            *orders += bucket->orders;
+            *revenue_cents += bucket->revenue_cents;
+        }
+    }
+}
+
+static int by_count(const void *a, const void *b) {
+    const counter_t *x = a, *y = b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+// Function to append formatted text to a report, truncating at the end of the buffer
+static void append(char *buf, size_t size, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    if (n > 0) {
+        *len = (size_t)n < size - *len ? *len + n : size - 1;
+    }
+}
+
+// Function to write the windows and top items as text
+size_t analytics_report(char *buf, size_t size, const char *const *names, int restaurants) {
+    static const uint32_t sliding[] = {60, 300, 3600};     // Sliding windows in seconds
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t minute = now - now % 60;
+    size_t len = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+    pthread_mutex_lock(&analytics_mutex);
+    append(buf, size, &len, "orders seen %llu, dropped %llu\n", (unsigned long long)events_seen,
+           (unsigned long long)__atomic_load_n(&dropped, __ATOMIC_RELAXED));
+    append(buf, size, &len, "restaurant: last full minute | orders/min over 1m 5m 60m | revenue over 1m 5m 60m\n");
+    for (int id = 1; id <= restaurants && id < ANALYTICS_RESTAURANTS; id++) {
+        uint32_t orders[3];
+        uint64_t revenue[3];
+        window(id, minute - 60, minute, &orders[0], &revenue[0]);     // Tumbling: the last full minute
+        append(buf, size, &len, "%s: %u $%.2f |", names[id - 1], orders[0], revenue[0] / 100.0);
+        for (int w = 0; w < 3; w++) {
+            window(id, now - sliding[w] + 1, now + 1, &orders[w], &revenue[w]);
+        }
+        append(buf, size, &len, " %.1f %.1f %.1f | $%.2f $%.2f $%.2f\n", orders[0] * 60.0 / sliding[0], orders[1] * 60.0 / sliding[1],
+               orders[2] * 60.0 / sliding[2], revenue[0] / 100.0, revenue[1] / 100.0, revenue[2] / 100.0);
+    }
+
+    counter_t top[TOP_COUNTERS];
+    uint32_t count = counter_count;
+    memcpy(top, counters, count * sizeof(counter_t));
+    pthread_mutex_unlock(&analytics_mutex);
+
+    qsort(top, count, sizeof(counter_t), by_count);
+    append(buf, size, &len, "top items: orders (overcount at most)\n");
+    for (uint32_t i = 0; i < count && i < ANALYTICS_TOP_ITEMS; i++) {
+        int id = top[i].key >> 16;
+        append(buf, size, &len, "%s item %u: %u (+%u)\n", id >= 1 && id <= restaurants ? names[id - 1] : "?",
+               top[i].key & 0xffff, top[i].count, top[i].error);
+    }
+    return len;
+}
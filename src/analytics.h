@@ -0,0 +1,21 @@
+#ifndef ANALYTICS_H
+#define ANALYTICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Live order analytics. The order path pushes events into a lock-free
+// single-producer ring and never waits; an aggregator thread drains it into
+// per-restaurant 10 second buckets covering the last hour, from which the
+// tumbling (last full minute) and sliding (1, 5 and 60 minute) windows are
+// summed, and a Space-Saving sketch of the most ordered items. Memory is
+// fixed however many items or orders there are.
+
+#define ANALYTICS_RESTAURANTS 8     // Restaurant ids tracked are below this
+#define ANALYTICS_TOP_ITEMS 5       // Items listed in a report
+
+int analytics_start(void);
+int analytics_record(uint8_t restaurant, uint16_t item, uint32_t price_cents);    // Event loop thread only, -1 when the ring is full
+size_t analytics_report(char *buf, size_t size, const char *const *names, int restaurants);  // names[id - 1] of each restaurant
+
+#endif
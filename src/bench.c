@@ -0,0 +1,1781 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+
+#include "protocol.h"
+#include "session.h"
+#include "journal.h"
+#include "history.h"
+#include "menu.h"
+#include "catalog.h"
+#include "admission.h"
+#include "codel.h"
+#include "shm_ring.h"
+
+#define SERVER_IP "127.0.0.1"   // Benchmarks run against a local server
+#define CLIENT_PORT 8080        // Port for clients to connect
+#define GATEWAY_PORT 8081       // Port for gateways carrying many sessions
+#define ADMIN_PORT 8090         // Probed to see that a started server is up, opens no session
+#define MCDONALDS_PORT 5556     // TCP Port for McDonald's
+#define BENCH_IO_JOURNAL "/tmp/bench-io.journal"   // Order journal of the servers started by bench io
+#define BENCH_IO_HISTORY "/tmp/bench-io-history"   // Order history of the servers started by bench io
+#define BENCH_UPGRADE_SOCKET "/tmp/bench-upgrade.sock"  // Upgrade socket of the servers started by bench upgrade
+
+int bench_io(int argc, char *argv[]);
+int bench_sessions(int argc, char *argv[]);
+int bench_journal(int argc, char *argv[]);
+int bench_history(int argc, char *argv[]);
+int bench_catalog(int argc, char *argv[]);
+int bench_admission(int argc, char *argv[]);
+int bench_shed(int argc, char *argv[]);
+int bench_ring(int argc, char *argv[]);
+int bench_gateway(int argc, char *argv[]);
+int bench_upgrade(int argc, char *argv[]);
+int bench_throttle(int argc, char *argv[]);
+int bench_credits(int argc, char *argv[]);
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "io") == 0) {
+        return bench_io(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "sessions") == 0) {
+        return bench_sessions(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "journal") == 0) {
+        return bench_journal(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "history") == 0) {
+        return bench_history(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "catalog") == 0) {
+        return bench_catalog(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "admission") == 0) {
+        return bench_admission(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "shed") == 0) {
+        return bench_shed(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "ring") == 0) {
+        return bench_ring(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "gateway") == 0) {
+        return bench_gateway(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "upgrade") == 0) {
+        return bench_upgrade(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "throttle") == 0) {
+        return bench_throttle(argc - 1, argv + 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "credits") == 0) {
+        return bench_credits(argc - 1, argv + 1);
+    }
+    fprintf(stderr, "Usage: %s io|sessions|journal|history|catalog|admission|shed|ring|gateway|upgrade|throttle|credits [options]\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+// Function to read the monotonic clock in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to delete a history directory and its segments
+static void remove_history(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    char path[4200];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+// Function to connect to a local server port, retrying while the server starts
+static int connect_local(int port, int attempts) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+
+    for (int i = 0; i < attempts; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            return -1;
+        }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return sock;
+        }
+        close(sock);
+        usleep(50000);
+    }
+    return -1;
+}
+
+// Function to receive one whole frame
+static int recv_msg(int sock, message_t *msg) {
+    do {
+        if (recv(sock, msg, sizeof(message_t), MSG_WAITALL) != sizeof(message_t)) {
+            return -1;
+        }
+    } while (msg->type == ERROR);
+    return 0;
+}
+
+static int send_msg(int sock, message_type_t type, const char *data, const session_token_t *token) {
+    message_t msg;
+    memset(&msg, 0, sizeof(message_t));
+    msg.type = type;
+    strcpy(msg.data, data);
+    if (token != NULL) {
+        msg.client_token = *token;
+    }
+    return send(sock, &msg, sizeof(message_t), MSG_NOSIGNAL) == sizeof(message_t) ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------
+// io: loopback comparison of the server's epoll and io_uring backends
+
+typedef struct {
+    int orders;             // Orders to place
+    long long *latency;     // Per-order latency in ns
+    int done;               // Orders completed
+} io_client_t;
+
+// Fake McDonald's that answers every order at once
+static void *io_restaurant(void *arg) {
+    int sock = *(int *)arg;
+    message_t msg;
+    while (recv_msg(sock, &msg) == 0) {
+        if (msg.type == MSG_ORDER) {
+            if (send_msg(sock, MSG_ESTIMATED_TIME, "Your order will be ready in 1 minutes.", &msg.client_token) < 0) {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Client placing orders through the full menu flow back to back
+static void *io_client(void *arg) {
+    io_client_t *client = arg;
+    message_t msg;
+    session_token_t token;
+
+    int sock = connect_local(CLIENT_PORT, 20);
+    if (sock < 0 || recv_msg(sock, &msg) < 0 || msg.type != MSG_TOKEN) {
+        fprintf(stderr, "bench client: no token from server\n");
+        if (sock >= 0) {
+            close(sock);
+        }
+        return NULL;
+    }
+    token = msg.client_token;
+
+    while (client->done < client->orders) {
+        long long start = now_ns();
+        if (send_msg(sock, MSG_REQUEST_MENU, "REQUEST_MENU", &token) < 0 || recv_msg(sock, &msg) < 0) {
+            break;
+        }
+        if (send_msg(sock, MSG_ORDER, "1", &token) < 0 || recv_msg(sock, &msg) < 0) {
+            break;
+        }
+        if (msg.type == REST_UNAVALIABLE) {     // Restaurant not registered yet
+            usleep(10000);
+            continue;
+        }
+        if (send_msg(sock, MSG_ORDER, "ORDER: 1", &token) < 0 || recv_msg(sock, &msg) < 0) {
+            break;
+        }
+        if (msg.type != MSG_ESTIMATED_TIME) {
+            fprintf(stderr, "bench client: unexpected message type %d\n", msg.type);
+            break;
+        }
+        client->latency[client->done++] = now_ns() - start;
+    }
+    close(sock);
+    return NULL;
+}
+
+// Function to start the server binary with the given backend, session table size (NULL for the default) and further
+// options (a NULL-terminated list or NULL), returns the read end of its stderr
+static pid_t start_server(const char *path, const char *backend, const char *max_clients, const char *const *extra, int *err_fd) {
+    int pipe_fd[2];
+    if (pipe(pipe_fd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);   // The server is chatty, keep only the stats line
+        dup2(pipe_fd[1], STDERR_FILENO);
+        close(pipe_fd[0]);
+        // Benchmarks open sessions and send requests as fast as they can, the rate limits would only measure themselves
+        const char *args[32] = {path, "--io", backend, "--journal", BENCH_IO_JOURNAL, "--history", BENCH_IO_HISTORY,
+                                "--accept-rate", "0", "--rate", "all=0", "--address-rate", "all=0"};
+        int count = 13;
+        if (max_clients != NULL) {
+            args[count++] = "--max-clients";
+            args[count++] = max_clients;
+        }
+        for (int i = 0; extra != NULL && extra[i] != NULL && count < 31; i++) {
+            args[count++] = extra[i];   // After the defaults above, so they can override them
+        }
+        args[count] = NULL;
+        execv(path, (char *const *)args);
+        perror("execv");
+        _exit(127);
+    }
+    close(pipe_fd[1]);
+    *err_fd = pipe_fd[0];
+    return pid;
+}
+
+static int run_io_backend(const char *server, const char *backend, int clients, int orders) {
+    int err_fd;
+    pid_t pid = start_server(server, backend, NULL, NULL, &err_fd);
+    if (pid < 0) {
+        return -1;
+    }
+
+    int restaurant = connect_local(MCDONALDS_PORT, 100);
+    if (restaurant < 0) {
+        fprintf(stderr, "bench: server did not come up\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    send_msg(restaurant, MSG_MENU, "McDonalds 1. Bench Burger - $1.00", NULL);
+    pthread_t restaurant_thread;
+    pthread_create(&restaurant_thread, NULL, io_restaurant, &restaurant);
+
+    io_client_t *state = calloc(clients, sizeof(io_client_t));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    long long start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        state[i].orders = orders;
+        state[i].latency = calloc(orders, sizeof(long long));
+        pthread_create(&threads[i], NULL, io_client, &state[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    long long elapsed = now_ns() - start;
+
+    shutdown(restaurant, SHUT_RDWR);
+    pthread_join(restaurant_thread, NULL);
+    close(restaurant);
+    usleep(100000);     // Let the server see the disconnects before counting
+    kill(pid, SIGTERM);
+
+    char stats[512] = "";
+    ssize_t n, total = 0;
+    while ((n = read(err_fd, stats + total, sizeof(stats) - 1 - total)) > 0) {
+        total += n;
+    }
+    stats[total] = '\0';
+    close(err_fd);
+    waitpid(pid, NULL, 0);
+    unlink(BENCH_IO_JOURNAL);
+    remove_history(BENCH_IO_HISTORY);
+
+    unsigned long long syscalls = 0, allocs = 0, copied = 0;
+    char *line = strstr(stats, "io-stats");
+    if (line == NULL || sscanf(line, "io-stats backend=%*s syscalls=%llu bytes_in=%*u bytes_out=%*u allocs=%llu copied=%llu",
+                               &syscalls, &allocs, &copied) != 3) {
+        fprintf(stderr, "bench: no stats from server (%s)\n", stats);
+    }
+    unsigned long long frames = 0, slabs = 0;
+    line = strstr(stats, "frame-stats");
+    if (line != NULL && sscanf(line, "frame-stats built=%llu slabs=%llu", &frames, &slabs) == 2) {
+        allocs += slabs;    // Pooled frames only allocate when the pool grows
+    }
+
+    int completed = 0;
+    for (int i = 0; i < clients; i++) {
+        completed += state[i].done;
+    }
+    long long *all = calloc(completed ? completed : 1, sizeof(long long));
+    int k = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(all + k, state[i].latency, state[i].done * sizeof(long long));
+        k += state[i].done;
+        free(state[i].latency);
+    }
+    qsort(all, completed, sizeof(long long), cmp_ll);
+
+    if (completed > 0) {
+        printf("%-9s %8d %14.2f %12.2f %12.2f %12.0f %10.1f %10.1f %12.0f\n", backend, completed, (double)syscalls / completed,
+               (double)frames / completed, (double)allocs / completed, (double)copied / completed, all[completed / 2] / 1000.0,
+               all[(int)(completed * 0.99)] / 1000.0, completed / (elapsed / 1e9));
+    } else {
+        printf("%-9s no orders completed\n", backend);
+    }
+    free(all);
+    free(state);
+    free(threads);
+    return 0;
+}
+
+int bench_io(int argc, char *argv[]) {
+    const char *server = "./server";
+    int clients = 3;    // The server accepts MAX_CLIENTS clients
+    int orders = 2000;  // Orders per client
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            orders = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench io [--server PATH] [--clients N] [--orders N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d clients x %d orders over loopback, each order is the full 4 round trip menu flow\n", clients, orders);
+    printf("%-9s %8s %14s %12s %12s %12s %10s %10s %12s\n", "backend", "orders", "syscalls/order", "frames/order", "allocs/order", "copied B/ord",
+           "p50 us", "p99 us", "orders/s");
+    run_io_backend(server, "epoll", clients, orders);
+    run_io_backend(server, "uring", clients, orders);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// sessions: memory used by idle client sessions
+
+typedef struct {
+    int client_socket;
+    char token[BUFFER_SIZE];
+    time_t last_keep_alive;
+    pthread_t thread_id;
+} legacy_client_info_t;     // Session layout before the compact table, for comparison
+
+// Function to read the resident set size of a process in bytes, 0 for this one
+static long long resident_bytes(pid_t pid) {
+    long long pages = 0, resident = 0;
+    char path[64];
+    snprintf(path, sizeof(path), pid ? "/proc/%d/statm" : "/proc/self/statm", (int)pid);
+    FILE *statm = fopen(path, "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    if (fscanf(statm, "%lld %lld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int bench_sessions(int argc, char *argv[]) {
+    uint32_t count = 1000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: bench sessions [--sessions N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    long long before = resident_bytes(0);
+    long long start = now_ns();
+    if (session_table_init(count) < 0) {
+        return EXIT_FAILURE;
+    }
+    uint32_t now = (uint32_t)time(NULL);
+    for (uint32_t i = 0; i < count; i++) {
+        client_info_t *client = session_alloc((int)i + 1000);  // Idle sessions, no frame buffers
+        if (client == NULL) {
+            fprintf(stderr, "bench: session table full at %u\n", i);
+            return EXIT_FAILURE;
+        }
+        client->last_keep_alive = now;
+    }
+    long long elapsed = now_ns() - start;
+    long long used = resident_bytes(0) - before;
+
+    // Validate tokens of random sessions, then the same tokens after their slots were reused
+    int lookups = 1000000;
+    session_token_t *tokens = malloc(lookups * sizeof(session_token_t));
+    for (int i = 0; i < lookups; i++) {
+        tokens[i] = session_at((uint32_t)rand() % count)->token;
+    }
+    int valid = 0;
+    long long lookup_start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        valid += session_lookup(&tokens[i]) != NULL;
+    }
+    long long lookup_elapsed = now_ns() - lookup_start;
+    for (int i = 0; i < lookups; i++) {
+        client_info_t *client = session_lookup(&tokens[i]);
+        if (client != NULL) {   // Slot not reused yet
+            int sock = client->client_socket;
+            session_free(client);
+            session_alloc(sock);
+        }
+    }
+    int stale = 0;
+    long long stale_start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        stale += session_lookup(&tokens[i]) == NULL;
+    }
+    long long stale_elapsed = now_ns() - stale_start;
+    free(tokens);
+
+    printf("sessions:            %u\n", count);
+    printf("session entry:       %zu bytes (was %zu)\n", sizeof(client_info_t), sizeof(legacy_client_info_t));
+    printf("message frame:       %zu bytes (was %d)\n", sizeof(message_t), (int)(sizeof(message_type_t) + 2 * BUFFER_SIZE));
+    printf("resident memory:     %.1f MB\n", used / (1024.0 * 1024.0));
+    printf("bytes per session:   %.1f\n", (double)used / count);
+    printf("setup time:          %.1f ns per session\n", (double)elapsed / count);
+    printf("token validation:    %.1f ns (%d/%d valid)\n", (double)lookup_elapsed / lookups, valid, lookups);
+    printf("stale token reject:  %.1f ns (%d/%d rejected)\n", (double)stale_elapsed / lookups, stale, lookups);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// journal: order throughput of the journal at different group commit sizes
+
+typedef struct {
+    int orders;             // Orders to append
+    long long latency;      // Total ns spent waiting for durability
+} journal_client_t;
+
+// Client appending orders and waiting for each to be durable, like a server connection would
+static void *journal_client(void *arg) {
+    journal_client_t *client = arg;
+    session_token_t token;
+    memset(&token, 0, sizeof(token));
+    for (int i = 0; i < client->orders; i++) {
+        long long start = now_ns();
+        memcpy(token.bytes, &i, sizeof(i));
+        journal_wait(journal_append(JOURNAL_ORDER, &token, 1, 0, "ORDER: 1", -1, NULL));
+        journal_append(JOURNAL_DONE, &token, 1, 0, NULL, -1, NULL);
+        client->latency += now_ns() - start;
+    }
+    return NULL;
+}
+
+int bench_journal(int argc, char *argv[]) {
+    const char *path = "/tmp/bench.journal";
+    int clients = 64;           // Concurrent orders in flight
+    int orders = 20000;         // Orders in total
+    uint32_t batches[] = {1, 4, 16, 64};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            orders = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench journal [--path PATH] [--clients N] [--orders N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (clients < 1 || orders < clients) {
+        fprintf(stderr, "bench: need at least one order per client\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d orders from %d concurrent clients, journal at %s\n", orders, clients, path);
+    printf("%-6s %12s %10s %14s %16s\n", "batch", "orders/s", "fsyncs", "records/fsync", "commit wait us");
+    journal_client_t *state = calloc(clients, sizeof(journal_client_t));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        uint8_t key[JOURNAL_KEY_SIZE] = {0};
+        uint64_t records_before, syncs_before, records, syncs;
+        unlink(path);
+        if (journal_open(path, batches[b], key, NULL, NULL) < 0) {
+            return EXIT_FAILURE;
+        }
+        journal_stats(&records_before, &syncs_before);
+
+        long long start = now_ns();
+        for (int i = 0; i < clients; i++) {
+            state[i].orders = orders / clients;
+            state[i].latency = 0;
+            pthread_create(&threads[i], NULL, journal_client, &state[i]);
+        }
+        long long waited = 0;
+        for (int i = 0; i < clients; i++) {
+            pthread_join(threads[i], NULL);
+            waited += state[i].latency;
+        }
+        journal_close();
+        long long elapsed = now_ns() - start;
+        journal_stats(&records, &syncs);
+        records -= records_before;
+        syncs -= syncs_before;
+
+        int placed = orders / clients * clients;
+        printf("%-6u %12.0f %10llu %14.1f %16.1f\n", batches[b], placed / (elapsed / 1e9), (unsigned long long)syncs,
+               syncs ? (double)records / syncs : 0.0, waited / 1000.0 / placed);
+    }
+    unlink(path);
+    free(state);
+    free(threads);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// history: scanning the columnar order history against parsing a text log
+
+#define TEXT_ROWS 1000000       // Rows of the text log baseline
+
+// Function to run the example query over a text log, the way it would be done without the column store
+static uint64_t text_orders_per_item_hour(const char *log, uint8_t restaurant, uint32_t from, uint32_t to, uint32_t *counts) {
+    uint32_t hours = (to - from + 3599) / 3600;
+    uint64_t matched = 0;
+    memset(counts, 0, (size_t)HISTORY_MAX_ITEMS * hours * sizeof(uint32_t));
+    const char *p = log;
+    while (*p != '\0') {
+        char *end;
+        uint32_t time = strtoul(p, &end, 10);
+        uint32_t rest = strtoul(end + 1, &end, 10);
+        uint32_t item = strtoul(end + 1, &end, 10);
+        p = strchr(end, '\n') + 1;     // Price, quoted ETA and latency are not needed
+        if (rest == restaurant && time >= from && time < to && item < HISTORY_MAX_ITEMS) {
+            counts[item * hours + (time - from) / 3600]++;
+            matched++;
+        }
+    }
+    return matched;
+}
+
+int bench_history(int argc, char *argv[]) {
+    const char *dir = "/tmp/bench-history";
+    uint64_t rows = 100000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            rows = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: bench history [--dir DIR] [--rows N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    remove_history(dir);
+    if (history_open(dir) < 0) {
+        return EXIT_FAILURE;
+    }
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t month = 30 * 24 * 3600;
+    uint64_t seed = 88172645463325252ULL;
+    long long start = now_ns();
+    for (uint64_t i = 0; i < rows; i++) {
+        seed ^= seed << 13;     // xorshift64, rand() would dominate the load time
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        history_row_t row;
+        row.time = now - month + (uint32_t)(i * month / rows);     // Rows arrive in time order
+        row.restaurant = 1 + seed % 3;
+        row.item = 1 + (seed >> 8) % 10;
+        row.price_cents = 399 + (seed >> 16) % 700;
+        row.quoted_eta = 60 * (10 + (seed >> 24) % 20);
+        row.latency_ms = (seed >> 32) % 2000;
+        if (history_append(&row) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    long long load_elapsed = now_ns() - start;
+
+    // Taco Bell orders per item per hour over the last week
+    uint32_t from = now - 7 * 24 * 3600, to = now;
+    uint32_t hours = (to - from + 3599) / 3600;
+    uint32_t *counts = malloc((size_t)HISTORY_MAX_ITEMS * hours * sizeof(uint32_t));
+    history_orders_per_item_hour(3, from, to, counts);     // Warm the page cache
+    start = now_ns();
+    uint64_t matched = history_orders_per_item_hour(3, from, to, counts);
+    long long scan_elapsed = now_ns() - start;
+    uint32_t busiest = 0;
+    for (uint32_t i = 0; i < HISTORY_MAX_ITEMS * hours; i++) {
+        busiest = counts[i] > busiest ? counts[i] : busiest;
+    }
+
+    // Same query over a text log of the first rows
+    uint64_t text_rows = rows < TEXT_ROWS ? rows : TEXT_ROWS;
+    char *log = malloc(text_rows * 48 + 1);
+    size_t len = 0;
+    seed = 88172645463325252ULL;
+    for (uint64_t i = 0; i < text_rows; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        len += sprintf(log + len, "%u,%u,%u,%u,%u,%u\n", now - 7 * 24 * 3600 + (uint32_t)(i * 7 * 24 * 3600 / text_rows),
+                       (unsigned)(1 + seed % 3), (unsigned)(1 + (seed >> 8) % 10), (unsigned)(399 + (seed >> 16) % 700),
+                       (unsigned)(60 * (10 + (seed >> 24) % 20)), (unsigned)((seed >> 32) % 2000));
+    }
+    log[len] = '\0';
+    start = now_ns();
+    uint64_t text_matched = text_orders_per_item_hour(log, 3, from, to, counts);
+    long long text_elapsed = now_ns() - start;
+    free(log);
+
+    printf("rows:                %llu in %s\n", (unsigned long long)history_rows(), dir);
+    printf("row size:            %zu bytes over 6 columns\n", 4 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t));
+    printf("append:              %.1f ns per row\n", (double)load_elapsed / rows);
+    printf("query:               Taco Bell orders per item per hour, last week\n");
+    printf("column scan:         %.3f s, %.0f M rows/s, %.2f GB/s of columns, %llu orders matched, busiest item-hour %u\n",
+           scan_elapsed / 1e9, rows / (scan_elapsed / 1e3), rows * 7.0 / scan_elapsed, (unsigned long long)matched, busiest);
+    printf("text log parse:      %.0f M rows/s (%llu rows, %llu matched)\n", text_rows / (text_elapsed / 1e3),
+           (unsigned long long)text_rows, (unsigned long long)text_matched);
+    free(counts);
+    history_close();
+    remove_history(dir);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// catalog: finding an item across every restaurant through the inverted index
+
+#define CATALOG_QUERIES 10000   // Queries timed
+
+static const char *catalog_sizes[] = {"small", "medium", "large", "family"};
+static const char *catalog_kinds[] = {"pizza", "burger", "taco", "burrito", "salad", "wings", "fries", "soda", "sandwich", "wrap"};
+static const char *catalog_styles[] = {"classic", "spicy", "bbq", "veggie", "cheese", "chicken", "beef", "supreme", "deluxe", "hawaiian",
+                                       "buffalo", "ranch", "crispy", "grilled", "double", "mini"};
+
+// Function to write a menu of generated items, seed picks which ones
+static void catalog_menu(char *text, int items, uint64_t seed) {
+    size_t len = sprintf(text, "Restaurant ");
+    for (int item = 1; item <= items; item++) {
+        seed ^= seed << 13;     // xorshift64
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        len += sprintf(text + len, "%d. %s %s %s - $%d.%02d\n", item, catalog_sizes[seed % 4], catalog_styles[(seed >> 8) % 16],
+                       catalog_kinds[(seed >> 16) % 10], 3 + (int)((seed >> 24) % 20), (int)((seed >> 32) % 100));
+    }
+}
+
+int bench_catalog(int argc, char *argv[]) {
+    int restaurants = 2000;
+    int items = 50;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--restaurants") == 0 && i + 1 < argc) {
+            restaurants = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--items") == 0 && i + 1 < argc) {
+            items = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench catalog [--restaurants N] [--items N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *text = malloc((size_t)items * 64 + 64);
+    menu_t **menus = calloc(restaurants + 1, sizeof(menu_t *));
+    if (text == NULL || menus == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    long long start = now_ns();
+    for (int id = 1; id <= restaurants; id++) {
+        catalog_menu(text, items, 88172645463325252ULL + id);
+        if ((menus[id] = menu_get(text)) == NULL || catalog_set_menu(id, menus[id]) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    long long build_elapsed = now_ns() - start;
+
+    // Queries of one and two words, the way a user would ask for them
+    long long *latencies = malloc(CATALOG_QUERIES * sizeof(long long));
+    char lines[BUFFER_SIZE];
+    char query[64];
+    uint64_t total_matches = 0;
+    for (int i = 0; i < CATALOG_QUERIES; i++) {
+        if (i % 2 == 0) {
+            snprintf(query, sizeof(query), "%s %s", catalog_styles[i % 16], catalog_kinds[i / 2 % 10]);
+        } else {
+            snprintf(query, sizeof(query), "%s", catalog_kinds[i / 2 % 10]);
+        }
+        int shown;
+        start = now_ns();
+        total_matches += catalog_search(query, 0, lines, sizeof(lines), &shown);
+        latencies[i] = now_ns() - start;
+    }
+    qsort(latencies, CATALOG_QUERIES, sizeof(long long), cmp_ll);
+
+    // One restaurant changing its menu and one closing, while the rest stay indexed
+    catalog_menu(text, items, 1);
+    menu_t *changed = menu_get(text);
+    start = now_ns();
+    catalog_set_menu(restaurants / 2, changed);
+    long long update_elapsed = now_ns() - start;
+    start = now_ns();
+    catalog_remove(restaurants / 3 + 1);
+    long long remove_elapsed = now_ns() - start;
+
+    uint32_t words;
+    uint64_t postings;
+    catalog_stats(&words, &postings);
+    printf("catalog:             %d restaurants x %d items, %u words, %llu postings\n", restaurants, items, words, (unsigned long long)postings);
+    printf("build:               %.1f ms, %.1f us per restaurant\n", build_elapsed / 1e6, build_elapsed / 1e3 / restaurants);
+    printf("query:               p50 %.1f us, p99 %.1f us, %.0f matches per query\n", latencies[CATALOG_QUERIES / 2] / 1e3,
+           latencies[CATALOG_QUERIES * 99 / 100] / 1e3, (double)total_matches / CATALOG_QUERIES);
+    printf("menu change:         %.1f us\n", update_elapsed / 1e3);
+    printf("restaurant closed:   %.1f us\n", remove_elapsed / 1e3);
+
+    for (int id = 1; id <= restaurants; id++) {
+        catalog_remove(id);
+        menu_put(menus[id]);
+    }
+    menu_put(changed);
+    free(latencies);
+    free(menus);
+    free(text);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// admission: deadline misses of a saturated kitchen, orders held by deadline or by arrival
+
+#define ADMISSION_COOK_MIN 10       // Minutes an order takes to cook, at least
+#define ADMISSION_COOK_MAX 30       // and at most
+#define ADMISSION_TIGHT_WAIT 35     // Minutes a tight order may take from arrival to ready
+#define ADMISSION_RELAXED_WAIT 90   // Minutes the other orders may take
+
+typedef struct {
+    uint64_t arrival;           // Simulated milliseconds
+    uint64_t deadline;
+    uint64_t cook;
+    int tight;
+} sim_order_t;
+
+// Function to draw a number in [0, 1) from a xorshift64 state
+static double sim_uniform(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return (*seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function to run the orders through a kitchen of slots, held in an admission queue while every slot is busy;
+// with a hold controller, arrivals it sheds are turned away, returns the orders cooked
+static int simulate_kitchen(sim_order_t *orders, int count, int slots, int fifo, codel_t *hold, int *late, int *tight_late,
+                            long long *waits) {
+    admission_queue_t queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.fifo = fifo;
+    uint64_t *busy_until = calloc(slots, sizeof(uint64_t));
+    int next = 0;
+    int started = 0;
+    int shed = 0;
+    *late = 0;
+    *tight_late = 0;
+    while (started + shed < count && busy_until != NULL) {
+        int slot = 0;   // Slot that frees up first
+        for (int i = 1; i < slots; i++) {
+            if (busy_until[i] < busy_until[slot]) {
+                slot = i;
+            }
+        }
+        uint64_t now;
+        if (next < count && (queue.count == 0 || orders[next].arrival <= busy_until[slot])) {
+            now = orders[next].arrival;
+            if (hold != NULL && codel_shed(hold, now)) {
+                shed++;
+            } else {
+                admission_push(&queue, orders[next].deadline, now, &orders[next]);
+            }
+            next++;
+        } else {
+            now = busy_until[slot];
+        }
+        while (queue.count > 0 && busy_until[slot] <= now) {   // Every slot free by now takes the next held order
+            sim_order_t *order = admission_pop(&queue, NULL, NULL);
+            if (hold != NULL) {
+                codel_sample(hold, now - order->arrival, now);
+            }
+            busy_until[slot] = now + order->cook;
+            waits[started++] = (long long)(now - order->arrival);
+            if (busy_until[slot] > order->deadline) {
+                (*late)++;
+                *tight_late += order->tight;
+            }
+            for (int i = 0; i < slots; i++) {
+                if (busy_until[i] < busy_until[slot]) {
+                    slot = i;
+                }
+            }
+        }
+    }
+    admission_free(&queue);
+    free(busy_until);
+    return started;
+}
+
+int bench_admission(int argc, char *argv[]) {
+    int count = 100000;
+    int slots = 4;
+    double load = 0.95;     // Orders arriving per order the kitchen can cook
+    double tight_share = 0.2;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tight") == 0 && i + 1 < argc) {
+            tight_share = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench admission [--orders N] [--slots N] [--load X] [--tight FRACTION]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (count <= 0 || slots <= 0 || load <= 0) {
+        fprintf(stderr, "bench admission: orders, slots and load must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    sim_order_t *orders = malloc(count * sizeof(sim_order_t));
+    long long *waits = malloc(count * sizeof(long long));
+    if (orders == NULL || waits == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    // Arrivals spaced at random around the rate that keeps the kitchen at the load asked for
+    double mean_cook = (ADMISSION_COOK_MIN + ADMISSION_COOK_MAX) / 2.0 * 60000;
+    double mean_gap = mean_cook / slots / load;
+    uint64_t seed = 88172645463325252ULL;
+    uint64_t now = 0;
+    int tight_count = 0;
+    for (int i = 0; i < count; i++) {
+        now += (uint64_t)(2 * mean_gap * sim_uniform(&seed));
+        orders[i].arrival = now;
+        orders[i].cook = (uint64_t)((ADMISSION_COOK_MIN + (ADMISSION_COOK_MAX - ADMISSION_COOK_MIN) * sim_uniform(&seed)) * 60000);
+        orders[i].tight = sim_uniform(&seed) < tight_share;
+        orders[i].deadline = now + (orders[i].tight ? ADMISSION_TIGHT_WAIT : ADMISSION_RELAXED_WAIT) * 60000ULL;
+        tight_count += orders[i].tight;
+    }
+
+    printf("kitchen:             %d orders, %d slots, load %.2f, %d tight (%d min), %d relaxed (%d min)\n", count, slots, load,
+           tight_count, ADMISSION_TIGHT_WAIT, count - tight_count, ADMISSION_RELAXED_WAIT);
+    for (int fifo = 1; fifo >= 0; fifo--) {
+        int late, tight_late;
+        simulate_kitchen(orders, count, slots, fifo, NULL, &late, &tight_late, waits);
+        qsort(waits, count, sizeof(long long), cmp_ll);
+        printf("%-20s missed %.2f%% (tight %.2f%%, relaxed %.2f%%), held p50 %.1f min, p99 %.1f min\n", fifo ? "fifo:" : "edf:",
+               100.0 * late / count, tight_count ? 100.0 * tight_late / tight_count : 0.0,
+               count > tight_count ? 100.0 * (late - tight_late) / (count - tight_count) : 0.0,
+               waits[count / 2] / 60000.0, waits[(long long)count * 99 / 100] / 60000.0);
+    }
+
+    free(waits);
+    free(orders);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// shed: a kitchen through a traffic spike, with and without the hold controller turning orders away
+
+int bench_shed(int argc, char *argv[]) {
+    int count = 100000;
+    int slots = 4;
+    double load = 0.8;      // Load before and after the spike
+    double spike = 1.5;     // Load of the middle third of the orders
+    double target = 10;     // Minutes orders may stay held
+    double interval = 60;   // Minutes the hold must stand above target before orders are shed
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--spike") == 0 && i + 1 < argc) {
+            spike = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+            target = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench shed [--orders N] [--slots N] [--load X] [--spike X] [--target MIN] [--interval MIN]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (count <= 0 || slots <= 0 || load <= 0 || spike <= 0 || target <= 0 || interval <= 0) {
+        fprintf(stderr, "bench shed: every option must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    sim_order_t *orders = malloc(count * sizeof(sim_order_t));
+    long long *waits = malloc(count * sizeof(long long));
+    if (orders == NULL || waits == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    double mean_cook = (ADMISSION_COOK_MIN + ADMISSION_COOK_MAX) / 2.0 * 60000;
+    uint64_t seed = 88172645463325252ULL;
+    uint64_t now = 0;
+    for (int i = 0; i < count; i++) {
+        double at = i >= count / 3 && i < 2 * count / 3 ? spike : load;
+        now += (uint64_t)(2 * mean_cook / slots / at * sim_uniform(&seed));
+        orders[i].arrival = now;
+        orders[i].cook = (uint64_t)((ADMISSION_COOK_MIN + (ADMISSION_COOK_MAX - ADMISSION_COOK_MIN) * sim_uniform(&seed)) * 60000);
+        orders[i].tight = 0;
+        orders[i].deadline = now + ADMISSION_RELAXED_WAIT * 60000ULL;
+    }
+
+    printf("kitchen:             %d orders, %d slots, load %.2f with a spike to %.2f, hold target %.0f min in %.0f min\n", count, slots,
+           load, spike, target, interval);
+    for (int controlled = 0; controlled <= 1; controlled++) {
+        codel_t hold;
+        codel_init(&hold, (uint64_t)(target * 60000), (uint64_t)(interval * 60000));   // Simulated milliseconds
+        int late, tight_late;
+        int cooked = simulate_kitchen(orders, count, slots, 0, controlled ? &hold : NULL, &late, &tight_late, waits);
+        qsort(waits, cooked, sizeof(long long), cmp_ll);
+        printf("%-20s shed %.2f%%, missed %.2f%% of cooked, held p50 %.1f min, p99 %.1f min, max %.1f min\n",
+               controlled ? "codel:" : "no shedding:", 100.0 * (count - cooked) / count, cooked ? 100.0 * late / cooked : 0.0,
+               waits[cooked / 2] / 60000.0, waits[(long long)cooked * 99 / 100] / 60000.0, waits[cooked - 1] / 60000.0);
+    }
+
+    free(waits);
+    free(orders);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// ring: round trips of a frame to another process over TCP loopback, a Unix socket pair and the shared-memory link
+
+// Function to send a frame over a link when there is one, else over the socket
+static int ring_send(int sock, shm_link_t *link, const message_t *msg) {
+    if (link != NULL) {
+        while (shm_send(link, msg) < 0) {
+            // Full, the echo side is draining it
+        }
+        return 0;
+    }
+    return send(sock, msg, sizeof(message_t), 0) == sizeof(message_t) ? 0 : -1;
+}
+
+static int ring_recv(int sock, shm_link_t *link, message_t *msg) {
+    if (link != NULL) {
+        while (!shm_recv(link, msg)) {
+            if (shm_wait(link, -1) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    return recv(sock, msg, sizeof(message_t), MSG_WAITALL) == sizeof(message_t) ? 0 : -1;
+}
+
+// Function to time count round trips against a forked process echoing every frame, the way a restaurant answers
+static int run_ring(const char *name, int sock, int peer_sock, shm_link_t *link, shm_link_t *peer_link, int count, long long *rtts) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        message_t msg;
+        for (int i = 0; i < count && ring_recv(peer_sock, peer_link, &msg) == 0; i++) {
+            ring_send(peer_sock, peer_link, &msg);
+        }
+        _exit(0);
+    }
+    if (peer_sock >= 0) {
+        close(peer_sock);
+    }
+
+    message_t msg;
+    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    msg.type = MSG_ORDER;
+    strcpy(msg.data, "ORDER: 1 2");
+    long long began = now_ns();
+    int done = 0;
+    for (; done < count; done++) {
+        long long start = now_ns();
+        if (ring_send(sock, link, &msg) < 0 || ring_recv(sock, link, &msg) < 0) {
+            break;
+        }
+        rtts[done] = now_ns() - start;
+    }
+    long long elapsed = now_ns() - began;
+    if (sock >= 0) {
+        close(sock);
+    }
+    waitpid(pid, NULL, 0);
+    if (done < count) {
+        fprintf(stderr, "%s: echo stopped after %d round trips\n", name, done);
+        return -1;
+    }
+
+    qsort(rtts, count, sizeof(long long), cmp_ll);
+    printf("%-20s p50 %.1f us, p99 %.1f us, %.0f round trips/s\n", name, rtts[count / 2] / 1000.0,
+           rtts[(long long)count * 99 / 100] / 1000.0, count * 1e9 / elapsed);
+    return 0;
+}
+
+int bench_ring(int argc, char *argv[]) {
+    int count = 100000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--round-trips") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench ring [--round-trips N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (count <= 0) {
+        fprintf(stderr, "bench ring: --round-trips must be positive\n");
+        return EXIT_FAILURE;
+    }
+    long long *rtts = malloc(count * sizeof(long long));
+    if (rtts == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    printf("frames:              %d round trips of %zu bytes\n", count, sizeof(message_t));
+
+    // TCP over loopback, how restaurants reach the server by default
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("loopback listener");
+        free(rtts);
+        return EXIT_FAILURE;
+    }
+    int sock = connect_local(ntohs(addr.sin_port), 1);
+    int peer = accept(listener, NULL, NULL);
+    close(listener);
+    if (sock < 0 || peer < 0) {
+        perror("loopback connect");
+        free(rtts);
+        return EXIT_FAILURE;
+    }
+    int one = 1;
+    setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int failed = run_ring("tcp loopback:", sock, peer, NULL, NULL, count, rtts) < 0;
+
+    // Unix domain socket, the same host without the TCP stack
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        perror("socketpair");
+        free(rtts);
+        return EXIT_FAILURE;
+    }
+    failed |= run_ring("unix socket:", pair[0], pair[1], NULL, NULL, count, rtts) < 0;
+
+    // Shared-memory rings, each side sleeping on its own eventfd once it has spun on an empty ring
+    shm_link_t link, peer_link;
+    int memfd = shm_link_create();
+    int event = eventfd(0, EFD_NONBLOCK);
+    int peer_event = eventfd(0, EFD_NONBLOCK);
+    if (memfd < 0 || event < 0 || peer_event < 0 || shm_link_map(&link, memfd, SHM_CREATOR, event, peer_event) < 0 ||
+        shm_link_map(&peer_link, memfd, SHM_ACCEPTOR, peer_event, event) < 0) {
+        perror("shared memory link");
+        free(rtts);
+        return EXIT_FAILURE;
+    }
+    close(memfd);
+    failed |= run_ring("shared memory:", -1, -1, &link, &peer_link, count, rtts) < 0;
+    munmap(peer_link.map, 2 * sizeof(shm_ring_t));
+    shm_link_close(&link);      // Closes both eventfds
+
+    free(rtts);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// ---------------------------------------------------------------------------
+// gateway: many sessions with a connection each against the same sessions as streams of one gateway connection
+
+// Function to read the kernel's slab memory in bytes, where idle sockets keep their state
+static long long slab_bytes(void) {
+    long long kb = 0;
+    char line[128];
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "Slab: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return kb * 1024;
+}
+
+static int run_gateway(const char *server, int gateway, int sessions, int rounds) {
+    char max_clients[16];
+    snprintf(max_clients, sizeof(max_clients), "%d", sessions);
+    int err_fd;
+    pid_t pid = start_server(server, "epoll", max_clients, NULL, &err_fd);
+    if (pid < 0) {
+        return -1;
+    }
+    int probe = connect_local(ADMIN_PORT, 100);
+    if (probe < 0) {
+        fprintf(stderr, "bench: server did not come up\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    close(probe);
+
+    int connections = gateway ? 1 : sessions;
+    int *socks = malloc(connections * sizeof(int));
+    session_token_t *tokens = malloc(sessions * sizeof(session_token_t));
+    message_t *frames = calloc(sessions, sizeof(message_t));   // One round of requests, written at once through a gateway
+    if (socks == NULL || tokens == NULL || frames == NULL) {
+        perror("malloc");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    usleep(100000);
+    long long rss_before = resident_bytes(pid);
+    long long slab_before = slab_bytes();
+
+    // Open every session, a connection and a token each, or one MSG_STREAM each written in one go
+    message_t msg;
+    int opened = 0;
+    long long start = now_ns();
+    if (gateway) {
+        socks[0] = connect_local(GATEWAY_PORT, 1);
+        for (int i = 0; i < sessions; i++) {
+            frames[i].type = MSG_STREAM;
+        }
+        if (socks[0] >= 0 && send(socks[0], frames, sessions * sizeof(message_t), MSG_NOSIGNAL) == (ssize_t)(sessions * sizeof(message_t))) {
+            while (opened < sessions && recv_msg(socks[0], &msg) == 0 && msg.type == MSG_TOKEN) {
+                tokens[opened++] = msg.client_token;
+            }
+        }
+    } else {
+        for (; opened < sessions; opened++) {
+            if ((socks[opened] = connect_local(CLIENT_PORT, 1)) < 0 || recv_msg(socks[opened], &msg) < 0 || msg.type != MSG_TOKEN) {
+                break;
+            }
+            tokens[opened] = msg.client_token;
+        }
+    }
+    long long open_ns = now_ns() - start;
+    usleep(100000);
+    long long rss_used = resident_bytes(pid) - rss_before;
+    long long slab_used = slab_bytes() - slab_before;
+
+    // Every session asks for the restaurant list once per round
+    long long requests = 0;
+    start = now_ns();
+    for (int r = 0; r < rounds && opened == sessions; r++) {
+        for (int i = 0; i < sessions; i++) {
+            frames[i].type = MSG_REQUEST_MENU;
+            frames[i].client_token = tokens[i];
+            if (!gateway) {
+                send(socks[i], &frames[i], sizeof(message_t), MSG_NOSIGNAL);
+            }
+        }
+        if (gateway) {
+            send(socks[0], frames, sessions * sizeof(message_t), MSG_NOSIGNAL);
+        }
+        for (int i = 0; i < sessions; i++) {
+            if (recv_msg(socks[gateway ? 0 : i], &msg) < 0 || msg.type != MSG_RESTAURANT_OPTIONS) {
+                break;
+            }
+            requests++;
+        }
+    }
+    long long request_ns = now_ns() - start;
+
+    for (int i = 0; i < (gateway ? 1 : opened); i++) {
+        if (socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+    usleep(100000);     // Let the server see the disconnects before counting
+    kill(pid, SIGTERM);
+    char stats[512] = "";
+    ssize_t n, total = 0;
+    while ((n = read(err_fd, stats + total, sizeof(stats) - 1 - total)) > 0) {
+        total += n;
+    }
+    stats[total] = '\0';
+    close(err_fd);
+    waitpid(pid, NULL, 0);
+    unlink(BENCH_IO_JOURNAL);
+    remove_history(BENCH_IO_HISTORY);
+    free(frames);
+    free(tokens);
+    free(socks);
+
+    unsigned long long syscalls = 0;
+    char *line = strstr(stats, "io-stats");
+    if (line == NULL || sscanf(line, "io-stats backend=%*s syscalls=%llu", &syscalls) != 1) {
+        fprintf(stderr, "bench: no stats from server (%s)\n", stats);
+    }
+    if (opened < sessions || requests < (long long)sessions * rounds) {
+        printf("%-12s only %d sessions opened and %lld requests answered\n", gateway ? "gateway" : "connections", opened, requests);
+        return -1;
+    }
+    printf("%-12s %8d %11d %10.1f %12.0f %14.2f %12.0f %12.0f\n", gateway ? "gateway" : "connections", sessions, connections,
+           open_ns / 1e6, requests / (request_ns / 1e9), (double)syscalls / (sessions + requests),
+           (double)rss_used / sessions, (double)slab_used / sessions);
+    return 0;
+}
+
+int bench_gateway(int argc, char *argv[]) {
+    const char *server = "./server";
+    int sessions = 1000;
+    int rounds = 20;    // Requests per session
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench gateway [--server PATH] [--sessions N] [--rounds N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (sessions <= 0 || rounds <= 0) {
+        fprintf(stderr, "bench gateway: --sessions and --rounds must be positive\n");
+        return EXIT_FAILURE;
+    }
+    struct rlimit files;    // A connection per session needs both ends open here and one in the server
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    printf("%d sessions, %d restaurant list requests each over loopback\n", sessions, rounds);
+    printf("%-12s %8s %11s %10s %12s %14s %12s %12s\n", "mode", "sessions", "connections", "open ms", "requests/s", "syscalls/frame",
+           "server B/ses", "kernel B/ses");
+    int failed = run_gateway(server, 0, sessions, rounds) < 0;
+    failed |= run_gateway(server, 1, sessions, rounds) < 0;
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// ---------------------------------------------------------------------------
+// upgrade: replacing a running server with a live upgrade against a restart
+
+// Function to place one order through the menu flow, 1 when the restaurant is not registered, -1 when the connection is gone
+static int upgrade_order(int sock, const session_token_t *token) {
+    message_t msg;
+    if (send_msg(sock, MSG_REQUEST_MENU, "REQUEST_MENU", token) < 0 || recv_msg(sock, &msg) < 0 ||
+        send_msg(sock, MSG_ORDER, "1", token) < 0 || recv_msg(sock, &msg) < 0) {
+        return -1;
+    }
+    if (msg.type == REST_UNAVALIABLE) {
+        return 1;
+    }
+    if (send_msg(sock, MSG_ORDER, "ORDER: 1", token) < 0 || recv_msg(sock, &msg) < 0) {
+        return -1;
+    }
+    return msg.type == MSG_ESTIMATED_TIME ? 0 : -1;
+}
+
+// Function to connect a fake McDonald's, register its menu and answer its orders on a thread
+static int upgrade_restaurant(int *sock, pthread_t *thread) {
+    if ((*sock = connect_local(MCDONALDS_PORT, 100)) < 0 || send_msg(*sock, MSG_MENU, "1. Burger - $5.00", NULL) < 0) {
+        return -1;
+    }
+    return pthread_create(thread, NULL, io_restaurant, sock) == 0 ? 0 : -1;
+}
+
+static int run_upgrade(const char *server, int live, int clients) {
+    char max_clients[16];
+    snprintf(max_clients, sizeof(max_clients), "%d", 2 * clients);     // Room for the sessions of reconnecting clients
+    const char *upgrade[] = {"--upgrade", BENCH_UPGRADE_SOCKET, NULL};
+    int err_fd, new_err_fd;
+    pid_t pid = start_server(server, "epoll", max_clients, live ? upgrade : NULL, &err_fd);
+    int probe = pid > 0 ? connect_local(ADMIN_PORT, 100) : -1;
+    if (probe < 0) {
+        fprintf(stderr, "bench: server did not come up\n");
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    close(probe);
+
+    int restaurant;
+    pthread_t restaurant_thread;
+    int *socks = malloc(clients * sizeof(int));
+    session_token_t *tokens = malloc(clients * sizeof(session_token_t));
+    message_t msg;
+    int opened = 0;
+    if (socks != NULL && tokens != NULL && upgrade_restaurant(&restaurant, &restaurant_thread) == 0) {
+        for (; opened < clients; opened++) {    // Each client orders once, so everything is warm before the deploy
+            if ((socks[opened] = connect_local(CLIENT_PORT, 1)) < 0 || recv_msg(socks[opened], &msg) < 0) {
+                break;
+            }
+            tokens[opened] = msg.client_token;
+            int ret;
+            while ((ret = upgrade_order(socks[opened], &tokens[opened])) == 1) {
+                usleep(10000);
+            }
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    if (opened < clients) {
+        fprintf(stderr, "bench: only %d clients ordered before the deploy\n", opened);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    // Deploy, then time until every client has ordered again
+    int status = 0;
+    int reconnects = 0, unavailable = 0, failed = 0;
+    long long start = now_ns();
+    if (live) {
+        pid_t new_pid = start_server(server, "epoll", max_clients, upgrade, &new_err_fd);
+        waitpid(pid, &status, 0);   // The old server exits once the new one has taken over
+        pid = new_pid;
+    } else {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        pid = start_server(server, "epoll", max_clients, NULL, &new_err_fd);
+        pthread_join(restaurant_thread, NULL);
+        close(restaurant);
+        reconnects++;   // Best case for a restart: the restaurant comes back at once instead of at the next menu request
+        if (upgrade_restaurant(&restaurant, &restaurant_thread) < 0) {
+            failed = clients;
+        }
+    }
+    close(err_fd);
+    long long deploy_ns = now_ns() - start;
+    for (int i = 0; i < clients && !failed; i++) {
+        int ret;
+        while ((ret = upgrade_order(socks[i], &tokens[i])) != 0) {
+            if (ret == 1) {
+                unavailable++;
+                usleep(10000);
+                continue;
+            }
+            close(socks[i]);    // Dropped by the restart, come back with a new session
+            reconnects++;
+            if ((socks[i] = connect_local(CLIENT_PORT, 100)) < 0 || recv_msg(socks[i], &msg) < 0 || msg.type != MSG_TOKEN) {
+                failed++;
+                break;
+            }
+            tokens[i] = msg.client_token;
+        }
+    }
+    long long served_ns = now_ns() - start;
+
+    for (int i = 0; i < clients; i++) {
+        if (socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    shutdown(restaurant, SHUT_RDWR);
+    pthread_join(restaurant_thread, NULL);
+    close(restaurant);
+    close(new_err_fd);
+    unlink(BENCH_IO_JOURNAL);
+    remove_history(BENCH_IO_HISTORY);
+    free(tokens);
+    free(socks);
+
+    if (failed || !WIFEXITED(status)) {
+        printf("%-8s %d clients could not order again\n", live ? "upgrade" : "restart", failed);
+        return -1;
+    }
+    printf("%-8s %10.1f %10.1f %11d %12d\n", live ? "upgrade" : "restart", deploy_ns / 1e6, served_ns / 1e6, reconnects,
+           unavailable);
+    return 0;
+}
+
+int bench_upgrade(int argc, char *argv[]) {
+    const char *server = "./server";
+    int clients = 200;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench upgrade [--server PATH] [--clients N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (clients <= 0) {
+        fprintf(stderr, "bench upgrade: --clients must be positive\n");
+        return EXIT_FAILURE;
+    }
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    printf("%d connected clients, each orders once after the server binary is replaced\n", clients);
+    printf("%-8s %10s %10s %11s %12s\n", "mode", "deploy ms", "served ms", "reconnects", "unavailable");
+    int failed = run_upgrade(server, 0, clients) < 0;
+    failed |= run_upgrade(server, 1, clients) < 0;
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// ---------------------------------------------------------------------------
+// throttle: latency of well-behaved clients next to clients flooding the server, with and without rate limits
+
+typedef struct {
+    int sock;
+    session_token_t token;
+    volatile int *stop;
+    long long answered;     // Searches the server answered
+    long long refused;      // Busy frames, the server says when to come back
+} throttle_abuser_t;
+
+// Client sending catalog searches as fast as the server takes them, reading whatever comes back in between
+static void *throttle_abuser(void *arg) {
+    throttle_abuser_t *abuser = arg;
+    message_t msg;
+    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    msg.type = MSG_CATALOG_SEARCH;
+    msg.client_token = abuser->token;
+    strcpy(msg.data, "0 burger");
+    while (!*abuser->stop) {
+        for (int i = 0; i < 16; i++) {
+            if (send(abuser->sock, &msg, sizeof(message_t), MSG_NOSIGNAL) != sizeof(message_t)) {
+                return NULL;
+            }
+        }
+        message_t reply;
+        while (recv(abuser->sock, &reply, sizeof(message_t), MSG_DONTWAIT | MSG_WAITALL) == sizeof(message_t)) {
+            abuser->answered += reply.type == MSG_CATALOG_SEARCH;
+            abuser->refused += reply.type == MSG_BUSY;
+        }
+    }
+    return NULL;
+}
+
+static int run_throttle(const char *server, int limited, int clients, int abusers, int seconds) {
+    const char *limits[] = {"--rate", "all=5/10", NULL};
+    char max_clients[16];
+    snprintf(max_clients, sizeof(max_clients), "%d", clients + abusers);
+    int err_fd;
+    pid_t pid = start_server(server, "epoll", max_clients, limited ? limits : NULL, &err_fd);
+    int restaurant = pid > 0 ? connect_local(MCDONALDS_PORT, 100) : -1;
+    if (restaurant < 0) {
+        fprintf(stderr, "bench: server did not come up\n");
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    char menu[BUFFER_SIZE];
+    catalog_menu(menu, 12, 1);
+    send_msg(restaurant, MSG_MENU, menu, NULL);
+    pthread_t restaurant_thread;
+    pthread_create(&restaurant_thread, NULL, io_restaurant, &restaurant);
+
+    int *socks = calloc(clients, sizeof(int));
+    session_token_t *tokens = calloc(clients, sizeof(session_token_t));
+    throttle_abuser_t *flood = calloc(abusers, sizeof(throttle_abuser_t));
+    pthread_t *threads = calloc(abusers, sizeof(pthread_t));
+    int rounds = seconds * 4;   // Each client asks four times a second, under any limit
+    long long *latency = malloc((size_t)rounds * clients * sizeof(long long));
+    volatile int stop = 0;
+    int samples = 0, busy = 0, started = 0, failed = socks == NULL || tokens == NULL || flood == NULL || threads == NULL || latency == NULL;
+    message_t msg;
+    for (int i = 0; i < clients && !failed; i++) {
+        failed = (socks[i] = connect_local(CLIENT_PORT, 1)) < 0 || recv_msg(socks[i], &msg) < 0 || msg.type != MSG_TOKEN;
+        tokens[i] = msg.client_token;
+    }
+    for (; started < abusers && !failed; started++) {
+        flood[started].stop = &stop;
+        if ((flood[started].sock = connect_local(CLIENT_PORT, 1)) < 0 || recv_msg(flood[started].sock, &msg) < 0) {
+            failed = 1;
+            break;
+        }
+        flood[started].token = msg.client_token;
+        pthread_create(&threads[started], NULL, throttle_abuser, &flood[started]);
+    }
+
+    long long start = now_ns();
+    for (int round = 0; round < rounds && !failed; round++) {
+        for (int i = 0; i < clients && !failed; i++) {
+            long long sent = now_ns();
+            if (send_msg(socks[i], MSG_REQUEST_MENU, "REQUEST_MENU", &tokens[i]) < 0 || recv_msg(socks[i], &msg) < 0) {
+                failed = 1;
+            } else if (msg.type == MSG_BUSY) {
+                busy++;
+            } else {
+                latency[samples++] = now_ns() - sent;
+            }
+        }
+        long long next = start + (round + 1) * 250000000LL;
+        long long left = next - now_ns();
+        if (left > 0) {
+            usleep((useconds_t)(left / 1000));
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    stop = 1;
+    long long answered = 0, refused = 0;
+    for (int i = 0; i < started; i++) {
+        shutdown(flood[i].sock, SHUT_RDWR);     // Wakes a thread blocked on a full socket
+        pthread_join(threads[i], NULL);
+        close(flood[i].sock);
+        answered += flood[i].answered;
+        refused += flood[i].refused;
+    }
+    for (int i = 0; i < clients && socks != NULL; i++) {
+        if (socks[i] > 0) {
+            close(socks[i]);
+        }
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    shutdown(restaurant, SHUT_RDWR);
+    pthread_join(restaurant_thread, NULL);
+    close(restaurant);
+    close(err_fd);
+    unlink(BENCH_IO_JOURNAL);
+    remove_history(BENCH_IO_HISTORY);
+
+    if (failed || samples == 0) {
+        fprintf(stderr, "bench: a client lost the server\n");
+    } else {
+        qsort(latency, samples, sizeof(long long), cmp_ll);
+        printf("%-8s %10.1f %10.1f %10d %14.0f %10lld\n", limited ? "limited" : "open", latency[samples / 2] / 1e3,
+               latency[(long long)samples * 99 / 100] / 1e3, busy, answered / elapsed, refused);
+    }
+    free(latency);
+    free(threads);
+    free(flood);
+    free(tokens);
+    free(socks);
+    return failed || samples == 0 ? -1 : 0;
+}
+
+int bench_throttle(int argc, char *argv[]) {
+    const char *server = "./server";
+    int clients = 8;
+    int abusers = 4;
+    int seconds = 20;   // 640 samples, so the p99 is not just the slowest one or two
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--abusers") == 0 && i + 1 < argc) {
+            abusers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench throttle [--server PATH] [--clients N] [--abusers N] [--seconds N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (clients <= 0 || abusers < 0 || seconds <= 0) {
+        fprintf(stderr, "bench throttle: --clients and --seconds must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d clients asking for the restaurants 4 times a second, %d clients flooding catalog searches\n", clients, abusers);
+    printf("%-8s %10s %10s %10s %14s %10s\n", "limits", "p50 us", "p99 us", "refused", "flood answers/s", "flood busy");
+    int failed = run_throttle(server, 0, clients, abusers, seconds) < 0;
+    failed |= run_throttle(server, 1, clients, abusers, seconds) < 0;
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// ---------------------------------------------------------------------------
+// credits: orders a restaurant is sent after it reconnects, against the free kitchen slots it reports
+
+typedef struct {
+    int sock;
+    unsigned int received;  // Orders received on this registration, what the restaurant reports with its free slots
+} credit_restaurant_t;
+
+// Function to connect a fake McDonald's, register its menu and report its free slots, the counter starts over unless kept
+static int credit_register(credit_restaurant_t *restaurant, int free_slots, int keep_count) {
+    char capacity[32];
+    if (!keep_count) {
+        restaurant->received = 0;
+    }
+    snprintf(capacity, sizeof(capacity), "%d %u", free_slots, restaurant->received);
+    if ((restaurant->sock = connect_local(MCDONALDS_PORT, 100)) < 0 ||
+        send_msg(restaurant->sock, MSG_MENU, "1. Burger - $5.00", NULL) < 0 ||
+        send_msg(restaurant->sock, MSG_CAPACITY, capacity, NULL) < 0) {
+        return -1;
+    }
+    usleep(100000);     // Registered and reported before the first order comes in
+    return 0;
+}
+
+// Function to open a session and place one order through the menu flow without waiting for its estimated time
+static int credit_order(void) {
+    message_t msg;
+    int sock = connect_local(CLIENT_PORT, 1);
+    if (sock < 0 || recv_msg(sock, &msg) < 0 || msg.type != MSG_TOKEN) {
+        return -1;
+    }
+    session_token_t token = msg.client_token;
+    if (send_msg(sock, MSG_REQUEST_MENU, "REQUEST_MENU", &token) < 0 || recv_msg(sock, &msg) < 0 ||
+        send_msg(sock, MSG_ORDER, "1", &token) < 0 || recv_msg(sock, &msg) < 0 || msg.type == REST_UNAVALIABLE ||
+        send_msg(sock, MSG_ORDER, "ORDER: 1", &token) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;    // Left open, closing it would end the session and its order
+}
+
+// Function to count the orders the restaurant is sent until none came for a while
+static int credit_receive(credit_restaurant_t *restaurant) {
+    struct timeval timeout = {0, 300000};
+    setsockopt(restaurant->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    message_t msg;
+    int orders = 0;
+    while (recv_msg(restaurant->sock, &msg) == 0) {
+        if (msg.type == MSG_ORDER) {
+            restaurant->received++;
+            orders++;
+        }
+    }
+    return orders;
+}
+
+static int run_credits(const char *server, int keep_count, int slots, int orders) {
+    char max_clients[16];
+    snprintf(max_clients, sizeof(max_clients), "%d", slots + orders);
+    const char *extra[] = {"--register-rate", "0", NULL};
+    int err_fd;
+    pid_t pid = start_server(server, "epoll", max_clients, extra, &err_fd);
+    int probe = pid > 0 ? connect_local(ADMIN_PORT, 100) : -1;
+    if (probe < 0) {
+        fprintf(stderr, "bench: server did not come up\n");
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    close(probe);
+
+    // Fill the kitchen, then reconnect with one slot free again and order more than it has room for
+    credit_restaurant_t restaurant = {-1, 0};
+    int *socks = malloc((slots + orders) * sizeof(int));
+    int placed = 0, before = -1, after = -1;
+    if (socks != NULL && credit_register(&restaurant, slots, keep_count) == 0) {
+        for (; placed < slots && (socks[placed] = credit_order()) >= 0; placed++) {
+        }
+        before = credit_receive(&restaurant);
+        close(restaurant.sock);
+        usleep(100000);     // The server has seen the old connection close before the new one registers
+        if (placed == slots && credit_register(&restaurant, 1, keep_count) == 0) {
+            for (; placed < slots + orders && (socks[placed] = credit_order()) >= 0; placed++) {
+            }
+            after = credit_receive(&restaurant);
+        }
+    }
+
+    for (int i = 0; i < placed; i++) {
+        close(socks[i]);
+    }
+    free(socks);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (restaurant.sock >= 0) {
+        close(restaurant.sock);
+    }
+    close(err_fd);
+    unlink(BENCH_IO_JOURNAL);
+    remove_history(BENCH_IO_HISTORY);
+
+    if (placed < slots + orders || after < 0) {
+        fprintf(stderr, "bench: only %d orders were placed\n", placed);
+        return -1;
+    }
+    printf("%-8s %10d %10d %10d\n", keep_count ? "kept" : "reset", before, 1, after);
+    return keep_count || after <= 1 ? 0 : -1;   // With the counter reset the server keeps to the free slot
+}
+
+int bench_credits(int argc, char *argv[]) {
+    const char *server = "./server";
+    int slots = 4;
+    int orders = 8;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--orders") == 0 && i + 1 < argc) {
+            orders = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench credits [--server PATH] [--slots N] [--orders N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (slots <= 0 || orders <= 1) {
+        fprintf(stderr, "bench credits: --slots must be positive and --orders more than 1\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("A restaurant with %d free slots takes %d orders and reconnects with 1 free slot, then %d more are placed\n",
+           slots, slots, orders);
+    printf("%-8s %10s %10s %10s\n", "counter", "before", "free", "sent after");
+    int failed = run_credits(server, 0, slots, orders) < 0;
+    failed |= run_credits(server, 1, slots, orders) < 0;
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+
+typedef struct {
+    uint32_t conn;              // Capture id of the connection on this fd, 0 when none
+    uint16_t port;
+} capture_fd_t;
+
+static FILE *capture_file = NULL;
+static struct timespec capture_start;
+static capture_fd_t *fds = NULL;    // Indexed by fd
+static int fds_size = 0;
+static uint32_t next_conn = 1;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the file and the fd table
+
+// Function to start writing a capture file
+int capture_open(const char *path) {
+    if ((capture_file = fopen(path, "wb")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, capture_file) != 1) {
+        perror(path);
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &capture_start);
+    return 0;
+}
+
+// Function to write one record, caller holds capture_mutex
+static void write_record(uint32_t conn, uint16_t port, capture_event_t event, const message_t *msg) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    capture_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.time_ns = (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL + now.tv_nsec - capture_start.tv_nsec;
+    record.conn = conn;
+    record.port = port;
+    record.event = event;
+    if (msg != NULL) {
+        record.len = CAPTURE_FRAME_HEADER + strnlen(msg->data, BUFFER_SIZE);
+    }
+    fwrite(&record, sizeof(record), 1, capture_file);
+    if (msg != NULL) {
+        uint32_t type = msg->type;
+        fwrite(&type, sizeof(type), 1, capture_file);
+        fwrite(&msg->client_token, sizeof(session_token_t), 1, capture_file);
+        fwrite(msg->data, record.len - CAPTURE_FRAME_HEADER, 1, capture_file);
+    }
+}
+
+// Function to give a new connection its capture id
+void capture_conn(int fd) {
+    if (capture_file == NULL || fd < 0) {
+        return;
+    }
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    uint16_t port = 0;
+    if (getsockname(fd, (struct sockaddr *)&local, &local_len) == 0) {
+        port = ntohs(local.sin_port);
+    }
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file == NULL) {
+        pthread_mutex_unlock(&capture_mutex);
+        return;
+    }
+    if (fd >= fds_size) {
+        int size = fds_size ? fds_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        capture_fd_t *grown = realloc(fds, size * sizeof(capture_fd_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&capture_mutex);
+            return;
+        }
+        memset(grown + fds_size, 0, (size - fds_size) * sizeof(capture_fd_t));
+        fds = grown;
+        fds_size = size;
+    }
+    fds[fd].conn = next_conn++;
+    fds[fd].port = port;
+    write_record(fds[fd].conn, port, CAPTURE_OPEN, NULL);
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_frame(int fd, capture_event_t event, const message_t *msg) {
+    if (capture_file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL && fd >= 0 && fd < fds_size && fds[fd].conn != 0) {
+        write_record(fds[fd].conn, fds[fd].port, event, msg);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_close(int fd) {
+    if (capture_file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL && fd >= 0 && fd < fds_size && fds[fd].conn != 0) {
+        write_record(fds[fd].conn, fds[fd].port, CAPTURE_CLOSE, NULL);
+        fds[fd].conn = 0;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_finish(void) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
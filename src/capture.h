@@ -0,0 +1,38 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Binary capture of the server's protocol traffic for replay. The file starts
+// with CAPTURE_MAGIC and holds one record per connection event; frames are
+// stored as type, token and data without its zero padding.
+
+#define CAPTURE_MAGIC "ORDCAP01"
+
+typedef enum {
+    CAPTURE_OPEN = 1,           // Connection accepted, port is the server port it came in on
+    CAPTURE_CLOSE,              // Connection closed
+    CAPTURE_IN,                 // Frame received by the server
+    CAPTURE_OUT                 // Frame sent by the server
+} capture_event_t;
+
+typedef struct {
+    uint64_t time_ns;           // Monotonic time since the capture started
+    uint32_t conn;              // Connection id, unique within the capture
+    uint16_t port;              // Server port of the connection
+    uint16_t len;               // Bytes of frame following the record
+    uint8_t event;              // capture_event_t
+    uint8_t reserved[7];
+} capture_record_t;
+
+#define CAPTURE_FRAME_HEADER (sizeof(uint32_t) + sizeof(session_token_t))   // Type and token before the data
+
+int capture_open(const char *path);
+void capture_conn(int fd);      // New connection, before anything is sent on it
+void capture_frame(int fd, capture_event_t event, const message_t *msg);   // Safe from any thread
+void capture_close(int fd);
+void capture_finish(void);
+
+#endif
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "catalog.h"
+
+#define WORD_LEN 32             // Longer words are cut, the same way when indexing and when searching
+#define MIN_BUCKETS 1024        // Word table size before it first grows
+#define CATALOG_TOP 48          // Cheapest matches kept by a query, more lines never fit in a frame
+
+typedef struct {
+    uint32_t restaurant;
+    uint32_t number;            // Item number, with the restaurant the sort key of a list
+    uint32_t price_cents;       // Copied from the item so ranking does not chase the pointer
+    uint32_t menu_version;
+    const menu_item_t *item;    // In the restaurant's menu, kept alive by the catalog's reference
+} posting_t;
+
+typedef struct word {
+    struct word *next;          // Hash chain
+    uint32_t hash;
+    uint32_t count;
+    uint32_t capacity;
+    posting_t *postings;        // Sorted by restaurant and item number
+    char text[WORD_LEN];
+} word_t;
+
+typedef struct {
+    word_t *word;
+    posting_t posting;
+} pending_t;                    // Posting of a menu being indexed, merged into its word's list in one move
+
+static word_t **buckets = NULL;     // Words ever seen, their lists empty out when their items go
+static uint32_t bucket_count = 0;
+static uint32_t word_count = 0;
+static uint64_t posting_count = 0;
+static menu_t **indexed = NULL;     // Menu indexed for each restaurant id, NULL when none
+static uint32_t indexed_size = 0;
+static pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;  // Queries share it, updates take it alone
+
+// FNV-1a hash
+static uint32_t hash_string(const char *text) {
+    uint32_t hash = 2166136261u;
+    while (*text) {
+        hash ^= (uint8_t)*text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to copy the next lowercase word of a text, returns the text after it or NULL when there is none
+static const char *next_word(const char *text, char *word) {
+    while (*text != '\0' && !isalnum((unsigned char)*text)) {
+        text++;
+    }
+    if (*text == '\0') {
+        return NULL;
+    }
+    size_t len = 0;
+    while (isalnum((unsigned char)*text)) {
+        if (len < WORD_LEN - 1) {
+            word[len++] = tolower((unsigned char)*text);
+        }
+        text++;
+    }
+    word[len] = '\0';
+    return text;
+}
+
+// Function to find a word, adding it when create is set, caller holds the lock for writing to create
+static word_t *find_word(const char *text, int create) {
+    uint32_t hash = hash_string(text);
+    if (bucket_count > 0) {
+        for (word_t *word = buckets[hash % bucket_count]; word != NULL; word = word->next) {
+            if (word->hash == hash && strcmp(word->text, text) == 0) {
+                return word;
+            }
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (word_count >= bucket_count) {   // Keep chains short as the vocabulary grows
+        uint32_t grown_count = bucket_count ? bucket_count * 2 : MIN_BUCKETS;
+        word_t **grown = calloc(grown_count, sizeof(word_t *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < bucket_count; i++) {
+            while (buckets[i] != NULL) {
+                word_t *word = buckets[i];
+                buckets[i] = word->next;
+                word->next = grown[word->hash % grown_count];
+                grown[word->hash % grown_count] = word;
+            }
+        }
+        free(buckets);
+        buckets = grown;
+        bucket_count = grown_count;
+    }
+    word_t *word = calloc(1, sizeof(word_t));
+    if (word == NULL) {
+        return NULL;
+    }
+    strcpy(word->text, text);
+    word->hash = hash;
+    word->next = buckets[hash % bucket_count];
+    buckets[hash % bucket_count] = word;
+    word_count++;
+    return word;
+}
+
+// Function to find where an item goes in a word's list
+static uint32_t lower_bound(const word_t *word, uint32_t restaurant, uint32_t number) {
+    uint32_t low = 0, high = word->count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        const posting_t *posting = &word->postings[mid];
+        if (posting->restaurant < restaurant || (posting->restaurant == restaurant && posting->number < number)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Function to drop a restaurant's postings from the lists of the words of its menu
+static void remove_postings(uint32_t restaurant, const menu_t *menu) {
+    char text[WORD_LEN];
+    for (uint32_t i = 0; i < menu->item_count; i++) {
+        const char *name = menu->items[i].folded;
+        while ((name = next_word(name, text)) != NULL) {
+            word_t *word = find_word(text, 0);
+            if (word == NULL) {
+                continue;
+            }
+            uint32_t first = lower_bound(word, restaurant, 0);
+            uint32_t end = lower_bound(word, restaurant + 1, 0);    // The restaurant's postings are contiguous
+            memmove(&word->postings[first], &word->postings[end], (word->count - end) * sizeof(posting_t));
+            word->count -= end - first;
+            posting_count -= end - first;
+        }
+    }
+}
+
+static int compare_pending(const void *a, const void *b) {
+    const pending_t *x = a, *y = b;
+    if (x->word != y->word) {
+        return x->word < y->word ? -1 : 1;
+    }
+    return (x->posting.number > y->posting.number) - (x->posting.number < y->posting.number);
+}
+
+// Function to add a restaurant's postings, each word's list is moved once for the whole menu
+static int add_postings(uint32_t restaurant, const menu_t *menu) {
+    uint32_t capacity = menu->item_count * 4 + 1;
+    uint32_t count = 0;
+    pending_t *pending = malloc(capacity * sizeof(pending_t));
+    if (pending == NULL) {
+        return -1;
+    }
+    char text[WORD_LEN];
+    for (uint32_t i = 0; i < menu->item_count; i++) {
+        const char *name = menu->items[i].folded;
+        while ((name = next_word(name, text)) != NULL) {
+            if (count == capacity) {
+                pending_t *grown = realloc(pending, capacity * 2 * sizeof(pending_t));
+                if (grown == NULL) {
+                    free(pending);
+                    return -1;
+                }
+                pending = grown;
+                capacity *= 2;
+            }
+            word_t *word = find_word(text, 1);
+            if (word == NULL) {
+                free(pending);
+                return -1;
+            }
+            pending[count].word = word;
+            pending[count].posting.restaurant = restaurant;
+            pending[count].posting.number = menu->items[i].number;
+            pending[count].posting.price_cents = menu->items[i].price_cents;
+            pending[count].posting.menu_version = menu->version;
+            pending[count].posting.item = &menu->items[i];
+            count++;
+        }
+    }
+    qsort(pending, count, sizeof(pending_t), compare_pending);
+
+    int ret = 0;
+    for (uint32_t run = 0; run < count;) {
+        word_t *word = pending[run].word;
+        uint32_t end = run;
+        uint32_t added = 0;
+        while (end < count && pending[end].word == word) {  // Compact the run, a name may repeat a word
+            if (added == 0 || pending[run + added - 1].posting.number != pending[end].posting.number) {
+                pending[run + added++] = pending[end];
+            }
+            end++;
+        }
+        if (word->count + added > word->capacity) {
+            uint32_t grown_capacity = word->capacity ? word->capacity : 4;
+            while (grown_capacity < word->count + added) {
+                grown_capacity *= 2;
+            }
+            posting_t *grown = realloc(word->postings, grown_capacity * sizeof(posting_t));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            word->postings = grown;
+            word->capacity = grown_capacity;
+        }
+        uint32_t at = lower_bound(word, restaurant, 0);
+        memmove(&word->postings[at + added], &word->postings[at], (word->count - at) * sizeof(posting_t));
+        for (uint32_t i = 0; i < added; i++) {
+            word->postings[at + i] = pending[run + i].posting;
+        }
+        word->count += added;
+        posting_count += added;
+        run = end;
+    }
+    free(pending);
+    if (ret < 0) {
+        remove_postings(restaurant, menu);  // Undo the words that made it in
+    }
+    return ret;
+}
+
+int catalog_set_menu(uint32_t restaurant, menu_t *menu) {
+    int ret = 0;
+    menu_t *old = NULL;
+    pthread_rwlock_wrlock(&catalog_lock);
+    if (restaurant >= indexed_size) {
+        uint32_t size = indexed_size ? indexed_size : 16;
+        while (size <= restaurant) {
+            size *= 2;
+        }
+        menu_t **grown = realloc(indexed, size * sizeof(menu_t *));
+        if (grown == NULL) {
+            pthread_rwlock_unlock(&catalog_lock);
+            return -1;
+        }
+        memset(grown + indexed_size, 0, (size - indexed_size) * sizeof(menu_t *));
+        indexed = grown;
+        indexed_size = size;
+    }
+    if (indexed[restaurant] != menu) {  // Same menu version, nothing to do
+        old = indexed[restaurant];
+        if (old != NULL) {
+            remove_postings(restaurant, old);
+        }
+        indexed[restaurant] = NULL;
+        if (menu != NULL) {
+            if ((ret = add_postings(restaurant, menu)) == 0) {
+                indexed[restaurant] = menu_ref(menu);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    menu_put(old);
+    return ret;
+}
+
+void catalog_remove(uint32_t restaurant) {
+    catalog_set_menu(restaurant, NULL);
+}
+
+// Function to rank two postings, cheapest first
+static int cheaper(const posting_t *x, const posting_t *y) {
+    if (x->price_cents != y->price_cents) {
+        return x->price_cents < y->price_cents;
+    }
+    return x->restaurant < y->restaurant || (x->restaurant == y->restaurant && x->number < y->number);
+}
+
+static int compare_hits(const void *a, const void *b) {
+    const posting_t *x = *(const posting_t *const *)a, *y = *(const posting_t *const *)b;
+    return cheaper(x, y) ? -1 : cheaper(y, x);
+}
+
+// Function to move a cursor forward to an item or past where it would be, galloping from where it is
+static uint32_t advance(const word_t *word, uint32_t from, uint32_t restaurant, uint32_t number) {
+    uint32_t step = 1;
+    uint32_t low = from, high = from;
+    while (high < word->count && (word->postings[high].restaurant < restaurant ||
+                                  (word->postings[high].restaurant == restaurant && word->postings[high].number < number))) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > word->count) {
+        high = word->count;
+    }
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        const posting_t *posting = &word->postings[mid];
+        if (posting->restaurant < restaurant || (posting->restaurant == restaurant && posting->number < number)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Function to keep the cheapest postings in a max-heap of at most CATALOG_TOP, the most expensive at the root
+static void keep_cheapest(const posting_t **heap, int *count, const posting_t *posting) {
+    int at;
+    if (*count < CATALOG_TOP) {
+        at = (*count)++;
+        while (at > 0 && cheaper(heap[(at - 1) / 2], posting)) {    // Sift up
+            heap[at] = heap[(at - 1) / 2];
+            at = (at - 1) / 2;
+        }
+        heap[at] = posting;
+        return;
+    }
+    if (!cheaper(posting, heap[0])) {
+        return;
+    }
+    at = 0;
+    while (1) {     // Replace the root and sift down
+        int child = 2 * at + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && cheaper(heap[child], heap[child + 1])) {
+            child++;
+        }
+        if (!cheaper(posting, heap[child])) {
+            break;
+        }
+        heap[at] = heap[child];
+        at = child;
+    }
+    heap[at] = posting;
+}
+
+int catalog_search(const char *text, uint32_t max_cents, char *buf, size_t size, int *shown) {
+    char words[CATALOG_MAX_WORDS][WORD_LEN];
+    int word_total = 0;
+    while (word_total < CATALOG_MAX_WORDS && (text = next_word(text, words[word_total])) != NULL) {
+        word_total++;
+    }
+    *shown = 0;
+    buf[0] = '\0';
+    if (word_total == 0) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    word_t *lists[CATALOG_MAX_WORDS];
+    uint32_t cursors[CATALOG_MAX_WORDS];
+    for (int i = 0; i < word_total; i++) {
+        if ((lists[i] = find_word(words[i], 0)) == NULL) {
+            pthread_rwlock_unlock(&catalog_lock);
+            return 0;   // No item has this word
+        }
+        cursors[i] = 0;
+        for (int j = i; j > 0 && lists[j]->count < lists[j - 1]->count; j--) {     // Shortest list first
+            word_t *swap = lists[j];
+            lists[j] = lists[j - 1];
+            lists[j - 1] = swap;
+        }
+    }
+
+    // Walk the shortest list, the cursors of the longer ones only ever move forward
+    const posting_t *heap[CATALOG_TOP];
+    int kept = 0;
+    int matches = 0;
+    for (uint32_t i = 0; i < lists[0]->count; i++) {
+        const posting_t *posting = &lists[0]->postings[i];
+        if (max_cents != 0 && posting->price_cents > max_cents) {
+            continue;
+        }
+        int found = 1;
+        for (int j = 1; j < word_total && found; j++) {
+            cursors[j] = advance(lists[j], cursors[j], posting->restaurant, posting->number);
+            found = cursors[j] < lists[j]->count && lists[j]->postings[cursors[j]].restaurant == posting->restaurant &&
+                    lists[j]->postings[cursors[j]].number == posting->number;
+        }
+        if (found) {
+            matches++;
+            keep_cheapest(heap, &kept, posting);
+        }
+    }
+    qsort(heap, kept, sizeof(posting_t *), compare_hits);
+
+    size_t used = 0;
+    for (int i = 0; i < kept; i++) {
+        const posting_t *posting = heap[i];
+        int len = snprintf(buf + used, size - used, "%u %u %.*s\n", posting->restaurant, posting->menu_version,
+                           (int)posting->item->line_len, posting->item->line);
+        if (len < 0 || (size_t)len >= size - used) {
+            buf[used] = '\0';   // Cut lines are left out
+            break;
+        }
+        used += len;
+        (*shown)++;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    return matches;
+}
+
+void catalog_stats(uint32_t *words, uint64_t *postings) {
+    pthread_rwlock_rdlock(&catalog_lock);
+    *words = word_count;
+    *postings = posting_count;
+    pthread_rwlock_unlock(&catalog_lock);
+}
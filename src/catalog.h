@@ -0,0 +1,25 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "menu.h"
+
+// Inverted index over the items of every open restaurant, so an item can be
+// found anywhere without fetching each menu. Item names are split into
+// lowercase words and each word keeps a posting list of the items whose name
+// has it, ordered by restaurant and item number. A restaurant's postings are
+// replaced when its menu version changes and dropped when it closes; a query
+// intersects the lists of its words and ranks the matches by price.
+
+#define CATALOG_MAX_WORDS 8     // Query words beyond this are ignored
+
+int catalog_set_menu(uint32_t restaurant, menu_t *menu);   // Index the menu in place of the restaurant's previous one
+void catalog_remove(uint32_t restaurant);
+// Write "restaurant menu_version item line" lines of the items whose names have
+// every word of text, cheapest first, as many as fit. Returns the match count.
+int catalog_search(const char *text, uint32_t max_cents, char *buf, size_t size, int *shown);
+void catalog_stats(uint32_t *words, uint64_t *postings);
+
+#endif
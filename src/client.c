@@ -2,49 +2,111 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+#include "protocol.h"
+#include "trace.h"
+
 #define SERVER_IP "192.15.6.1"   // Server IP address
 #define SERVER_PORT 8080    // Server port
-#define BUFFER_SIZE 512    // Buffer size for receiving data
-
-typedef enum {
-    ERROR,
-    MSG_KEEP_ALIVE,
-    MSG_REQUEST_MENU,
-    MSG_MENU,
-    MSG_ORDER,
-    MSG_ESTIMATED_TIME,
-    MSG_RESTAURANT_OPTIONS,
-    REST_UNAVALIABLE,
-    MSG_LEAVE,
-    MSG_TOKEN
-} message_type_t;
+#define RESUME_ATTEMPTS 8   // Reconnect attempts before giving up on the session, their backoffs add up past its timeout
+#define RECONNECT_BASE_MS 250   // Longest wait before the first reconnect attempt, doubled with every failed one
+#define RECONNECT_MAX_MS 30000  // Longest wait between reconnect attempts
+#define MAX_RESTAURANTS 3   // Restaurant ids go from 1 to this
+#define CART_MAX_ITEMS 32   // Items in one cart, the server takes no more
+#define MAX_WAIT_MINUTES 255    // Longest max wait the server holds an order to, it keeps the minutes in a byte
+#define MEAL_OTHER_RESTAURANT -2    // User goes back to the restaurants to add items from another one
+#define MEAL_CHECKOUT -3    // User orders the cart
+
+typedef struct {
+    int open;               // Restaurant is taking orders
+    unsigned menu_version;  // Changes whenever the restaurant's menu changes
+    char name[32];
+} restaurant_state_t;
 
 typedef struct {
-    message_type_t type;
-    char data[BUFFER_SIZE];
-    char client_token[BUFFER_SIZE];
-} message_t;
+    unsigned version;       // Menu version the text belongs to, 0 when nothing is cached
+    char text[BUFFER_SIZE];
+} cached_menu_t;
 
-char my_token[BUFFER_SIZE];
+typedef struct {
+    int restaurant;
+    int item;
+    unsigned version;       // Menu version the item was picked from
+} cart_item_t;
+
+session_token_t my_token;  // Token received from the server
+int server_sock = -1;       // Current connection to the server, replaced when the session is resumed
+struct sockaddr_in server_addr; // Server address
+int use_fastopen = 0;       // Send the resume frame in the SYN with TCP Fast Open
+restaurant_state_t restaurants[MAX_RESTAURANTS + 1];   // Indexed by restaurant id, kept current by the server's pushes
+int have_availability = 0;  // Server sent the state of every restaurant on this connection
+cached_menu_t menus[MAX_RESTAURANTS + 1];   // Indexed by restaurant id, kept across runs in the menu cache
+const char *menu_cache_path = "menus.cache";
+int current_restaurant = 0; // Restaurant the order goes to
+cart_item_t cart[CART_MAX_ITEMS];   // Items from any restaurants, ordered together
+int cart_count = 0;
+int max_wait = 0;           // Minutes the user is willing to wait for an order, 0 for no limit
+long long busy_until = 0;   // Server turns requests away until then, milliseconds of the monotonic clock
+FILE *trace_file = NULL;    // Traces of this client's orders, with --trace
+
+enum {
+    STEP_REQUEST,           // Ask for the restaurants and pick one
+    STEP_MEAL,              // Menu received, pick a meal
+    STEP_ETA                // Meal ordered, wait for the estimated time
+};
 
 void *server_communication(void *arg);
 void *keep_alive(void *arg);
+int open_connection(const message_t *first);
+int connect_with_backoff(void);
+int backoff_ms(int attempt);
+int retry_after_ms(int hint_ms);
+long long now_ms(void);
+int send_frame(message_t *msg);
+int recv_any(message_t *msg);
+int recv_frame(message_t *msg);
+int resume_session(message_t *msg);
+void subscribe(void);
+void apply_availability(const char *data);
+int await_availability(void);
+void drain_availability(void);
+void load_menu_cache(void);
+int store_menu_update(const char *data);
+void drop_from_cart(int restaurant, const char *reason);
+int write_cart(char *text, size_t size);
+int choose_meal(message_t *msg);
+int search_catalog(message_t *msg, const char *words);
+void print_busy(const message_t *msg);
 
-int main() {
-    struct sockaddr_in server_addr; // Server address
-    int sock; // Socket descriptor
-
-    // Create socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { // Create a socket for sending and receiving data
-        perror("socket creation failed");
-        exit(EXIT_FAILURE);
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fastopen") == 0) {
+            use_fastopen = 1;
+        } else if (strcmp(argv[i], "--menu-cache") == 0 && i + 1 < argc) {
+            menu_cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-wait") == 0 && i + 1 < argc) {
+            max_wait = atoi(argv[++i]);
+            max_wait = max_wait < 0 ? 0 : (max_wait > MAX_WAIT_MINUTES ? MAX_WAIT_MINUTES : max_wait);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            if ((trace_file = trace_open(argv[++i])) == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--fastopen] [--menu-cache PATH] [--max-wait MINUTES] [--trace FILE]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
+    load_menu_cache();
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());  // Clients started together back off differently
+
     server_addr.sin_family = AF_INET; // Set the address family to IPv4
     server_addr.sin_port = htons(SERVER_PORT); // Set the port number
 
@@ -55,170 +117,620 @@ int main() {
     }
 
     // Connect to server
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) { // Connect to the server at the specified address
-        perror("Connection Failed");
+    if ((server_sock = connect_with_backoff()) < 0) { // Connect to the server at the specified address
+        printf("Connection Failed\n");
         exit(EXIT_FAILURE);
     }
 
     // Create keep-alive thread
     pthread_t keep_alive_thread;
-    if (pthread_create(&keep_alive_thread, NULL, keep_alive, (void *)&sock) != 0) { // Create a thread for sending keep-alive messages
+    if (pthread_create(&keep_alive_thread, NULL, keep_alive, NULL) != 0) { // Create a thread for sending keep-alive messages
         perror("Keep-alive thread creation failed");
-        close(sock);
+        close(server_sock);
         exit(EXIT_FAILURE);
     }
     pthread_detach(keep_alive_thread); // Detach the keep-alive thread to allow it to run independently
 
     // Create server communication thread
     pthread_t server_comm_thread;
-    if (pthread_create(&server_comm_thread, NULL, server_communication, (void *)&sock) != 0) { // Create a thread for server communication
+    if (pthread_create(&server_comm_thread, NULL, server_communication, NULL) != 0) { // Create a thread for server communication
         perror("Server communication thread creation failed");
-        close(sock);
+        close(server_sock);
         exit(EXIT_FAILURE);
     }
     pthread_join(server_comm_thread, NULL); // Wait for the server communication thread to finish
 
-    close(sock); // Close the socket
+    close(server_sock); // Close the socket
+    return 0;
+}
+
+// Function to connect to the server, sending a first frame along with the handshake when Fast Open is on
+int open_connection(const message_t *first) {
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { // Create a socket for sending and receiving data
+        perror("socket creation failed");
+        return -1;
+    }
+
+    if (first != NULL && use_fastopen) {
+        // Connects and carries the frame in the SYN once the server has handed us a Fast Open cookie
+        if (sendto(sock, first, sizeof(message_t), MSG_FASTOPEN, (struct sockaddr *)&server_addr, sizeof(server_addr)) == sizeof(message_t)) {
+            return sock;
+        }
+        perror("sendto MSG_FASTOPEN");
+        close(sock);
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (first != NULL && send(sock, first, sizeof(message_t), 0) != sizeof(message_t)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to connect to the server, trying again with backoff while it is not answering, -1 when it never does
+int connect_with_backoff(void) {
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS; attempt++) {
+        int sock = open_connection(NULL);
+        if (sock >= 0) {
+            return sock;
+        }
+        int delay = backoff_ms(attempt);
+        printf("Server is not answering, connecting again in %d ms.\n", delay);
+        usleep((useconds_t)delay * 1000);
+    }
+    return -1;
+}
+
+// Function to pick the wait before a reconnect attempt, anywhere up to a backoff that doubles with every failed attempt
+int backoff_ms(int attempt) {
+    int limit = RECONNECT_MAX_MS;
+    if (attempt < 16 && (RECONNECT_BASE_MS << attempt) < limit) {
+        limit = RECONNECT_BASE_MS << attempt;
+    }
+    return rand() % (limit + 1);    // Full jitter, clients that lost the server together come back spread out
+}
+
+// Function to pick the wait after a busy answer, at least the server's hint and up to twice it so retries spread out
+int retry_after_ms(int hint_ms) {
+    return hint_ms + rand() % (hint_ms + 1);
+}
+
+// Function to send a frame with the client's token
+int send_frame(message_t *msg) {
+    // Asking again before the server said to only gets the request dropped, and a dropped request is never answered
+    long long wait_ms = busy_until - now_ms();
+    if (wait_ms > 0) {
+        printf("Waiting %lld ms before asking the server again.\n", wait_ms);
+        usleep((useconds_t)wait_ms * 1000);
+    }
+    msg->client_token = my_token; // Include the client's token in the message
+    if (msg->type == MSG_DIRECT_ORDER || msg->type == MSG_CART) {
+        // Orders carry a trace; the server numbers it unless this client wants it written down itself
+        trace_context_t trace;
+        memset(&trace, 0, sizeof(trace_context_t));
+        if (trace_file != NULL) {
+            trace.id = (uint64_t)rand() << 32 ^ (uint64_t)rand() << 1 ^ 1;
+            trace.keep = 1;
+        }
+        trace.stamps[TRACE_CLIENT_SEND] = trace_now();
+        trace_put(msg, &trace);
+    }
+    ssize_t bytes_sent = send(server_sock, msg, sizeof(message_t), MSG_NOSIGNAL);
+    if (bytes_sent <= 0) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read the monotonic clock in milliseconds
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to receive the next frame that is not empty
+int recv_any(message_t *msg) {
+    do {
+        ssize_t bytes_received = recv(server_sock, msg, sizeof(message_t), MSG_WAITALL);
+        if (bytes_received <= 0) {
+            perror("recv");
+            return -1;
+        }
+    } while (msg->type == 0);
+    return 0;
+}
+
+// Function to receive the next reply, applying availability pushes that arrive in between
+int recv_frame(message_t *msg) {
+    do {
+        if (recv_any(msg) < 0) {
+            return -1;
+        }
+        if (msg->type == MSG_AVAILABILITY) {
+            apply_availability(msg->data);
+        }
+    } while (msg->type == MSG_AVAILABILITY);
+    return 0;
+}
+
+// Function to ask the server to push restaurant availability to this connection
+void subscribe(void) {
+    message_t msg;
+    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    msg.type = MSG_SUBSCRIBE;
+    have_availability = 0;  // Until the full state for this connection arrives
+    if (send_frame(&msg) < 0) {
+        printf("Could not subscribe to restaurant availability\n");
+    }
+}
+
+// Function to update the restaurants from "id open menu_version name" lines
+void apply_availability(const char *data) {
+    const char *line = data;
+    while (*line != '\0') {
+        int id, open;
+        unsigned version;
+        char name[32];
+        if (sscanf(line, "%d %d %u %31[^\n]", &id, &open, &version, name) == 4 && id >= 1 && id <= MAX_RESTAURANTS) {
+            if (have_availability && restaurants[id].open != open) {
+                printf("\n%s is now %s\n", name, open ? "open" : "closed");
+            }
+            restaurants[id].open = open;
+            restaurants[id].menu_version = version;
+            strcpy(restaurants[id].name, name);
+        }
+        const char *next = strchr(line, '\n');
+        if (next == NULL) {
+            break;
+        }
+        line = next + 1;
+    }
+    have_availability = 1;
+}
+
+// Function to block until the server pushes availability
+int await_availability(void) {
+    message_t msg;
+    while (1) {
+        if (recv_any(&msg) < 0) {
+            return -1;
+        }
+        if (msg.type == MSG_AVAILABILITY) {
+            apply_availability(msg.data);
+            return 0;
+        }
+    }
+}
+
+// Function to apply the pushes that arrived while the user was choosing, without waiting for more
+void drain_availability(void) {
+    struct pollfd pfd = {server_sock, POLLIN, 0};
+    message_t msg;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (recv_any(&msg) < 0) {
+            return;     // The next send or receive fails and resumes the session
+        }
+        if (msg.type == MSG_AVAILABILITY) {
+            apply_availability(msg.data);
+        }
+    }
+}
+
+// Function to load the menus saved by earlier runs
+void load_menu_cache(void) {
+    FILE *file = fopen(menu_cache_path, "rb");
+    if (file == NULL) {
+        return;     // First run, every menu is fetched on first use
+    }
+    if (fread(menus, sizeof(menus), 1, file) != 1) {
+        memset(menus, 0, sizeof(menus));    // Short or foreign file, start empty
+    }
+    fclose(file);
+}
+
+// Function to cache a menu from a "restaurant menu_version" line followed by the menu, returns the restaurant
+int store_menu_update(const char *data) {
+    int id;
+    unsigned version;
+    const char *text = strchr(data, '\n');
+    if (text == NULL || sscanf(data, "%d %u", &id, &version) != 2 || id < 1 || id > MAX_RESTAURANTS) {
+        return 0;
+    }
+    menus[id].version = version;
+    strncpy(menus[id].text, text + 1, BUFFER_SIZE - 1);
+
+    FILE *file = fopen(menu_cache_path, "wb");
+    if (file == NULL) {
+        perror(menu_cache_path);
+        return id;
+    }
+    fwrite(menus, sizeof(menus), 1, file);
+    fclose(file);
+    return id;
+}
+
+// Function to take a restaurant's items out of the cart, all of them when restaurant is 0
+void drop_from_cart(int restaurant, const char *reason) {
+    int kept = 0;
+    for (int i = 0; i < cart_count; i++) {
+        int closed = restaurant == 0 && !restaurants[cart[i].restaurant].open;
+        int stale = cart[i].restaurant == restaurant && cart[i].version != menus[restaurant].version;
+        if (!closed && !stale) {
+            cart[kept++] = cart[i];
+        }
+    }
+    if (kept < cart_count) {
+        printf("%d items removed from your cart, %s.\n", cart_count - kept, reason);
+    }
+    cart_count = kept;
+}
+
+// Function to write the cart as "restaurant item menu_version max_wait" lines, returns how many items fit in size
+int write_cart(char *text, size_t size) {
+    size_t len = 0;
+    int written = 0;
+    text[0] = '\0';
+    for (; written < cart_count; written++) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%d %d %u %d\n", cart[written].restaurant, cart[written].item, cart[written].version, max_wait);
+        if (len + n >= size) {
+            break;
+        }
+        memcpy(text + len, line, n + 1);
+        len += n;
+    }
+    return written;
+}
+
+// Function to let the user browse the menu and fill the cart, returns the item, 0 when the restaurant closed,
+// -1 when the connection dropped, or MEAL_OTHER_RESTAURANT or MEAL_CHECKOUT
+int choose_meal(message_t *msg) {
+    int page = 0;
+    printf("Menu:\n%s\n", menus[current_restaurant].text); // Print the cached first page
+    while (1) {
+        printf("Enter the number of the meal you want to order, +number to add it to your cart, n or p for the next or previous page, /text or ^text to search: ");
+        fflush(stdout); // Flush the output buffer
+        char input[64];
+        if (scanf(" %63[^\n]", input) != 1) { // Read the user choice
+            printf("Invalid choice.\n");
+            close(server_sock);
+            pthread_exit(NULL);
+        }
+        if (isdigit((unsigned char)input[0]) && atoi(input) > 0) {
+            return atoi(input);
+        }
+        if (input[0] == '+' && atoi(input + 1) > 0 && cart_count < CART_MAX_ITEMS) {
+            cart[cart_count].restaurant = current_restaurant;
+            cart[cart_count].item = atoi(input + 1);
+            cart[cart_count].version = menus[current_restaurant].version;
+            cart_count++;
+            char text[TRACE_TEXT_SIZE];
+            if (write_cart(text, sizeof(text)) < cart_count) {  // The whole cart goes in one frame, ahead of its trace
+                cart_count--;
+                printf("Your cart is full, c to order it\n");
+                continue;
+            }
+            printf("%d items in your cart, r to add from another restaurant, c to order the cart\n", cart_count);
+            continue;
+        }
+        if (input[0] == 'r') {
+            return MEAL_OTHER_RESTAURANT;
+        }
+        if (input[0] == 'c' && cart_count > 0) {
+            return MEAL_CHECKOUT;
+        }
+
+        int next_page = page;
+        memset(msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+        if (input[0] == 'n' || input[0] == 'p') {
+            next_page = input[0] == 'n' ? page + 1 : (page > 0 ? page - 1 : 0);
+            msg->type = MSG_MENU_PAGE;
+            sprintf(msg->data, "%d %d", current_restaurant, next_page);
+        } else if (input[0] == '/' || input[0] == '^') {
+            msg->type = MSG_MENU_SEARCH;
+            snprintf(msg->data, BUFFER_SIZE, "%d %s 0 0 %s", current_restaurant, input[0] == '^' ? "prefix" : "contains", input + 1);
+        } else {
+            printf("Invalid choice.\n");
+            continue;
+        }
+        if (send_frame(msg) < 0 || recv_frame(msg) < 0) {
+            return -1;
+        }
+        if (msg->type == REST_UNAVALIABLE) {
+            return 0;
+        }
+        if (msg->type == MSG_BUSY) {
+            print_busy(msg);    // Asked too often, the page stays where it was
+            continue;
+        }
+
+        const char *lines = strchr(msg->data, '\n');
+        lines = lines != NULL ? lines + 1 : "";
+        int matches, shown;
+        if (msg->type == MSG_MENU_SEARCH && sscanf(msg->data, "%*d %*u %d %d", &matches, &shown) == 2) {
+            printf("%d matching items%s:\n%s\n", matches, shown < matches ? ", refine the search to see them all" : "", lines);
+        } else if (*lines == '\0') {
+            printf("No more items.\n");
+        } else {
+            page = next_page;
+            printf("Menu page %d:\n%s\n", page + 1, lines);
+        }
+    }
+}
+
+// Function to show the cheapest items matching words across every open restaurant
+int search_catalog(message_t *msg, const char *words) {
+    memset(msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    msg->type = MSG_CATALOG_SEARCH;
+    snprintf(msg->data, BUFFER_SIZE, "0 %s", words);
+    if (send_frame(msg) < 0 || recv_frame(msg) < 0) {
+        return -1;
+    }
+    if (msg->type == MSG_BUSY) {
+        print_busy(msg);
+        return 0;
+    }
+
+    int matches = 0, shown = 0;
+    sscanf(msg->data, "%d %d", &matches, &shown);
+    printf("%d matching items%s\n", matches, shown < matches ? ", cheapest first:" : ":");
+    const char *line = strchr(msg->data, '\n');
+    while (line != NULL && line[1] != '\0') {
+        int id, offset;
+        unsigned version;
+        line++;
+        if (sscanf(line, "%d %u %n", &id, &version, &offset) == 2 && id >= 1 && id <= MAX_RESTAURANTS) {
+            printf("%s: %.*s\n", restaurants[id].name, (int)strcspn(line + offset, "\n"), line + offset);
+        }
+        line = strchr(line, '\n');
+    }
     return 0;
 }
 
+// Function to tell the user the server turned a request away and when to ask again
+void print_busy(const message_t *msg) {
+    int retry_ms = 0;
+    int offset = 0;
+    sscanf(msg->data, "%d %n", &retry_ms, &offset);
+    printf("%s, try again in %d seconds.\n", msg->data + offset, (retry_ms + 999) / 1000);
+    busy_until = now_ms() + retry_ms;
+}
+
+// Function to reconnect after the connection dropped and pick the session up where the server left it
+int resume_session(message_t *msg) {
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS; attempt++) {
+        close(server_sock);
+        usleep((useconds_t)backoff_ms(attempt) * 1000);    // Not all at once after a server restart
+
+        memset(msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+        msg->type = MSG_RESUME;
+        msg->client_token = my_token; // The old token identifies the session to resume
+        if ((server_sock = open_connection(msg)) < 0) {
+            printf("Reconnect attempt %d failed\n", attempt + 1);
+            continue;
+        }
+
+        // The server greets every connection with a token or, when busy, a retry hint; the resume answer follows
+        int received = recv_frame(msg);
+        if (received == 0 && (msg->type == MSG_TOKEN || msg->type == MSG_BUSY)) {
+            received = recv_frame(msg);
+        }
+        if (received == 0 && msg->type == MSG_BUSY) {
+            usleep((useconds_t)retry_after_ms(atoi(msg->data)) * 1000);    // Resume refused while busy, the session is gone
+        }
+        if (received < 0 || msg->type != MSG_RESUME) {
+            continue;
+        }
+
+        my_token = msg->client_token; // Unchanged when resumed, a fresh token when the session was gone
+        printf("Session resumed, server state: %s\n", msg->data);
+        subscribe();    // Subscriptions belong to the connection, the state arrives with the next frames
+        if (strcmp(msg->data, "ORDER") == 0) {
+            return STEP_ETA;    // Order reached the restaurant, the estimated time is on its way
+        }
+        if (strcmp(msg->data, "MENU") == 0) {
+            if (recv_frame(msg) == 0 && msg->type == MSG_MENU) {
+                // Server sends the menu again, the cached copy carries the version to order against
+                return menus[current_restaurant].version != 0 ? STEP_MEAL : STEP_REQUEST;
+            }
+            continue;
+        }
+        printf("Starting the order over\n");
+        return STEP_REQUEST;
+    }
+
+    printf("Could not resume the session.\n");
+    close(server_sock);
+    pthread_exit(NULL);
+}
+
 void *server_communication(void *arg) {
-    int sock = *(int *)arg; // Socket descriptor
     message_t msg;
     memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
 
-    // Receive token from server
-    ssize_t bytes_received = recv(sock, &msg, sizeof(message_t), 0);
+    // Receive token from server, or when it is too busy to take new clients, when to try again
+    ssize_t bytes_received;
+    while ((bytes_received = recv(server_sock, &msg, sizeof(message_t), MSG_WAITALL)) > 0 && msg.type == MSG_BUSY) {
+        int retry_ms = retry_after_ms(atoi(msg.data));
+        const char *reason = strchr(msg.data, ' ');
+        printf("%s, connecting again in %d ms.\n", reason != NULL ? reason + 1 : "Server is busy", retry_ms);
+        close(server_sock);
+        usleep((useconds_t)retry_ms * 1000);
+        if ((server_sock = connect_with_backoff()) < 0) {
+            printf("Connection Failed\n");
+            pthread_exit(NULL);
+        }
+    }
     if (bytes_received <= 0) {
         perror("recv");
-        close(sock);
+        close(server_sock);
         pthread_exit(NULL);
     }
 
     if (msg.type == MSG_TOKEN) {
-        strcpy(my_token, msg.data); // Correctly copy the token from msg.data to my_token
-        printf("Received token from server: %s\n", my_token);
+        my_token = msg.client_token; // Copy the binary token, msg.data holds a printable copy
+        printf("Received token from server: %s\n", msg.data);
     } else {
         perror("Expected token message");
-        close(sock);
+        close(server_sock);
         pthread_exit(NULL);
     }
     printf("i got message type %d, i wanted token\n", msg.type);
     printf("this is the data %s\n", msg.data);
-    printf("this is my token now: %s\n", my_token);
+    subscribe();    // Learn which restaurants are open without asking each time
 
+    int step = STEP_REQUEST;
     while (1) {
-        // Send a message to request the list of available restaurants
-        msg.type = MSG_REQUEST_MENU;
-        strcpy(msg.data, "REQUEST_MENU");
-        strcpy(msg.client_token, my_token); // Include the client's token in the message
-        printf("Client requesting available restaurants\n");
-        ssize_t bytes_sent = send(sock, &msg, sizeof(message_t), 0);
-        if (bytes_sent <= 0) {
-            perror("send");
-            close(sock);
-            pthread_exit(NULL);
-        }
-
-        // Receive restaurant options from server
-        do {
-            ssize_t bytes_received = recv(sock, &msg, sizeof(message_t), 0);
-            if (bytes_received <= 0) {
-                perror("recv");
-                close(sock);
-                pthread_exit(NULL);
+        if (step == STEP_REQUEST) {
+            // The server pushes which restaurants are open, no need to ask for the list
+            int open_count = 0;
+            for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+                open_count += have_availability && restaurants[id].open;
+            }
+            if (open_count == 0) {
+                if (have_availability) {
+                    printf("No restaurant is open right now, waiting for one to open\n");
+                }
+                if (await_availability() < 0) {
+                    step = resume_session(&msg);
+                }
+                continue;
+            }
+            printf("Restaurants:\n");
+            for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+                if (restaurants[id].open) {
+                    printf("%d. %s\n", id, restaurants[id].name);
+                }
             }
-        } while (msg.type == 0);
-
-        printf("Client received message type %d\n", msg.type);
-
-        if (msg.type == MSG_RESTAURANT_OPTIONS) {
-            printf("Restaurants:\n%s\n", msg.data); // Print the received data
 
             // Choose a restaurant
-            printf("Enter the number of the restaurant you want to order from: "); // Prompt the user to enter a choice
+            printf("Enter the number of the restaurant you want to order from, or ?words to find an item anywhere: "); // Prompt the user to enter a choice
             fflush(stdout); // Flush the output buffer
-            int choice; // User choice
-            if (scanf("%d", &choice) != 1 || choice < 1 || choice > 3) { // Read the user choice
+            char input[64];
+            if (scanf(" %63[^\n]", input) != 1) { // Read the user choice
                 printf("Invalid choice.\n");
-                close(sock);
+                close(server_sock);
                 pthread_exit(NULL);
             }
-
-            msg.type = MSG_ORDER;
-            sprintf(msg.data, "%d", choice);
-            strcpy(msg.client_token, my_token); // Include the client's token in the message
-            bytes_sent = send(sock, &msg, sizeof(message_t), 0);
-            if (bytes_sent <= 0) {
-                perror("send");
-                close(sock);
+            if (input[0] == '?') {
+                if (search_catalog(&msg, input + 1) < 0) {
+                    step = resume_session(&msg);
+                }
+                continue;
+            }
+            int choice = atoi(input); // User choice
+            if (choice < 1 || choice > MAX_RESTAURANTS) {
+                printf("Invalid choice.\n");
+                close(server_sock);
                 pthread_exit(NULL);
             }
+            drain_availability();   // It may have closed while the user was choosing
+            if (!restaurants[choice].open) {
+                printf("That restaurant is closed, choose another one.\n");
+                continue;
+            }
 
-            // Receive response from server
-            do {
-                ssize_t bytes_received = recv(sock, &msg, sizeof(message_t), 0);
-                if (bytes_received <= 0) {
-                    perror("recv");
-                    close(sock);
-                    pthread_exit(NULL);
+            current_restaurant = choice;
+            if (menus[choice].version == restaurants[choice].menu_version && menus[choice].version != 0) {
+                step = STEP_MEAL;   // Cached menu is current, the order is the only round trip
+            } else {
+                // Version 0 never matches, the server answers with the current menu
+                msg.type = MSG_DIRECT_ORDER;
+                sprintf(msg.data, "%d 0 0", choice);
+                if (send_frame(&msg) < 0) {
+                    step = resume_session(&msg);
+                    continue;
                 }
-            } while (msg.type == 0);
-
-            printf("Client received message type %d\n", msg.type);
+                step = STEP_ETA;
+            }
+        }
 
-            if (msg.type == REST_UNAVALIABLE) {
-                printf("%s", msg.data);
+        if (step == STEP_MEAL) {
+            int meal_choice = choose_meal(&msg);    // The server checks the item exists
+            if (meal_choice == MEAL_OTHER_RESTAURANT) {
+                step = STEP_REQUEST;
                 continue;
-            } else if (msg.type == MSG_MENU) {
-                printf("Menu received:\n%s\n", msg.data); // Print the received menu
-
-                // Choose a meal
-                printf("Enter the number of the meal you want to order: "); // Prompt the user to enter a choice
-                fflush(stdout); // Flush the output buffer
-                int meal_choice; // User choice
-                if (scanf("%d", &meal_choice) != 1 || meal_choice < 1 || meal_choice > 10) { // Read the user choice
-                    printf("Invalid choice.\n");
-                    close(sock);
-                    pthread_exit(NULL);
-                }
-
-                msg.type = MSG_ORDER;
-                sprintf(msg.data, "ORDER: %d", meal_choice);
-                strcpy(msg.client_token, my_token); // Include the client's token in the message
-                bytes_sent = send(sock, &msg, sizeof(message_t), 0);
-                if (bytes_sent <= 0) {
-                    perror("send");
-                    close(sock);
-                    pthread_exit(NULL);
-                }
+            }
+            if (meal_choice == -1) {
+                step = resume_session(&msg);
+                continue;
+            }
+            if (meal_choice == 0) {
+                printf("Restaurant is not available\n");
+                step = STEP_REQUEST;
+                continue;
+            }
 
-                // Receive time estimation from server
-                do {
-                    ssize_t bytes_received = recv(sock, &msg, sizeof(message_t), 0);
-                    if (bytes_received <= 0) {
-                        perror("recv");
-                        close(sock);
-                        pthread_exit(NULL);
-                    }
-                } while (msg.type == 0);
-
-                if (msg.type != MSG_ESTIMATED_TIME) {
-                    perror("Expected estimated time message");
-                    close(sock);
-                    pthread_exit(NULL);
-                }
-                printf("Estimated time for your order: %s\n", msg.data); // Print the time estimation
+            memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+            if (meal_choice == MEAL_CHECKOUT) {
+                // Every item of the cart in one frame, the server splits it between the restaurants
+                msg.type = MSG_CART;
+                write_cart(msg.data, TRACE_TEXT_SIZE);  // Filled only as far as it fits, checked as items were added
             } else {
-                perror("Unexpected message type");
-                close(sock);
-                pthread_exit(NULL);
+                msg.type = MSG_DIRECT_ORDER;    // The server holds orders with a tight max wait ahead of the others
+                sprintf(msg.data, "%d %d %u %d", current_restaurant, meal_choice, menus[current_restaurant].version, max_wait);
             }
-        } else {
-            perror("Expected restaurant options message");
-            close(sock);
+            if (send_frame(&msg) < 0) {
+                step = resume_session(&msg);
+                continue;
+            }
+            step = STEP_ETA;
+        }
+
+        // Receive time estimation from server
+        if (recv_frame(&msg) < 0) {
+            step = resume_session(&msg);
+            continue;
+        }
+        if (msg.type == MSG_MENU_UPDATE) {
+            // The menu changed since it was cached, nothing was ordered
+            int id = 0;
+            sscanf(msg.data, "%d", &id);
+            if (id >= 1 && id <= MAX_RESTAURANTS && menus[id].version != 0) {
+                printf("The menu of %s has changed.\n", restaurants[id].name);
+            }
+            if ((id = store_menu_update(msg.data)) != 0) {
+                current_restaurant = id;
+                drop_from_cart(id, "the menu changed");
+            }
+            step = STEP_MEAL;
+            continue;
+        }
+        if (msg.type == REST_UNAVALIABLE) {
+            printf("%s\n", msg.data);
+            drain_availability();
+            drop_from_cart(0, "the restaurant closed");
+            step = STEP_REQUEST;
+            continue;
+        }
+        if (msg.type == MSG_BUSY) {
+            print_busy(&msg);
+            // Menu and cart are kept, the user orders again when ready; without a menu there is nothing to order from
+            step = menus[current_restaurant].version != 0 ? STEP_MEAL : STEP_REQUEST;
+            continue;
+        }
+        if (msg.type != MSG_ESTIMATED_TIME) {
+            perror("Expected estimated time message");
+            close(server_sock);
             pthread_exit(NULL);
         }
+        printf("Estimated time for your order: %s\n", msg.data); // Print the time estimation
+        trace_context_t trace;
+        if (trace_file != NULL && trace_get(&msg, &trace) && trace.id != 0) {
+            trace.stamps[TRACE_CLIENT_RECEIVE] = trace_now();
+            int id = trace.restaurant >= 1 && trace.restaurant <= MAX_RESTAURANTS ? trace.restaurant : 0;
+            trace_write(trace_file, &trace, id != 0 ? restaurants[id].name : "restaurant");
+            printf("Trace %016llx of the order written\n", (unsigned long long)trace.id);
+        }
+        cart_count = 0;
         break; // Exit the loop once an order is successfully placed and time estimation is received
     }
     return NULL; // Return from the thread
@@ -226,20 +738,18 @@ void *server_communication(void *arg) {
 
 // Keep-alive thread function
 void *keep_alive(void *arg) {
-    int sock = *(int *)arg; // Socket descriptor
     message_t keep_alive_msg;
     memset(&keep_alive_msg, 0, sizeof(message_t));  // Ensure message is zeroed out
     keep_alive_msg.type = MSG_KEEP_ALIVE;
     strcpy(keep_alive_msg.data, "KEEP_ALIVE");
-    strcpy(keep_alive_msg.client_token, my_token); // Include the client's token in the message
 
     while (1) { // Loop to send keep-alive messages
         sleep(30); // Send keep-alive message every 30 seconds
-        ssize_t bytes_sent = send(sock, &keep_alive_msg, sizeof(message_t), 0);
+        keep_alive_msg.client_token = my_token; // Include the client's token in the message, it changes if the session could not be resumed
+        ssize_t bytes_sent = send(server_sock, &keep_alive_msg, sizeof(message_t), MSG_NOSIGNAL);
         if (bytes_sent <= 0) {
-            perror("send");
-            close(sock);
-            pthread_exit(NULL);
+            perror("send");     // The communication thread reconnects
+            continue;
         }
         printf("\nKEEP_ALIVE sent\n"); // Print the keep-alive message
     }
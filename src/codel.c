@@ -0,0 +1,60 @@
+#include "codel.h"
+
+#define CODEL_MEMORY 16     // Intervals after an episode in which a new one resumes its shedding rate
+
+// Function to take the integer square root, the control law needs no floating point
+static uint32_t isqrt(uint32_t n) {
+    uint32_t root = n, next = (n + 1) / 2;
+    while (next < root) {   // Newton's method from above
+        root = next;
+        next = (root + n / root) / 2;
+    }
+    return root;
+}
+
+void codel_init(codel_t *codel, uint64_t target, uint64_t interval) {
+    codel->target = target;
+    codel->interval = interval;
+    codel->first_above = 0;
+    codel->shed_next = 0;
+    codel->count = 0;
+    codel->last_count = 0;
+    codel->shedding = 0;
+    codel->shed = 0;
+}
+
+void codel_sample(codel_t *codel, uint64_t sojourn, uint64_t now) {
+    if (sojourn < codel->target) {
+        codel->first_above = 0;     // Burst drained, nothing is standing
+        if (codel->shedding) {
+            codel->shedding = 0;
+            codel->last_count = codel->count;
+        }
+        return;
+    }
+    if (codel->first_above == 0) {
+        codel->first_above = now + codel->interval;
+        return;
+    }
+    if (!codel->shedding && now >= codel->first_above) {
+        // Overload that comes straight back picks up near the rate that ended the last episode
+        int recent = codel->last_count > 2 && now - codel->shed_next < CODEL_MEMORY * codel->interval;
+        codel->count = recent ? codel->last_count - 2 : 0;
+        codel->shed_next = now;
+        codel->shedding = 1;
+    }
+}
+
+int codel_shed(codel_t *codel, uint64_t now) {
+    if (!codel->shedding || now < codel->shed_next) {
+        return 0;
+    }
+    codel->count++;
+    codel->shed++;
+    codel->shed_next = now + codel->interval / isqrt(codel->count);
+    return 1;
+}
+
+int codel_overloaded(const codel_t *codel) {
+    return codel->shedding;
+}
@@ -0,0 +1,30 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdint.h>
+
+// Overload controller after CoDel. Callers report how long work waited
+// (its sojourn) each time some leaves a queue. While that delay stays above
+// target for a whole interval the queue is standing rather than absorbing a
+// burst, and the controller starts shedding: the first arrival is shed at
+// once and the next ones at interval / sqrt(count), so shedding speeds up
+// until the delay falls back under target. Times are in microseconds of a
+// monotonic clock. Callers serialize access.
+
+typedef struct {
+    uint64_t target;            // Delay the queue may keep
+    uint64_t interval;          // How long the delay must stay above target before shedding
+    uint64_t first_above;       // When the delay may first count as standing, 0 while below target
+    uint64_t shed_next;         // When the next arrival is shed
+    uint32_t count;             // Arrivals shed since shedding started
+    uint32_t last_count;        // Count of the previous shedding episode
+    uint8_t shedding;
+    uint64_t shed;              // Arrivals shed in total
+} codel_t;
+
+void codel_init(codel_t *codel, uint64_t target, uint64_t interval);
+void codel_sample(codel_t *codel, uint64_t sojourn, uint64_t now);     // Work left the queue after waiting sojourn
+int codel_shed(codel_t *codel, uint64_t now);      // 1 when the arrival at now should be turned away
+int codel_overloaded(const codel_t *codel);        // Shedding, arrivals that can wait should stay away
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "frame.h"
+
+#define FRAMES_PER_SLAB 64      // Frames carved out of one allocation
+#define FRAME_CACHE 64          // Frames a thread keeps before spilling half to the shared list
+
+static __thread frame_t *cache = NULL;     // This thread's free frames
+static __thread uint32_t cache_count = 0;
+static frame_t *shared = NULL;              // Free frames spilled by any thread
+static uint32_t shared_count = 0;
+static uint64_t built = 0;
+static uint64_t slabs = 0;
+static pthread_mutex_t frame_mutex = PTHREAD_MUTEX_INITIALIZER;    // Guards the shared list
+
+// Function to refill this thread's cache from the shared list or a new slab
+static void refill(void) {
+    pthread_mutex_lock(&frame_mutex);
+    while (shared != NULL && cache_count < FRAME_CACHE / 2) {
+        frame_t *frame = shared;
+        shared = frame->next;
+        shared_count--;
+        frame->next = cache;
+        cache = frame;
+        cache_count++;
+    }
+    pthread_mutex_unlock(&frame_mutex);
+    if (cache != NULL) {
+        return;
+    }
+
+    frame_t *slab = malloc(FRAMES_PER_SLAB * sizeof(frame_t));  // Never freed, frames live in the pool
+    if (slab == NULL) {
+        perror("frame slab");
+        return;
+    }
+    __atomic_add_fetch(&slabs, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < FRAMES_PER_SLAB; i++) {
+        slab[i].next = cache;
+        cache = &slab[i];
+    }
+    cache_count += FRAMES_PER_SLAB;
+}
+
+frame_t *frame_new(message_type_t type, const session_token_t *token) {
+    if (cache == NULL) {
+        refill();
+        if (cache == NULL) {
+            return NULL;
+        }
+    }
+    frame_t *frame = cache;
+    cache = frame->next;
+    cache_count--;
+
+    frame->next = NULL;
+    frame->refs = 1;
+    memset(&frame->msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    frame->msg.type = type;
+    if (token != NULL) {
+        frame->msg.client_token = *token;
+    }
+    __atomic_add_fetch(&built, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+frame_t *frame_text(message_type_t type, const session_token_t *token, const char *text) {
+    frame_t *frame = frame_new(type, token);
+    if (frame != NULL) {
+        strncpy(frame->msg.data, text, BUFFER_SIZE - 1);
+    }
+    return frame;
+}
+
+frame_t *frame_ref(frame_t *frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_unref(frame_t *frame) {
+    if (frame == NULL || __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    frame->next = cache;
+    cache = frame;
+    if (++cache_count <= FRAME_CACHE) {
+        return;
+    }
+
+    // Threads that only free (the event loop finishing sends) hand frames back to the ones that build them
+    pthread_mutex_lock(&frame_mutex);
+    while (cache_count > FRAME_CACHE / 2) {
+        frame_t *spilled = cache;
+        cache = spilled->next;
+        cache_count--;
+        spilled->next = shared;
+        shared = spilled;
+        shared_count++;
+    }
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+void frame_stats(uint64_t *built_count, uint64_t *slab_count) {
+    *built_count = __atomic_load_n(&built, __ATOMIC_RELAXED);
+    *slab_count = __atomic_load_n(&slabs, __ATOMIC_RELAXED);
+}
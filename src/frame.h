@@ -0,0 +1,26 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Pooled, reference counted protocol frames. A frame is encoded once and can
+// be queued to any number of connections without copying; each queued send
+// holds a reference and the last one to finish returns the frame to the pool.
+// Frames come from slabs and are recycled through a small per-thread cache
+// that spills into and refills from a shared list.
+
+typedef struct frame {
+    struct frame *next;         // Free list link while pooled
+    uint32_t refs;
+    message_t msg;
+} frame_t;
+
+frame_t *frame_new(message_type_t type, const session_token_t *token);   // Zeroed frame with one reference, token may be NULL
+frame_t *frame_text(message_type_t type, const session_token_t *token, const char *text);  // Same, data set to text
+frame_t *frame_ref(frame_t *frame);
+void frame_unref(frame_t *frame);       // Drop a reference, the last one returns the frame to the pool
+void frame_stats(uint64_t *built, uint64_t *slabs);
+
+#endif
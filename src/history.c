@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+#define HISTORY_MAGIC "ORDHIST1"    // First bytes of a segment file
+#define HEADER_SIZE 4096            // Columns start on the next page
+#define SCAN_BLOCK 4096             // Rows filtered per pass of a query
+
+typedef struct {
+    char magic[8];
+    uint32_t capacity;          // Rows the segment was created for
+    uint32_t reserved;
+    uint64_t rows;              // Rows written, published after their columns
+} segment_header_t;
+
+typedef struct {
+    void *base;                 // Mapping of the whole file
+    size_t size;
+    segment_header_t *header;
+    uint32_t *time;             // Column arrays, one value per row
+    uint32_t *price_cents;
+    uint32_t *quoted_eta;
+    uint32_t *latency_ms;
+    uint16_t *item;
+    uint8_t *restaurant;
+} segment_t;
+
+static char history_dir[4096];
+static segment_t **segments = NULL;     // Segments never move or unmap before history_close
+static uint32_t segment_count = 0;
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the segment list and appends
+
+static size_t segment_size(uint32_t capacity) {
+    return HEADER_SIZE + (size_t)capacity * (4 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t));
+}
+
+// Function to map segment number index, creating the file when it does not exist
+static segment_t *map_segment(uint32_t index, int create) {
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/segment-%06u.col", history_dir, index);
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            perror(path);
+        }
+        return NULL;
+    }
+
+    size_t size = segment_size(HISTORY_SEGMENT_ROWS);
+    if (create && ftruncate(fd, size) < 0) {    // Sparse until rows are written
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < HEADER_SIZE) {
+        fprintf(stderr, "%s: not a history segment\n", path);
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    segment_header_t *header = base;
+    if (create) {
+        memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+        header->capacity = HISTORY_SEGMENT_ROWS;
+    } else if (memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) != 0 ||
+               segment_size(header->capacity) != size || header->rows > header->capacity) {
+        fprintf(stderr, "%s: not a history segment\n", path);
+        munmap(base, size);
+        return NULL;
+    }
+
+    segment_t *segment = malloc(sizeof(segment_t));
+    if (segment == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+    uint32_t capacity = header->capacity;
+    segment->base = base;
+    segment->size = size;
+    segment->header = header;
+    segment->time = (uint32_t *)((char *)base + HEADER_SIZE);
+    segment->price_cents = segment->time + capacity;
+    segment->quoted_eta = segment->price_cents + capacity;
+    segment->latency_ms = segment->quoted_eta + capacity;
+    segment->item = (uint16_t *)(segment->latency_ms + capacity);
+    segment->restaurant = (uint8_t *)(segment->item + capacity);
+    return segment;
+}
+
+// Function to add a mapped segment to the list, caller holds history_mutex
+static int add_segment(segment_t *segment) {
+    segment_t **grown = realloc(segments, (segment_count + 1) * sizeof(segment_t *));
+    if (grown == NULL) {
+        munmap(segment->base, segment->size);
+        free(segment);
+        return -1;
+    }
+    segments = grown;
+    segments[segment_count++] = segment;
+    return 0;
+}
+
+// Function to map the existing segments of a history directory
+int history_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    snprintf(history_dir, sizeof(history_dir), "%s", dir);
+
+    pthread_mutex_lock(&history_mutex);
+    segment_t *segment;
+    while ((segment = map_segment(segment_count, 0)) != NULL) {
+        if (add_segment(segment) < 0) {
+            break;
+        }
+    }
+    if (segment_count == 0 && ((segment = map_segment(0, 1)) == NULL || add_segment(segment) < 0)) {
+        pthread_mutex_unlock(&history_mutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return 0;
+}
+
+// Function to append a completed order, starting a new segment when the last one is full
+int history_append(const history_row_t *row) {
+    pthread_mutex_lock(&history_mutex);
+    if (segment_count == 0) {
+        pthread_mutex_unlock(&history_mutex);
+        return -1;
+    }
+    segment_t *segment = segments[segment_count - 1];
+    uint64_t n = segment->header->rows;
+    if (n == segment->header->capacity) {
+        if ((segment = map_segment(segment_count, 1)) == NULL || add_segment(segment) < 0) {
+            pthread_mutex_unlock(&history_mutex);
+            return -1;
+        }
+        n = 0;
+    }
+    segment->time[n] = row->time;
+    segment->price_cents[n] = row->price_cents;
+    segment->quoted_eta[n] = row->quoted_eta;
+    segment->latency_ms[n] = row->latency_ms;
+    segment->item[n] = row->item;
+    segment->restaurant[n] = row->restaurant;
+    __atomic_store_n(&segment->header->rows, n + 1, __ATOMIC_RELEASE);     // Scans see whole rows only
+    pthread_mutex_unlock(&history_mutex);
+    return 0;
+}
+
+uint64_t history_rows(void) {
+    uint64_t rows = 0;
+    pthread_mutex_lock(&history_mutex);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        rows += __atomic_load_n(&segments[i]->header->rows, __ATOMIC_ACQUIRE);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return rows;
+}
+
+// Function to count a restaurant's orders per item and hour with a scan over the time, restaurant and item columns
+uint64_t history_orders_per_item_hour(uint8_t restaurant, uint32_t from, uint32_t to, uint32_t *counts) {
+    uint32_t span = to > from ? to - from : 0;
+    uint32_t hours = (span + 3599) / 3600;
+    uint64_t matched = 0;
+    uint8_t selected[SCAN_BLOCK];
+
+    memset(counts, 0, (size_t)HISTORY_MAX_ITEMS * hours * sizeof(uint32_t));
+    pthread_mutex_lock(&history_mutex);     // Snapshot the segment list, appends go on while we scan
+    uint32_t count = segment_count;
+    segment_t **list = malloc((count ? count : 1) * sizeof(segment_t *));
+    if (list == NULL) {
+        pthread_mutex_unlock(&history_mutex);
+        return 0;
+    }
+    memcpy(list, segments, count * sizeof(segment_t *));
+    pthread_mutex_unlock(&history_mutex);
+
+    for (uint32_t s = 0; s < count; s++) {
+        const segment_t *segment = list[s];
+        uint64_t rows = __atomic_load_n(&segment->header->rows, __ATOMIC_ACQUIRE);
+        for (uint64_t start = 0; start < rows; start += SCAN_BLOCK) {
+            uint32_t n = rows - start < SCAN_BLOCK ? rows - start : SCAN_BLOCK;
+            const uint32_t *time = segment->time + start;
+            const uint8_t *restaurants = segment->restaurant + start;
+
+            // Branch-free filter over two columns, one compare covers both ends of the time range
+            for (uint32_t i = 0; i < n; i++) {
+                selected[i] = (restaurants[i] == restaurant) & (time[i] - from < span);
+            }
+            const uint16_t *item = segment->item + start;
+            for (uint32_t i = 0; i < n; i++) {
+                if (selected[i] && item[i] < HISTORY_MAX_ITEMS) {
+                    counts[item[i] * hours + (time[i] - from) / 3600]++;
+                    matched++;
+                }
+            }
+        }
+    }
+    free(list);
+    return matched;
+}
+
+void history_close(void) {
+    pthread_mutex_lock(&history_mutex);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        munmap(segments[i]->base, segments[i]->size);
+        free(segments[i]);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = 0;
+    pthread_mutex_unlock(&history_mutex);
+}
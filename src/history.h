@@ -0,0 +1,31 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+// Columnar history of completed orders for analytics. Rows go into memory
+// mapped segment files, each holding fixed-width column arrays, so queries
+// scan only the columns they need in tight loops the compiler vectorizes
+// instead of parsing text.
+
+#define HISTORY_SEGMENT_ROWS (1u << 22)     // Rows per segment file
+#define HISTORY_MAX_ITEMS 64                // Item ids counted by queries are below this
+
+typedef struct {
+    uint32_t time;              // Completion time, seconds since the epoch
+    uint8_t restaurant;         // Restaurant id
+    uint16_t item;              // Menu item number
+    uint32_t price_cents;       // Item price from the menu
+    uint32_t quoted_eta;        // Seconds quoted by the restaurant
+    uint32_t latency_ms;        // Order forwarded until the estimated time arrived
+} history_row_t;
+
+int history_open(const char *dir);          // Map the segments in dir, creating it when missing
+int history_append(const history_row_t *row);
+uint64_t history_rows(void);
+// Count orders of a restaurant per item and hour in [from, to). counts holds
+// HISTORY_MAX_ITEMS rows of ceil((to - from) / 3600) hours. Returns matching orders.
+uint64_t history_orders_per_item_hour(uint8_t restaurant, uint32_t from, uint32_t to, uint32_t *counts);
+void history_close(void);
+
+#endif
@@ -0,0 +1,757 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "io_backend.h"
+
+#define EPOLL_MAX_EVENTS 64     // Events handled per epoll_wait
+#define RECV_CHUNK 4096         // Bytes read per recv call
+#define IO_MAX_LINKS 8          // Shared-memory links, one per colocated restaurant
+#define IDLE_WAIT_NS 50000      // A wait shorter than this found events already pending, the loop did not sleep
+
+const io_callbacks_t *io_callbacks;    // Server callbacks
+volatile int io_stopping = 0;           // Set when the loop should exit
+int io_wake_fd = -1;                    // eventfd to wake the loop
+
+static const io_ops_t *io_ops;          // Selected backend
+static pthread_t io_loop_thread;        // Thread running io_run()
+static io_stats_t io_stats;             // Counters, updated atomically
+static uint64_t wait_began;             // Loop thread only, nanoseconds of the monotonic clock
+static uint64_t batch_woke;             // When the loop picked up the events being handled
+static uint64_t batch_since;            // Oldest time those events can have been waiting since
+
+typedef struct {
+    int fd;                     // Connection the link carries the frames of
+    shm_link_t *link;
+} io_link_t;
+
+typedef struct {
+    int fd;                     // Connection whose input waits in the kernel
+    uint64_t until;             // When it is read again, nanoseconds of the monotonic clock
+} io_paused_t;
+
+static io_link_t io_links[IO_MAX_LINKS];
+static int io_link_count = 0;           // Changed on the loop thread only
+static pthread_mutex_t io_links_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards io_links and the send side of every link
+static io_paused_t *io_paused = NULL;   // Paused connections, loop thread only
+static int io_paused_count = 0;
+static int io_paused_cap = 0;
+
+void io_count_syscall(void) {
+    __atomic_add_fetch(&io_stats.syscalls, 1, __ATOMIC_RELAXED);
+}
+
+void io_count_bytes(uint64_t in, uint64_t out) {
+    if (in) {
+        __atomic_add_fetch(&io_stats.bytes_in, in, __ATOMIC_RELAXED);
+    }
+    if (out) {
+        __atomic_add_fetch(&io_stats.bytes_out, out, __ATOMIC_RELAXED);
+    }
+}
+
+void io_count_copy(uint64_t allocs, uint64_t bytes) {
+    if (allocs) {
+        __atomic_add_fetch(&io_stats.allocs, allocs, __ATOMIC_RELAXED);
+    }
+    if (bytes) {
+        __atomic_add_fetch(&io_stats.copied, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+int io_on_loop_thread(void) {
+    return pthread_equal(pthread_self(), io_loop_thread);
+}
+
+// Function to read the monotonic clock in nanoseconds
+uint64_t io_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void io_wait_begin(void) {
+    wait_began = io_monotonic_ns();
+}
+
+void io_wait_end(void) {
+    uint64_t now = io_monotonic_ns();
+    // Events found without sleeping arrived while the previous batch was handled, otherwise while we slept
+    batch_since = now - wait_began < IDLE_WAIT_NS && batch_woke != 0 ? batch_woke : now;
+    batch_woke = now;
+}
+
+uint64_t io_loop_delay(void) {
+    return batch_since != 0 ? (io_monotonic_ns() - batch_since) / 1000 : 0;
+}
+
+void io_get_stats(io_stats_t *stats) {
+    stats->syscalls = __atomic_load_n(&io_stats.syscalls, __ATOMIC_RELAXED);
+    stats->bytes_in = __atomic_load_n(&io_stats.bytes_in, __ATOMIC_RELAXED);
+    stats->bytes_out = __atomic_load_n(&io_stats.bytes_out, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&io_stats.allocs, __ATOMIC_RELAXED);
+    stats->copied = __atomic_load_n(&io_stats.copied, __ATOMIC_RELAXED);
+}
+
+const char *io_backend_name(io_backend_t backend) {
+    return backend == IO_BACKEND_URING ? "io_uring" : "epoll";
+}
+
+// Function to create a listening Unix domain socket for processes on the same host
+int io_listen_unix(const char *path, int backlog) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);   // Left behind by a server that did not exit cleanly
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to create a listening TCP socket
+int io_listen(int port, int backlog) {
+    int fd;
+    struct sockaddr_in address;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    int reuse = 1;  // Allow a restarted server to bind while old connections sit in TIME_WAIT
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        perror("Setting SO_REUSEADDR error");
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, backlog) < 0) {
+        perror("listen failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to select and initialize a backend, falling back to epoll
+io_backend_t io_init(io_backend_t requested, const int *listeners, int count, const io_callbacks_t *callbacks) {
+    io_callbacks = callbacks;
+    io_loop_thread = pthread_self();
+
+    // An inherited eventfd keeps the wakeups of linked restaurants coming to this loop
+    if (io_wake_fd < 0 && (io_wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (requested == IO_BACKEND_URING) {
+        if (io_uring_ops.init(listeners, count) == 0) {
+            io_ops = &io_uring_ops;
+            return IO_BACKEND_URING;
+        }
+        printf("io_uring backend unavailable, falling back to epoll\n");
+    }
+
+    if (io_epoll_ops.init(listeners, count) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    io_ops = &io_epoll_ops;
+    return IO_BACKEND_EPOLL;
+}
+
+int io_run(void) {
+    io_loop_thread = pthread_self();
+    return io_ops->run();
+}
+
+void io_quiesce(void) {
+    io_ops->quiesce();
+}
+
+void io_drain(void) {
+    io_ops->drain();
+}
+
+void io_resume(void) {
+    io_stopping = 0;
+    io_ops->resume();
+}
+
+int io_adopt(int fd) {
+    return io_ops->adopt(fd);
+}
+
+void io_stop(void) {
+    uint64_t one = 1;
+    io_stopping = 1;
+    if (write(io_wake_fd, &one, sizeof(one)) < 0) {
+        // Nothing to do, the loop is already awake
+    }
+}
+
+// Function to send whole frames over the link of a connection, returns 1 when the connection has none
+static int link_send(int fd, const void *buf, size_t len) {
+    if (__atomic_load_n(&io_link_count, __ATOMIC_ACQUIRE) == 0) {
+        return 1;
+    }
+    int result = 1;
+    pthread_mutex_lock(&io_links_mutex);
+    for (int i = 0; i < io_link_count; i++) {
+        if (io_links[i].fd == fd) {
+            result = len % sizeof(message_t) == 0 ? 0 : -1;     // Links carry frames, not a byte stream
+            // Credits keep a restaurant's ring far from full, a full one fails like a dead socket would
+            for (size_t off = 0; result == 0 && off < len; off += sizeof(message_t)) {
+                result = shm_send(io_links[i].link, (const message_t *)((const char *)buf + off));
+            }
+            if (result == 0) {
+                io_count_bytes(0, len);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&io_links_mutex);
+    return result;
+}
+
+int io_send(int fd, const void *buf, size_t len) {
+    int result = link_send(fd, buf, len);
+    return result != 1 ? result : io_ops->send(fd, buf, len);
+}
+
+int io_send_frame(int fd, frame_t *frame) {
+    int result = link_send(fd, &frame->msg, sizeof(message_t));
+    return result != 1 ? result : io_ops->send_frame(fd, frame);
+}
+
+int io_attach_link(int fd, shm_link_t *link) {
+    pthread_mutex_lock(&io_links_mutex);
+    if (io_link_count == IO_MAX_LINKS) {
+        pthread_mutex_unlock(&io_links_mutex);
+        return -1;
+    }
+    io_links[io_link_count].fd = fd;
+    io_links[io_link_count].link = link;
+    __atomic_store_n(&io_link_count, io_link_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&io_links_mutex);
+    return 0;
+}
+
+shm_link_t *io_link(int fd) {
+    shm_link_t *link = NULL;
+    pthread_mutex_lock(&io_links_mutex);
+    for (int i = 0; i < io_link_count; i++) {
+        if (io_links[i].fd == fd) {
+            link = io_links[i].link;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&io_links_mutex);
+    return link;
+}
+
+void io_detach_link(int fd) {
+    pthread_mutex_lock(&io_links_mutex);
+    for (int i = 0; i < io_link_count; i++) {
+        if (io_links[i].fd == fd) {
+            shm_link_close(io_links[i].link);
+            free(io_links[i].link);
+            io_links[i] = io_links[io_link_count - 1];
+            __atomic_store_n(&io_link_count, io_link_count - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&io_links_mutex);
+}
+
+void io_poll_links(void) {
+    for (int i = 0; i < io_link_count; i++) {   // Only the loop thread changes the table, no lock to read it here
+        int fd = io_links[i].fd;
+        message_t msg;
+        while (shm_recv(io_links[i].link, &msg)) {
+            io_count_bytes(sizeof(message_t), 0);
+            io_callbacks->on_data(fd, (const char *)&msg, sizeof(message_t));   // Closing waits for the socket's EOF
+        }
+    }
+}
+
+void io_shutdown(int fd) {
+    io_count_syscall();
+    shutdown(fd, SHUT_RDWR);    // The loop sees EOF and runs on_close
+}
+
+// Function to stop reading a connection for a while, a peer that keeps sending fills its socket and blocks
+void io_pause(int fd, uint32_t ms) {
+    uint64_t until = io_monotonic_ns() + ms * 1000000ULL;
+    for (int i = 0; i < io_paused_count; i++) {
+        if (io_paused[i].fd == fd) {
+            io_paused[i].until = until > io_paused[i].until ? until : io_paused[i].until;
+            return;
+        }
+    }
+    if (io_paused_count == io_paused_cap) {
+        int cap = io_paused_cap ? io_paused_cap * 2 : 16;
+        io_paused_t *paused = realloc(io_paused, cap * sizeof(io_paused_t));
+        if (paused == NULL) {
+            return;     // Read on, the frames are still turned away
+        }
+        io_paused = paused;
+        io_paused_cap = cap;
+    }
+    io_paused[io_paused_count].fd = fd;
+    io_paused[io_paused_count].until = until;
+    io_paused_count++;
+    io_ops->pause(fd, 1);
+}
+
+int io_resume_paused(void) {
+    uint64_t now = io_monotonic_ns();
+    int next_ms = -1;
+    for (int i = 0; i < io_paused_count;) {
+        if (io_paused[i].until <= now) {
+            io_ops->pause(io_paused[i].fd, 0);
+            io_paused[i] = io_paused[--io_paused_count];
+            continue;
+        }
+        int ms = (int)((io_paused[i].until - now + 999999) / 1000000);
+        next_ms = next_ms < 0 || ms < next_ms ? ms : next_ms;
+        i++;
+    }
+    return next_ms;
+}
+
+void io_forget_pause(int fd) {
+    for (int i = 0; i < io_paused_count; i++) {
+        if (io_paused[i].fd == fd) {
+            io_paused[i] = io_paused[--io_paused_count];
+            return;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// epoll backend: readiness based, non-blocking sockets with a per-fd send queue
+
+typedef struct tx_buf {
+    struct tx_buf *next;
+    frame_t *frame;             // Frame the bytes belong to, NULL when they were copied into data
+    const char *bytes;          // Bytes to send, in the frame or in data
+    size_t len;                 // Bytes to send
+    size_t off;                 // Bytes already sent
+    char data[];
+} tx_buf_t;
+
+typedef struct {
+    tx_buf_t *head;             // Pending output, oldest first
+    tx_buf_t *tail;
+    int paused;                 // Not watched for input
+} epoll_conn_t;
+
+static int epoll_fd = -1;
+static int epoll_listeners[8];  // Listening sockets
+static int epoll_listener_count = 0;
+static epoll_conn_t *epoll_conns = NULL;   // Indexed by fd
+static int epoll_conn_cap = 0;
+static pthread_mutex_t epoll_tx_mutex = PTHREAD_MUTEX_INITIALIZER;    // Guards epoll_conns
+
+// Grow the per-fd table, caller holds epoll_tx_mutex
+static epoll_conn_t *epoll_conn(int fd) {
+    if (fd >= epoll_conn_cap) {
+        int cap = epoll_conn_cap ? epoll_conn_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        epoll_conn_t *conns = realloc(epoll_conns, cap * sizeof(epoll_conn_t));
+        if (conns == NULL) {
+            return NULL;
+        }
+        memset(conns + epoll_conn_cap, 0, (cap - epoll_conn_cap) * sizeof(epoll_conn_t));
+        epoll_conns = conns;
+        epoll_conn_cap = cap;
+    }
+    return &epoll_conns[fd];
+}
+
+// Events a connection is watched for, caller holds epoll_tx_mutex
+static uint32_t epoll_events(const epoll_conn_t *conn) {
+    return (conn->paused ? 0 : EPOLLIN) | EPOLLRDHUP | (conn->head != NULL ? EPOLLOUT : 0);
+}
+
+static void epoll_watch(int fd, uint32_t events, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    io_count_syscall();
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+// Watch a descriptor for events whether or not it is in the epoll set already
+static void epoll_rewatch(int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    io_count_syscall();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 && (errno != EEXIST || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)) {
+        perror("epoll_ctl");
+    }
+}
+
+static int epoll_init(const int *listeners, int count) {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    for (int i = 0; i < count && i < (int)(sizeof(epoll_listeners) / sizeof(epoll_listeners[0])); i++) {
+        epoll_listeners[epoll_listener_count++] = listeners[i];
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);   // accept until EAGAIN
+        epoll_watch(listeners[i], EPOLLIN, EPOLL_CTL_ADD);
+    }
+    epoll_watch(io_wake_fd, EPOLLIN, EPOLL_CTL_ADD);
+    return 0;
+}
+
+static int epoll_is_listener(int fd) {
+    for (int i = 0; i < epoll_listener_count; i++) {
+        if (epoll_listeners[i] == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Send as much queued output as the socket takes, caller holds epoll_tx_mutex
+static int epoll_flush(int fd, epoll_conn_t *conn) {
+    while (conn->head != NULL) {
+        tx_buf_t *buf = conn->head;
+        io_count_syscall();
+        ssize_t bytes_sent = send(fd, buf->bytes + buf->off, buf->len - buf->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        io_count_bytes(0, bytes_sent);
+        buf->off += bytes_sent;
+        if (buf->off < buf->len) {
+            return 0;
+        }
+        conn->head = buf->next;
+        if (conn->head == NULL) {
+            conn->tail = NULL;
+        }
+        frame_unref(buf->frame);
+        free(buf);
+    }
+    return 0;
+}
+
+static void epoll_drop(int fd) {
+    pthread_mutex_lock(&epoll_tx_mutex);
+    epoll_conn_t *conn = epoll_conn(fd);
+    while (conn != NULL && conn->head != NULL) {
+        tx_buf_t *buf = conn->head;
+        conn->head = buf->next;
+        frame_unref(buf->frame);
+        free(buf);
+    }
+    if (conn != NULL) {
+        conn->tail = NULL;
+        conn->paused = 0;
+    }
+    pthread_mutex_unlock(&epoll_tx_mutex);
+}
+
+static void epoll_close(int fd) {
+    io_callbacks->on_close(fd);
+    io_detach_link(fd);
+    io_forget_pause(fd);
+    epoll_drop(fd);
+    io_count_syscall();
+    close(fd);  // Also removes the fd from the epoll set
+}
+
+static void epoll_accept(int listener) {
+    while (1) {
+        io_count_syscall();
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept failed");
+            }
+            return;
+        }
+        if (io_callbacks->on_accept(listener, fd) < 0) {
+            io_count_syscall();
+            close(fd);
+            continue;
+        }
+        epoll_watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+    }
+}
+
+static void epoll_readable(int fd) {
+    char buf[RECV_CHUNK];
+    io_count_syscall();
+    ssize_t bytes_received = recv(fd, buf, sizeof(buf), 0);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytes_received <= 0) {
+        epoll_close(fd);
+        return;
+    }
+    io_count_bytes(bytes_received, 0);
+    io_callbacks->on_data(fd, buf, bytes_received);
+}
+
+static void epoll_writable(int fd) {
+    pthread_mutex_lock(&epoll_tx_mutex);
+    epoll_conn_t *conn = epoll_conn(fd);
+    if (conn != NULL && epoll_flush(fd, conn) == 0 && conn->head == NULL) {
+        epoll_watch(fd, epoll_events(conn), EPOLL_CTL_MOD);     // Nothing left to send
+    }
+    pthread_mutex_unlock(&epoll_tx_mutex);
+}
+
+static int epoll_run(void) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (!io_stopping) {
+        int timeout = io_resume_paused();
+        io_count_syscall();
+        io_wait_begin();
+        int n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+        io_wait_end();
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == io_wake_fd) {
+                uint64_t value;
+                io_count_syscall();
+                if (read(io_wake_fd, &value, sizeof(value)) < 0) {
+                    // Spurious wakeup
+                }
+                io_poll_links();    // Linked restaurants signal the same eventfd
+            } else if (epoll_is_listener(fd)) {
+                epoll_accept(fd);
+            } else {
+                if (events[i].events & EPOLLOUT) {
+                    epoll_writable(fd);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    epoll_readable(fd);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Send what the socket takes right away and queue the rest, a frame is queued by reference instead of copied
+static int epoll_queue(int fd, const void *data, size_t len, frame_t *frame) {
+    int ret = 0;
+    pthread_mutex_lock(&epoll_tx_mutex);
+    epoll_conn_t *conn = epoll_conn(fd);
+    if (conn == NULL) {
+        pthread_mutex_unlock(&epoll_tx_mutex);
+        return -1;
+    }
+
+    size_t off = 0;
+    if (conn->head == NULL) {   // Nothing queued, try to send right away
+        io_count_syscall();
+        ssize_t bytes_sent = send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            pthread_mutex_unlock(&epoll_tx_mutex);
+            return -1;
+        }
+        if (bytes_sent > 0) {
+            io_count_bytes(0, bytes_sent);
+            off = bytes_sent;
+        }
+    }
+
+    if (off < len) {    // Queue the rest and wait for EPOLLOUT
+        tx_buf_t *buf = malloc(sizeof(tx_buf_t) + (frame != NULL ? 0 : len - off));
+        if (buf == NULL) {
+            ret = -1;
+        } else {
+            buf->next = NULL;
+            buf->len = len - off;
+            buf->off = 0;
+            if (frame != NULL) {
+                buf->frame = frame_ref(frame);
+                buf->bytes = (const char *)data + off;
+                io_count_copy(1, 0);
+            } else {
+                buf->frame = NULL;
+                buf->bytes = buf->data;
+                memcpy(buf->data, (const char *)data + off, len - off);
+                io_count_copy(1, len - off);
+            }
+            if (conn->tail != NULL) {
+                conn->tail->next = buf;
+            } else {
+                conn->head = buf;
+                epoll_watch(fd, epoll_events(conn), EPOLL_CTL_MOD);
+            }
+            conn->tail = buf;
+        }
+    }
+    pthread_mutex_unlock(&epoll_tx_mutex);
+    return ret;
+}
+
+static int epoll_send(int fd, const void *data, size_t len) {
+    return epoll_queue(fd, data, len, NULL);
+}
+
+static int epoll_send_frame(int fd, frame_t *frame) {
+    return epoll_queue(fd, &frame->msg, sizeof(message_t), frame);
+}
+
+// The loop has stopped reading, so input already waits in the kernel for whoever reads next
+static void epoll_quiesce(void) {
+    for (int i = 0; i < epoll_listener_count; i++) {
+        epoll_watch(epoll_listeners[i], 0, EPOLL_CTL_DEL);
+    }
+    epoll_watch(io_wake_fd, 0, EPOLL_CTL_DEL);     // Wakeups from links are left for the next reader too
+}
+
+static int epoll_sending(void) {
+    int sending = 0;
+    pthread_mutex_lock(&epoll_tx_mutex);
+    for (int fd = 0; fd < epoll_conn_cap && !sending; fd++) {
+        sending = epoll_conns[fd].head != NULL;
+    }
+    pthread_mutex_unlock(&epoll_tx_mutex);
+    return sending;
+}
+
+// Function to write out queued output, watching each connection only while it has some
+static void epoll_drain(void) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    uint64_t deadline = io_monotonic_ns() + IO_DRAIN_TIMEOUT_MS * 1000000ULL;
+
+    while (epoll_sending()) {
+        uint64_t now = io_monotonic_ns();
+        if (now >= deadline) {  // Peers that stopped reading are dropped as a restart would, their output with them
+            for (int fd = 0; fd < epoll_conn_cap; fd++) {
+                if (epoll_conns[fd].head != NULL) {
+                    epoll_drop(fd);
+                    io_shutdown(fd);
+                }
+            }
+            break;
+        }
+        io_count_syscall();
+        int n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, (int)((deadline - now) / 1000000) + 1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            pthread_mutex_lock(&epoll_tx_mutex);
+            epoll_conn_t *conn = epoll_conn(fd);
+            if (conn != NULL && (events[i].events & EPOLLOUT) && epoll_flush(fd, conn) < 0) {
+                conn = NULL;    // Peer is gone, its output with it
+            }
+            if (conn != NULL && conn->head != NULL) {
+                epoll_watch(fd, EPOLLOUT, EPOLL_CTL_MOD);   // Readable sockets would wake the wait for nothing
+            } else {
+                epoll_watch(fd, 0, EPOLL_CTL_DEL);
+            }
+            pthread_mutex_unlock(&epoll_tx_mutex);
+            if (conn == NULL) {
+                epoll_drop(fd);
+            }
+        }
+    }
+}
+
+// Listeners and wakeups come back, connections come back with io_adopt()
+static void epoll_resume(void) {
+    for (int i = 0; i < epoll_listener_count; i++) {
+        epoll_rewatch(epoll_listeners[i], EPOLLIN);
+    }
+    epoll_rewatch(io_wake_fd, EPOLLIN);
+}
+
+static int epoll_adopt(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);  // The earlier server may have used blocking sockets
+    pthread_mutex_lock(&epoll_tx_mutex);
+    epoll_conn_t *conn = epoll_conn(fd);
+    uint32_t events = conn != NULL ? epoll_events(conn) : 0;
+    pthread_mutex_unlock(&epoll_tx_mutex);
+    if (conn == NULL) {
+        return -1;
+    }
+    epoll_rewatch(fd, events);     // Drained connections left the set, the others are still in it
+    return 0;
+}
+
+static void epoll_pause(int fd, int paused) {
+    pthread_mutex_lock(&epoll_tx_mutex);
+    epoll_conn_t *conn = epoll_conn(fd);
+    if (conn != NULL) {
+        conn->paused = paused;
+        epoll_watch(fd, epoll_events(conn), EPOLL_CTL_MOD);   // A peer that hangs up is still seen
+    }
+    pthread_mutex_unlock(&epoll_tx_mutex);
+}
+
+const io_ops_t io_epoll_ops = {
+    .init = epoll_init,
+    .run = epoll_run,
+    .send = epoll_send,
+    .send_frame = epoll_send_frame,
+    .quiesce = epoll_quiesce,
+    .drain = epoll_drain,
+    .resume = epoll_resume,
+    .pause = epoll_pause,
+    .adopt = epoll_adopt,
+};
@@ -0,0 +1,94 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "shm_ring.h"
+
+// Event-loop I/O layer used by the server for its client and restaurant sockets.
+// The epoll backend is the default and the fallback; the io_uring backend uses
+// multishot accept, a provided buffer ring for receives and linked sends.
+// A connection from a process on the same host can be moved onto a
+// shared-memory link; its frames then skip the socket, which only tells
+// when the peer goes away.
+//
+// For a live upgrade the loop can be quiesced: it stops accepting and reading,
+// handles the input it had already taken from the kernel, and then drains its
+// output, so the sockets can move to another process with nothing in flight.
+// If the other process never gets them, io_resume() and io_adopt() on each
+// connection still open put the loop back as it was.
+
+typedef enum {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING
+} io_backend_t;
+
+typedef struct {
+    int (*on_accept)(int listener, int fd);                 // New connection on a listener, return -1 to reject it
+    void (*on_data)(int fd, const char *data, size_t len);  // Bytes received on a connection
+    void (*on_close)(int fd);                               // Connection is gone, the backend closes the fd afterwards
+} io_callbacks_t;
+
+typedef struct {
+    uint64_t syscalls;      // Syscalls issued by the I/O layer
+    uint64_t bytes_in;      // Bytes received from connections
+    uint64_t bytes_out;     // Bytes sent to connections
+    uint64_t allocs;        // Heap allocations for outgoing data
+    uint64_t copied;        // Bytes copied into send buffers
+} io_stats_t;
+
+int io_listen(int port, int backlog);   // Create a listening TCP socket on the given port
+int io_listen_unix(const char *path, int backlog);  // Create a listening Unix domain socket, replacing a stale one
+io_backend_t io_init(io_backend_t requested, const int *listeners, int count, const io_callbacks_t *callbacks);
+int io_run(void);                       // Run the event loop until io_stop() is called
+void io_stop(void);                     // Async-signal-safe request to leave io_run()
+int io_send(int fd, const void *buf, size_t len);   // Queue bytes to a connection, safe from any thread
+int io_send_frame(int fd, frame_t *frame);          // Queue a frame without copying it, the send holds its own reference
+void io_shutdown(int fd);               // Shut a connection down, on_close follows on the loop thread
+void io_pause(int fd, uint32_t ms);     // Leave a connection's input in the kernel for ms milliseconds, loop thread only
+int io_attach_link(int fd, shm_link_t *link);       // Carry the frames of a connection over a link it owns, loop thread only
+shm_link_t *io_link(int fd);            // Link of a connection, NULL when it has none
+void io_quiesce(void);                  // Stop accepting and reading, handle what was already received; after io_run() returned
+void io_drain(void);                    // Write out queued output; connections that take none for IO_DRAIN_TIMEOUT_MS are shut down
+void io_resume(void);                   // Accept again after io_quiesce() and io_drain(), then io_adopt() the connections
+int io_adopt(int fd);                   // Watch a connection inherited from an earlier server, or again after io_resume()
+void io_get_stats(io_stats_t *stats);
+uint64_t io_loop_delay(void);           // Microseconds the events being handled may have waited for the loop, loop thread only
+const char *io_backend_name(io_backend_t backend);
+
+// Shared between the backend implementations
+#define IO_DRAIN_TIMEOUT_MS 2000    // How long io_drain() waits for a peer to take its output
+
+typedef struct {
+    int (*init)(const int *listeners, int count);
+    int (*run)(void);
+    int (*send)(int fd, const void *buf, size_t len);
+    int (*send_frame)(int fd, frame_t *frame);
+    void (*quiesce)(void);
+    void (*drain)(void);
+    void (*resume)(void);
+    void (*pause)(int fd, int paused);  // Stop or start reading a connection
+    int (*adopt)(int fd);
+} io_ops_t;
+
+extern const io_ops_t io_epoll_ops;
+extern const io_ops_t io_uring_ops;
+extern const io_callbacks_t *io_callbacks;
+extern volatile int io_stopping;
+extern int io_wake_fd;          // eventfd used to wake the loop from other threads and signal handlers, set before io_init() to inherit one
+
+void io_count_syscall(void);
+void io_count_bytes(uint64_t in, uint64_t out);
+void io_count_copy(uint64_t allocs, uint64_t bytes);
+int io_on_loop_thread(void);
+void io_poll_links(void);       // Hand the frames waiting on links to on_data, on every wakeup of the loop
+void io_detach_link(int fd);    // Before a linked connection is closed
+int io_resume_paused(void);     // Read paused connections again once due, returns milliseconds until the next or -1
+void io_forget_pause(int fd);   // Before a connection is closed
+void io_wait_begin(void);       // Around the blocking wait of the loop, to tell a busy loop from an idle one
+void io_wait_end(void);
+uint64_t io_monotonic_ns(void);
+
+#endif
@@ -0,0 +1,843 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io_backend.h"
+
+// io_uring backend, talking to the kernel directly (no liburing).
+// Needs Linux 6.0+ for multishot recv on a provided buffer ring.
+
+#define URING_ENTRIES 256       // Submission queue size
+#define URING_BUF_GROUP 1       // Provided buffer group id
+#define URING_BUF_COUNT 256     // Buffers in the ring, power of two
+#define URING_BUF_SIZE 4096     // Bytes per receive buffer
+#define URING_MAX_CHAIN 16      // Longest linked send chain per connection
+
+#define OP_ACCEPT 1ULL
+#define OP_RECV 2ULL
+#define OP_WAKE 3ULL
+#define OP_CANCEL 4ULL
+#define OP_TIMER 5ULL
+#define OP_HANGUP 6ULL
+#define UD(op, fd) (((op) << 48) | (uint32_t)(fd))  // Sends use the request pointer as user_data instead
+#define UD_RECV(fd, gen) (UD(OP_RECV, fd) | ((uint64_t)((gen) & 0xffff) << 32))  // Tagged, the fd may be reused
+#define UD_HANGUP(fd, gen) (UD(OP_HANGUP, fd) | ((uint64_t)((gen) & 0xffff) << 32))
+#define UD_OP(ud) ((ud) >> 48)
+#define UD_GEN(ud) ((unsigned)((ud) >> 32) & 0xffff)
+#define UD_FD(ud) ((int)((ud) & 0xffffffffULL))
+
+typedef struct send_req {
+    struct send_req *next;
+    int fd;
+    unsigned gen;               // Generation of the connection it was submitted for
+    int res;                    // Result of the submitted send
+    frame_t *frame;             // Frame being sent, NULL when the bytes were copied into data
+    const char *bytes;          // Bytes to send, in the frame or in data
+    size_t len;
+    char data[];
+} send_req_t;
+
+typedef struct {
+    send_req_t *head;           // Sends waiting for the in-flight chain to finish
+    send_req_t *tail;
+    send_req_t *chain_head;     // Sends submitted in the in-flight chain, in order
+    send_req_t *chain_tail;
+    unsigned inflight;          // Sends submitted and not yet completed
+    unsigned gen;               // Bumped on close, completions for an earlier connection on the fd are stale
+    int dirty;                  // Queued on the dirty list
+    int next_dirty;             // Next fd on the dirty list
+    int receiving;              // A multishot receive is armed
+    int paused;                 // No receive is armed until it is read again
+    int cancelled;              // The armed receive was cancelled for a pause
+    int watching;               // A poll for the peer going away is armed while paused
+} uring_conn_t;
+
+static struct {
+    int fd;
+    char *sq_ptr, *cq_ptr;      // Mapped rings, NULL until mapped
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // Local tail, published on submit
+    unsigned sqe_submitted;     // Tail already handed to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring;
+
+static struct io_uring_buf_ring *buf_ring = MAP_FAILED;  // Provided buffer ring for receives
+static char *buf_base;                      // Backing memory for the buffers
+static unsigned short buf_tail;
+
+static uring_conn_t *uring_conns = NULL;    // Indexed by fd, loop thread only
+static int uring_conn_cap = 0;
+static int dirty_head = -1;                 // Connections with queued sends
+
+static send_req_t *pending_head = NULL;     // Sends handed over by io_send, any thread
+static send_req_t *pending_tail = NULL;
+static send_req_t *req_pool = NULL;         // Finished frame sends, reused by io_send_frame
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the pending sends and req_pool
+static send_req_t *done_reqs = NULL;        // Finished frame sends not yet back in the pool, loop thread only
+static send_req_t *done_tail = NULL;
+
+static uint64_t wake_value;
+static const int *uring_listeners;
+static int uring_listener_count;
+static int armed = 0;                       // Accepts, receives and wakeup reads that may still complete, loop thread only
+static int quiescing = 0;                   // Nothing is rearmed once set
+static int listening = 0;                   // Accepts and the wakeup read are armed, loop thread only
+static struct __kernel_timespec timer_ts;   // Wakes the loop for paused connections
+static uint64_t timer_until = 0;            // When the last armed timer fires, 0 once it has
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    io_count_syscall();
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static struct io_uring_sqe *uring_get_sqe(void) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sqe_tail - head >= ring.sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sqe_tail & *ring.sq_mask];
+    ring.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static unsigned uring_sq_space(void) {
+    return ring.sq_entries - (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Publish new SQEs and optionally wait for completions
+static int uring_submit(unsigned wait) {
+    unsigned to_submit = ring.sqe_tail - ring.sqe_submitted;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    ring.sqe_submitted = ring.sqe_tail;
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+    int ret = uring_enter(to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    return 0;
+}
+
+// Get an SQE, flushing the queue to the kernel if it is full
+static struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    while (sqe == NULL) {
+        uring_submit(0);
+        sqe = uring_get_sqe();
+    }
+    return sqe;
+}
+
+static uring_conn_t *uring_conn(int fd) {
+    if (fd >= uring_conn_cap) {
+        int cap = uring_conn_cap ? uring_conn_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        uring_conn_t *conns = realloc(uring_conns, cap * sizeof(uring_conn_t));
+        if (conns == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(conns + uring_conn_cap, 0, (cap - uring_conn_cap) * sizeof(uring_conn_t));
+        uring_conns = conns;
+        uring_conn_cap = cap;
+    }
+    return &uring_conns[fd];
+}
+
+static void buf_ring_add(unsigned short bid) {
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(int listener) {
+    armed++;
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD(OP_ACCEPT, listener);
+}
+
+static void arm_recv(int fd) {
+    uring_conn_t *conn = uring_conn(fd);
+    if (quiescing || conn->paused) {
+        return;     // Left for the server that takes the connection over, or until it is read again
+    }
+    conn->receiving = 1;
+    armed++;
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = UD_RECV(fd, conn->gen);
+}
+
+// Function to notice a paused peer going away, as the receive would have
+static void arm_hangup(int fd) {
+    if (quiescing) {
+        return;
+    }
+    uring_conn_t *conn = uring_conn(fd);
+    conn->watching = 1;
+    armed++;
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLRDHUP;     // Errors and hangups are reported without asking
+    sqe->user_data = UD_HANGUP(fd, conn->gen);
+}
+
+static void arm_timer(int ms) {
+    timer_ts.tv_sec = ms / 1000;
+    timer_ts.tv_nsec = (long long)(ms % 1000) * 1000000;
+    timer_until = io_monotonic_ns() + ms * 1000000ULL;
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&timer_ts;     // Copied when the request is submitted
+    sqe->len = 1;
+    sqe->user_data = UD(OP_TIMER, 0);
+}
+
+static void arm_wake(void) {
+    armed++;
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = io_wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&wake_value;
+    sqe->len = sizeof(wake_value);
+    sqe->user_data = UD(OP_WAKE, io_wake_fd);
+}
+
+static void uring_cancel(uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = UD(OP_CANCEL, 0);
+}
+
+// Function to undo a uring_init() that failed part of the way
+static void uring_free(void) {
+    if (buf_ring != MAP_FAILED) {
+        munmap(buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        buf_ring = MAP_FAILED;
+    }
+    free(buf_base);
+    buf_base = NULL;
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if (ring.sq_ptr != NULL) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+static int uring_init(const int *listeners, int count) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    ring.sq_entries = params.sq_entries;
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap sq ring");
+        uring_free();
+        return -1;
+    }
+    ring.sq_ptr = sq_ptr;
+    ring.sq_size = sq_size;
+    char *cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap cq ring");
+            uring_free();
+            return -1;
+        }
+    }
+    ring.cq_ptr = cq_ptr;
+    ring.cq_size = cq_size;
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        perror("mmap sqes");
+        uring_free();
+        return -1;
+    }
+    ring.sqes = sqes;
+
+    ring.sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    unsigned *sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;    // SQEs are used in ring order
+    }
+    ring.sqe_tail = ring.sqe_submitted = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    // Register the provided buffer ring for multishot receives
+    buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (buf_ring == MAP_FAILED || buf_base == NULL) {
+        perror("buffer ring allocation");
+        uring_free();
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    io_count_syscall();
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register buffer ring");
+        uring_free();
+        return -1;
+    }
+    buf_tail = 0;
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+        buf_ring_add(bid);
+    }
+
+    for (int i = 0; i < count; i++) {   // Listeners inherited from an epoll server are non-blocking
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) & ~O_NONBLOCK);
+    }
+    uring_listeners = listeners;
+    uring_listener_count = count;
+    return 0;
+}
+
+static void mark_dirty(int fd, uring_conn_t *conn) {
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = dirty_head;
+        dirty_head = fd;
+    }
+}
+
+// Submit the queued sends of a connection as one linked chain so they stay in order
+static void start_chain(int fd, uring_conn_t *conn) {
+    unsigned count = 0;
+    for (send_req_t *req = conn->head; req != NULL && count < URING_MAX_CHAIN; req = req->next) {
+        count++;
+    }
+    if (uring_sq_space() < count) {
+        uring_submit(0);    // Never split a chain across two submissions
+        if (uring_sq_space() < count) {
+            count = uring_sq_space();
+        }
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        send_req_t *req = conn->head;
+        conn->head = req->next;
+        req->next = NULL;
+        req->gen = conn->gen;
+        if (conn->chain_tail != NULL) {
+            conn->chain_tail->next = req;
+        } else {
+            conn->chain_head = req;
+        }
+        conn->chain_tail = req;
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)req->bytes;
+        sqe->len = req->len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        if (i + 1 < count) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        conn->inflight++;
+    }
+    if (conn->head == NULL) {
+        conn->tail = NULL;
+    }
+}
+
+// Function to finish with a send request, frame requests are kept for reuse
+static void release_req(send_req_t *req) {
+    if (req->frame == NULL) {
+        free(req);
+        return;
+    }
+    frame_unref(req->frame);
+    req->frame = NULL;
+    req->next = NULL;
+    if (done_tail != NULL) {
+        done_tail->next = req;
+    } else {
+        done_reqs = req;
+    }
+    done_tail = req;
+}
+
+// Function to settle a chain once every send in it has completed. A short send is
+// resubmitted from where it stopped, with the sends the kernel cancelled behind it;
+// a failed one shuts the connection down and drops what it had queued.
+static void finish_chain(int fd, uring_conn_t *conn) {
+    send_req_t *req = conn->chain_head;
+    send_req_t *retry_head = NULL, *retry_tail = NULL;
+    int failed = 0;
+    conn->chain_head = conn->chain_tail = NULL;
+    while (req != NULL) {
+        send_req_t *next = req->next;
+        if (!failed && req->res > 0 && (size_t)req->res < req->len) {
+            req->bytes += req->res;
+            req->len -= req->res;
+            req->res = -ECANCELED;
+        }
+        if (failed || req->res == (int)req->len) {
+            release_req(req);
+        } else if (req->res == -ECANCELED) {    // Sent again, in order, ahead of the queued sends
+            req->next = NULL;
+            if (retry_tail != NULL) {
+                retry_tail->next = req;
+            } else {
+                retry_head = req;
+            }
+            retry_tail = req;
+        } else {
+            failed = 1;
+            release_req(req);
+        }
+        req = next;
+    }
+    if (failed) {
+        while (retry_head != NULL) {
+            send_req_t *next = retry_head->next;
+            release_req(retry_head);
+            retry_head = next;
+        }
+        while (conn->head != NULL) {
+            send_req_t *next = conn->head->next;
+            release_req(conn->head);
+            conn->head = next;
+        }
+        conn->tail = NULL;
+        io_shutdown(fd);    // The receive sees the end and closes it
+        return;
+    }
+    if (retry_head != NULL) {
+        retry_tail->next = conn->head;
+        if (conn->head == NULL) {
+            conn->tail = retry_tail;
+        }
+        conn->head = retry_head;
+    }
+    if (conn->head != NULL) {
+        mark_dirty(fd, conn);
+    }
+}
+
+// Move sends handed over by io_send into per-connection queues and start chains
+static void flush_sends(void) {
+    pthread_mutex_lock(&pending_mutex);
+    send_req_t *req = pending_head;
+    pending_head = pending_tail = NULL;
+    if (done_tail != NULL) {    // Hand finished requests back while holding the lock anyway
+        done_tail->next = req_pool;
+        req_pool = done_reqs;
+        done_reqs = done_tail = NULL;
+    }
+    pthread_mutex_unlock(&pending_mutex);
+
+    while (req != NULL) {
+        send_req_t *next = req->next;
+        uring_conn_t *conn = uring_conn(req->fd);
+        req->next = NULL;
+        if (conn->tail != NULL) {
+            conn->tail->next = req;
+        } else {
+            conn->head = req;
+        }
+        conn->tail = req;
+        mark_dirty(req->fd, conn);
+        req = next;
+    }
+
+    while (dirty_head >= 0) {
+        int fd = dirty_head;
+        uring_conn_t *conn = &uring_conns[fd];
+        dirty_head = conn->next_dirty;
+        conn->dirty = 0;
+        if (conn->inflight == 0 && conn->head != NULL) {
+            start_chain(fd, conn);
+        }
+    }
+}
+
+static void uring_close(int fd) {
+    uring_conn_t *conn = uring_conn(fd);
+    while (conn->head != NULL) {
+        send_req_t *req = conn->head;
+        conn->head = req->next;
+        release_req(req);
+    }
+    conn->tail = NULL;
+    if (conn->receiving) {
+        uring_cancel(UD_RECV(fd, conn->gen));
+        conn->receiving = 0;
+    }
+    if (conn->watching) {
+        uring_cancel(UD_HANGUP(fd, conn->gen));
+        conn->watching = 0;
+    }
+    conn->chain_head = conn->chain_tail = NULL;     // Sends still in flight are released as they complete
+    conn->inflight = 0;
+    conn->paused = 0;
+    conn->cancelled = 0;
+    conn->gen++;
+    io_callbacks->on_close(fd);
+    io_detach_link(fd);
+    io_forget_pause(fd);
+    io_count_syscall();
+    close(fd);
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+    uint64_t ud = cqe->user_data;
+
+    if (UD_OP(ud) == 0) {   // Send completion
+        send_req_t *req = (send_req_t *)(uintptr_t)ud;
+        uring_conn_t *conn = uring_conn(req->fd);
+        if (cqe->res > 0) {
+            io_count_bytes(0, cqe->res);
+        }
+        if (req->gen != conn->gen) {
+            release_req(req);   // The connection was closed while it was in flight
+            return;
+        }
+        req->res = cqe->res;
+        if (--conn->inflight == 0) {
+            finish_chain(req->fd, conn);
+        }
+        return;
+    }
+
+    int fd = UD_FD(ud);
+    if ((UD_OP(ud) == OP_RECV || UD_OP(ud) == OP_HANGUP) && UD_GEN(ud) != (uring_conn(fd)->gen & 0xffff)) {  // For a connection closed since
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            buf_ring_add(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            armed--;
+        }
+        return;
+    }
+    switch (UD_OP(ud)) {
+        case OP_CANCEL:
+            break;      // The cancelled request completes on its own
+        case OP_TIMER:
+            timer_until = 0;
+            break;
+        case OP_HANGUP:
+            armed--;
+            uring_conn(fd)->watching = 0;
+            if (cqe->res > 0) {
+                uring_conn(fd)->paused = 0;     // Read what is left up to the EOF or reset
+                arm_recv(fd);
+            } else if (uring_conn(fd)->paused) {
+                arm_hangup(fd);     // Paused again before the cancel went through
+            }
+            break;
+        case OP_ACCEPT:
+            if (cqe->res >= 0) {
+                uring_conn(cqe->res);   // Make room for the new fd
+                if (io_callbacks->on_accept(fd, cqe->res) < 0) {
+                    io_count_syscall();
+                    close(cqe->res);
+                } else {
+                    arm_recv(cqe->res);
+                }
+            } else if (cqe->res != -ECANCELED) {
+                fprintf(stderr, "accept failed: %s\n", strerror(-cqe->res));
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                armed--;
+                if (!quiescing) {
+                    arm_accept(fd);     // Multishot accept ended, rearm it
+                }
+            }
+            break;
+        case OP_RECV: {
+            int cancelled = 0;
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                cancelled = uring_conn(fd)->cancelled;
+                uring_conn(fd)->receiving = 0;
+                uring_conn(fd)->cancelled = 0;
+                armed--;
+            }
+            if (cqe->res > 0) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                io_count_bytes(cqe->res, 0);
+                io_callbacks->on_data(fd, buf_base + (size_t)bid * URING_BUF_SIZE, cqe->res);
+                buf_ring_add(bid);
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    arm_recv(fd);
+                }
+            } else if (cqe->res == -ENOBUFS) {
+                arm_recv(fd);       // Buffers are back in the ring by now
+            } else if (cqe->res == -ECANCELED && (quiescing || cancelled)) {
+                arm_recv(fd);       // Unread input stays in the socket, unless the pause is already over
+            } else {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    buf_ring_add(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                uring_close(fd);    // EOF or error
+            }
+            break;
+        }
+        case OP_WAKE:
+            armed--;
+            if (!quiescing) {
+                arm_wake();
+                io_poll_links();    // Linked restaurants signal the same eventfd
+            }
+            break;
+    }
+}
+
+// Function to handle every completion the kernel has posted
+static void uring_reap(void) {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        handle_cqe(&ring.cqes[head & *ring.cq_mask]);
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static int uring_run(void) {
+    if (!listening) {   // First run, or the first after a quiesce
+        for (int i = 0; i < uring_listener_count; i++) {
+            arm_accept(uring_listeners[i]);
+        }
+        arm_wake();
+        listening = 1;
+    }
+
+    while (!io_stopping) {
+        flush_sends();
+        int wait_ms = io_resume_paused();
+        if (wait_ms >= 0 && (timer_until == 0 || io_monotonic_ns() + wait_ms * 1000000ULL < timer_until)) {
+            arm_timer(wait_ms);
+        }
+        io_wait_begin();
+        if (uring_submit(1) < 0) {
+            return -1;
+        }
+        io_wait_end();
+        uring_reap();
+    }
+    return 0;
+}
+
+// Cancel the multishot requests and handle the input they had already taken from the sockets
+static void uring_quiesce(void) {
+    quiescing = 1;
+    listening = 0;
+    for (int i = 0; i < uring_listener_count; i++) {
+        uring_cancel(UD(OP_ACCEPT, uring_listeners[i]));
+    }
+    uring_cancel(UD(OP_WAKE, io_wake_fd));      // Or it takes a wakeup meant for the next server
+    for (int fd = 0; fd < uring_conn_cap; fd++) {
+        if (uring_conns[fd].receiving) {
+            uring_cancel(UD_RECV(fd, uring_conns[fd].gen));
+        }
+        if (uring_conns[fd].watching) {
+            uring_cancel(UD_HANGUP(fd, uring_conns[fd].gen));
+        }
+    }
+    while (armed > 0) {
+        flush_sends();
+        if (uring_submit(1) < 0) {
+            return;
+        }
+        uring_reap();
+    }
+}
+
+static int uring_sending(void) {
+    pthread_mutex_lock(&pending_mutex);
+    int sending = pending_head != NULL;
+    pthread_mutex_unlock(&pending_mutex);
+    for (int fd = 0; fd < uring_conn_cap && !sending; fd++) {
+        sending = uring_conns[fd].inflight > 0 || uring_conns[fd].head != NULL;
+    }
+    return sending;
+}
+
+// Function to wait until every queued send has completed
+static void uring_drain(void) {
+    uint64_t deadline = io_monotonic_ns() + IO_DRAIN_TIMEOUT_MS * 1000000ULL;
+    int stalled = 0;
+    flush_sends();
+    while (uring_sending()) {
+        if (!stalled && io_monotonic_ns() >= deadline) {
+            for (int fd = 0; fd < uring_conn_cap; fd++) {   // Peers that stopped reading are dropped as a restart would
+                if (uring_conns[fd].inflight > 0 || uring_conns[fd].head != NULL) {
+                    io_shutdown(fd);    // Their sends fail and complete
+                }
+            }
+            stalled = 1;
+        }
+        uring_submit(0);
+        struct pollfd pfd = {ring.fd, POLLIN, 0};   // The ring is readable while completions wait
+        io_count_syscall();
+        poll(&pfd, 1, 100);
+        uring_reap();
+        flush_sends();
+    }
+}
+
+// Receives may be armed again, uring_run() arms the accepts and the wakeup read
+static void uring_resume(void) {
+    quiescing = 0;
+}
+
+static void uring_pause(int fd, int paused) {
+    uring_conn_t *conn = uring_conn(fd);
+    conn->paused = paused;
+    if (paused && conn->receiving && !conn->cancelled) {
+        conn->cancelled = 1;
+        uring_cancel(UD_RECV(fd, conn->gen));   // What it already took from the socket is still handled
+    } else if (!paused && !conn->receiving) {
+        arm_recv(fd);
+    }
+    if (paused && !conn->watching) {
+        arm_hangup(fd);
+    } else if (!paused && conn->watching) {
+        uring_cancel(UD_HANGUP(fd, conn->gen));
+    }
+}
+
+static int uring_adopt(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);  // Receives wait in the kernel, not in EAGAIN
+    if (!uring_conn(fd)->receiving) {
+        arm_recv(fd);
+    }
+    if (uring_conn(fd)->paused && !uring_conn(fd)->watching) {
+        arm_hangup(fd);
+    }
+    return 0;
+}
+
+// Function to hand a send over to the loop thread
+static int queue_send(send_req_t *req) {
+    pthread_mutex_lock(&pending_mutex);
+    if (pending_tail != NULL) {
+        pending_tail->next = req;
+    } else {
+        pending_head = req;
+    }
+    pending_tail = req;
+    pthread_mutex_unlock(&pending_mutex);
+
+    if (!io_on_loop_thread()) {     // The loop picks up its own sends before it next enters the kernel
+        uint64_t one = 1;
+        io_count_syscall();
+        if (write(io_wake_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+        }
+    }
+    return 0;
+}
+
+static int uring_send(int fd, const void *data, size_t len) {
+    send_req_t *req = malloc(sizeof(send_req_t) + len);
+    if (req == NULL) {
+        return -1;
+    }
+    req->next = NULL;
+    req->fd = fd;
+    req->frame = NULL;
+    req->bytes = req->data;
+    req->len = len;
+    memcpy(req->data, data, len);
+    io_count_copy(1, len);
+    return queue_send(req);
+}
+
+static int uring_send_frame(int fd, frame_t *frame) {
+    pthread_mutex_lock(&pending_mutex);
+    send_req_t *req = req_pool;
+    if (req != NULL) {
+        req_pool = req->next;
+    }
+    pthread_mutex_unlock(&pending_mutex);
+    if (req == NULL) {
+        if ((req = malloc(sizeof(send_req_t))) == NULL) {
+            return -1;
+        }
+        io_count_copy(1, 0);
+    }
+    req->next = NULL;
+    req->fd = fd;
+    req->frame = frame_ref(frame);
+    req->bytes = (const char *)&frame->msg;
+    req->len = sizeof(message_t);
+    return queue_send(req);
+}
+
+const io_ops_t io_uring_ops = {
+    .init = uring_init,
+    .run = uring_run,
+    .send = uring_send,
+    .send_frame = uring_send_frame,
+    .quiesce = uring_quiesce,
+    .drain = uring_drain,
+    .resume = uring_resume,
+    .pause = uring_pause,
+    .adopt = uring_adopt,
+};
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC "ORDJRNL1"    // First bytes of a journal file
+
+typedef struct entry {
+    struct entry *next;
+    journal_header_t header;
+    int fd;                     // Connection to send frame to once durable, -1 for none
+    frame_t *frame;             // Referenced until it is sent
+    char data[];
+} entry_t;                      // Queued record
+
+static int journal_fd = -1;
+static off_t journal_end = 0;       // End of the last committed group, a failed group is cut back to it
+static int journal_broken = 0;      // Could not be cut back, nothing more is committed
+static uint32_t group_max = 1;
+static journal_send_fn send_frame = NULL;
+static entry_t *queue_head = NULL;  // Records waiting for the writer
+static entry_t *queue_tail = NULL;
+static uint32_t queue_count = 0;
+static uint64_t next_seq = 1;
+static uint64_t committed_seq = 0;  // Every record up to this one is durable
+static uint64_t record_count = 0;
+static uint64_t sync_count = 0;
+static int stopping = 0;
+static pthread_t writer_thread;
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;     // Signalled by appenders
+static pthread_cond_t committed_cond = PTHREAD_COND_INITIALIZER;  // Signalled after each group commit
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Function to compute the checksum of a record
+static uint32_t record_crc(const journal_header_t *header, const char *data) {
+    uint32_t crc = crc_update(0xffffffffu, (const uint8_t *)header + sizeof(header->crc), sizeof(journal_header_t) - sizeof(header->crc));
+    return ~crc_update(crc, data, header->len);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to read the journal back, keeping the orders that never got a DONE
+static entry_t *replay(FILE *file, uint64_t *last_seq) {
+    entry_t *pending = NULL;
+    entry_t **tail = &pending;  // Keep the orders in journal order
+    journal_header_t header;
+    char data[BUFFER_SIZE];
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.len > BUFFER_SIZE || fread(data, 1, header.len, file) != header.len ||
+            record_crc(&header, data) != header.crc) {
+            printf("Journal: ignoring torn record after seq %llu\n", (unsigned long long)*last_seq);
+            break;  // Crash in the middle of a group, nothing after it was acknowledged
+        }
+        *last_seq = header.seq;
+
+        if (header.type == JOURNAL_ORDER) {
+            entry_t *entry = malloc(sizeof(entry_t) + header.len);
+            if (entry == NULL) {
+                break;
+            }
+            entry->header = header;
+            memcpy(entry->data, data, header.len);
+            entry->next = NULL;
+            *tail = entry;
+            tail = &entry->next;
+        } else if (header.type == JOURNAL_DONE) {
+            for (entry_t **link = &pending; *link != NULL; link = &(*link)->next) {
+                // A cart has one order per restaurant under the same token
+                if (memcmp(&(*link)->header.token, &header.token, sizeof(session_token_t)) == 0 &&
+                    (header.restaurant == 0 || (*link)->header.restaurant == header.restaurant)) {
+                    entry_t *done = *link;
+                    *link = done->next;
+                    if (*link == NULL) {
+                        tail = link;
+                    }
+                    free(done);
+                    break;
+                }
+            }
+        }
+    }
+    return pending;
+}
+
+// Function to commit queued records in groups until the journal is closed
+static void *writer(void *arg) {
+    char *buf = NULL;
+    size_t buf_size = 0;
+
+    pthread_mutex_lock(&journal_mutex);
+    while (1) {
+        while (queue_count == 0 && !stopping) {
+            pthread_cond_wait(&queued_cond, &journal_mutex);
+        }
+        if (queue_count == 0) {
+            break;  // Stopping and drained
+        }
+
+        entry_t *group = queue_head;    // Records queued during the last fdatasync form this group, up to group_max
+        entry_t *last = group;
+        uint32_t count = 1;
+        while (count < group_max && last->next != NULL) {
+            last = last->next;
+            count++;
+        }
+        queue_head = last->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        last->next = NULL;
+        queue_count -= count;
+        uint64_t group_seq = last->header.seq;
+        pthread_mutex_unlock(&journal_mutex);
+
+        size_t len = 0;
+        for (entry_t *entry = group; entry != NULL; entry = entry->next) {
+            len += sizeof(journal_header_t) + entry->header.len;
+        }
+        if (len > buf_size) {
+            free(buf);
+            buf_size = len * 2;
+            buf = malloc(buf_size);
+        }
+        size_t off = 0;
+        for (entry_t *entry = group; entry != NULL && buf != NULL; entry = entry->next) {
+            memcpy(buf + off, &entry->header, sizeof(journal_header_t));
+            memcpy(buf + off + sizeof(journal_header_t), entry->data, entry->header.len);
+            off += sizeof(journal_header_t) + entry->header.len;
+        }
+        int durable = !journal_broken && buf != NULL && write_all(journal_fd, buf, len) == 0 && fdatasync(journal_fd) == 0;
+        if (durable) {
+            journal_end += len;
+        } else if (!journal_broken) {
+            perror("journal write");    // The group's orders do not go out, their clients are told
+            buf_size = 0;
+            if (ftruncate(journal_fd, journal_end) < 0) {   // Part of the group may be in the file
+                perror("journal truncate");
+                journal_broken = 1;     // Records after a torn one would not be replayed, nothing is committed from now on
+            }
+        }
+
+        for (entry_t *entry = group; entry != NULL; ) {
+            entry_t *next = entry->next;
+            if (entry->fd >= 0 && send_frame(&entry->header, entry->fd, entry->frame, durable) < 0) {
+                perror("send");
+            }
+            frame_unref(entry->frame);
+            free(entry);
+            entry = next;
+        }
+
+        pthread_mutex_lock(&journal_mutex);
+        committed_seq = group_seq;
+        if (durable) {
+            record_count += count;
+            sync_count++;
+        }
+        pthread_cond_broadcast(&committed_cond);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    free(buf);
+    return NULL;
+}
+
+// Function to give up on rewriting the journal, the old file stays as it was
+static void abandon_rewrite(int fd, const char *tmp_path, entry_t *orders) {
+    perror("journal");
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (tmp_path != NULL) {
+        unlink(tmp_path);
+    }
+    while (orders != NULL) {
+        entry_t *next = orders->next;
+        free(orders);
+        orders = next;
+    }
+}
+
+// Function to replay, compact and open the journal for appending
+int journal_open(const char *path, uint32_t batch, uint8_t key[JOURNAL_KEY_SIZE],
+                 journal_pending_fn pending, journal_send_fn send) {
+    char magic[sizeof(JOURNAL_MAGIC) - 1];
+    entry_t *orders = NULL;
+    uint64_t last_seq = 0;
+
+    crc_init();
+    FILE *file = fopen(path, "rb");
+    if (file != NULL) {
+        if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0 ||
+            fread(key, JOURNAL_KEY_SIZE, 1, file) != 1) {
+            fprintf(stderr, "%s is not an order journal\n", path);
+            fclose(file);
+            return -1;
+        }
+        orders = replay(file, &last_seq);
+        fclose(file);
+    }
+
+    // Rewrite the journal with only the pending orders so it does not grow across restarts
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);   // Holds the session key
+    if (fd < 0 || write_all(fd, JOURNAL_MAGIC, sizeof(magic)) < 0 || write_all(fd, key, JOURNAL_KEY_SIZE) < 0) {
+        abandon_rewrite(fd, tmp_path, orders);
+        return -1;
+    }
+    int recovered = 0;
+    for (entry_t *entry = orders; entry != NULL; entry = entry->next) {
+        if (write_all(fd, &entry->header, sizeof(journal_header_t)) < 0 || write_all(fd, entry->data, entry->header.len) < 0) {
+            abandon_rewrite(fd, tmp_path, orders);
+            return -1;
+        }
+        recovered++;
+    }
+    if (fsync(fd) < 0 || rename(tmp_path, path) < 0) {
+        abandon_rewrite(fd, tmp_path, orders);
+        return -1;
+    }
+    close(fd);
+
+    if ((journal_fd = open(path, O_WRONLY | O_APPEND)) < 0 || (journal_end = lseek(journal_fd, 0, SEEK_END)) < 0) {
+        if (journal_fd >= 0) {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+        abandon_rewrite(-1, NULL, orders);
+        return -1;
+    }
+    journal_broken = 0;
+
+    while (orders != NULL) {
+        entry_t *next = orders->next;
+        if (pending != NULL) {
+            pending(&orders->header, orders->data);
+        }
+        free(orders);
+        orders = next;
+    }
+    if (recovered > 0) {
+        printf("Journal: recovered %d pending orders from %s\n", recovered, path);
+    }
+
+    group_max = batch ? batch : 1;
+    send_frame = send;
+    next_seq = last_seq + 1;
+    committed_seq = last_seq;
+    stopping = 0;
+    if (pthread_create(&writer_thread, NULL, writer, NULL) != 0) {
+        perror("journal writer");
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to queue a record, the frame goes out to fd once the record is durable
+uint64_t journal_append(journal_type_t type, const session_token_t *token, uint8_t restaurant, uint8_t wait_minutes,
+                        const char *data, int fd, frame_t *frame) {
+    size_t len = data ? strnlen(data, BUFFER_SIZE) : 0;
+    entry_t *entry = malloc(sizeof(entry_t) + len);
+    if (entry == NULL) {
+        journal_header_t header;    // Never durable, handed back as failed
+        memset(&header, 0, sizeof(journal_header_t));
+        header.type = type;
+        header.restaurant = restaurant;
+        header.wait_minutes = wait_minutes;
+        header.time = (uint32_t)time(NULL);
+        header.token = *token;
+        if (fd >= 0 && send_frame(&header, fd, frame, 0) < 0) {
+            perror("send");
+        }
+        return 0;
+    }
+    memset(&entry->header, 0, sizeof(journal_header_t));
+    entry->header.type = type;
+    entry->header.restaurant = restaurant;
+    entry->header.wait_minutes = wait_minutes;
+    entry->header.time = (uint32_t)time(NULL);
+    entry->header.len = (uint32_t)len;
+    entry->header.token = *token;
+    if (len > 0) {
+        memcpy(entry->data, data, len);
+    }
+    entry->fd = fd;
+    entry->frame = fd >= 0 ? frame_ref(frame) : NULL;
+    entry->next = NULL;
+
+    pthread_mutex_lock(&journal_mutex);
+    uint64_t seq = next_seq++;
+    entry->header.seq = seq;
+    entry->header.crc = record_crc(&entry->header, entry->data);
+    if (queue_tail != NULL) {
+        queue_tail->next = entry;
+    } else {
+        queue_head = entry;
+    }
+    queue_tail = entry;
+    if (++queue_count == 1) {
+        pthread_cond_signal(&queued_cond);  // Writer may be idle
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    return seq;
+}
+
+void journal_wait(uint64_t seq) {
+    pthread_mutex_lock(&journal_mutex);
+    while (committed_seq < seq) {
+        pthread_cond_wait(&committed_cond, &journal_mutex);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_stats(uint64_t *records, uint64_t *syncs) {
+    pthread_mutex_lock(&journal_mutex);
+    *records = record_count;
+    *syncs = sync_count;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_close(void) {
+    if (journal_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&journal_mutex);
+    stopping = 1;
+    pthread_cond_signal(&queued_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(writer_thread, NULL);
+    close(journal_fd);
+    journal_fd = -1;
+}
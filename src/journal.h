@@ -0,0 +1,51 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "frame.h"
+
+// Append-only order journal. Every record carries a CRC32 so a torn tail is
+// detected on replay. Appends are queued and a writer thread makes them
+// durable in groups with one fdatasync per group; a frame handed to
+// journal_append() is sent only after its record is on disk. A group that
+// fails to commit is cut off the file again, so the records after it still
+// replay, and its frames are handed back as not durable.
+//
+// The file starts with a magic and the session MAC key, so tokens of orders
+// recovered after a restart still validate and their clients can resume.
+
+#define JOURNAL_KEY_SIZE 16
+
+typedef enum {
+    JOURNAL_ORDER = 1,          // Order forwarded to a restaurant
+    JOURNAL_DONE = 2            // Estimated time for the client's order arrived
+} journal_type_t;
+
+typedef struct {
+    uint32_t crc;               // CRC32 of the rest of the header and the data
+    uint16_t type;              // journal_type_t
+    uint8_t restaurant;         // Restaurant id of the order
+    uint8_t wait_minutes;       // Longest wait the client accepts for the order, 0 for no limit
+    uint64_t seq;               // Record sequence number
+    uint32_t time;              // Seconds since the epoch
+    uint32_t len;               // Bytes of order text following the header
+    session_token_t token;      // Client the record belongs to
+} journal_header_t;
+
+typedef void (*journal_pending_fn)(const journal_header_t *header, const char *data);  // Order replayed without a DONE
+typedef int (*journal_send_fn)(const journal_header_t *header, int fd, frame_t *frame, int durable);  // Sends frames once durable
+
+// Replays the journal (key is read from it, or written to a new one), compacts
+// it to the pending orders and starts the writer. batch is the largest group.
+int journal_open(const char *path, uint32_t batch, uint8_t key[JOURNAL_KEY_SIZE],
+                 journal_pending_fn pending, journal_send_fn send);
+uint64_t journal_append(journal_type_t type, const session_token_t *token, uint8_t restaurant, uint8_t wait_minutes,
+                        const char *data, int fd, frame_t *frame);     // Sequence number of the record, the journal references frame
+void journal_wait(uint64_t seq);        // Block until the record is durable, or its group failed
+void journal_stats(uint64_t *records, uint64_t *syncs);
+void journal_close(void);               // Flush what is queued and stop the writer
+
+#endif
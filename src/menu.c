@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "menu.h"
+
+#define NAME_BUCKETS 64         // Hash buckets for interned names
+#define MENU_BUCKETS 64         // Hash buckets for shared menus
+
+typedef struct name {
+    struct name *next;
+    char text[];
+} name_t;
+
+static name_t *names[NAME_BUCKETS];     // Interned names, never freed
+static menu_t *menus[MENU_BUCKETS];     // Live menus
+static uint32_t next_version = 1;
+static pthread_mutex_t menu_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards names and menus
+
+// FNV-1a hash
+static uint32_t hash_string(const char *text) {
+    uint32_t hash = 2166136261u;
+    while (*text) {
+        hash ^= (uint8_t)*text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to return the single shared copy of a name
+const char *intern_name(const char *text) {
+    uint32_t bucket = hash_string(text) % NAME_BUCKETS;
+
+    pthread_mutex_lock(&menu_mutex);
+    for (name_t *name = names[bucket]; name != NULL; name = name->next) {
+        if (strcmp(name->text, text) == 0) {
+            pthread_mutex_unlock(&menu_mutex);
+            return name->text;
+        }
+    }
+    size_t len = strlen(text);
+    name_t *name = malloc(sizeof(name_t) + len + 1);
+    if (name == NULL) {
+        pthread_mutex_unlock(&menu_mutex);
+        return NULL;
+    }
+    memcpy(name->text, text, len + 1);
+    name->next = names[bucket];
+    names[bucket] = name;
+    pthread_mutex_unlock(&menu_mutex);
+    return name->text;
+}
+
+// Function to find the "N." that starts a menu line, NULL when the line lists no item
+static const char *line_item(const char *line, const char *line_end, long *number) {
+    for (const char *p = line; p < line_end; p++) {
+        if (!isdigit((unsigned char)*p) || (p > line && !isspace((unsigned char)p[-1]))) {
+            continue;   // Item numbers start a line or follow the restaurant name
+        }
+        char *end;
+        *number = strtol(p, &end, 10);
+        if (end < line_end && *end == '.' && *number > 0) {
+            return p;
+        }
+        p = end - 1;
+    }
+    return NULL;
+}
+
+static int compare_number(const void *a, const void *b) {
+    const menu_item_t *x = a, *y = b;
+    return (x->number > y->number) - (x->number < y->number);
+}
+
+static int compare_name(const void *a, const void *b) {
+    const menu_item_t *x = *(menu_item_t *const *)a, *y = *(menu_item_t *const *)b;
+    return strcmp(x->folded, y->folded);
+}
+
+// Function to index a new menu's items by number and name and split them into pages
+static int index_menu(menu_t *menu) {
+    uint32_t lines = 1;
+    for (const char *p = menu->text; *p != '\0'; p++) {
+        lines += *p == '\n';
+    }
+    menu->items = malloc(lines * sizeof(menu_item_t));
+    menu->by_name = malloc(lines * sizeof(menu_item_t *));
+    menu->pages = malloc(lines * sizeof(uint32_t));
+    menu->folded = malloc(menu->len + 1);  // Names are shorter than the text they come from
+    if (menu->items == NULL || menu->by_name == NULL || menu->pages == NULL || menu->folded == NULL) {
+        return -1;
+    }
+
+    char *folded = menu->folded;
+    menu->item_count = 0;
+    for (const char *line = menu->text; *line != '\0';) {
+        const char *line_end = strchr(line, '\n');
+        if (line_end == NULL) {
+            line_end = menu->text + menu->len;
+        }
+        long number;
+        const char *start = line_item(line, line_end, &number);
+        if (start != NULL) {
+            menu_item_t *item = &menu->items[menu->item_count++];
+            const char *name = strchr(start, '.') + 1;
+            const char *name_end = line_end;
+            for (const char *p = name; p + 3 < line_end; p++) {
+                if (memcmp(p, " - $", 4) == 0) {
+                    name_end = p;   // Last one, names may contain dashes
+                }
+            }
+            while (name < name_end && isspace((unsigned char)*name)) {
+                name++;
+            }
+            unsigned int dollars = 0, cents = 0;
+            if (name_end < line_end) {
+                sscanf(name_end + 4, "%u.%2u", &dollars, &cents);
+            }
+            item->number = number;
+            item->price_cents = dollars * 100 + cents;
+            item->line = start;
+            item->line_len = line_end - start;
+            item->folded = folded;
+            while (name < name_end) {
+                *folded++ = tolower((unsigned char)*name++);
+            }
+            *folded++ = '\0';
+        }
+        line = *line_end == '\n' ? line_end + 1 : line_end;
+    }
+
+    qsort(menu->items, menu->item_count, sizeof(menu_item_t), compare_number);
+    menu->page_count = 0;
+    size_t page_bytes = MENU_PAGE_BYTES;    // Start a page at the first item
+    for (uint32_t i = 0; i < menu->item_count; i++) {
+        menu->by_name[i] = &menu->items[i];
+        if (page_bytes + menu->items[i].line_len + 1 > MENU_PAGE_BYTES) {
+            menu->pages[menu->page_count++] = i;
+            page_bytes = 0;
+        }
+        page_bytes += menu->items[i].line_len + 1;
+    }
+    qsort(menu->by_name, menu->item_count, sizeof(menu_item_t *), compare_name);
+    return 0;
+}
+
+// Function to free a menu and its index
+static void free_menu(menu_t *menu) {
+    free(menu->items);
+    free(menu->by_name);
+    free(menu->pages);
+    free(menu->folded);
+    free(menu);
+}
+
+// Function to get a shared menu for a menu text
+menu_t *menu_get(const char *text) {
+    uint32_t hash = hash_string(text);
+    uint32_t bucket = hash % MENU_BUCKETS;
+
+    pthread_mutex_lock(&menu_mutex);
+    for (menu_t *menu = menus[bucket]; menu != NULL; menu = menu->next) {
+        if (menu->hash == hash && strcmp(menu->text, text) == 0) {
+            menu->refcount++;
+            pthread_mutex_unlock(&menu_mutex);
+            return menu;
+        }
+    }
+    size_t len = strlen(text);
+    menu_t *menu = calloc(1, sizeof(menu_t) + len + 1);
+    if (menu == NULL) {
+        pthread_mutex_unlock(&menu_mutex);
+        return NULL;
+    }
+    memcpy(menu->text, text, len + 1);
+    menu->len = len;
+    if (index_menu(menu) < 0) {     // Once per menu version, every lookup after this uses it
+        perror("menu index");
+        free_menu(menu);
+        pthread_mutex_unlock(&menu_mutex);
+        return NULL;
+    }
+    menu->hash = hash;
+    menu->refcount = 1;
+    menu->version = next_version++;
+    menu->next = menus[bucket];
+    menus[bucket] = menu;
+    pthread_mutex_unlock(&menu_mutex);
+    return menu;
+}
+
+// Function to take over a menu from an earlier server, clients already hold its version
+menu_t *menu_adopt(const char *text, uint32_t version) {
+    menu_t *menu = menu_get(text);
+    if (menu != NULL) {
+        pthread_mutex_lock(&menu_mutex);
+        if (menu->refcount == 1) {  // Just created, nobody has seen the version it was given
+            menu->version = version;
+        }
+        if (next_version <= version) {
+            next_version = version + 1;
+        }
+        pthread_mutex_unlock(&menu_mutex);
+    }
+    return menu;
+}
+
+menu_t *menu_ref(menu_t *menu) {
+    if (menu != NULL) {
+        pthread_mutex_lock(&menu_mutex);
+        menu->refcount++;
+        pthread_mutex_unlock(&menu_mutex);
+    }
+    return menu;
+}
+
+void menu_put(menu_t *menu) {
+    if (menu == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&menu_mutex);
+    if (--menu->refcount == 0) {
+        menu_t **link = &menus[menu->hash % MENU_BUCKETS];
+        while (*link != menu) {
+            link = &(*link)->next;
+        }
+        *link = menu->next;
+        free_menu(menu);
+    }
+    pthread_mutex_unlock(&menu_mutex);
+}
+
+// Function to find an item by number
+const menu_item_t *menu_item(const menu_t *menu, int number) {
+    uint32_t low = 0, high = menu->item_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (menu->items[mid].number < (uint32_t)number) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (number <= 0 || low == menu->item_count || menu->items[low].number != (uint32_t)number) {
+        return NULL;
+    }
+    return &menu->items[low];
+}
+
+uint32_t menu_price_cents(const menu_t *menu, int item) {
+    const menu_item_t *found = menu_item(menu, item);
+    return found != NULL ? found->price_cents : 0;
+}
+
+// Function to append an item's line if it fits, returns 1 when it did
+static int write_line(const menu_item_t *item, char *buf, size_t size, size_t *used) {
+    if (*used + item->line_len + 2 > size) {
+        *used = size;   // Full, later shorter lines would leave a gap in the results
+        return 0;
+    }
+    memcpy(buf + *used, item->line, item->line_len);
+    *used += item->line_len;
+    buf[(*used)++] = '\n';
+    buf[*used] = '\0';
+    return 1;
+}
+
+int menu_page(const menu_t *menu, int page, char *buf, size_t size) {
+    size_t used = 0;
+    int lines = 0;
+    buf[0] = '\0';
+    if (page < 0 || (uint32_t)page >= menu->page_count) {
+        return 0;
+    }
+    uint32_t end = (uint32_t)page + 1 < menu->page_count ? menu->pages[page + 1] : menu->item_count;
+    for (uint32_t i = menu->pages[page]; i < end; i++) {
+        lines += write_line(&menu->items[i], buf, size, &used);
+    }
+    return lines;
+}
+
+// Function to check an item against the price range of a query
+static int price_matches(const menu_item_t *item, const menu_query_t *query) {
+    return item->price_cents >= query->min_cents && (query->max_cents == 0 || item->price_cents <= query->max_cents);
+}
+
+int menu_search(const menu_t *menu, const menu_query_t *query, char *buf, size_t size, int *shown) {
+    char text[MENU_QUERY_LEN];
+    size_t text_len = strnlen(query->text, MENU_QUERY_LEN - 1);
+    for (size_t i = 0; i < text_len; i++) {
+        text[i] = tolower((unsigned char)query->text[i]);
+    }
+    text[text_len] = '\0';
+
+    size_t used = 0;
+    int matches = 0;
+    *shown = 0;
+    buf[0] = '\0';
+    if (query->prefix) {
+        // Names sharing the prefix are adjacent in name order, find the first one
+        uint32_t low = 0, high = menu->item_count;
+        while (low < high) {
+            uint32_t mid = (low + high) / 2;
+            if (strcmp(menu->by_name[mid]->folded, text) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        for (uint32_t i = low; i < menu->item_count && strncmp(menu->by_name[i]->folded, text, text_len) == 0; i++) {
+            if (price_matches(menu->by_name[i], query)) {
+                matches++;
+                *shown += write_line(menu->by_name[i], buf, size, &used);
+            }
+        }
+        return matches;
+    }
+    for (uint32_t i = 0; i < menu->item_count; i++) {
+        if (price_matches(&menu->items[i], query) && strstr(menu->items[i].folded, text) != NULL) {
+            matches++;
+            *shown += write_line(&menu->items[i], buf, size, &used);
+        }
+    }
+    return matches;
+}
@@ -0,0 +1,58 @@
+#ifndef MENU_H
+#define MENU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Interned restaurant names and shared, reference counted menus.
+// Restaurants resend an identical menu every update round, and several
+// restaurants may serve the same one, so equal menus share one copy.
+// Each menu is indexed once when it is first seen: items by number for
+// orders, by lowercased name for prefix search, and split into pages that
+// each fit in a frame, so large menus are never sent or scanned whole.
+
+#define MENU_MAX_LEN (1 << 20)  // Longest menu text a restaurant may upload
+#define MENU_QUERY_LEN 64       // Longest search text
+#define MENU_PAGE_BYTES 448     // Lines per page, leaves room in a frame for the page's header line
+
+typedef struct {
+    uint32_t number;            // Item number the client orders by
+    uint32_t price_cents;       // 0 when the line has no price
+    const char *line;           // "N. name - $D.CC" in the menu text, not terminated
+    uint32_t line_len;
+    const char *folded;         // Lowercased name, terminated
+} menu_item_t;
+
+typedef struct {
+    int prefix;                 // Names starting with text, otherwise names containing it
+    uint32_t min_cents;
+    uint32_t max_cents;         // 0 for no upper bound
+    char text[MENU_QUERY_LEN];  // Empty matches every name
+} menu_query_t;
+
+typedef struct menu {
+    struct menu *next;          // Hash chain
+    uint32_t refcount;          // References held by restaurants and sessions
+    uint32_t hash;              // Hash of the menu text
+    uint32_t version;           // Changes whenever a restaurant's menu text changes
+    uint32_t len;               // Length of text without the terminator
+    menu_item_t *items;         // Sorted by number
+    uint32_t item_count;
+    menu_item_t **by_name;      // Sorted by folded name
+    char *folded;               // Lowercased item names the items point into
+    uint32_t *pages;            // Index of the first item of each page
+    uint32_t page_count;
+    char text[];
+} menu_t;
+
+const char *intern_name(const char *name);  // Same pointer for equal names, compare with ==
+menu_t *menu_get(const char *text);         // Referenced menu with this text
+menu_t *menu_adopt(const char *text, uint32_t version);    // Same, keeping the version an earlier server gave it
+menu_t *menu_ref(menu_t *menu);
+void menu_put(menu_t *menu);                // Drop a reference, the last one frees the menu
+const menu_item_t *menu_item(const menu_t *menu, int number);  // NULL when the menu does not list it
+uint32_t menu_price_cents(const menu_t *menu, int item);        // Price of "N. name - $D.CC", 0 when not listed
+int menu_page(const menu_t *menu, int page, char *buf, size_t size);   // Writes the page's lines, returns the line count
+int menu_search(const menu_t *menu, const menu_query_t *query, char *buf, size_t size, int *shown);    // Returns the match count
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// USDT probes of the "food" provider, for perf and bpftrace, for example
+//   bpftrace -e 'usdt:./server:food:order_forwarded { @[arg2] = count(); }'
+// A probe is a single nop in the code and a note in the binary until a tracer
+// attaches to it. Without <sys/sdt.h> (systemtap-sdt-dev) they compile to
+// nothing. Arguments are kept to integers that are already at hand: sessions
+// by session_probe_id() and orders by their trace id (see trace.h).
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(food, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(food, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(food, name, a, b, c)
+#endif
+#endif
+
+#ifndef PROBE1     // Arguments are never evaluated, only kept from looking unused
+#define PROBE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#endif
+
+// Session id of a token for probes: its slot and generation, the part that is not secret
+static inline uint64_t session_probe_id(const session_token_t *token) {
+    uint64_t id;
+    memcpy(&id, token->bytes, sizeof(id));
+    return id;
+}
+
+#endif
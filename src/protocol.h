@@ -0,0 +1,78 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Wire protocol shared by the server, the client and the restaurants.
+// New message types go at the end so older programs keep their numbering.
+
+#define BUFFER_SIZE 512         // Buffer size for message data
+#define TOKEN_SIZE 16           // Session tokens are 128-bit binary ids
+
+typedef enum {
+    ERROR,
+    MSG_KEEP_ALIVE,
+    MSG_REQUEST_MENU,
+    MSG_MENU,
+    MSG_ORDER,
+    MSG_ESTIMATED_TIME,
+    MSG_RESTAURANT_OPTIONS,
+    REST_UNAVALIABLE,
+    MSG_LEAVE,
+    MSG_TOKEN,
+    MSG_RESUME,     // Client presents its old token on a new connection, the server answers with the session state
+    MSG_STATS,      // Admin asks for live order analytics, answered in frames ending with an empty one
+    MSG_SUBSCRIBE,  // Client asks to be told about restaurant availability, answered with a full MSG_AVAILABILITY
+    MSG_AVAILABILITY,   // Pushed to subscribers: one "id open menu_version name" line per restaurant that changed
+    MSG_DIRECT_ORDER,   // Client orders in one round trip: "restaurant item menu_version [max_wait_minutes]" of its cached menu
+    MSG_MENU_UPDATE,    // Answer to a direct order with a stale menu version: "restaurant menu_version pages" line, then the first page
+    MSG_MENU_PART,      // Restaurant sends a menu too large for one frame, whole lines per part, a MSG_MENU carries the last ones
+    MSG_MENU_PAGE,      // Client asks "restaurant page", answered with a "restaurant menu_version page pages" line, then the page
+    MSG_MENU_SEARCH,    // Client asks "restaurant prefix|contains min_cents max_cents text", answered with a
+                        // "restaurant menu_version matches shown" line, then the matching items that fit
+    MSG_CATALOG_SEARCH, // Client asks "max_cents words" across every open restaurant, answered with a "matches shown"
+                        // line, then "restaurant menu_version item" lines, cheapest first
+    MSG_CART,           // Client orders "restaurant item menu_version [max_wait_minutes]" lines from any restaurants in one round trip,
+                        // answered with one MSG_ESTIMATED_TIME once every restaurant has answered
+    MSG_CAPACITY,       // Restaurant reports "free received": orders its kitchen can take now and orders received so far
+                        // on this connection; the server holds the rest, earliest deadline first
+    MSG_BUSY,           // Server did not take an order or request: "retry_after_ms reason", try again after that long
+    MSG_STREAM          // Gateway opens a session for one of its users, answered in order with a MSG_TOKEN or a MSG_BUSY;
+                        // frames of the session carry its token, a MSG_LEAVE with the token ends it from either side
+} message_type_t;
+
+typedef struct {
+    uint8_t bytes[TOKEN_SIZE];
+} session_token_t;
+
+typedef enum {
+    TRACE_CLIENT_SEND,          // Client sent the order
+    TRACE_SERVER_RECEIVE,       // Server read it
+    TRACE_SERVER_FORWARD,       // Server sent it to the restaurant, once durable and admitted to the kitchen
+    TRACE_RESTAURANT_RECEIVE,
+    TRACE_RESTAURANT_REPLY,     // Restaurant sent the estimated time
+    TRACE_SERVER_REPLY,         // Server read the estimated time and passed it on
+    TRACE_CLIENT_RECEIVE,
+    TRACE_HOPS
+} trace_hop_t;
+
+// Trace of an order, carried in the last bytes of the data of the frames of
+// the order (MSG_DIRECT_ORDER, MSG_CART, MSG_ORDER and MSG_ESTIMATED_TIME),
+// after the text and its terminator. A frame whose text runs into it carries
+// no trace. Each hop stamps CLOCK_MONOTONIC nanoseconds of its own host.
+typedef struct {
+    uint64_t id;                    // Trace id, given by the server when the client sent none
+    uint32_t restaurant;            // Restaurant id the order went to, set by the server
+    uint32_t keep;                  // Client asks the server to record this trace whatever it samples
+    uint64_t stamps[TRACE_HOPS];    // By hop, 0 for hops that did not stamp
+} trace_context_t;
+
+#define TRACE_TEXT_SIZE (BUFFER_SIZE - sizeof(trace_context_t))     // Room for the text of a frame that carries a trace
+
+typedef struct {
+    message_type_t type;
+    session_token_t client_token;   // Token of the client the message belongs to, zero when none
+    char data[BUFFER_SIZE];
+} message_t;
+
+#endif
@@ -0,0 +1,59 @@
+#include "ratelimit.h"
+
+#define RATELIMIT_UNIT 1000000ULL   // Millionths of a token in one token
+
+void ratelimit_init(ratelimit_t *limit, uint32_t rate, uint32_t burst, uint64_t now) {
+    limit->rate = rate;
+    limit->burst = burst > 0 ? burst : 1;
+    limit->level = limit->burst * RATELIMIT_UNIT;
+    limit->last = now;
+    limit->limited = 0;
+}
+
+int ratelimit_take(ratelimit_t *limit, uint64_t now) {
+    if (limit->rate == 0) {
+        return 1;
+    }
+    if (now > limit->last) {    // A second of microseconds times the rate in millionths is the rate in tokens
+        uint64_t full = limit->burst * RATELIMIT_UNIT;
+        uint64_t elapsed = now - limit->last;
+        limit->level = elapsed >= full / limit->rate ? full : limit->level + elapsed * limit->rate;
+        limit->level = limit->level < full ? limit->level : full;
+        limit->last = now;
+    }
+    if (limit->level < RATELIMIT_UNIT) {
+        limit->limited++;
+        return 0;
+    }
+    limit->level -= RATELIMIT_UNIT;
+    return 1;
+}
+
+uint32_t ratelimit_wait_ms(const ratelimit_t *limit) {
+    if (limit->rate == 0 || limit->level >= RATELIMIT_UNIT) {
+        return 0;
+    }
+    uint64_t wait_us = (RATELIMIT_UNIT - limit->level + limit->rate - 1) / limit->rate;
+    return (uint32_t)((wait_us + 999) / 1000);
+}
+
+void ratelimit_rule_init(ratelimit_rule_t *rule, uint32_t rate, uint32_t burst) {
+    rule->interval = rate == 0 ? 0 : (rate < 1000 ? 1000 / rate : 1);
+    rule->tolerance = (burst > 1 ? burst - 1 : 0) * rule->interval;
+}
+
+int ratelimit_due(const ratelimit_rule_t *rule, uint32_t *due, uint32_t now, uint32_t *wait_ms) {
+    if (rule->interval == 0) {
+        return 1;
+    }
+    int32_t ahead = (int32_t)(*due - now);
+    if (ahead < 0 || (uint32_t)ahead > rule->tolerance + rule->interval) {
+        ahead = 0;  // Idle for a burst or more, or for longer than the clock wraps
+    }
+    if ((uint32_t)ahead > rule->tolerance) {
+        *wait_ms = (uint32_t)ahead - rule->tolerance;
+        return 0;
+    }
+    *due = now + (uint32_t)ahead + rule->interval;
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Token bucket. It fills at rate tokens a second up to burst, and every
+// arrival takes one token; an arrival that finds the bucket empty is over the
+// limit and is told how long until the next token. A full bucket lets a burst
+// through at once, so the limit only bites on a flood that lasts longer than
+// the burst takes to drain. Times are in microseconds of a monotonic clock. A
+// rate of 0 lets everything through. Callers serialize access.
+
+typedef struct {
+    uint32_t rate;              // Tokens added a second, 0 for no limit
+    uint32_t burst;             // Tokens the bucket holds when full
+    uint64_t level;             // Tokens in the bucket, in millionths so a fill at any rate keeps its fractions
+    uint64_t last;              // When the bucket was last filled
+    uint64_t limited;           // Arrivals turned away in total
+} ratelimit_t;
+
+void ratelimit_init(ratelimit_t *limit, uint32_t rate, uint32_t burst, uint64_t now);  // Starts full
+int ratelimit_take(ratelimit_t *limit, uint64_t now);           // 1 when the arrival at now may go on
+uint32_t ratelimit_wait_ms(const ratelimit_t *limit);           // Until the next token after a refused arrival
+
+// The same limit kept in one timestamp per entry, for limits with many
+// entries such as one per session (GCRA). An entry holds when its next
+// arrival is due at the sustained rate, and an arrival may come up to a burst
+// of intervals early. An entry that is not ahead of the clock has a full
+// burst, so a zeroed entry starts full. Times are milliseconds of a 32-bit
+// clock; an entry left alone for longer than the clock takes to wrap reads as
+// impossibly far ahead and starts over full.
+
+typedef struct {
+    uint32_t interval;          // Milliseconds between arrivals at the sustained rate, 0 for no limit
+    uint32_t tolerance;         // How much earlier than due an arrival may come
+} ratelimit_rule_t;
+
+void ratelimit_rule_init(ratelimit_rule_t *rule, uint32_t rate, uint32_t burst);  // Rate a second, up to 1000
+int ratelimit_due(const ratelimit_rule_t *rule, uint32_t *due, uint32_t now, uint32_t *wait_ms);   // 1 when the arrival may go on
+
+#endif
@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <dirent.h>
+
+#include "protocol.h"
+#include "capture.h"
+
+#define SERVER_IP "127.0.0.1"   // Captures are replayed against a local server
+#define CLIENT_PORT 8080        // Latency is measured on client connections
+#define GATEWAY_PORT 8081       // and on gateway connections
+#define ADMIN_PORT 8090         // Probed to see that a started server is up, opens no session
+#define REPLY_TIMEOUT_MS 5000   // A captured reply that does not come in this long is missing
+#define REGRESSION 1.2          // Slower than the reference by this factor is reported
+
+typedef struct {
+    capture_record_t record;
+    message_t msg;              // Frame of IN and OUT records, zero padded again
+    int turn;                   // Position among the OPEN, IN and CLOSE records, -1 for OUT
+    int turns_before;           // OPEN, IN and CLOSE records before this one
+} event_t;
+
+typedef struct {
+    int *events;                // Indexes into the events array, in capture order
+    int count;
+    int capacity;
+    int sock;
+    uint16_t port;
+} replay_conn_t;
+
+typedef struct {
+    session_token_t captured;
+    session_token_t replayed;
+} token_pair_t;
+
+typedef struct {
+    long long *values;
+    int count;
+    int capacity;
+} samples_t;
+
+static event_t *events = NULL;
+static int event_count = 0;
+static replay_conn_t *conns = NULL;
+static uint32_t conn_count = 0;
+
+static double speed = 1.0;      // 0 replays as fast as possible
+static long long replay_start;
+static int turn = 0;            // Next OPEN, IN or CLOSE record to perform
+static pthread_mutex_t turn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+
+static token_pair_t *tokens = NULL;
+static int token_count = 0;
+static int token_capacity = 0;
+static pthread_mutex_t tokens_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *type_names[] = {"ERROR", "KEEP_ALIVE", "REQUEST_MENU", "MENU", "ORDER", "ESTIMATED_TIME",
+                                   "RESTAURANT_OPTIONS", "REST_UNAVALIABLE", "LEAVE", "TOKEN", "RESUME", "STATS",
+                                   "SUBSCRIBE", "AVAILABILITY", "DIRECT_ORDER", "MENU_UPDATE", "MENU_PART", "MENU_PAGE",
+                                   "MENU_SEARCH", "CATALOG_SEARCH", "CART", "CAPACITY", "BUSY", "STREAM"};
+#define TYPES (int)(sizeof(type_names) / sizeof(type_names[0]))    // Message types the report knows by name
+
+static samples_t captured_latency[TYPES];   // Indexed by the type of the frame that caused the reply
+static samples_t replayed_latency[TYPES];
+static int missing = 0;         // Captured replies that never came
+static int mismatched = 0;      // Replies of another type than captured
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to read the monotonic clock in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int token_is_zero(const session_token_t *token) {
+    static const session_token_t zero;
+    return memcmp(token, &zero, sizeof(session_token_t)) == 0;
+}
+
+static void add_sample(samples_t *samples, long long value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(long long));
+    }
+    samples->values[samples->count++] = value;
+}
+
+// Function to load every record of a capture file
+static int load_capture(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    int capacity = 0, turns = 0;
+    capture_record_t record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.len > CAPTURE_FRAME_HEADER + BUFFER_SIZE || (record.len > 0 && record.len < CAPTURE_FRAME_HEADER)) {
+            break;  // Damaged, keep what came before
+        }
+        if (event_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            events = realloc(events, capacity * sizeof(event_t));
+        }
+        event_t *event = &events[event_count];
+        memset(event, 0, sizeof(event_t));
+        event->record = record;
+        if (record.len > 0) {
+            uint32_t type;
+            if (fread(&type, sizeof(type), 1, file) != 1 ||
+                fread(&event->msg.client_token, sizeof(session_token_t), 1, file) != 1 ||
+                fread(event->msg.data, record.len - CAPTURE_FRAME_HEADER, 1, file) != (record.len > CAPTURE_FRAME_HEADER)) {
+                break;  // Torn at the end of the file
+            }
+            event->msg.type = type;
+        }
+        event->turns_before = turns;
+        event->turn = record.event == CAPTURE_OUT ? -1 : turns++;
+
+        if (record.conn >= conn_count) {
+            uint32_t count = record.conn + 1;
+            conns = realloc(conns, count * sizeof(replay_conn_t));
+            memset(conns + conn_count, 0, (count - conn_count) * sizeof(replay_conn_t));
+            conn_count = count;
+        }
+        replay_conn_t *conn = &conns[record.conn];
+        if (conn->count == conn->capacity) {
+            conn->capacity = conn->capacity ? conn->capacity * 2 : 16;
+            conn->events = realloc(conn->events, conn->capacity * sizeof(int));
+        }
+        conn->events[conn->count++] = event_count;
+        conn->port = record.port;
+        event_count++;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Function to swap a captured token for the one the replayed server handed out
+static void map_token(session_token_t *token) {
+    if (token_is_zero(token)) {
+        return;
+    }
+    pthread_mutex_lock(&tokens_mutex);
+    for (int i = 0; i < token_count; i++) {
+        if (memcmp(&tokens[i].captured, token, sizeof(session_token_t)) == 0) {
+            *token = tokens[i].replayed;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tokens_mutex);
+}
+
+// Function to remember which token the replayed server used where the capture had another
+static void learn_token(const session_token_t *captured, const session_token_t *replayed) {
+    if (token_is_zero(captured) || token_is_zero(replayed)) {
+        return;
+    }
+    pthread_mutex_lock(&tokens_mutex);
+    for (int i = 0; i < token_count; i++) {
+        if (memcmp(&tokens[i].captured, captured, sizeof(session_token_t)) == 0) {
+            pthread_mutex_unlock(&tokens_mutex);
+            return;
+        }
+    }
+    if (token_count == token_capacity) {
+        token_capacity = token_capacity ? token_capacity * 2 : 64;
+        tokens = realloc(tokens, token_capacity * sizeof(token_pair_t));
+    }
+    tokens[token_count].captured = *captured;
+    tokens[token_count].replayed = *replayed;
+    token_count++;
+    pthread_mutex_unlock(&tokens_mutex);
+}
+
+// Function to wait until an OPEN, IN or CLOSE record may be performed, at its time scaled by the speed
+static void wait_turn(const event_t *event) {
+    pthread_mutex_lock(&turn_mutex);
+    while (turn != event->turn) {
+        pthread_cond_wait(&turn_cond, &turn_mutex);
+    }
+    pthread_mutex_unlock(&turn_mutex);
+    if (speed > 0) {
+        long long due = replay_start + (long long)(event->record.time_ns / speed);
+        long long wait = due - now_ns();
+        if (wait > 0) {
+            struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+static void end_turn(void) {
+    pthread_mutex_lock(&turn_mutex);
+    turn++;
+    pthread_cond_broadcast(&turn_cond);
+    pthread_mutex_unlock(&turn_mutex);
+}
+
+// Function to wait until everything the capture did before a reply has been replayed
+static void wait_cause(const event_t *event) {
+    pthread_mutex_lock(&turn_mutex);
+    while (turn < event->turns_before) {
+        pthread_cond_wait(&turn_cond, &turn_mutex);
+    }
+    pthread_mutex_unlock(&turn_mutex);
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {REPLY_TIMEOUT_MS / 1000, REPLY_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+// Function to replay one captured connection, its own records in order
+static void *replay_conn(void *arg) {
+    replay_conn_t *conn = arg;
+    conn->sock = -1;
+    long long sent = 0;         // When the last IN went out, 0 once its reply was timed
+    int sent_type = 0;
+    uint64_t sent_time = 0;     // Capture time of that IN
+
+    for (int i = 0; i < conn->count; i++) {
+        event_t *event = &events[conn->events[i]];
+        switch (event->record.event) {
+            case CAPTURE_OPEN:
+                wait_turn(event);
+                if ((conn->sock = connect_local(event->record.port)) < 0) {
+                    fprintf(stderr, "replay: connect to port %u: %s\n", event->record.port, strerror(errno));
+                }
+                end_turn();
+                break;
+            case CAPTURE_IN: {
+                message_t msg = event->msg;
+                wait_turn(event);
+                map_token(&msg.client_token);
+                if (conn->sock >= 0 && send(conn->sock, &msg, sizeof(message_t), MSG_NOSIGNAL) == sizeof(message_t)) {
+                    sent = now_ns();
+                    sent_type = msg.type;
+                    sent_time = event->record.time_ns;
+                }
+                end_turn();
+                break;
+            }
+            case CAPTURE_OUT: {
+                message_t msg;
+                wait_cause(event);
+                ssize_t n = conn->sock >= 0 ? recv(conn->sock, &msg, sizeof(message_t), MSG_WAITALL) : -1;
+                long long received = now_ns();
+                pthread_mutex_lock(&stats_mutex);
+                if (n != sizeof(message_t)) {
+                    missing++;
+                    if (n >= 0 && conn->sock >= 0) {    // Torn frame or closed by the server, nothing more will line up
+                        close(conn->sock);
+                        conn->sock = -1;
+                    }
+                } else if (msg.type != event->msg.type) {
+                    mismatched++;
+                } else {
+                    learn_token(&event->msg.client_token, &msg.client_token);
+                    if (sent != 0 && (conn->port == CLIENT_PORT || conn->port == GATEWAY_PORT) && sent_type >= 0 && sent_type < TYPES) {
+                        add_sample(&captured_latency[sent_type], event->record.time_ns - sent_time);
+                        add_sample(&replayed_latency[sent_type], received - sent);
+                    }
+                }
+                sent = 0;
+                pthread_mutex_unlock(&stats_mutex);
+                break;
+            }
+            case CAPTURE_CLOSE:
+                wait_turn(event);
+                if (conn->sock >= 0) {
+                    close(conn->sock);
+                    conn->sock = -1;
+                }
+                end_turn();
+                break;
+        }
+    }
+    if (conn->sock >= 0) {
+        close(conn->sock);  // Capture ended with the connection still open
+    }
+    return NULL;
+}
+
+static void percentiles(samples_t *samples, long long *p50, long long *p99) {
+    qsort(samples->values, samples->count, sizeof(long long), cmp_ll);
+    *p50 = samples->values[samples->count / 2];
+    *p99 = samples->values[(int)(samples->count * 0.99)];
+}
+
+// Function to read a saved report, lines of "type p50 p99" in nanoseconds
+static int load_baseline(const char *path, long long reference[][2]) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char name[64];
+    long long p50, p99;
+    while (fscanf(file, "%63s %lld %lld", name, &p50, &p99) == 3) {
+        for (int type = 0; type < TYPES; type++) {
+            if (strcmp(name, type_names[type]) == 0) {
+                reference[type][0] = p50;
+                reference[type][1] = p99;
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Function to print replay latencies against the capture or a saved baseline, returns the regressions found.
+// Captured latencies are taken inside the server, so only a baseline from an earlier replay is judged.
+static int report(const char *baseline, const char *save) {
+    long long reference[TYPES][2];
+    memset(reference, 0, sizeof(reference));
+    if (baseline != NULL && load_baseline(baseline, reference) < 0) {
+        return -1;
+    }
+    FILE *saved = NULL;
+    if (save != NULL && (saved = fopen(save, "w")) == NULL) {
+        perror(save);
+    }
+
+    int regressions = 0;
+    printf("%-16s %8s %22s %22s %16s\n", "request", "samples", baseline ? "baseline p50/p99 us" : "capture p50/p99 us",
+           "replay p50/p99 us", "change p50/p99");
+    for (int type = 0; type < TYPES; type++) {
+        if (replayed_latency[type].count == 0) {
+            continue;
+        }
+        long long p50, p99;
+        percentiles(&replayed_latency[type], &p50, &p99);
+        if (baseline == NULL) {
+            percentiles(&captured_latency[type], &reference[type][0], &reference[type][1]);
+        } else if (reference[type][0] == 0) {
+            printf("%-16s %8d %22s %10.1f/%-11.1f\n", type_names[type], replayed_latency[type].count, "-", p50 / 1000.0, p99 / 1000.0);
+            continue;
+        }
+        double change50 = 100.0 * (p50 - reference[type][0]) / reference[type][0];
+        double change99 = 100.0 * (p99 - reference[type][1]) / reference[type][1];
+        int regressed = baseline != NULL && (p50 > reference[type][0] * REGRESSION || p99 > reference[type][1] * REGRESSION);
+        regressions += regressed;
+        printf("%-16s %8d %10.1f/%-11.1f %10.1f/%-11.1f %+7.0f%%/%+6.0f%%%s\n", type_names[type], replayed_latency[type].count,
+               reference[type][0] / 1000.0, reference[type][1] / 1000.0, p50 / 1000.0, p99 / 1000.0, change50, change99,
+               regressed ? "  REGRESSION" : "");
+        if (saved != NULL) {
+            fprintf(saved, "%s %lld %lld\n", type_names[type], p50, p99);
+        }
+    }
+    printf("missing replies %d, mismatched replies %d\n", missing, mismatched);
+    if (saved != NULL) {
+        fclose(saved);
+    }
+    return regressions;
+}
+
+// Function to start a fresh server with its own journal and history, so earlier runs cannot leak in
+static pid_t start_server(const char *path, const char *journal, const char *history) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);   // The server is chatty
+        execl(path, path, "--journal", journal, "--history", history, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) {     // Up once the admin port answers
+        int sock = connect_local(ADMIN_PORT);
+        if (sock >= 0) {
+            close(sock);
+            return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "replay: server did not come up\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// Function to delete a history directory and its segments
+static void remove_history(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    char path[4200];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[]) {
+    const char *capture = NULL;
+    const char *server = NULL;      // Server binary to start, otherwise one must be running
+    const char *save = NULL;
+    const char *baseline = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (capture == NULL && argv[i][0] != '-') {
+            capture = argv[i];
+        } else {
+            capture = NULL;
+            break;
+        }
+    }
+    if (capture == NULL || speed < 0) {
+        fprintf(stderr, "Usage: %s CAPTURE [--speed 1|10|0] [--server PATH] [--save FILE] [--baseline FILE]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (load_capture(capture) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    char journal[64], history[64];
+    pid_t pid = -1;
+    if (server != NULL) {
+        snprintf(journal, sizeof(journal), "/tmp/replay-%d.journal", (int)getpid());
+        snprintf(history, sizeof(history), "/tmp/replay-%d-history", (int)getpid());
+        if ((pid = start_server(server, journal, history)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (speed > 0) {
+        printf("Replaying %d records on %u connections at %gx\n", event_count, conn_count ? conn_count - 1 : 0, speed);
+    } else {
+        printf("Replaying %d records on %u connections as fast as possible\n", event_count, conn_count ? conn_count - 1 : 0);
+    }
+    pthread_t *threads = calloc(conn_count, sizeof(pthread_t));
+    replay_start = now_ns();
+    for (uint32_t i = 1; i < conn_count; i++) {     // Connection ids start at 1
+        pthread_create(&threads[i], NULL, replay_conn, &conns[i]);
+    }
+    for (uint32_t i = 1; i < conn_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("Replay took %.2f s\n", (now_ns() - replay_start) / 1e9);
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        unlink(journal);
+        remove_history(history);
+    }
+    int regressions = report(baseline, save);
+    return regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "restaurant.h"
+#include "shm_ring.h"
+#include "probes.h"
+
+#define MULTICAST_GROUP "239.0.0.1" // Multicast group address
+#define MULTICAST_PORT 5555         // Multicast port
+#define SERVER_IP "192.15.6.1"
+#define KITCHEN_SLOTS 4             // Orders the kitchen cooks at once
+#define SECONDS_PER_MINUTE 1        // Kitchen clock, a quoted minute of cooking takes a second
+#define BATCH_WINDOW 2              // Minutes a new batch waits for more orders of its item before it goes on
+#define SIM_ORDERS 1000             // Default orders of a simulation
+#define SIM_ORDERS_PER_HOUR 40      // Default orders arriving per hour in a simulation
+#define RECONNECT_BASE_MS 250       // Longest wait before the first reconnect attempt, doubled with every failed one
+#define RECONNECT_MAX_MS 30000      // Longest wait between reconnect attempts
+
+static void *multicast_listener(void *arg);
+static void *tcp_communication_handler(void *arg);
+static void *keep_alive_handler(void *arg);
+static void handle_signal(int signal);
+static void *kitchen_handler(void *arg);
+static int kitchen_free_slots(time_t now);
+static int report_capacity(int tcp_socket);
+static time_t cook_item(int item, time_t now);
+static time_t cook_order(const char *order, time_t now);
+static void simulate_kitchen(int orders, int per_hour);
+static ssize_t recv_message(int tcp_socket, message_t *msg);
+static int connect_server(void);
+static void reconnect_server(void);
+static int backoff_ms(int attempt);
+static long long clock_ms(void);
+static uint64_t stamp_trace(message_t *msg, trace_hop_t hop);
+
+typedef struct {
+    time_t start;               // When the batch goes on, orders of the item can join it until then
+    time_t ready;               // When the batch is done
+    int count;                  // Orders in the batch
+} batch_t;
+
+static const restaurant_t *restaurant;  // Restaurant the program runs
+static int sent_menu = 0;
+static int tcp_socket; // Global variable for TCP socket
+static pthread_mutex_t tcp_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for TCP socket
+static pthread_cond_t tcp_cond = PTHREAD_COND_INITIALIZER; // Wakes the kitchen thread when a registration is scheduled
+static int tcp_connected = 0;
+static long long register_at = 0;       // When to send the menu again after MSG_BUSY, 0 when not scheduled, guarded by tcp_mutex
+static time_t kitchen_ready[KITCHEN_SLOTS];     // When the order in each slot is ready, guarded by tcp_mutex
+static unsigned int orders_received = 0;        // Orders received from the server, reported with the free slots
+static int reported_free = -1;                  // Free slots last reported to the server, -1 to report again
+static batch_t batches[MENU_ITEMS + 1];         // Latest batch of each item, guarded by tcp_mutex
+static int batching = 1;                        // Cook identical items together, 0 cooks every order on its own
+static uint64_t batches_cooked = 0;             // Batches put on since the kitchen opened
+static shm_link_t server_link;                  // Frames to and from a server on the same host, with --uds
+static int linked = 0;                          // Frames go over server_link, the socket only tells when the server leaves
+static const char *uds_path = NULL;             // Server's local socket, TCP when not given
+
+int restaurant_main(const restaurant_t *r, int argc, char *argv[]) {
+    restaurant = r;
+    for (int i = 1; i < argc; i++) {
+        int taken = restaurant->parse_option != NULL ? restaurant->parse_option(argc, argv, i) : 0;
+        if (taken > 0) {
+            i += taken - 1;
+        } else if (strcmp(argv[i], "--uds") == 0 && i + 1 < argc) {
+            uds_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-batching") == 0) {
+            batching = 0;
+        } else if (strcmp(argv[i], "--simulate") == 0) {
+            int orders = i + 1 < argc ? atoi(argv[i + 1]) : SIM_ORDERS;
+            int per_hour = i + 2 < argc ? atoi(argv[i + 2]) : SIM_ORDERS_PER_HOUR;
+            if (orders <= 0 || per_hour <= 0) {
+                fprintf(stderr, "Orders and orders per hour must be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            simulate_kitchen(orders, per_hour);
+            return 0;
+        } else {
+            fprintf(stderr, "Usage: %s %s[--uds PATH] [--no-batching] [--simulate [ORDERS [ORDERS_PER_HOUR]]]\n", argv[0],
+                    restaurant->options != NULL ? restaurant->options : "");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = handle_signal;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
+    pthread_t multicast_thread, tcp_thread, keep_alive_thread, kitchen_thread;
+
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());  // Restaurants started together back off differently
+    for (int attempt = 0; (tcp_socket = connect_server()) < 0; attempt++) {    // Started before the server, wait for it
+        int delay = backoff_ms(attempt);
+        printf("Connecting to the server again in %d ms\n", delay);
+        usleep((useconds_t)delay * 1000);
+    }
+    tcp_connected = 1;
+
+    pthread_create(&tcp_thread, NULL, tcp_communication_handler, &tcp_socket);
+    pthread_create(&multicast_thread, NULL, multicast_listener, &tcp_socket);
+    pthread_create(&keep_alive_thread, NULL, keep_alive_handler, &tcp_socket);
+    pthread_create(&kitchen_thread, NULL, kitchen_handler, &tcp_socket);
+
+    pthread_join(tcp_thread, NULL);
+    pthread_join(multicast_thread, NULL);
+    pthread_join(keep_alive_thread, NULL);
+    pthread_join(kitchen_thread, NULL);
+
+    close(tcp_socket);
+
+    return 0;
+}
+
+// Function to connect to the server, over shared memory when it is on the same host, returns the socket or -1
+static int connect_server(void) {
+    int sock;
+    if (uds_path != NULL) {
+        if ((sock = shm_link_connect(uds_path, restaurant->name, &server_link)) < 0) {
+            return -1;
+        }
+        linked = 1;
+        printf("%s restaurant connected to server over shared memory\n", restaurant->display_name);
+        return sock;
+    }
+
+    struct sockaddr_in tcp_addr;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("TCP socket creation failed");
+        return -1;
+    }
+
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    tcp_addr.sin_port = htons(restaurant->port);
+
+    if (connect(sock, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
+        perror("TCP connect failed");
+        close(sock);
+        return -1;
+    }
+
+    printf("%s restaurant connected to server via TCP\n", restaurant->display_name);
+    return sock;
+}
+
+// Function to connect again once the server went away and register, restaurants that lost it together come back spread out
+static void reconnect_server(void) {
+    pthread_mutex_lock(&tcp_mutex);
+    tcp_connected = 0;      // The other threads leave the connection alone until it is back
+    sent_menu = 0;
+    register_at = 0;        // A MSG_BUSY retry was for the old connection
+    if (linked) {
+        shm_link_close(&server_link);
+        linked = 0;
+    }
+    close(tcp_socket);
+    pthread_mutex_unlock(&tcp_mutex);
+
+    int sock = -1;
+    for (int attempt = 0; sock < 0; attempt++) {
+        int delay = backoff_ms(attempt);
+        printf("Lost the server, connecting again in %d ms\n", delay);
+        usleep((useconds_t)delay * 1000);
+        sock = connect_server();
+    }
+
+    pthread_mutex_lock(&tcp_mutex);
+    tcp_socket = sock;
+    tcp_connected = 1;
+    orders_received = 0;    // The server counts the orders it sends from zero on every new registration
+    reported_free = -1;
+    if (restaurant->send_menu(tcp_socket) < 0) {    // A restarted server has forgotten the menu, no need to wait for its next request
+        perror("send");
+    } else {
+        sent_menu = 1;
+    }
+    pthread_mutex_unlock(&tcp_mutex);
+}
+
+// Function to pick the wait before a reconnect attempt, anywhere up to a backoff that doubles with every failed attempt
+static int backoff_ms(int attempt) {
+    int limit = RECONNECT_MAX_MS;
+    if (attempt < 16 && (RECONNECT_BASE_MS << attempt) < limit) {
+        limit = RECONNECT_BASE_MS << attempt;
+    }
+    return rand() % (limit + 1);
+}
+
+// Function to read the clock pthread_cond_timedwait waits on, in milliseconds
+static long long clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void *multicast_listener(void *arg) {
+    struct sockaddr_in multicast_addr; // Multicast address
+    struct ip_mreqn mreq;              // Multicast request structure
+    int multicast_socket;              // Multicast socket
+    socklen_t addr_len = sizeof(multicast_addr); // Address length for multicast address
+    message_t msg;
+
+    // Create multicast socket
+    if ((multicast_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) { // Create a socket for sending and receiving datagrams
+        perror("multicast socket creation failed");
+        pthread_exit(NULL);
+    }
+
+    // Set socket options
+    int reuse = 1;
+    if (setsockopt(multicast_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse)) < 0) {
+        perror("Setting SO_REUSEADDR error");
+        close(multicast_socket);
+        pthread_exit(NULL);
+    }
+
+    // Set up multicast group information
+    memset(&mreq, 0, sizeof(mreq));                // Clear the multicast request structure
+    mreq.imr_multiaddr.s_addr = inet_addr(MULTICAST_GROUP); // Set the multicast group address
+    mreq.imr_address.s_addr = htonl(INADDR_ANY);   // Set the local address
+    mreq.imr_ifindex = 0;                          // Set the interface index to 0
+
+    // Join the multicast group
+    if (setsockopt(multicast_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) { // Join the multicast group
+        perror("multicast join failed");
+        close(multicast_socket); // Close the multicast socket
+        pthread_exit(NULL);
+    }
+
+    // Set up multicast address to receive from any source
+    memset(&multicast_addr, 0, sizeof(multicast_addr)); // Clear the multicast address structure
+    multicast_addr.sin_family = AF_INET;                // Set the address family to IPv4
+    multicast_addr.sin_addr.s_addr = htonl(INADDR_ANY); // Set the address to receive from any source
+    multicast_addr.sin_port = htons(MULTICAST_PORT);    // Set the port number
+
+    // Bind to the multicast address
+    if (bind(multicast_socket, (struct sockaddr *)&multicast_addr, sizeof(multicast_addr)) < 0) { // Bind the multicast socket to the multicast address
+        perror("bind failed");
+        close(multicast_socket);
+        pthread_exit(NULL);
+    }
+
+    printf("%s restaurant listening on multicast group %s:%d\n", restaurant->display_name, MULTICAST_GROUP, MULTICAST_PORT); // Print the multicast group information
+
+    while (1) { // Loop to keep receiving requests
+        int bytes_received = recvfrom(multicast_socket, &msg, sizeof(msg), 0, (struct sockaddr *)&multicast_addr, &addr_len);
+        if (bytes_received < 0) {
+            perror("recvfrom failed");
+            continue;
+        }
+
+        // Process the received message
+        printf("%d <--- message type!\n ", msg.type);
+        fflush(stdout);
+        if (msg.type == MSG_REQUEST_MENU) {
+            if (sent_menu == 0 && tcp_connected) {
+                sent_menu = 1;
+                printf("Multicast request received. Preparing to send menu data via TCP...\n"); // Debug print statement
+
+                // Send menu data back to the server via TCP
+                pthread_mutex_lock(&tcp_mutex);
+                printf("now sending on tcp\n");
+                if (restaurant->send_menu(tcp_socket) < 0) {
+                    perror("send");
+                }
+                reported_free = -1;     // Registered now, the kitchen thread reports its capacity
+                pthread_mutex_unlock(&tcp_mutex);
+            } else {
+                printf("Menu Already Sent\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    close(multicast_socket); // Close the multicast socket
+    pthread_exit(NULL);
+}
+
+static void *tcp_communication_handler(void *arg) {
+    message_t msg;
+
+    while (1) {
+        ssize_t bytes_received = recv_message(tcp_socket, &msg);
+        if (bytes_received <= 0) {
+            perror("recv");
+            reconnect_server();
+            continue;
+        }
+
+        switch (msg.type) {
+            case MSG_ORDER: {
+                uint64_t order = stamp_trace(&msg, TRACE_RESTAURANT_RECEIVE);
+                PROBE2(order_received, session_probe_id(&msg.client_token), order);
+                printf("%s got the order, %d\n", restaurant->display_name, msg.type);
+                message_t response;
+                memset(&response, 0, sizeof(message_t));
+                response.type = MSG_ESTIMATED_TIME;
+                response.client_token = msg.client_token; // Echo the token so the server knows which client ordered
+                pthread_mutex_lock(&tcp_mutex);
+                orders_received++;
+                time_t now = time(NULL);
+                int estimated_time = (int)(cook_order(msg.data, now) - now) / SECONDS_PER_MINUTE;
+                snprintf(response.data, BUFFER_SIZE, "Your order will be ready in %d minutes.", estimated_time);
+                memcpy(response.data + TRACE_TEXT_SIZE, msg.data + TRACE_TEXT_SIZE, sizeof(trace_context_t));  // Trace of the order goes back with it
+                stamp_trace(&response, TRACE_RESTAURANT_REPLY);
+                PROBE3(eta_sent, session_probe_id(&msg.client_token), order, estimated_time);
+                ssize_t bytes_sent = send_message(tcp_socket, &response);
+                if (bytes_sent <= 0 || report_capacity(tcp_socket) < 0) {
+                    perror("send");
+                    shutdown(tcp_socket, SHUT_RDWR);    // The next receive fails and reconnects
+                }
+                pthread_mutex_unlock(&tcp_mutex);
+                break;
+            }
+            case MSG_BUSY: {    // Server is taking registrations slowly after an outage, register again after the hint
+                int retry_ms = atoi(msg.data);
+                retry_ms = retry_ms > 0 ? retry_ms : 0;
+                pthread_mutex_lock(&tcp_mutex);
+                register_at = clock_ms() + retry_ms + rand() % (retry_ms + 1);  // Up to twice the hint, spread out
+                pthread_cond_signal(&tcp_cond);     // The kitchen thread sends the menu then, this one keeps reading
+                pthread_mutex_unlock(&tcp_mutex);
+                break;
+            }
+            default:
+                printf("Unknown message type received from server: %d\n", msg.type);
+                break;
+        }
+    }
+
+    close(tcp_socket);
+    pthread_exit(NULL);
+}
+
+static void *keep_alive_handler(void *arg) {
+    message_t keep_alive_msg;
+    memset(&keep_alive_msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    keep_alive_msg.type = MSG_KEEP_ALIVE;
+    strcpy(keep_alive_msg.data, "KEEP_ALIVE");
+
+    while (1) {
+        sleep(60); // Send keep-alive every 60 seconds
+        pthread_mutex_lock(&tcp_mutex);
+        if (!tcp_connected) {   // Reconnecting, a new connection needs no keep-alive yet
+            pthread_mutex_unlock(&tcp_mutex);
+            continue;
+        }
+        ssize_t bytes_sent = send_message(tcp_socket, &keep_alive_msg);
+        if (bytes_sent <= 0) {
+            perror("send");
+            shutdown(tcp_socket, SHUT_RDWR);    // The communication thread reconnects
+            pthread_mutex_unlock(&tcp_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&tcp_mutex);
+        printf("\nKeep-alive sent to server\n");
+    }
+    pthread_exit(NULL);
+}
+
+// Function to report freed kitchen slots, and to register again when a MSG_BUSY retry is due
+static void *kitchen_handler(void *arg) {
+    pthread_mutex_lock(&tcp_mutex);
+    while (1) {
+        long long now = clock_ms();
+        long long wake = now + 1000;    // Check for finished orders every second
+        if (register_at != 0 && register_at <= now) {
+            register_at = 0;
+            if (tcp_connected && restaurant->send_menu(tcp_socket) < 0) {
+                perror("send");
+                shutdown(tcp_socket, SHUT_RDWR);    // The communication thread reconnects
+            }
+            reported_free = -1;
+        } else if (register_at != 0 && register_at < wake) {
+            wake = register_at;
+        }
+        if (tcp_connected && sent_menu && kitchen_free_slots(time(NULL)) != reported_free && report_capacity(tcp_socket) < 0) {
+            perror("send");
+            shutdown(tcp_socket, SHUT_RDWR);    // The communication thread reconnects
+        }
+        struct timespec until = {wake / 1000, wake % 1000 * 1000000};
+        pthread_cond_timedwait(&tcp_cond, &tcp_mutex, &until);
+    }
+    pthread_mutex_unlock(&tcp_mutex);
+    pthread_exit(NULL);
+}
+
+// Function to count the kitchen slots with no order cooking, caller holds tcp_mutex
+static int kitchen_free_slots(time_t now) {
+    int free_slots = 0;
+    for (int i = 0; i < KITCHEN_SLOTS; i++) {
+        free_slots += kitchen_ready[i] <= now;
+    }
+    return free_slots;
+}
+
+// Function to tell the server how many more orders the kitchen can take, caller holds tcp_mutex
+static int report_capacity(int tcp_socket) {
+    message_t capacity_msg;
+    memset(&capacity_msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    capacity_msg.type = MSG_CAPACITY;
+    int free_slots = kitchen_free_slots(time(NULL));
+    snprintf(capacity_msg.data, BUFFER_SIZE, "%d %u", free_slots, orders_received); // Lets the server count orders still on the wire
+    if (send_message(tcp_socket, &capacity_msg) <= 0) {
+        return -1;
+    }
+    reported_free = free_slots;
+    return 0;
+}
+
+// Function to stamp a hop into the trace an order frame carries after its text, when it carries one, returns its id
+static uint64_t stamp_trace(message_t *msg, trace_hop_t hop) {
+    trace_context_t trace;
+    if (memchr(msg->data, '\0', TRACE_TEXT_SIZE) == NULL) {
+        return 0;   // Text runs into where the trace would be
+    }
+    memcpy(&trace, msg->data + TRACE_TEXT_SIZE, sizeof(trace_context_t));
+    if (trace.id != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        trace.stamps[hop] = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        memcpy(msg->data + TRACE_TEXT_SIZE, &trace, sizeof(trace_context_t));
+    }
+    return trace.id;
+}
+
+// Function to send a frame to the server, over the shared-memory link when there is one
+ssize_t send_message(int tcp_socket, const message_t *msg) {
+    if (!linked) {
+        return send(tcp_socket, msg, sizeof(message_t), 0);
+    }
+    while (shm_send(&server_link, msg) < 0) {   // Ring is full, the server is draining it
+        char byte;
+        if (recv(tcp_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            return -1;  // Server went away, nobody will drain it
+        }
+        usleep(100);
+    }
+    return sizeof(message_t);
+}
+
+// Function to receive a frame from the server, over the shared-memory link when there is one
+static ssize_t recv_message(int tcp_socket, message_t *msg) {
+    if (!linked) {
+        ssize_t bytes_received = recv(tcp_socket, msg, sizeof(message_t), MSG_WAITALL);  // A frame may arrive in pieces
+        if (bytes_received > 0 && bytes_received < (ssize_t)sizeof(message_t)) {
+            return 0;   // Server went away in the middle of a frame
+        }
+        return bytes_received;
+    }
+    while (!shm_recv(&server_link, msg)) {
+        if (shm_wait(&server_link, tcp_socket) < 0) {
+            return 0;   // Server went away
+        }
+    }
+    return sizeof(message_t);
+}
+
+// Function to put one item in the kitchen, returns when it is ready, caller holds tcp_mutex
+static time_t cook_item(int item, time_t now) {
+    if (item < 1 || item > MENU_ITEMS) {
+        item = 0;
+    }
+    const item_model_t *model = &restaurant->item_models[item];
+    batch_t *batch = &batches[item];
+    if (batching && batch->start > now && batch->count < model->batch_size) {
+        batch->count++;     // Joins a batch that has not gone on yet, ready with it
+        return batch->ready;
+    }
+
+    int slot = 0;   // Slot that frees up first, the batch waits for it when the kitchen is full
+    for (int i = 1; i < KITCHEN_SLOTS; i++) {
+        if (kitchen_ready[i] < kitchen_ready[slot]) {
+            slot = i;
+        }
+    }
+    batch->start = now + (batching && model->batch_size > 1 ? BATCH_WINDOW * SECONDS_PER_MINUTE : 0);
+    if (kitchen_ready[slot] > batch->start) {
+        batch->start = kitchen_ready[slot];
+    }
+    batch->ready = batch->start + model->prep_minutes * SECONDS_PER_MINUTE;
+    batch->count = 1;
+    kitchen_ready[slot] = batch->ready;
+    batches_cooked++;
+    return batch->ready;
+}
+
+// Function to cook the items of an "ORDER: N N ..." line, returns when the last one is ready, caller holds tcp_mutex
+static time_t cook_order(const char *order, time_t now) {
+    time_t ready = now;
+    int offset = 0;
+    const char *items = strchr(order, ':');
+    items = items != NULL ? items + 1 : order;
+    int item, cooked = 0;
+    while (sscanf(items, "%d%n", &item, &offset) == 1) {
+        time_t item_ready = cook_item(item, now);
+        ready = item_ready > ready ? item_ready : ready;
+        items += offset;
+        cooked++;
+    }
+    if (cooked == 0) {
+        ready = cook_item(0, now);  // Order without item numbers, cooked on its own
+    }
+    return ready;
+}
+
+// Function to compare two waits for qsort
+static int compare_waits(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Function to run generated orders through the kitchen cooking each on its own and in batches, and compare them
+static void simulate_kitchen(int orders, int per_hour) {
+    int *waits = malloc(orders * sizeof(int));
+    if (waits == NULL) {
+        perror("malloc");
+        return;
+    }
+    printf("%d orders of one item at %d an hour, %d kitchen slots\n", orders, per_hour, KITCHEN_SLOTS);
+    for (int mode = 0; mode <= 1; mode++) {
+        batching = mode;
+        memset(kitchen_ready, 0, sizeof(kitchen_ready));
+        memset(batches, 0, sizeof(batches));
+        batches_cooked = 0;
+        srand(1);   // Both runs get the same orders
+        double arrival = 0;
+        time_t last_ready = 0;
+        for (int i = 0; i < orders; i++) {
+            arrival += 2.0 * 60 * SECONDS_PER_MINUTE / per_hour * rand() / RAND_MAX;
+            time_t now = (time_t)arrival;
+            time_t ready = cook_item(rand() % MENU_ITEMS + 1, now);
+            waits[i] = (int)(ready - now) / SECONDS_PER_MINUTE;
+            last_ready = ready > last_ready ? ready : last_ready;
+        }
+        qsort(waits, orders, sizeof(int), compare_waits);
+        double hours = (double)last_ready / SECONDS_PER_MINUTE / 60;
+        printf("%-10s %.1f orders an hour, %llu batches, wait p50 %d p95 %d minutes\n", mode ? "batched:" : "per order:",
+               hours > 0 ? orders / hours : 0, (unsigned long long)batches_cooked, waits[orders / 2], waits[(long long)orders * 95 / 100]);
+    }
+    free(waits);
+}
+
+static void handle_signal(int signal) {
+    if (signal == SIGINT) {
+        message_t leave_msg;
+        leave_msg.type = MSG_LEAVE;
+        strcpy(leave_msg.data, "LEAVE");
+
+        pthread_mutex_lock(&tcp_mutex);
+        ssize_t bytes_sent = send_message(tcp_socket, &leave_msg);
+        if (bytes_sent <= 0) {
+            perror("send");
+        }
+        pthread_mutex_unlock(&tcp_mutex);
+
+        close(tcp_socket);
+        printf("Disconnected from server\n");
+        exit(0);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef RESTAURANT_H
+#define RESTAURANT_H
+
+#include <sys/types.h>
+
+#include "protocol.h"
+
+// Code the restaurant programs share: the connection to the server, over TCP
+// or a shared-memory link with --uds, reconnecting with backoff when the
+// server goes away, registering when the server asks over multicast or says
+// MSG_BUSY, keep-alives, and the kitchen model that quotes estimated times
+// and reports free slots with MSG_CAPACITY. Each program describes itself
+// with a restaurant_t and hands it to restaurant_main().
+
+#define MENU_ITEMS 10               // Items of the regular menu, each with its own batch model
+
+typedef struct {
+    int batch_size;             // Orders of the item cooked together
+    int prep_minutes;           // Minutes a batch takes, however full it is
+} item_model_t;
+
+typedef struct {
+    const char *name;           // Name the menu starts with, sent with the setup of a shared-memory link
+    const char *display_name;   // Name in messages
+    int port;                   // Unicast TCP port for communication with server
+    const item_model_t *item_models;    // MENU_ITEMS + 1 models indexed by item number, 0 for items not on the regular menu
+    int (*send_menu)(int tcp_socket);   // Registers the restaurant with the server, returns -1 when a send failed
+    const char *options;        // Usage of the restaurant's own options, NULL when it has none
+    int (*parse_option)(int argc, char *argv[], int i);     // Takes the restaurant's own option at argv[i], returns the arguments taken or 0
+} restaurant_t;
+
+int restaurant_main(const restaurant_t *restaurant, int argc, char *argv[]);   // Parses the shared options and runs the restaurant
+ssize_t send_message(int tcp_socket, const message_t *msg);     // Sends a frame to the server, over the shared-memory link when there is one
+
+#endif
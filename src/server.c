@@ -5,111 +5,521 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#include "io_backend.h"
+#include "protocol.h"
+#include "session.h"
+#include "menu.h"
+#include "catalog.h"
+#include "admission.h"
+#include "codel.h"
+#include "ratelimit.h"
+#include "journal.h"
+#include "history.h"
+#include "analytics.h"
+#include "capture.h"
+#include "frame.h"
+#include "upgrade.h"
+#include "trace.h"
+#include "probes.h"
 
 #define CLIENT_PORT 8080        // Port for clients to connect
+#define ADMIN_PORT 8090         // Port for admin commands, local connections only
+#define GATEWAY_PORT 8081       // Port for gateways carrying the sessions of many users on one connection
 #define MULTICAST_GROUP "239.0.0.1" // Multicast group for restaurants to listen
 #define MULTICAST_PORT 5555     // Port for multicast communication
 #define MCDONALDS_PORT 5556     // TCP Port for McDonald's
 #define DOMINOS_PORT 5557       // TCP Port for Domino's
 #define TACO_BELL_PORT 5558     // TCP Port for Taco Bell
-#define BUFFER_SIZE 512        // Buffer size for messages
 #define TOKEN_TIMEOUT 180       // 3 minutes
 #define RESTAURANT_TIMEOUT 180  // 3 minutes
-#define MAX_CLIENTS 3           // Maximum number of clients that can connect
+#define RESUME_TIMEOUT 60       // Seconds a dropped client can resume its session
+#define FASTOPEN_QUEUE 16       // Pending TCP Fast Open requests on the client port
+#define MAX_CLIENTS 3           // Default maximum number of clients that can connect
 #define MAX_RESTAURANTS 3       // Maximum number of restaurants that can connect
+#define JOURNAL_PATH "orders.journal"   // Default order journal
+#define JOURNAL_BATCH 32        // Default largest group of orders committed with one fdatasync
+#define HISTORY_DIR "history"   // Default directory of the completed order history
+#define CART_MAX_ITEMS 32       // Items in one cart, their lines fit in a frame
+#define CART_WAITING -1         // Restaurant of a cart has not answered yet
+#define CART_FAILED -2          // Restaurant of a cart went away before answering
+#define ADMISSION_DEFAULT_WAIT 60   // Minutes an order without a max wait is given before it is late
+#define ORDER_WINDOW 8          // Orders without an estimated time a restaurant that does not report its capacity is sent
+#define ADMISSION_MAX_HELD 32   // Default orders a restaurant can have held before new ones are refused
+#define BUSY_RETRY_MS 5000      // Retry hint sent with orders refused for a full restaurant
+#define LOOP_DELAY_TARGET 5     // Default milliseconds events may wait for the event loop before new sessions are shed
+#define HOLD_DELAY_TARGET 5000  // Default milliseconds orders may stay held before new orders are shed
+#define CODEL_INTERVALS 20      // Interval of an overload controller in targets, CoDel's 100 ms for 5 ms
+#define ACCEPT_RATE 1000        // Default new client connections and gateway streams a second, as many again in a burst
+#define REGISTER_RATE 1         // Default restaurant registrations a second after a burst of one per restaurant
+#define ADDRESS_SLOTS 4096      // Client addresses the per-address rate limits follow at once, a power of two
+#define ADDRESS_PROBES 8        // Slots an address may land in, the least active one gives way when all are taken
+#define CONN_NO_SESSION UINT32_MAX  // Client turned away before it got a session, it may only resume one
+#define GATEWAY_BATCH 16        // Frames of a gateway read that its streams take turns over
+#define TRACE_SAMPLE 100        // Default orders per order trace written, the rest only carry their stamps
+#define RESTAURANT_SILENT 0     // Reasons of the restaurant_inactive probe: keep-alive expired,
+#define RESTAURANT_DISCONNECTED 1   // connection closed,
+#define RESTAURANT_LEFT 2       // or said goodbye
+#define UPGRADE_LISTENERS (MAX_RESTAURANTS + 5)    // Listening sockets a live upgrade passes on, in main's order
+
+typedef struct {
+    int restaurant_socket;      // Socket for restaurant connection
+    const char *name;           // Interned restaurant name
+    struct sockaddr_in address; // Address structure for restaurant
+    menu_t *menu;               // Shared restaurant menu
+    frame_t *menu_frame;        // Menu encoded once, sent to every client that picks the restaurant
+    frame_t *update_frame;      // Menu with its version, the answer to direct orders against an older one
+    time_t last_keep_alive;     // Last keep-alive time for the restaurant
+    int active;                 // Active status of the restaurant
+} restaurant_info_t;
+
+typedef enum {
+    CONN_CLIENT,
+    CONN_RESTAURANT,
+    CONN_ADMIN,
+    CONN_GATEWAY
+} conn_kind_t;
 
 typedef enum {
-    ERROR,
-    MSG_KEEP_ALIVE,
-    MSG_REQUEST_MENU,
-    MSG_MENU,
-    MSG_ORDER,
-    MSG_ESTIMATED_TIME,
-    MSG_RESTAURANT_OPTIONS,
-    REST_UNAVALIABLE,
-    MSG_LEAVE,
-    MSG_TOKEN
-} message_type_t;
+    RATE_MENU,                  // Frames answered with a menu or a page of one
+    RATE_SEARCH,                // Searches of a menu or of the catalog
+    RATE_ORDER                  // Orders and carts, each may go on to a restaurant
+} rate_class_t;                 // Classes of client frames with a rate limit, SESSION_RATE_CLASSES of them
 
 typedef struct {
-    message_type_t type;
-    char data[BUFFER_SIZE];
-    char client_token[BUFFER_SIZE];
-} message_t;
+    uint8_t kind;               // conn_kind_t of the connection
+    uint8_t closing;            // Connection was shut down, ignore further frames
+    uint8_t subscribed;         // Client gets availability changes pushed
+    uint8_t reserved;
+    uint16_t rx_len;            // Bytes of the current frame received so far
+    uint32_t id;                // Session slot for clients, restaurant id for restaurants
+    uint32_t peer;              // IPv4 address of a client connection in network order, 0 when unknown
+    message_t *rx;              // Partial frame, only allocated while one is pending
+} conn_t;                       // Structure to store per-connection state of the event loop
+
+typedef struct parked_eta {
+    struct parked_eta *next;
+    uint32_t slot;              // Session the estimated time belongs to
+    char data[BUFFER_SIZE];     // Estimated time from the restaurant
+} parked_eta_t;                 // Estimated time that arrived while its client was disconnected
+
+typedef struct in_flight {
+    struct in_flight *next;
+    session_token_t token;      // Client that placed the order
+    uint8_t restaurant;         // Restaurant id the order went to
+    uint16_t item;              // Menu item number
+    uint32_t price_cents;       // Item price from the menu at order time
+    struct timespec started;    // When the order was forwarded
+} in_flight_t;                  // Order waiting for its estimated time, recorded in the history when it arrives
+
+typedef struct cart {
+    struct cart *next;
+    uint32_t slot;              // Session that ordered
+    int waiting;                // Restaurants that have not answered yet
+    int minutes[MAX_RESTAURANTS];   // Estimated time per restaurant id minus one, or CART_WAITING or CART_FAILED
+    int items[MAX_RESTAURANTS];     // Items ordered from each restaurant, 0 when none
+} cart_t;                       // Order split across restaurants, answered once every restaurant has
+
+typedef struct recovered_order {
+    struct recovered_order *next;
+    uint8_t restaurant;         // Restaurant id the order goes to
+    session_token_t token;      // Client that placed the order
+    uint64_t deadline;          // When the client wanted it ready, in milliseconds since the epoch
+    char data[BUFFER_SIZE];     // Order text
+} recovered_order_t;            // Order replayed from the journal, forwarded again when its restaurant registers
 
 typedef struct {
-    int client_socket;          // Socket for client connection
-    char token[BUFFER_SIZE];    // Token for client identification
-    time_t last_keep_alive;     // Last keep-alive time for the client
-    pthread_t thread_id;        // Thread ID for client handling
-} client_info_t;                // Structure to store client information
+    int port;                   // TCP port the restaurant connects to
+    const char *name;           // Interned restaurant name
+    int listener;               // Listening socket
+} restaurant_port_t;
 
 typedef struct {
-    int restaurant_socket;      // Socket for restaurant connection
-    char name[BUFFER_SIZE];     // Restaurant name
-    struct sockaddr_in address; // Address structure for restaurant
-    char menu[BUFFER_SIZE];     // Restaurant menu
-    time_t last_keep_alive;     // Last keep-alive time for the restaurant
-    int active;                 // Active status of the restaurant
-} restaurant_info_t;
+    char *text;                 // Parts received so far, NULL when no menu is arriving
+    size_t len;
+} menu_upload_t;                // Menu too large for one frame, sent as MSG_MENU_PART frames and a closing MSG_MENU
+
+typedef struct {
+    admission_queue_t queue;    // Durable orders waiting for a credit
+    int restaurant_socket;      // Connection orders are released to, 0 while the restaurant is away
+    int32_t credits;            // Orders that may still be sent, each release spends one
+    uint32_t released;          // Orders sent on this connection
+    uint32_t admitting;         // Orders accepted on the event loop and not durable yet, they count as held
+    uint8_t reports;            // Restaurant grants credits with capacity reports, otherwise each estimated time returns one
+    uint64_t waited;            // Orders that had to wait for a credit
+    uint64_t late;              // Orders released after their deadline had passed
+    uint64_t dropped;           // Orders whose restaurant left before they were released
+    uint64_t refused;           // Orders refused because too many were held
+    codel_t hold;               // Time orders stay held, sheds new orders while it stands above target
+} admission_t;                  // Orders of one restaurant between the journal and its kitchen
+
+typedef struct {
+    int32_t fd;                 // Number of the socket in the old server, sessions and restaurants refer to it by it
+    uint8_t kind;
+    uint8_t subscribed;
+    uint8_t linked;             // The link's memfd and the restaurant's eventfd follow the socket
+    uint8_t reserved;
+    uint32_t id;
+    uint32_t rx_len;            // Bytes of a partial frame following the record
+} upgrade_conn_t;               // Connection passed to a new server in a live upgrade
+
+typedef struct {
+    int32_t socket;             // Old number of the restaurant's socket, 0 when the slot is free
+    uint8_t id;                 // Restaurant id
+    uint8_t active;
+    uint8_t reserved[2];
+    int64_t last_keep_alive;
+    uint32_t version;           // Version clients know the menu by
+    uint32_t menu_len;          // Bytes of menu text following the record
+} upgrade_restaurant_t;
+
+typedef struct {
+    int32_t socket;             // Old number of the restaurant's socket, 0 while it is away
+    int32_t credits;
+    uint32_t released;
+    uint32_t held;              // Orders following the record, earliest deadline first
+    uint8_t reports;
+    uint8_t reserved[7];
+    uint64_t waited;
+    uint64_t late;
+    uint64_t dropped;
+    uint64_t refused;
+} upgrade_admission_t;
+
+typedef struct {
+    uint32_t address;           // IPv4 address in network order, 0 for a free slot
+    uint32_t rate_due[SESSION_RATE_CLASSES];   // Same as a session's, for every session from the address together
+} address_limit_t;              // Rate limits of one client address
 
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex for clients array
 pthread_mutex_t restaurants_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for restaurants array
+pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for the subscriber list, taken before restaurants_mutex
+pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;   // Mutex for the admission queues, taken after any other
 
-client_info_t clients[MAX_CLIENTS]; // Array to store client information
 restaurant_info_t restaurants[MAX_RESTAURANTS]; // Array to store restaurant information
-
-void *handle_client(void *arg);
+menu_t *last_menus[MAX_RESTAURANTS];    // Menu each restaurant id had when it left, its version holds when the same text comes back
+
+restaurant_port_t restaurant_ports[MAX_RESTAURANTS] = {    // Restaurant ids are the index plus one
+    {MCDONALDS_PORT, "McDonalds", -1},
+    {DOMINOS_PORT, "Dominos", -1},
+    {TACO_BELL_PORT, "Taco Bell", -1},
+};
+
+menu_upload_t menu_uploads[MAX_RESTAURANTS];    // Indexed by restaurant id minus one, touched by the event loop only
+admission_t admissions[MAX_RESTAURANTS];        // Indexed by restaurant id minus one, guarded by admission_mutex
+uint32_t max_held = ADMISSION_MAX_HELD;         // Orders a restaurant can have held before new ones are refused
+codel_t loop_delay;         // Time events wait for the event loop, touched by the event loop only
+uint64_t sessions_shed = 0; // New clients turned away while the event loop was overloaded or the table full
+ratelimit_t accept_limit;   // New sessions, so clients coming back after an outage arrive spread out, event loop only
+ratelimit_t register_limit; // Restaurant registrations, touched by the event loop only
+const char *rate_class_names[SESSION_RATE_CLASSES] = {"menu", "search", "order"};
+ratelimit_rule_t session_rules[SESSION_RATE_CLASSES];  // Rate limits of each session, by rate_class_t
+ratelimit_rule_t address_rules[SESSION_RATE_CLASSES];  // Rate limits of each client address, gateway streams are exempt
+address_limit_t *address_limits = NULL;    // ADDRESS_SLOTS open-addressed, touched by the event loop only
+uint64_t requests_throttled = 0;           // Client frames over a rate limit
+FILE *trace_file = NULL;    // Sampled order traces, NULL unless --trace is given
+uint32_t trace_sample = TRACE_SAMPLE;   // One order in this many is written, 0 for only those clients ask for
+uint64_t trace_next = 0;    // Trace id before the next order that came without one, event loop only
+int *subscribers = NULL;    // Client sockets subscribed to availability changes
+int subscriber_count = 0;
+int subscriber_capacity = 0;
+frame_t *options_frame = NULL;      // Restaurant options, the same frame for every client
+frame_t *unavailable_frame = NULL;  // Answer to picking a restaurant that is not open
+
+int welcome_socket = -1;    // Socket for clients to connect
+int admin_socket = -1;      // Socket for admin commands
+int gateway_socket = -1;    // Socket for gateways to connect
+int local_socket = -1;      // Unix domain socket for restaurants on the same host, -1 unless --uds is given
+int upgrade_socket = -1;    // Unix domain socket a new server connects to for a live upgrade, -1 unless --upgrade is given
+int upgrade_peer = -1;      // New server taking over, or the old one while this server takes over
+conn_t **conns = NULL;      // Connection state indexed by fd, touched by the event loop only
+int conns_size = 0;
+parked_eta_t *parked_etas = NULL;   // Estimated times waiting for a resume, guarded by clients_mutex
+in_flight_t *in_flight = NULL;      // Orders waiting for an estimated time, guarded by clients_mutex
+cart_t *carts = NULL;               // Carts waiting for their estimated times, guarded by clients_mutex
+recovered_order_t *recovered_orders = NULL;     // Touched by main before the loop starts and by the loop
+
+void handle_client(client_info_t *client, message_t *msg);
+void resume_session(int fd, conn_t *conn, message_t *msg);
+void release_session(client_info_t *client);
+void handle_restaurant(int restaurant_socket, const char *name, message_t *msg);
+void handle_admin(int admin_fd, message_t *msg);
+void handle_direct_order(client_info_t *client, message_t *msg);
+void handle_menu_query(client_info_t *client, message_t *msg);
+int append_menu_part(int id, const char *part);
+void discard_menu_upload(int id);
+void clear_restaurant(restaurant_info_t *restaurant);
+void encode_menu(restaurant_info_t *restaurant, int id, menu_t *menu);
+int restaurant_id(const char *name);
+void subscribe_client(int fd, conn_t *conn);
+void unsubscribe_client(int fd);
+void publish_availability(const char *name);
+void update_catalog(const char *name);
+void handle_catalog_search(client_info_t *client, message_t *msg);
+void handle_cart(client_info_t *client, message_t *msg);
+cart_t *find_cart(uint32_t slot, int unlink);
+void finish_cart_part(client_info_t *client, cart_t *cart, int id, int minutes, const trace_context_t *trace);
+void deliver_estimated_time(client_info_t *client, const char *estimated_time, const trace_context_t *trace);
+void fail_order(const session_token_t *token, int id);
+int quoted_minutes(const char *estimated_time);
+int availability_line(int id, char *buf, size_t size);
+void dispatch(int fd, conn_t *conn, message_t *msg);
 void *token_manager(void *arg);
 void *menu_update_manager(void *arg);
 void *active_restaurants_manager(void *arg);
-char *generate_token();
 void send_restaurant_options(client_info_t *client);
 void send_menu_to_client(client_info_t *client, const char *restaurant);
-void send_order_to_restaurant(client_info_t *client, const char *order, const char *restaurant);
-void *restaurant_tcp_handler_mcdonalds(void *arg);
-void *restaurant_tcp_handler_dominos(void *arg);
-void *restaurant_tcp_handler_taco_bell(void *arg);
-void send_estimated_time_to_client(int client_socket, const char *estimated_time);
-
-int main() {
-    int mcdonalds_socket;
-    int dominos_socket;
-    int taco_bell_socket;
-    int welcome_socket; // Socket for clients to connect
-    struct sockaddr_in address; // Address structure for server
-    int addrlen = sizeof(address);  // Length of address structure
-
-    memset(clients, 0, sizeof(clients));    // Initialize clients array to 0
-    memset(restaurants, 0, sizeof(restaurants)); // Initialize restaurants array to 0
+void send_token_to_client(client_info_t *client);
+void send_order_to_restaurant(client_info_t *client, const char *order, const char *restaurant, int wait_minutes, const trace_context_t *trace);
+void receive_trace(message_t *msg);
+int order_durable(const journal_header_t *header, int fd, frame_t *frame, int durable);
+uint64_t order_deadline(uint32_t placed, uint8_t wait_minutes);
+void admit_order(int id, uint64_t deadline, frame_t *frame);
+void release_orders(admission_t *admission);
+void open_admission(int id, int restaurant_socket);
+void close_admission(int id, int restaurant_socket);
+void set_capacity(int id, int restaurant_socket, int free_slots, uint32_t received);
+void return_credit(int id, int restaurant_socket);
+int admission_busy(int id);
+void refuse_order(client_info_t *client, int id, int retry_ms);
+int refuse_pending_order(client_info_t *client);
+uint64_t monotonic_us(void);
+void send_busy(int fd, const session_token_t *token, int retry_ms, const char *reason);
+size_t flow_report(char *buf, size_t size);
+void send_estimated_time_to_client(client_info_t *client, const char *estimated_time, const trace_context_t *trace);
+void send_resume_to_client(client_info_t *client, const char *state);
+void close_connection(int fd);
+void close_client(client_info_t *client);
+client_info_t *new_session(int fd);
+void handle_gateway(int fd, conn_t *conn, message_t *msg);
+void dispatch_streams(int fd, conn_t *conn, message_t *batch, int count);
+void open_stream(int fd);
+void end_stream(client_info_t *client);
+void send_leave(int fd, const session_token_t *token);
+int send_client_frame(client_info_t *client, frame_t *frame);
+int on_accept(int listener, int fd);
+int accept_connection(int listener, int fd);
+int shed_connection(int fd, int retry_ms, const char *reason);
+int accept_retry_ms(void);
+int parse_rate(const char *arg, uint32_t rates[SESSION_RATE_CLASSES][2]);
+int rate_class(const client_info_t *client, int type);
+address_limit_t *address_limit(uint32_t address, uint32_t now);
+int throttle_client(client_info_t *client, int type);
+int accept_local_restaurant(int fd);
+int send_frame(int fd, frame_t *frame);
+void on_data(int fd, const char *data, size_t len);
+void on_close(int fd);
+void handle_signal(int signal);
+void recover_order(const journal_header_t *header, const char *data);
+void forward_recovered_orders(const char *name);
+void record_completed_order(const session_token_t *token, int id, const char *estimated_time);
+int hand_off(int peer, const char *journal_path, uint32_t journal_batch, const char *history_dir);
+void resume_serving(void);
+int take_over(upgrade_state_t *state, const int *fds, int fd_count, int *listeners);
+void put_list(upgrade_state_t *state, void *head, size_t size);
+void *get_list(upgrade_state_t *state, size_t size);
+
+int main(int argc, char *argv[]) {
+    io_backend_t backend = IO_BACKEND_EPOLL;    // I/O backend, epoll unless io_uring is requested
+    uint32_t max_clients = MAX_CLIENTS;         // Size of the session table
+    const char *journal_path = JOURNAL_PATH;    // Order journal replayed at startup
+    uint32_t journal_batch = JOURNAL_BATCH;     // Largest group commit
+    const char *history_dir = HISTORY_DIR;      // Completed orders for analytics
+    const char *capture_path = NULL;            // Traffic capture for replay, off by default
+    int fifo_admission = 0;                     // Release held orders in arrival order instead of by deadline
+    uint64_t loop_target = LOOP_DELAY_TARGET;   // Overload targets in milliseconds
+    uint32_t accept_rate = ACCEPT_RATE;         // Rate limits a second, 0 for none
+    uint32_t register_rate = REGISTER_RATE;
+    uint32_t session_rates[SESSION_RATE_CLASSES][2] = {{5, 10}, {5, 10}, {1, 5}};     // Frames a second and burst, by class
+    uint32_t address_rates[SESSION_RATE_CLASSES][2] = {{50, 100}, {50, 100}, {10, 50}};
+    uint64_t hold_target = HOLD_DELAY_TARGET;
+    const char *uds_path = NULL;                // Shared-memory links for local restaurants, off by default
+    const char *upgrade_path = NULL;            // Live upgrades, off by default
+    const char *trace_path = NULL;              // Order traces, off by default
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uring") == 0 || strcmp(argv[i], "io_uring") == 0) {
+                backend = IO_BACKEND_URING;
+            } else if (strcmp(argv[i], "epoll") == 0) {
+                backend = IO_BACKEND_EPOLL;
+            } else {
+                fprintf(stderr, "Unknown I/O backend: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            max_clients = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--journal-batch") == 0 && i + 1 < argc) {
+            journal_batch = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            history_dir = argv[++i];
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-held") == 0 && i + 1 < argc) {
+            max_held = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--loop-target") == 0 && i + 1 < argc) {
+            loop_target = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--hold-target") == 0 && i + 1 < argc) {
+            hold_target = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc) {
+            accept_rate = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--register-rate") == 0 && i + 1 < argc) {
+            register_rate = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            if (parse_rate(argv[++i], session_rates) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--address-rate") == 0 && i + 1 < argc) {
+            if (parse_rate(argv[++i], address_rates) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--uds") == 0 && i + 1 < argc) {
+            uds_path = argv[++i];
+        } else if (strcmp(argv[i], "--upgrade") == 0 && i + 1 < argc) {
+            upgrade_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            trace_sample = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--admission") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fifo") == 0) {
+                fifo_admission = 1;
+            } else if (strcmp(argv[i], "edf") != 0) {
+                fprintf(stderr, "Unknown admission order: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--io epoll|uring] [--max-clients N] [--journal PATH] [--journal-batch N] [--history DIR] [--capture FILE] [--admission edf|fifo] [--max-held N] [--loop-target MS] [--hold-target MS] [--accept-rate N] [--register-rate N] [--rate CLASS=N[/BURST]] [--address-rate CLASS=N[/BURST]] [--uds PATH] [--upgrade PATH] [--trace FILE] [--trace-sample N]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if ((welcome_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {  // Create socket for clients to connect
-        perror("socket failed");    // Print error message if socket creation fails
+    if (max_clients == 0 || session_table_init(max_clients) < 0) {    // Initialize the client sessions
+        exit(EXIT_FAILURE);
+    }
+    upgrade_state_t state;  // Handed over by a running server, which has closed its journal by then
+    int *inherited = NULL;
+    int inherited_count = 0;
+    if (upgrade_path != NULL && (upgrade_peer = upgrade_connect(upgrade_path)) >= 0 &&
+        upgrade_recv(upgrade_peer, &state, &inherited, &inherited_count) < 0) {
+        exit(EXIT_FAILURE);     // The running server sees the socket close and keeps its clients' sessions
+    }
+    uint8_t key[JOURNAL_KEY_SIZE];     // Session MAC key, the journal keeps it across restarts
+    session_get_key(key);
+    codel_init(&loop_delay, loop_target * 1000, loop_target * 1000 * CODEL_INTERVALS);
+    ratelimit_init(&accept_limit, accept_rate, accept_rate, monotonic_us());
+    ratelimit_init(&register_limit, register_rate, MAX_RESTAURANTS, monotonic_us());
+    int address_limited = 0;
+    for (int i = 0; i < SESSION_RATE_CLASSES; i++) {
+        ratelimit_rule_init(&session_rules[i], session_rates[i][0], session_rates[i][1]);
+        ratelimit_rule_init(&address_rules[i], address_rates[i][0], address_rates[i][1]);
+        address_limited |= address_rates[i][0] != 0;
+    }
+    if (address_limited && (address_limits = calloc(ADDRESS_SLOTS, sizeof(address_limit_t))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        admissions[i].queue.fifo = fifo_admission;
+        codel_init(&admissions[i].hold, hold_target * 1000, hold_target * 1000 * CODEL_INTERVALS);
+    }
+    if (journal_open(journal_path, journal_batch, key, recover_order, order_durable) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    session_set_key(key);
+    if (history_open(history_dir) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (capture_path != NULL && capture_open(capture_path) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (trace_path != NULL && (trace_file = trace_open(trace_path)) == NULL) {
         exit(EXIT_FAILURE);
     }
+    trace_next = trace_now();   // Ids of this run start past those of any earlier one
+    memset(restaurants, 0, sizeof(restaurants)); // Initialize restaurants array to 0
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        restaurant_ports[i].name = intern_name(restaurant_ports[i].name);
+    }
 
-    address.sin_family = AF_INET;   // Set address family to IPv4
-    address.sin_addr.s_addr = INADDR_ANY;   // Set address to accept connections from any IP
-    address.sin_port = htons(CLIENT_PORT);  // Set port for clients to connect
+    int listeners[UPGRADE_LISTENERS];   // Client port, the restaurant ports, the admin and gateway ports, the local and upgrade sockets
+    int listener_count = 0;
+    if (upgrade_peer >= 0) {    // Everything the running server had, instead of what the journal replayed
+        if ((listener_count = take_over(&state, inherited, inherited_count, listeners)) < 0) {
+            fprintf(stderr, "Could not take over the running server's state\n");
+            exit(EXIT_FAILURE);
+        }
+        upgrade_free(&state);
+        free(inherited);
+    } else {
+        for (recovered_order_t *order = recovered_orders; order != NULL; order = order->next) {
+            client_info_t *client = session_restore(&order->token);     // Client can resume and wait for its estimated time
+            if (client != NULL) {
+                client->flags |= SESSION_ORDER_PENDING;
+                client->last_keep_alive = time(NULL);
+            }
+        }
 
-    if (bind(welcome_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {   // Bind socket to address
-        perror("bind failed");  // Print error message if bind fails
-        close(welcome_socket);  // Close welcome socket
+        if ((welcome_socket = io_listen(CLIENT_PORT, 3)) < 0) {    // Listen for incoming client connections
+            exit(EXIT_FAILURE);
+        }
+        listeners[0] = welcome_socket;
+        int fastopen_queue = FASTOPEN_QUEUE;    // Let resuming clients put their first frame in the SYN
+        if (setsockopt(welcome_socket, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof(fastopen_queue)) < 0) {
+            perror("TCP_FASTOPEN");     // Clients still resume, just without saving the handshake
+        }
+        for (int i = 0; i < MAX_RESTAURANTS; i++) {
+            if ((restaurant_ports[i].listener = io_listen(restaurant_ports[i].port, 1)) < 0) {
+                exit(EXIT_FAILURE);
+            }
+            listeners[i + 1] = restaurant_ports[i].listener;
+            printf("Server listening for %s TCP connections on port %d\n", restaurant_ports[i].name, restaurant_ports[i].port);
+        }
+        if ((admin_socket = io_listen(ADMIN_PORT, 1)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        listeners[MAX_RESTAURANTS + 1] = admin_socket;
+        if ((gateway_socket = io_listen(GATEWAY_PORT, 16)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        listeners[MAX_RESTAURANTS + 2] = gateway_socket;
+        listener_count = MAX_RESTAURANTS + 3;
+    }
+    if (uds_path != NULL && local_socket < 0) {
+        if ((local_socket = io_listen_unix(uds_path, MAX_RESTAURANTS)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        listeners[listener_count++] = local_socket;
+        printf("Server listening for local restaurants on %s\n", uds_path);
+    }
+    if (upgrade_path != NULL && upgrade_socket < 0) {
+        if ((upgrade_socket = io_listen_unix(upgrade_path, 1)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        listeners[listener_count++] = upgrade_socket;
+        printf("Server accepting live upgrades on %s\n", upgrade_path);
+    }
+    if (analytics_start() < 0) {
         exit(EXIT_FAILURE);
     }
-
-    if (listen(welcome_socket, 3) < 0) {    // Listen for incoming connections
-        perror("listen failed");    // Print error message if listen fails
-        close(welcome_socket);  // Close welcome socket
+    // Frames that never change are encoded once and live as long as the server
+    options_frame = frame_text(MSG_RESTAURANT_OPTIONS, NULL, "Choose a restaurant:\n1. McDonalds\n2. Dominos\n3. Taco Bell\n");
+    unavailable_frame = frame_text(REST_UNAVALIABLE, NULL, "not available");
+    if (options_frame == NULL || unavailable_frame == NULL) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening for clients on port %d\n", CLIENT_PORT);   // For debug
-
     pthread_t manager_thread, menu_thread, active_thread;   // Threads for token manager, menu updater, and active restaurants manager
     pthread_create(&manager_thread, NULL, token_manager, NULL);   // Create token manager thread
     pthread_detach(manager_thread); // Detach token manager thread to run in the background
@@ -120,206 +530,1612 @@ int main() {
     pthread_create(&active_thread, NULL, active_restaurants_manager, NULL);   // Create active restaurants manager thread
     pthread_detach(active_thread); // Detach active restaurants manager thread to run in the background
 
-    // Start threads to handle TCP communication with restaurants
-    pthread_t tcp_thread_mcdonalds, tcp_thread_dominos, tcp_thread_taco_bell;
-    pthread_create(&tcp_thread_mcdonalds, NULL, restaurant_tcp_handler_mcdonalds, &mcdonalds_socket);
-    pthread_create(&tcp_thread_dominos, NULL, restaurant_tcp_handler_dominos, &dominos_socket);
-    pthread_create(&tcp_thread_taco_bell, NULL, restaurant_tcp_handler_taco_bell, &taco_bell_socket);
-    pthread_detach(tcp_thread_mcdonalds);
-    pthread_detach(tcp_thread_dominos);
-    pthread_detach(tcp_thread_taco_bell);
-
-    while (1) { // Loop to accept incoming connections
-        int client_socket;  // Socket for client connection
-        if ((client_socket = accept(welcome_socket, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {  // Accept incoming connection from client
-            perror("accept failed");
+    io_callbacks_t callbacks = {on_accept, on_data, on_close};
+    backend = io_init(backend, listeners, listener_count, &callbacks);
+    if (upgrade_peer >= 0) {
+        for (int fd = 0; fd < conns_size; fd++) {
+            if (conns[fd] != NULL && io_adopt(fd) < 0) {
+                perror("adopt connection");
+            }
+        }
+        io_poll_links();    // Frames restaurants left in their rings during the handover
+        char ack = 1;   // The old server exits once it reads this
+        if (send(upgrade_peer, &ack, 1, MSG_NOSIGNAL) != 1) {
+            perror("upgrade ack");
+        }
+        close(upgrade_peer);
+        upgrade_peer = -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Server listening for clients on port %d (%s backend)\n", CLIENT_PORT, io_backend_name(backend));   // For debug
+    fflush(stdout);
+
+    io_run();   // Handle client and restaurant sockets until we are told to stop
+    while (upgrade_peer >= 0) {     // Stopped for a new server, which keeps the sockets and the paths
+        int ret = hand_off(upgrade_peer, journal_path, journal_batch, history_dir);
+        if (ret <= 0) {
+            printf(ret == 0 ? "Handed over to the new server\n" : "The new server did not take over\n");
+            exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        printf("The new server got nothing, serving on\n");
+        close(upgrade_peer);
+        upgrade_peer = -1;
+        io_run();
+    }
+
+    io_stats_t stats;
+    io_get_stats(&stats);
+    fprintf(stderr, "io-stats backend=%s syscalls=%llu bytes_in=%llu bytes_out=%llu allocs=%llu copied=%llu\n", io_backend_name(backend),
+            (unsigned long long)stats.syscalls, (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out,
+            (unsigned long long)stats.allocs, (unsigned long long)stats.copied);
+    uint64_t frames_built, frame_slabs;
+    frame_stats(&frames_built, &frame_slabs);
+    fprintf(stderr, "frame-stats built=%llu slabs=%llu\n", (unsigned long long)frames_built, (unsigned long long)frame_slabs);
+
+    uint64_t records, syncs;
+    journal_close();    // Commit what is still queued
+    journal_stats(&records, &syncs);
+    fprintf(stderr, "journal records=%llu syncs=%llu\n", (unsigned long long)records, (unsigned long long)syncs);
+    uint64_t waited = 0, late = 0, dropped = 0, refused = 0, shed = 0;
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        waited += admissions[i].waited;
+        late += admissions[i].late;
+        dropped += admissions[i].dropped;
+        refused += admissions[i].refused;
+        shed += admissions[i].hold.shed;
+    }
+    fprintf(stderr, "admission waited=%llu late=%llu dropped=%llu refused=%llu\n", (unsigned long long)waited,
+            (unsigned long long)late, (unsigned long long)dropped, (unsigned long long)refused);
+    fprintf(stderr, "shed sessions=%llu orders=%llu\n", (unsigned long long)sessions_shed,
+            (unsigned long long)(shed + loop_delay.shed));
+    history_close();
+    capture_finish();
+
+    close(welcome_socket);  // Close welcome socket
+    if (uds_path != NULL) {
+        unlink(uds_path);
+    }
+    if (upgrade_path != NULL) {
+        unlink(upgrade_path);
+    }
+    return 0;
+}
+
+// Function to stop the event loop on SIGINT/SIGTERM
+void handle_signal(int signal) {
+    if (signal == SIGINT || signal == SIGTERM) {
+        io_stop();
+    }
+}
+
+// Function to keep an order replayed from the journal until its restaurant registers
+void recover_order(const journal_header_t *header, const char *data) {
+    recovered_order_t *order = calloc(1, sizeof(recovered_order_t));
+    if (order == NULL || header->restaurant < 1 || header->restaurant > MAX_RESTAURANTS) {
+        free(order);
+        return;
+    }
+    order->restaurant = header->restaurant;
+    order->token = header->token;
+    order->deadline = order_deadline(header->time, header->wait_minutes);  // Keeps its place among new orders
+    memcpy(order->data, data, header->len < BUFFER_SIZE ? header->len : BUFFER_SIZE - 1);
+    recovered_order_t **tail = &recovered_orders;   // Keep journal order, only runs at startup
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = order;
+}
+
+// Function to send a restaurant the orders it had not answered before a restart
+void forward_recovered_orders(const char *name) {
+    recovered_order_t **link = &recovered_orders;
+    while (*link != NULL) {
+        recovered_order_t *order = *link;
+        if (restaurant_ports[order->restaurant - 1].name != name) {
+            link = &order->next;
             continue;
         }
+        frame_t *frame = frame_text(MSG_ORDER, &order->token, order->data);
+        if (frame == NULL) {
+            return;     // Stays recovered, the restaurant gets it when it registers again
+        }
+        admit_order(order->restaurant, order->deadline, frame);    // Queued with the new orders by deadline
+        frame_unref(frame);
+        printf("Forwarded recovered order to %s\n", name);
+        *link = order->next;
+        free(order);
+    }
+}
 
-        pthread_mutex_lock(&clients_mutex); // Lock clients array to prevent from multiple threads accessing it simultaneously
-        int i;  // Loop variable
-        for (i = 0; i < MAX_CLIENTS; i++) { // Loop through clients array to find empty slot
-            if (clients[i].client_socket == 0) {    // Check if client slot is empty
-                clients[i].client_socket = client_socket;   // Assign client socket to client slot
-                strcpy(clients[i].token, generate_token()); // Generate token for client
-                message_t msg;
-                memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-                msg.type = MSG_TOKEN;
-                strcpy(msg.data, clients[i].token);
-                ssize_t bytes_sent = send(clients[i].client_socket, &msg, sizeof(message_t), 0);
-                if (bytes_sent <= 0) {
-                    perror("send");
-                    close(clients[i].client_socket);
-                    pthread_exit(NULL);
+// Function to find the state of a connection
+conn_t *conn_get(int fd) {
+    if (fd < 0 || fd >= conns_size) {
+        return NULL;
+    }
+    return conns[fd];
+}
+
+// Function to create the state of a new connection
+conn_t *conn_new(int fd, conn_kind_t kind) {
+    if (fd >= conns_size) {
+        int size = conns_size ? conns_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        conn_t **grown = realloc(conns, size * sizeof(conn_t *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + conns_size, 0, (size - conns_size) * sizeof(conn_t *));
+        conns = grown;
+        conns_size = size;
+    }
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (conn != NULL) {
+        conn->kind = kind;
+        conns[fd] = conn;
+    }
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (conn != NULL && kind == CONN_CLIENT && getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0 &&
+        peer.sin_family == AF_INET) {
+        conn->peer = peer.sin_addr.s_addr;  // Once per connection, the rate limits look it up on every frame
+    }
+    return conn;
+}
+
+// Function to register a newly accepted connection with the capture and the handlers
+int on_accept(int listener, int fd) {
+    capture_conn(fd);   // Before the token goes out
+    if (accept_connection(listener, fd) < 0) {
+        capture_close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to register a newly accepted client or restaurant connection
+int accept_connection(int listener, int fd) {
+    if (listener == admin_socket) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) < 0 || peer.sin_family != AF_INET ||
+            (ntohl(peer.sin_addr.s_addr) >> 24) != 127) {
+            printf("Rejecting admin connection from outside the host\n");
+            return -1;
+        }
+        return conn_new(fd, CONN_ADMIN) != NULL ? 0 : -1;
+    }
+    if (listener == upgrade_socket) {   // A new server wants to take over, the loop stops and hands everything to it
+        if (upgrade_peer < 0 && (upgrade_peer = fcntl(fd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+            io_stop();
+        }
+        return -1;
+    }
+    if (listener == local_socket) {     // Restaurant on the same host, its frames go over shared memory
+        return accept_local_restaurant(fd);
+    }
+    if (listener == gateway_socket) {   // Sessions are opened later, one per user of the gateway
+        int one = 1;    // Answers to many streams go out back to back, the last one must not wait for an ACK
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        printf("Gateway connected on socket %d\n", fd);
+        return conn_new(fd, CONN_GATEWAY) != NULL ? 0 : -1;
+    }
+    if (listener != welcome_socket) {   // One of the restaurant ports
+        for (int i = 0; i < MAX_RESTAURANTS; i++) {
+            if (restaurant_ports[i].listener == listener) {
+                conn_t *conn = conn_new(fd, CONN_RESTAURANT);
+                if (conn == NULL) {
+                    return -1;
                 }
-                clients[i].last_keep_alive = time(NULL);    // Set last keep-alive time to current time
-                break;
+                conn->id = i + 1;
+                printf("%s connected to TCP\n", restaurant_ports[i].name);
+                return 0;
             }
         }
-        pthread_mutex_unlock(&clients_mutex);   // Unlock clients array
+        return -1;
+    }
+
+    codel_sample(&loop_delay, io_loop_delay(), monotonic_us());
+    if (codel_overloaded(&loop_delay)) {    // Sessions already going come first, new ones try again shortly
+        return shed_connection(fd, (int)(loop_delay.interval / 1000), "Server is busy");
+    }
+    if (!ratelimit_take(&accept_limit, monotonic_us())) {   // Clients coming back after an outage, let them in spread out
+        return shed_connection(fd, accept_retry_ms(), "Too many new connections");
+    }
+
+    pthread_mutex_lock(&clients_mutex); // Lock clients array to prevent from multiple threads accessing it simultaneously
+    client_info_t *client = new_session(fd);
+    if (client == NULL) { // Check if maximum client limit is reached
+        pthread_mutex_unlock(&clients_mutex);
+        printf("Maximum client limit reached. Rejecting new connection.\n");    // Print message if maximum client limit is reached
+        return shed_connection(fd, BUSY_RETRY_MS, "Server is full");   // It can still resume a session it has
+    }
+
+    conn_t *conn = conn_new(fd, CONN_CLIENT);
+    if (conn == NULL) {
+        session_free(client);
+        pthread_mutex_unlock(&clients_mutex);
+        return -1;
+    }
+    conn->id = session_index(client);
+    client->last_keep_alive = time(NULL);    // Set last keep-alive time to current time
+    send_token_to_client(client);
+    PROBE2(session_accept, session_probe_id(&client->token), fd);
+    pthread_mutex_unlock(&clients_mutex);   // Unlock clients array
+    return 0;
+}
 
-        if (i == MAX_CLIENTS) { // Check if maximum client limit is reached
-            printf("Maximum client limit reached. Rejecting new connection.\n");    // Print message if maximum client limit is reached
-            close(client_socket);   // Close client socket if maximum client limit is reached
-        } else {    // If client slot is available
-            pthread_create(&clients[i].thread_id, NULL, handle_client, (void *)&clients[i]);    // Create thread to handle client
-            pthread_detach(clients[i].thread_id);   // Detach client handling thread to run in the background
+// Function to take a free session slot and generate a token for a client, caller holds clients_mutex
+client_info_t *new_session(int fd) {
+    client_info_t *client = session_alloc(fd);
+    if (client == NULL) {   // Table is full, give up the session that has been detached the longest
+        client_info_t *oldest = NULL;
+        for (uint32_t i = 0; i < session_capacity(); i++) {
+            client_info_t *candidate = session_at(i);
+            if (candidate->client_socket == SESSION_DETACHED &&
+                (oldest == NULL || candidate->last_keep_alive < oldest->last_keep_alive)) {
+                oldest = candidate;
+            }
+        }
+        if (oldest != NULL) {
+            release_session(oldest);
+            client = session_alloc(fd);
         }
     }
+    return client;
+}
 
-    close(welcome_socket);  // Close welcome socket
+// Function to set up the shared-memory link of a restaurant that connected on the local socket
+int accept_local_restaurant(int fd) {
+    char name[32];
+    shm_link_t *link = calloc(1, sizeof(shm_link_t));
+    if (link == NULL || shm_link_accept(fd, name, sizeof(name), link, io_wake_fd) < 0) {
+        printf("Local restaurant did not set up its link\n");
+        free(link);
+        return -1;
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (strcmp(restaurant_ports[i].name, name) == 0) {
+            conn_t *conn = conn_new(fd, CONN_RESTAURANT);
+            if (conn != NULL && io_attach_link(fd, link) == 0) {
+                conn->id = i + 1;
+                printf("%s connected over shared memory\n", restaurant_ports[i].name);
+                return 0;
+            }
+            if (conn != NULL) {
+                conns[fd] = NULL;
+                free(conn);
+            }
+            break;
+        }
+    }
+    printf("Rejecting local restaurant %s\n", name);
+    shm_link_close(link);
+    free(link);
+    return -1;
+}
+
+// Function to pick the retry hint for a new session over the rate limit, clients spread their retries over a burst's refill
+int accept_retry_ms(void) {
+    return (int)(ratelimit_wait_ms(&accept_limit) + 1000ULL * accept_limit.burst / accept_limit.rate);
+}
+
+// Function to keep a client that was turned away connected without a session, it may resume one or go
+int shed_connection(int fd, int retry_ms, const char *reason) {
+    conn_t *conn = conn_new(fd, CONN_CLIENT);
+    if (conn == NULL) {
+        return -1;
+    }
+    conn->id = CONN_NO_SESSION;
+    sessions_shed++;
+    send_busy(fd, NULL, retry_ms, reason);  // Instead of a token, the client closes once it has read it
     return 0;
 }
 
-void *handle_client(void *arg) {
-    client_info_t *client = (client_info_t *)arg;   // Cast argument to client_info_t pointer
+// Function to hand a complete frame to the client or restaurant handler
+void dispatch(int fd, conn_t *conn, message_t *msg) {
+    capture_frame(fd, CAPTURE_IN, msg);
+    if (conn->kind == CONN_CLIENT) {
+        if (msg->type == MSG_RESUME) {
+            resume_session(fd, conn, msg);  // Authenticated by the old token, not by this connection's session
+        } else if (conn->id == CONN_NO_SESSION) {
+            close_connection(fd);   // Turned away, resuming is all it may do
+        } else if (msg->type == MSG_SUBSCRIBE) {
+            subscribe_client(fd, conn);     // Availability is public, any state of the session may ask
+        } else {
+            handle_client(session_at(conn->id), msg);
+        }
+    } else if (conn->kind == CONN_ADMIN) {
+        handle_admin(fd, msg);
+    } else if (conn->kind == CONN_GATEWAY) {
+        handle_gateway(fd, conn, msg);
+    } else {
+        handle_restaurant(fd, restaurant_ports[conn->id - 1].name, msg);
+    }
+}
+
+// Function to reassemble fixed-size frames from the bytes of a connection
+void on_data(int fd, const char *data, size_t len) {
+    conn_t *conn = conn_get(fd);
     message_t msg;
-    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
+    message_t batch[GATEWAY_BATCH];     // Frames of a gateway, handed over once its streams can take turns
+    int batched = 0;
+
+    codel_sample(&loop_delay, io_loop_delay(), monotonic_us());
+    while (conn != NULL && len > 0 && !conn->closing) {
+        if (conn->rx_len == 0 && len >= sizeof(message_t)) {   // Whole frame in the buffer, no reassembly needed
+            memcpy(&msg, data, sizeof(message_t));
+            data += sizeof(message_t);
+            len -= sizeof(message_t);
+        } else {
+            if (conn->rx == NULL && (conn->rx = malloc(sizeof(message_t))) == NULL) {
+                close_connection(fd);
+                break;
+            }
+            size_t needed = sizeof(message_t) - conn->rx_len;
+            size_t n = len < needed ? len : needed;
+            memcpy((char *)conn->rx + conn->rx_len, data, n);
+            conn->rx_len += n;
+            data += n;
+            len -= n;
+            if (conn->rx_len < sizeof(message_t)) {
+                break;  // Wait for the rest of the frame
+            }
+            memcpy(&msg, conn->rx, sizeof(message_t));
+            free(conn->rx);     // Idle connections keep no frame buffer
+            conn->rx = NULL;
+            conn->rx_len = 0;
+        }
 
-    printf("Client connected with token: %s\n", client->token);   // Print message when client connects
+        if (conn->kind != CONN_GATEWAY) {
+            dispatch(fd, conn, &msg);
+            continue;
+        }
+        batch[batched++] = msg;
+        if (batched == GATEWAY_BATCH) {
+            dispatch_streams(fd, conn, batch, batched);
+            batched = 0;
+        }
+    }
+    if (batched > 0) {
+        dispatch_streams(fd, conn, batch, batched);
+    }
+}
 
-    while (1) {
-        // Receive message from client
-        ssize_t bytes_received = recv(client->client_socket, &msg, sizeof(message_t),0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                printf("Client disconnected\n");
+// Function to clear the state of a connection that went away
+void on_close(int fd) {
+    capture_close(fd);
+    conn_t *conn = conn_get(fd);
+    if (conn == NULL) {
+        return;
+    }
+
+    if (conn->subscribed) {
+        unsubscribe_client(fd);
+    }
+    if (conn->kind == CONN_CLIENT && conn->id != CONN_NO_SESSION) {
+        printf("Client disconnected\n");
+        pthread_mutex_lock(&clients_mutex); // Lock clients array to prevent from multiple threads accessing it simultaneously
+        client_info_t *client = session_at(conn->id);
+        if (client->client_socket == fd) {
+            if (conn->closing || (client->flags & SESSION_EXPIRED)) {
+                release_session(client);    // Clear client information after the server dropped the client
             } else {
-                perror("recv");
+                client->client_socket = SESSION_DETACHED;   // Keep the session so the client can resume it
+                client->last_keep_alive = time(NULL);
             }
-            break;
         }
-        printf("Server received message type: %d\n", msg.type);
-        printf("this is the message data %s\n",msg.data);
-        printf("this is the message token received: %s\n", msg.client_token);
-        printf("this is the client token: %s \n", client->token);
-        if (strcmp(client->token, msg.client_token) == 0) {
-            printf("Authentication successful. Client's token: %s, socket: %d. Message holds token: %s\n", client->token, client->client_socket, msg.client_token);
+        pthread_mutex_unlock(&clients_mutex);   // Unlock clients array
+    } else if (conn->kind == CONN_GATEWAY) {
+        printf("Gateway disconnected\n");
+        pthread_mutex_lock(&clients_mutex);
+        time_t now = time(NULL);
+        for (uint32_t i = 0; i < session_capacity(); i++) {     // Its streams can be resumed on its next connection
+            client_info_t *client = session_at(i);
+            if (client->client_socket != fd) {
+                continue;
+            }
+            if (client->flags & SESSION_EXPIRED) {
+                release_session(client);
+            } else {
+                client->client_socket = SESSION_DETACHED;
+                client->last_keep_alive = now;
+            }
+        }
+        pthread_mutex_unlock(&clients_mutex);
+    } else if (conn->kind == CONN_RESTAURANT) {
+        printf("Restaurant disconnected\n");
+        pthread_mutex_lock(&clients_mutex);
+        in_flight_t **link = &in_flight;
+        while (*link != NULL) {     // Orders it did not answer never complete
+            if ((*link)->restaurant == conn->id) {
+                in_flight_t *order = *link;
+                *link = order->next;
+                fail_order(&order->token, conn->id);
+                free(order);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+        cart_t *next;
+        for (cart_t *cart = carts; cart != NULL; cart = next) {  // Carts answer without it
+            next = cart->next;
+            if (cart->minutes[conn->id - 1] == CART_WAITING) {
+                finish_cart_part(session_at(cart->slot), cart, conn->id, CART_FAILED, NULL);
+            }
+        }
+        pthread_mutex_unlock(&clients_mutex);
+        close_admission(conn->id, fd);
+        discard_menu_upload(conn->id);
+        pthread_mutex_lock(&restaurants_mutex);
+        int left = 0;
+        for (int i = 0; i < MAX_RESTAURANTS; i++) {
+            if (restaurants[i].restaurant_socket == fd) {
+                PROBE2(restaurant_inactive, conn->id, RESTAURANT_DISCONNECTED);
+                clear_restaurant(&restaurants[i]);
+                left = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&restaurants_mutex);
+        if (left) {
+            update_catalog(restaurant_ports[conn->id - 1].name);
+            publish_availability(restaurant_ports[conn->id - 1].name);
+        }
+    }
+
+    conns[fd] = NULL;
+    free(conn->rx);
+    free(conn);
+}
+
+// Function to queue a frame to a connection, recording it when capturing; the caller keeps its reference
+int send_frame(int fd, frame_t *frame) {
+    if (frame == NULL) {
+        return -1;
+    }
+    capture_frame(fd, CAPTURE_OUT, &frame->msg);
+    return io_send_frame(fd, frame);
+}
+
+// Function to shut a connection down from the event loop, it is cleaned up in on_close
+void close_connection(int fd) {
+    conn_t *conn = conn_get(fd);
+    if (conn != NULL) {
+        conn->closing = 1;
+    }
+    io_shutdown(fd);
+}
+
+// Function to drop a client that broke the protocol, only its own stream when it comes through a gateway
+void close_client(client_info_t *client) {
+    if (client->flags & SESSION_STREAM) {
+        end_stream(client);
+    } else {
+        close_connection(client->client_socket);
+    }
+}
+
+// Function to queue a frame to a client, a copy carrying its token when the client is a stream of a gateway
+int send_client_frame(client_info_t *client, frame_t *frame) {
+    if (frame == NULL || !(client->flags & SESSION_STREAM) ||
+        memcmp(&frame->msg.client_token, &client->token, sizeof(session_token_t)) == 0) {
+        return send_frame(client->client_socket, frame);
+    }
+    frame_t *stamped = frame_new(frame->msg.type, &client->token);    // Shared frames carry no token, the gateway routes by it
+    if (stamped == NULL) {
+        return -1;
+    }
+    memcpy(stamped->msg.data, frame->msg.data, BUFFER_SIZE);
+    io_count_copy(0, sizeof(message_t));
+    int ret = send_frame(client->client_socket, stamped);
+    frame_unref(stamped);
+    return ret;
+}
+
+// Function to free a session together with an estimated time parked for it, caller holds clients_mutex
+void release_session(client_info_t *client) {
+    uint32_t slot = session_index(client);
+    free(find_cart(slot, 1));
+    parked_eta_t **link = &parked_etas;
+    while (*link != NULL) {
+        if ((*link)->slot == slot) {
+            parked_eta_t *parked = *link;
+            *link = parked->next;
+            free(parked);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    session_free(client);
+}
+
+// Function to move a session presented by its old token onto a new connection
+void resume_session(int fd, conn_t *conn, message_t *msg) {
+    pthread_mutex_lock(&clients_mutex);
+    client_info_t *current = conn->kind == CONN_CLIENT && conn->id != CONN_NO_SESSION ? session_at(conn->id) : NULL;
+    client_info_t *client = session_lookup(&msg->client_token);
+    if (client == NULL || (client->flags & SESSION_EXPIRED)) {
+        if (conn->kind == CONN_GATEWAY) {
+            printf("Resume refused, gateway stream is gone\n");
+            send_leave(fd, &msg->client_token);     // The gateway opens a new stream for its user
+        } else if (current == NULL) {
+            printf("Resume refused, client was turned away\n");
+            send_busy(fd, NULL, BUSY_RETRY_MS, "Session is gone and the server is busy");
+        } else {
+            printf("Resume refused, client keeps its new session\n");
+            send_resume_to_client(current, "NEW");
+        }
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+
+    if (client != current) {
+        if (client->client_socket != SESSION_DETACHED && client->client_socket != fd && !(client->flags & SESSION_STREAM)) {
+            close_connection(client->client_socket);    // Old connection is half open, the client moved on
+        }
+        if (current != NULL) {
+            release_session(current);   // Session handed out on accept is not needed
+        }
+        client->client_socket = fd;
+        if (conn->kind == CONN_GATEWAY) {
+            client->flags |= SESSION_STREAM;
         } else {
-            if (msg.type != MSG_KEEP_ALIVE){
+            client->flags &= ~SESSION_STREAM;   // The user left its gateway, the session has the connection to itself
+            conn->id = session_index(client);
+        }
+    }
+    client->last_keep_alive = time(NULL);
+
+    parked_eta_t *parked = NULL;
+    for (parked_eta_t **link = &parked_etas; *link != NULL; link = &(*link)->next) {
+        if ((*link)->slot == session_index(client)) {
+            parked = *link;
+            *link = parked->next;
+            break;
+        }
+    }
+
+    if (parked != NULL || (client->flags & SESSION_ORDER_PENDING)) {
+        send_resume_to_client(client, "ORDER");     // Estimated time follows now or when the restaurant answers
+        if (parked != NULL) {
+            client->flags &= ~SESSION_ORDER_PENDING;
+            send_estimated_time_to_client(client, parked->data, NULL);
+            free(parked);
+        }
+    } else if (client->restaurant != 0) {
+        send_resume_to_client(client, "MENU");      // Menu follows, the client picks a meal again
+        send_menu_to_client(client, restaurant_ports[client->restaurant - 1].name);
+    } else {
+        send_resume_to_client(client, "IDLE");
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    printf("Client resumed its session on socket %d\n", fd);
+}
+
+// Function to handle a message from a client
+void handle_client(client_info_t *client, message_t *msg) {
+    char token[2 * TOKEN_SIZE + 1];
+    char msg_token[2 * TOKEN_SIZE + 1];
+    token_to_hex(&client->token, token);
+    token_to_hex(&msg->client_token, msg_token);
+
+    printf("Server received message type: %d\n", msg->type);
+    printf("this is the message data %s\n", msg->data);
+    printf("this is the message token received: %s\n", msg_token);
+    printf("this is the client token: %s \n", token);
+    if (session_lookup(&msg->client_token) == client) {    // Token decodes straight to this client's slot
+        PROBE2(token_validated, session_probe_id(&client->token), msg->type);
+        printf("Authentication successful. Client's token: %s, socket: %d. Message holds token: %s\n", token, client->client_socket, msg_token);
+    } else {
+        if (msg->type != MSG_KEEP_ALIVE){
             printf("Authentication failed.\n");
-            printf("Client's token: %s, socket: %d. Message holds token: %s\n", client->token, client->client_socket, msg.client_token);
-            close(client->client_socket);
-            pthread_exit(NULL);
+            printf("Client's token: %s, socket: %d. Message holds token: %s\n", token, client->client_socket, msg_token);
+            close_client(client);
+            return;
+        }
+    }
+    if (throttle_client(client, msg->type)) {
+        return;     // Over a rate limit, the client was told when to come back
+    }
+    if (msg->type == MSG_ORDER || msg->type == MSG_DIRECT_ORDER || msg->type == MSG_CART) {
+        receive_trace(msg);
+    }
+
+    if (client->restaurant != 0) {   // Menu was sent, wait for the client to order a meal
+        if (msg->type == MSG_ORDER) {
+            // Forward the order to the restaurant
+            const char *restaurant = restaurant_ports[client->restaurant - 1].name;
+            if (refuse_pending_order(client)) {
+                return;     // Still choosing a meal, it can order once the last one is answered
+            }
+            int retry_ms = admission_busy(client->restaurant);
+            if (retry_ms > 0) {
+                refuse_order(client, client->restaurant, retry_ms);     // Still choosing a meal, it can order again later
+                return;
             }
+            client->restaurant = 0;
+            trace_context_t trace;
+            trace_get(msg, &trace);
+            send_order_to_restaurant(client, msg->data, restaurant, 0, &trace);
+            return;
+        } else if (msg->type != MSG_KEEP_ALIVE && msg->type != MSG_DIRECT_ORDER &&
+                   msg->type != MSG_MENU_PAGE && msg->type != MSG_MENU_SEARCH && msg->type != MSG_CATALOG_SEARCH &&
+                   msg->type != MSG_CART) {
+            printf("in client: expected to get order, instead got %d\n", msg->type);
+            close_client(client);
+            return;
         }
+    }
 
-        switch (msg.type) {
-            case MSG_KEEP_ALIVE:
-                printf("Received keep alive from client\n");
-                pthread_mutex_lock(&clients_mutex);
-                client->last_keep_alive = time(NULL);
-                pthread_mutex_unlock(&clients_mutex);
-                break;
-            case MSG_REQUEST_MENU:
-                // Send restaurant options to client
-                printf("Server got a restaurant options request, now showing the client.\n");
-                send_restaurant_options(client);
-                break;
-            case MSG_ORDER:
-                // Handle client's restaurant choice
-                printf("Server got client choice\n");
-                int choice = atoi(msg.data);
-                const char *restaurant = NULL;
-
-                switch (choice) {
-                    case 1:
-                        restaurant = "McDonalds";
-                        printf("Server chose McDonalds\n");
-                        break;
-                    case 2:
-                        restaurant = "Dominos";
-                        printf("Server chose Dominos\n");
-                        break;
-                    case 3:
-                        restaurant = "Taco Bell";
-                        printf("Server chose Taco Bell\n");
-                        break;
-                    default:
-                        printf("Invalid restaurant choice\n");
-                        close(client->client_socket);
-                        pthread_exit(NULL);
+    switch (msg->type) {
+        case MSG_KEEP_ALIVE:
+            printf("Received keep alive from client\n");
+            pthread_mutex_lock(&clients_mutex);
+            client->last_keep_alive = time(NULL);
+            pthread_mutex_unlock(&clients_mutex);
+            break;
+        case MSG_REQUEST_MENU:
+            // Send restaurant options to client
+            printf("Server got a restaurant options request, now showing the client.\n");
+            send_restaurant_options(client);
+            break;
+        case MSG_ORDER:
+            // Handle client's restaurant choice
+            printf("Server got client choice\n");
+            int choice = atoi(msg->data);
+            if (choice < 1 || choice > MAX_RESTAURANTS) {
+                printf("Invalid restaurant choice\n");
+                close_client(client);
+                return;
+            }
+            const char *restaurant = restaurant_ports[choice - 1].name;
+            printf("Server chose %s\n", restaurant);
+
+            pthread_mutex_lock(&restaurants_mutex);
+            frame_t *menu_frame = NULL;
+            for (int i = 0; i < MAX_RESTAURANTS; i++) {
+                if (restaurants[i].name == restaurant && restaurants[i].active && restaurants[i].menu_frame != NULL) {
+                    menu_frame = frame_ref(restaurants[i].menu_frame);    // Same bytes for every client, nothing to encode
+                    break;
                 }
+            }
+            pthread_mutex_unlock(&restaurants_mutex);
 
-                pthread_mutex_lock(&restaurants_mutex);
-                int found = 0;
-                for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                    if (strcmp(restaurants[i].name, restaurant) == 0 && restaurants[i].active) {
-                        found = 1;
-                        strncpy(msg.data, restaurants[i].menu, BUFFER_SIZE);
-                        msg.type = MSG_MENU;
-                        ssize_t bytes_sent = send(client->client_socket, &msg, sizeof(message_t), 0);
-                        if (bytes_sent <= 0) {
-                            perror("send");
-                            close(client->client_socket);
-                            pthread_exit(NULL);
-                        }
-                        break;
-                    }
+            if (menu_frame == NULL) {
+                printf("Restaurant %s is not available\n", restaurant);
+                printf("Sending message type %d\n", REST_UNAVALIABLE);
+                if (send_client_frame(client, unavailable_frame) < 0) {
+                    perror("send");
+                    close_connection(client->client_socket);
                 }
-                pthread_mutex_unlock(&restaurants_mutex);
-
-                if (!found) {
-                    printf("Restaurant %s is not available\n", restaurant);
-                    message_t A_response;
-                    memset(&A_response, 0, sizeof(message_t)); // Ensure message is zeroed out
-                    A_response.type = REST_UNAVALIABLE;
-                    snprintf(A_response.data, BUFFER_SIZE, "not available");
-                    printf("Sending message type %d\n", A_response.type);
-                    ssize_t bytes_sent = send(client->client_socket, &A_response, sizeof(message_t), 0);
-                    if (bytes_sent <= 0) {
-                        perror("send");
-                        close(client->client_socket);
-                        pthread_exit(NULL);
-                    }
-                } else {
-                    // Wait for the client to order a meal
-                    while (1) {
-                        bytes_received = recv(client->client_socket, &msg, sizeof(message_t), 0);
-                        if (bytes_received <= 0) {
-                            if (bytes_received == 0) {
-                                printf("Client disconnected\n");
-                            } else {
-                                perror("recv");
-                            }
-                            break;
-                        }
-                        if (msg.type == MSG_ORDER) {
-                            // Forward the order to the restaurant
-                            send_order_to_restaurant(client, msg.data, restaurant);
-                            break;
-                        } else if (msg.type == MSG_KEEP_ALIVE) {
-                            printf("Received keep alive from client\n");
-                            pthread_mutex_lock(&clients_mutex);
-                            client->last_keep_alive = time(NULL);
-                            pthread_mutex_unlock(&clients_mutex);
-                            continue;
-                        } else {
-                            printf("in client: expected to get order, instead got %d\n", msg.type);
-                            close(client->client_socket);
-                            pthread_exit(NULL);
-                        }
+            } else {
+                if (send_client_frame(client, menu_frame) < 0) {
+                    perror("send");
+                    close_connection(client->client_socket);
+                }
+                frame_unref(menu_frame);
+                PROBE2(menu_served, session_probe_id(&client->token), choice);
+                client->restaurant = choice;    // The next order from this client is a meal choice
+            }
+            break;
+        case MSG_DIRECT_ORDER:
+            handle_direct_order(client, msg);
+            break;
+        case MSG_MENU_PAGE:
+        case MSG_MENU_SEARCH:
+            handle_menu_query(client, msg);
+            break;
+        case MSG_CATALOG_SEARCH:
+            handle_catalog_search(client, msg);
+            break;
+        case MSG_CART:
+            handle_cart(client, msg);
+            break;
+        default:
+            printf("In client: Unexpected message type: %d\n", msg->type);
+            close_client(client);
+            break;
+    }
+}
+
+// Function to read a "CLASS=N[/BURST]" rate limit option into rates, frames a second and burst by class, "all" for every class
+int parse_rate(const char *arg, uint32_t rates[SESSION_RATE_CLASSES][2]) {
+    const char *value = strchr(arg, '=');
+    unsigned int rate, burst;
+    int fields = value != NULL ? sscanf(value + 1, "%u/%u", &rate, &burst) : 0;
+    int matched = 0;
+    for (int i = 0; fields >= 1 && i < SESSION_RATE_CLASSES; i++) {
+        if (strncmp(arg, "all=", 4) == 0 ||
+            (strncmp(arg, rate_class_names[i], value - arg) == 0 && rate_class_names[i][value - arg] == '\0')) {
+            rates[i][0] = rate;
+            rates[i][1] = fields == 2 ? burst : rate;   // A second's worth unless given
+            matched = 1;
+        }
+    }
+    if (!matched) {
+        fprintf(stderr, "Rate limits are CLASS=N[/BURST] frames a second, with CLASS menu, search, order or all: %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to find the rate limit class of a client frame, -1 for frames without a limit
+int rate_class(const client_info_t *client, int type) {
+    switch (type) {
+        case MSG_REQUEST_MENU:
+        case MSG_MENU_PAGE:
+            return RATE_MENU;
+        case MSG_ORDER:
+            return client->restaurant != 0 ? RATE_ORDER : RATE_MENU;    // A restaurant choice is answered with its menu
+        case MSG_MENU_SEARCH:
+        case MSG_CATALOG_SEARCH:
+            return RATE_SEARCH;
+        case MSG_DIRECT_ORDER:
+        case MSG_CART:
+            return RATE_ORDER;
+        default:
+            return -1;
+    }
+}
+
+// Function to find the rate limits of a client address, taking the slot of the least active address near it when it has none
+address_limit_t *address_limit(uint32_t address, uint32_t now) {
+    uint32_t home = (address * 2654435761u) >> 20;     // Fibonacci hashing onto ADDRESS_SLOTS
+    address_limit_t *victim = NULL;
+    int32_t victim_ahead = INT32_MAX;
+    for (int i = 0; i < ADDRESS_PROBES; i++) {
+        address_limit_t *slot = &address_limits[(home + i) & (ADDRESS_SLOTS - 1)];
+        if (slot->address == address) {
+            return slot;
+        }
+        int32_t ahead = 0;  // How far its furthest class is ahead of the clock, a slot not ahead is as good as free
+        for (int c = 0; c < SESSION_RATE_CLASSES && slot->address != 0; c++) {
+            int32_t class_ahead = (int32_t)(slot->rate_due[c] - now);
+            ahead = class_ahead > ahead ? class_ahead : ahead;
+        }
+        if (ahead < victim_ahead) {
+            victim = slot;
+            victim_ahead = ahead;
+        }
+    }
+    memset(victim, 0, sizeof(address_limit_t));
+    victim->address = address;
+    return victim;
+}
+
+// Function to hold a client frame to the rate limits of its session and its address, returns 1 when the frame is dropped;
+// the first frame over a limit is answered with when to come back, the ones after it until then are not,
+// and a client of its own connection is not read until then, so it waits on its socket instead of sending more
+int throttle_client(client_info_t *client, int type) {
+    int class = rate_class(client, type);
+    if (class < 0) {
+        return 0;
+    }
+    uint32_t now = (uint32_t)(monotonic_us() / 1000);
+    uint32_t wait_ms = 0;
+    pthread_mutex_lock(&clients_mutex);     // The token manager resets the session under it
+    uint32_t session_due = client->rate_due[class];     // Both limits are checked on copies, then both advanced or neither
+    int allowed = ratelimit_due(&session_rules[class], &session_due, now, &wait_ms);
+    address_limit_t *address = NULL;
+    uint32_t address_due = 0;
+    conn_t *conn = conn_get(client->client_socket);
+    if (allowed && address_limits != NULL && conn != NULL && conn->kind == CONN_CLIENT && conn->peer != 0) {
+        address = address_limit(conn->peer, now);
+        address_due = address->rate_due[class];
+        allowed = ratelimit_due(&address_rules[class], &address_due, now, &wait_ms);
+    }
+    if (allowed) {
+        client->rate_due[class] = session_due;
+        if (address != NULL) {
+            address->rate_due[class] = address_due;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+        return 0;
+    }
+    requests_throttled++;
+    PROBE2(request_throttled, session_probe_id(&client->token), class);
+    if ((int32_t)(client->rate_quiet - now) <= 0) {
+        client->rate_quiet = now + wait_ms;
+        send_busy(client->client_socket, &client->token, (int)wait_ms, "Too many requests");
+    }
+    if (conn != NULL && conn->kind == CONN_CLIENT) {
+        io_pause(client->client_socket, wait_ms);   // A gateway's other streams are still read
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return 1;
+}
+
+// Function to handle a frame from a gateway, routed to the session whose token it carries
+void handle_gateway(int fd, conn_t *conn, message_t *msg) {
+    static const session_token_t no_token;
+    switch (msg->type) {
+        case MSG_STREAM:
+            open_stream(fd);
+            return;
+        case MSG_RESUME:
+            resume_session(fd, conn, msg);  // Stream of the gateway's previous connection
+            return;
+        case MSG_SUBSCRIBE:
+            subscribe_client(fd, conn);     // Once for all its users
+            return;
+        case MSG_KEEP_ALIVE:
+            if (memcmp(&msg->client_token, &no_token, sizeof(session_token_t)) == 0) {
+                pthread_mutex_lock(&clients_mutex);     // One keep-alive for every stream of the connection
+                time_t now = time(NULL);
+                for (uint32_t i = 0; i < session_capacity(); i++) {
+                    if (session_at(i)->client_socket == fd) {
+                        session_at(i)->last_keep_alive = now;
                     }
                 }
+                pthread_mutex_unlock(&clients_mutex);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    client_info_t *client = session_lookup(&msg->client_token);
+    int streaming = client != NULL && client->client_socket == fd && !(client->flags & SESSION_EXPIRED);
+    if (streaming && msg->type == MSG_LEAVE) {
+        printf("Gateway stream closed\n");
+        release_session(client);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    if (!streaming) {
+        if (msg->type != MSG_LEAVE) {
+            send_leave(fd, &msg->client_token);     // Unknown or ended stream, the other streams go on
+        }
+    } else if (msg->type != MSG_LEAVE) {
+        handle_client(client, msg);
+    }
+}
+
+// Function to hand a gateway's frames to their streams a frame each per round, so a stream that sent many does not hold
+// up the others; each stream's frames keep their order, and stream opens count as one stream so their answers stay in order
+void dispatch_streams(int fd, conn_t *conn, message_t *batch, int count) {
+    uint8_t done[GATEWAY_BATCH] = {0};
+    int left = count;
+    while (left > 0 && !conn->closing) {
+        const session_token_t *served[GATEWAY_BATCH];  // Streams that had their turn this round
+        int turns = 0;
+        for (int i = 0; i < count && !conn->closing; i++) {
+            int waiting = done[i];
+            for (int j = 0; j < turns && !waiting; j++) {
+                waiting = memcmp(served[j], &batch[i].client_token, sizeof(session_token_t)) == 0;
+            }
+            if (waiting) {
+                continue;
+            }
+            served[turns++] = &batch[i].client_token;
+            done[i] = 1;
+            left--;
+            dispatch(fd, conn, &batch[i]);
+        }
+    }
+}
+
+// Function to open a session for one user of a gateway, answered like the token of a new client connection
+void open_stream(int fd) {
+    codel_sample(&loop_delay, io_loop_delay(), monotonic_us());
+    if (codel_overloaded(&loop_delay)) {    // Same as a new connection, streams already open come first
+        sessions_shed++;
+        send_busy(fd, NULL, (int)(loop_delay.interval / 1000), "Server is busy");
+        return;
+    }
+    if (!ratelimit_take(&accept_limit, monotonic_us())) {
+        sessions_shed++;
+        send_busy(fd, NULL, accept_retry_ms(), "Too many new connections");
+        return;
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    client_info_t *client = new_session(fd);
+    if (client == NULL) {
+        pthread_mutex_unlock(&clients_mutex);
+        printf("Maximum client limit reached. Rejecting new stream.\n");
+        sessions_shed++;
+        send_busy(fd, NULL, BUSY_RETRY_MS, "Server is full");
+        return;
+    }
+    client->flags |= SESSION_STREAM;
+    client->last_keep_alive = time(NULL);
+    send_token_to_client(client);
+    PROBE2(session_accept, session_probe_id(&client->token), fd);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Function to end one stream of a gateway and tell the gateway, its other streams go on
+void end_stream(client_info_t *client) {
+    send_leave(client->client_socket, &client->token);
+    client->flags |= SESSION_EXPIRED;           // Nothing can resume it
+    client->client_socket = SESSION_DETACHED;
+    client->last_keep_alive = 0;                // The token manager frees it on its next pass
+}
+
+// Function to tell a gateway that a stream is gone
+void send_leave(int fd, const session_token_t *token) {
+    frame_t *frame = frame_new(MSG_LEAVE, token);
+    if (send_frame(fd, frame) < 0) {
+        perror("send");
+        close_connection(fd);
+    }
+    frame_unref(frame);
+}
+
+// Function to answer an admin command
+void handle_admin(int admin_fd, message_t *msg) {
+    if (msg->type != MSG_STATS) {
+        printf("In admin: Unexpected message type: %d\n", msg->type);
+        close_connection(admin_fd);
+        return;
+    }
+
+    const char *names[MAX_RESTAURANTS];
+    char report[4096];
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        names[i] = restaurant_ports[i].name;
+    }
+    size_t len = analytics_report(report, sizeof(report), names, MAX_RESTAURANTS);
+    len += flow_report(report + len, sizeof(report) - len);
+
+    size_t sent = 0;
+    size_t n;
+    do {    // Report split over frames, the last frame is empty
+        n = len - sent < BUFFER_SIZE - 1 ? len - sent : BUFFER_SIZE - 1;
+        frame_t *response = frame_new(MSG_STATS, NULL);
+        if (response != NULL) {
+            memcpy(response->msg.data, report + sent, n);
+        }
+        int ret = send_frame(admin_fd, response);
+        frame_unref(response);
+        if (ret < 0) {
+            perror("send");
+            close_connection(admin_fd);
+            return;
+        }
+        sent += n;
+    } while (n > 0);
+}
+
+// Function to write one restaurant's "id open menu_version name" line, caller holds restaurants_mutex
+int availability_line(int id, char *buf, size_t size) {
+    const char *name = restaurant_ports[id - 1].name;
+    int open = 0;
+    uint32_t version = 0;
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (restaurants[i].name == name && restaurants[i].restaurant_socket != 0) {
+            open = restaurants[i].active;
+            version = restaurants[i].menu != NULL ? restaurants[i].menu->version : 0;
+            break;
+        }
+    }
+    int len = snprintf(buf, size, "%d %d %u %s\n", id, open, version, name);
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Function to subscribe a client to availability changes, starting with every restaurant's state
+void subscribe_client(int fd, conn_t *conn) {
+    frame_t *frame = frame_new(MSG_AVAILABILITY, NULL);
+    pthread_mutex_lock(&subscribers_mutex);    // Held while reading the state so no change slips in between
+    if (frame != NULL) {
+        size_t len = 0;
+        pthread_mutex_lock(&restaurants_mutex);
+        for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+            len += availability_line(id, frame->msg.data + len, BUFFER_SIZE - len);
+        }
+        pthread_mutex_unlock(&restaurants_mutex);
+    }
+    if (!conn->subscribed) {
+        if (subscriber_count == subscriber_capacity) {
+            int capacity = subscriber_capacity ? subscriber_capacity * 2 : 16;
+            int *grown = realloc(subscribers, capacity * sizeof(int));
+            if (grown != NULL) {
+                subscribers = grown;
+                subscriber_capacity = capacity;
+            }
+        }
+        if (subscriber_count < subscriber_capacity) {
+            subscribers[subscriber_count++] = fd;
+            conn->subscribed = 1;
+        }
+    }
+    if (send_frame(fd, frame) < 0) {
+        perror("send");
+        close_connection(fd);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+    frame_unref(frame);
+}
+
+// Function to drop a closed connection from the subscriber list
+void unsubscribe_client(int fd) {
+    pthread_mutex_lock(&subscribers_mutex);
+    for (int i = 0; i < subscriber_count; i++) {
+        if (subscribers[i] == fd) {
+            subscribers[i] = subscribers[--subscriber_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+}
+
+// Function to push a restaurant's new state to every subscriber, encoded once and shared by all the sends
+void publish_availability(const char *name) {
+    int id = restaurant_id(name);
+    frame_t *frame = frame_new(MSG_AVAILABILITY, NULL);
+    if (id == 0 || frame == NULL) {
+        frame_unref(frame);
+        return;
+    }
+
+    pthread_mutex_lock(&subscribers_mutex);
+    pthread_mutex_lock(&restaurants_mutex);
+    availability_line(id, frame->msg.data, BUFFER_SIZE);
+    pthread_mutex_unlock(&restaurants_mutex);
+    for (int i = 0; i < subscriber_count; i++) {
+        if (send_frame(subscribers[i], frame) < 0) {
+            perror("send");     // The connection is going away, on_close unsubscribes it
+        }
+    }
+    printf("Availability of %s pushed to %d subscribers\n", name, subscriber_count);
+    pthread_mutex_unlock(&subscribers_mutex);
+    frame_unref(frame);
+}
+
+// Function to index a restaurant's current menu in the catalog, or drop it when the restaurant is not open
+void update_catalog(const char *name) {
+    int id = restaurant_id(name);
+    menu_t *menu = NULL;
+    pthread_mutex_lock(&restaurants_mutex);
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (restaurants[i].name == name && restaurants[i].active) {
+            menu = menu_ref(restaurants[i].menu);   // Indexed without holding the restaurants
+            break;
+        }
+    }
+    pthread_mutex_unlock(&restaurants_mutex);
+    if (id != 0 && catalog_set_menu(id, menu) < 0) {
+        printf("Could not index the menu of %s\n", name);
+    }
+    menu_put(menu);
+}
+
+// Function to find an item in every open restaurant, cheapest first
+void handle_catalog_search(client_info_t *client, message_t *msg) {
+    unsigned int max_cents = 0;
+    char text[MENU_QUERY_LEN] = "";
+    if (sscanf(msg->data, "%u %63[^\n]", &max_cents, text) < 1) {
+        printf("Invalid catalog search\n");
+        close_client(client);
+        return;
+    }
+
+    frame_t *reply = frame_new(MSG_CATALOG_SEARCH, NULL);
+    if (reply != NULL) {
+        char lines[BUFFER_SIZE - 24];  // Room for the header line
+        int shown;
+        int matches = catalog_search(text, max_cents, lines, sizeof(lines), &shown);
+        snprintf(reply->msg.data, BUFFER_SIZE, "%d %d\n%s", matches, shown, lines);
+    }
+    if (send_client_frame(client, reply) < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+    }
+    frame_unref(reply);
+}
+
+// Function to take a cart of items from one or more restaurants, forwarded as one order per restaurant
+void handle_cart(client_info_t *client, message_t *msg) {
+    int ids[CART_MAX_ITEMS], items[CART_MAX_ITEMS];
+    unsigned int versions[CART_MAX_ITEMS];
+    int count = 0;
+    int wait_minutes = 0;   // Tightest max wait of any item, the whole cart is held to it
+    trace_context_t trace;  // Every restaurant's share carries it, each comes back with its own stamps
+    trace_get(msg, &trace);
+    int valid = 1;
+    msg->data[BUFFER_SIZE - 1] = '\0';
+    for (const char *line = msg->data; *line != '\0';) {     // "restaurant item menu_version" lines
+        int wait = 0;
+        if (count == CART_MAX_ITEMS || sscanf(line, "%d %d %u %d", &ids[count], &items[count], &versions[count], &wait) < 3 ||
+            ids[count] < 1 || ids[count] > MAX_RESTAURANTS || items[count] < 1) {
+            valid = 0;  // A cart is ordered whole or not at all
+            break;
+        }
+        if (wait > 0 && (wait_minutes == 0 || wait < wait_minutes)) {
+            wait_minutes = wait > UINT8_MAX ? UINT8_MAX : wait;
+        }
+        count++;
+        line = strchr(line, '\n');
+        line = line != NULL ? line + 1 : "";
+    }
+    if (!valid || count == 0) {
+        printf("Invalid cart\n");
+        close_client(client);
+        return;
+    }
+    if (refuse_pending_order(client)) {
+        return;
+    }
+
+    // Every item is checked before anything is ordered, a stale or closed restaurant rejects the whole cart
+    frame_t *reply = NULL;
+    pthread_mutex_lock(&restaurants_mutex);
+    for (int k = 0; k < count && reply == NULL; k++) {
+        const char *restaurant = restaurant_ports[ids[k] - 1].name;
+        reply = unavailable_frame;
+        for (int i = 0; i < MAX_RESTAURANTS; i++) {
+            if (restaurants[i].name == restaurant && restaurants[i].active && restaurants[i].menu != NULL) {
+                int current = restaurants[i].menu->version == versions[k] && menu_item(restaurants[i].menu, items[k]) != NULL;
+                reply = current ? NULL : restaurants[i].update_frame;
+                break;
+            }
+        }
+        if (reply != NULL) {
+            reply = frame_ref(reply);
+        }
+    }
+    pthread_mutex_unlock(&restaurants_mutex);
+    if (reply != NULL) {
+        printf("Cart rejected, a restaurant is closed or its menu changed\n");
+        if (send_client_frame(client, reply) < 0) {
+            perror("send");
+            close_connection(client->client_socket);
+        }
+        frame_unref(reply);
+        return;
+    }
+
+    for (int k = 0; k < count; k++) {
+        int retry_ms = admission_busy(ids[k]);
+        if (retry_ms > 0) {     // Nothing is ordered unless every restaurant can take its share
+            refuse_order(client, ids[k], retry_ms);
+            return;
+        }
+    }
+
+    cart_t *cart = calloc(1, sizeof(cart_t));
+    if (cart == NULL) {     // Without it the answers could not be put together, nothing is ordered
+        perror("calloc");
+        send_busy(client->client_socket, &client->token, BUSY_RETRY_MS, "Server is out of memory");
+        return;
+    }
+    char orders[MAX_RESTAURANTS][BUFFER_SIZE];
+    for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+        int len = snprintf(orders[id - 1], BUFFER_SIZE, "ORDER:");
+        for (int k = 0; k < count; k++) {
+            if (ids[k] == id) {
+                len += snprintf(orders[id - 1] + len, BUFFER_SIZE - len, " %d", items[k]);
+                cart->items[id - 1]++;
+            }
+        }
+    }
+    // Registered first, the answers come back on this thread after the orders go out
+    cart->slot = session_index(client);
+    for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+        cart->minutes[id - 1] = cart->items[id - 1] > 0 ? CART_WAITING : 0;
+        cart->waiting += cart->items[id - 1] > 0;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    cart->next = carts;
+    carts = cart;
+    pthread_mutex_unlock(&clients_mutex);
+    client->restaurant = 0;     // Replaces a menu flow the client had started
+    for (int id = 1; id <= MAX_RESTAURANTS; id++) {
+        if (strcmp(orders[id - 1], "ORDER:") != 0) {
+            // Journaled together, the writer commits them with one fdatasync and sends them all
+            send_order_to_restaurant(client, orders[id - 1], restaurant_ports[id - 1].name, wait_minutes, &trace);
+        }
+    }
+    printf("Cart of %d items split over %d restaurants\n", count, cart->waiting);
+}
+
+// Function to find the cart of a session, taking it off the list when unlink is set, caller holds clients_mutex
+cart_t *find_cart(uint32_t slot, int unlink) {
+    for (cart_t **link = &carts; *link != NULL; link = &(*link)->next) {
+        cart_t *cart = *link;
+        if (cart->slot == slot) {
+            if (unlink) {
+                *link = cart->next;
+            }
+            return cart;
+        }
+    }
+    return NULL;
+}
+
+// Function to note one restaurant's answer to a cart, the client hears once all have answered, caller holds clients_mutex
+void finish_cart_part(client_info_t *client, cart_t *cart, int id, int minutes, const trace_context_t *trace) {
+    cart->minutes[id - 1] = minutes;
+    if (--cart->waiting > 0) {
+        return;
+    }
+    find_cart(cart->slot, 1);
+
+    int longest = 0;
+    char breakdown[BUFFER_SIZE] = "";
+    size_t len = 0;
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (cart->items[i] == 0) {
+            continue;
+        }
+        if (cart->minutes[i] == CART_FAILED) {
+            len += snprintf(breakdown + len, sizeof(breakdown) - len, "%s: not available, %d items not ordered\n",
+                            restaurant_ports[i].name, cart->items[i]);
+        } else {
+            len += snprintf(breakdown + len, sizeof(breakdown) - len, "%s: %d minutes, %d items\n",
+                            restaurant_ports[i].name, cart->minutes[i], cart->items[i]);
+            longest = cart->minutes[i] > longest ? cart->minutes[i] : longest;
+        }
+        len = len < sizeof(breakdown) ? len : sizeof(breakdown) - 1;
+    }
+    char estimated_time[BUFFER_SIZE];
+    snprintf(estimated_time, sizeof(estimated_time), "Your order will be ready in %d minutes.\n%s", longest, breakdown);
+    deliver_estimated_time(client, estimated_time, trace);     // Trace of the restaurant that answered last
+    free(cart);
+}
+
+// Function to take an order in one round trip, checked against the menu version the client has cached
+void handle_direct_order(client_info_t *client, message_t *msg) {
+    int id = 0, item = 0, wait_minutes = 0;
+    unsigned int version = 0;
+    if (sscanf(msg->data, "%d %d %u %d", &id, &item, &version, &wait_minutes) < 3 || id < 1 || id > MAX_RESTAURANTS) {
+        printf("Invalid direct order\n");
+        close_client(client);
+        return;
+    }
+    if (refuse_pending_order(client)) {     // The journal and history match answers by token, one order at a time
+        return;
+    }
+    const char *restaurant = restaurant_ports[id - 1].name;
+
+    frame_t *reply = NULL;  // Fresh menu when the client's copy is out of date
+    int current = 0;
+    pthread_mutex_lock(&restaurants_mutex);
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (restaurants[i].name == restaurant && restaurants[i].active && restaurants[i].menu != NULL) {
+            if (restaurants[i].menu->version == version && menu_item(restaurants[i].menu, item) != NULL) {
+                current = 1;
+            } else if (restaurants[i].update_frame != NULL) {
+                reply = frame_ref(restaurants[i].update_frame);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&restaurants_mutex);
+
+    int retry_ms = current ? admission_busy(id) : 0;
+    if (retry_ms > 0) {
+        refuse_order(client, id, retry_ms);
+        return;
+    }
+    if (current) {
+        char order[32];
+        snprintf(order, sizeof(order), "ORDER: %d", item);
+        printf("Direct order for item %d from %s\n", item, restaurant);
+        client->restaurant = 0;     // Replaces a menu flow the client had started
+        trace_context_t trace;
+        trace_get(msg, &trace);
+        send_order_to_restaurant(client, order, restaurant, wait_minutes < 0 ? 0 : wait_minutes > UINT8_MAX ? UINT8_MAX : wait_minutes, &trace);
+        return;
+    }
+    if (reply == NULL) {
+        printf("Restaurant %s is not available\n", restaurant);
+        reply = frame_ref(unavailable_frame);
+    } else {
+        printf("Client's menu of %s is out of date, sending the current version\n", restaurant);
+        PROBE2(menu_served, session_probe_id(&client->token), id);
+    }
+    if (send_client_frame(client, reply) < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+    }
+    frame_unref(reply);
+}
+
+// Function to answer a page or search request from the restaurant's indexed menu
+void handle_menu_query(client_info_t *client, message_t *msg) {
+    int id = 0, page = 0;
+    char mode[16] = "";
+    menu_query_t query;
+    memset(&query, 0, sizeof(query));
+    int parsed;
+    if (msg->type == MSG_MENU_PAGE) {
+        parsed = sscanf(msg->data, "%d %d", &id, &page) == 2;
+    } else {
+        parsed = sscanf(msg->data, "%d %15s %u %u %63[^\n]", &id, mode, &query.min_cents, &query.max_cents, query.text) >= 4;
+        query.prefix = strcmp(mode, "prefix") == 0;
+    }
+    if (!parsed || id < 1 || id > MAX_RESTAURANTS) {
+        printf("Invalid menu query\n");
+        close_client(client);
+        return;
+    }
+    const char *restaurant = restaurant_ports[id - 1].name;
+
+    menu_t *menu = NULL;
+    pthread_mutex_lock(&restaurants_mutex);
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (restaurants[i].name == restaurant && restaurants[i].active) {
+            menu = menu_ref(restaurants[i].menu);   // Searched without holding the restaurants
+            break;
+        }
+    }
+    pthread_mutex_unlock(&restaurants_mutex);
+
+    frame_t *reply;
+    if (menu == NULL) {
+        reply = frame_ref(unavailable_frame);
+    } else if ((reply = frame_new(msg->type, NULL)) != NULL && msg->type == MSG_MENU_PAGE) {
+        int len = snprintf(reply->msg.data, BUFFER_SIZE, "%d %u %d %u\n", id, menu->version, page, menu->page_count);
+        menu_page(menu, page, reply->msg.data + len, BUFFER_SIZE - len);
+    } else if (reply != NULL) {
+        char lines[MENU_PAGE_BYTES];
+        int shown;
+        int matches = menu_search(menu, &query, lines, sizeof(lines), &shown);
+        snprintf(reply->msg.data, BUFFER_SIZE, "%d %u %d %d\n%s", id, menu->version, matches, shown, lines);
+    }
+    menu_put(menu);
+    if (send_client_frame(client, reply) < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+    }
+    frame_unref(reply);
+}
+
+// Function to append one part of a menu sent over several frames
+int append_menu_part(int id, const char *part) {
+    menu_upload_t *upload = &menu_uploads[id - 1];
+    size_t len = strnlen(part, BUFFER_SIZE - 1);
+    if (upload->len + len > MENU_MAX_LEN) {
+        printf("Menu from %s is too large\n", restaurant_ports[id - 1].name);
+        discard_menu_upload(id);
+        return -1;
+    }
+    char *grown = realloc(upload->text, upload->len + len + 1);
+    if (grown == NULL) {
+        discard_menu_upload(id);
+        return -1;
+    }
+    memcpy(grown + upload->len, part, len);
+    upload->text = grown;
+    upload->len += len;
+    upload->text[upload->len] = '\0';
+    return 0;
+}
+
+void discard_menu_upload(int id) {
+    free(menu_uploads[id - 1].text);
+    menu_uploads[id - 1].text = NULL;
+    menu_uploads[id - 1].len = 0;
+}
+
+// Function to forget a restaurant's registration, caller holds restaurants_mutex
+void clear_restaurant(restaurant_info_t *restaurant) {
+    int id = restaurant_id(restaurant->name);
+    if (id > 0 && restaurant->menu != NULL) {   // Cached copies of it stay current across a reconnect
+        menu_put(last_menus[id - 1]);
+        last_menus[id - 1] = restaurant->menu;
+    } else {
+        menu_put(restaurant->menu);
+    }
+    frame_unref(restaurant->menu_frame);
+    frame_unref(restaurant->update_frame);
+    memset(restaurant, 0, sizeof(restaurant_info_t));
+}
+
+// Function to encode a restaurant's menu once for all the clients it goes to, caller holds restaurants_mutex
+void encode_menu(restaurant_info_t *restaurant, int id, menu_t *menu) {
+    frame_unref(restaurant->menu_frame);
+    frame_unref(restaurant->update_frame);
+    restaurant->menu_frame = frame_text(MSG_MENU, NULL, menu->text);
+    restaurant->update_frame = frame_new(MSG_MENU_UPDATE, NULL);
+    if (restaurant->update_frame != NULL) {   // Large menus start with their first page, clients fetch the rest
+        char *data = restaurant->update_frame->msg.data;
+        int len = snprintf(data, BUFFER_SIZE, "%d %u %u\n", id, menu->version, menu->page_count);
+        menu_page(menu, 0, data + len, BUFFER_SIZE - len);
+    }
+}
+
+// Function to map an interned restaurant name to its id, 0 when unknown
+int restaurant_id(const char *name) {
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (restaurant_ports[i].name == name) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Function to handle a message from a restaurant
+void handle_restaurant(int restaurant_socket, const char *name, message_t *msg) {
+    printf("Received message type: %d from %s\n", msg->type, name);
+
+    int id = restaurant_id(name);
+    switch (msg->type) {
+        case MSG_MENU_PART:
+            if (append_menu_part(id, msg->data) < 0) {
+                close_connection(restaurant_socket);
+            }
+            break;
+        case MSG_MENU:
+            msg->data[BUFFER_SIZE - 1] = '\0';
+            menu_t *menu;
+            if (menu_uploads[id - 1].text != NULL) {    // Last part of a menu sent over several frames
+                if (append_menu_part(id, msg->data) < 0) {
+                    close_connection(restaurant_socket);
+                    break;
+                }
+                menu = menu_get(menu_uploads[id - 1].text);
+                discard_menu_upload(id);
+            } else {
+                menu = menu_get(msg->data);     // Shared with any restaurant serving the same menu
+            }
+            if (menu == NULL) {
                 break;
-            default:
-                printf("In client: Unexpected message type: %d\n", msg.type);
-                close(client->client_socket);
-                pthread_exit(NULL);
+            }
+            pthread_mutex_lock(&restaurants_mutex);
+            int slot = -1;
+            int registered = 0;
+            int changed = 0;    // Subscribers hear about it
+            int retry_ms = 0;   // Registration refused, the restaurant sends its menu again after this long
+            for (int i = 0; i < MAX_RESTAURANTS; i++) {
+                if (restaurants[i].restaurant_socket == restaurant_socket) {   // Menu update from a known restaurant
+                    slot = i;
+                    break;
+                }
+                if (slot < 0 && restaurants[i].restaurant_socket == 0) {
+                    slot = i;
+                }
+            }
+            if (slot >= 0 && restaurants[slot].restaurant_socket == 0 && !ratelimit_take(&register_limit, monotonic_us())) {
+                retry_ms = (int)ratelimit_wait_ms(&register_limit);   // Restaurants coming back after an outage take turns
+                slot = -1;
+            }
+            if (slot >= 0) {
+                if (restaurants[slot].restaurant_socket == 0) {     // First menu registers the restaurant
+                    socklen_t addrlen = sizeof(restaurants[slot].address);
+                    restaurants[slot].restaurant_socket = restaurant_socket;
+                    restaurants[slot].name = name;
+                    getpeername(restaurant_socket, (struct sockaddr *)&restaurants[slot].address, &addrlen);
+                    registered = 1;
+                }
+                menu_t *old_menu = restaurants[slot].menu;
+                if (menu != old_menu) {
+                    encode_menu(&restaurants[slot], id, menu);
+                }
+                changed = registered || menu != old_menu || !restaurants[slot].active;
+                restaurants[slot].menu = menu;
+                menu = old_menu;    // Released below
+                restaurants[slot].last_keep_alive = time(NULL);
+                restaurants[slot].active = 1; // Set restaurant as active
+            }
+            pthread_mutex_unlock(&restaurants_mutex);
+            menu_put(menu);
+            if (retry_ms > 0) {
+                printf("Too many registrations, %s registers again in %d ms\n", name, retry_ms);
+                send_busy(restaurant_socket, NULL, retry_ms, "Too many registrations");
+            }
+            if (registered) {
+                open_admission(id, restaurant_socket);
+                forward_recovered_orders(name);
+            }
+            if (changed) {
+                update_catalog(name);
+                publish_availability(name);
+            }
+            break;
+        case MSG_KEEP_ALIVE:
+            pthread_mutex_lock(&restaurants_mutex);
+            for (int i = 0; i < MAX_RESTAURANTS; i++) {
+                if (restaurants[i].restaurant_socket == restaurant_socket) {
+                    restaurants[i].last_keep_alive = time(NULL);
+                    printf("Keep-alive received from %s\n", restaurants[i].name);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&restaurants_mutex);
+            break;
+        case MSG_ESTIMATED_TIME:
+            // Find the client that placed the order, restaurants echo its token back
+            trace_stamp(msg, TRACE_SERVER_REPLY);
+            trace_context_t trace;
+            trace_get(msg, &trace);
+            PROBE3(eta_received, session_probe_id(&msg->client_token), trace.id, id);
+            journal_append(JOURNAL_DONE, &msg->client_token, id, 0, NULL, -1, NULL);    // Order no longer needs replaying
+            return_credit(id, restaurant_socket);
+            pthread_mutex_lock(&clients_mutex);
+            record_completed_order(&msg->client_token, id, msg->data);
+            client_info_t *client = session_lookup(&msg->client_token);
+            cart_t *cart = client != NULL ? find_cart(session_index(client), 0) : NULL;
+            if (cart != NULL && cart->minutes[id - 1] == CART_WAITING) {
+                finish_cart_part(client, cart, id, quoted_minutes(msg->data), &trace);  // Answered once every restaurant has
+            } else if (client != NULL) {
+                deliver_estimated_time(client, msg->data, &trace);
+            } else {
+                printf("No client for estimated time from %s\n", name);
+            }
+            pthread_mutex_unlock(&clients_mutex);
+            if (trace_file != NULL && trace.id != 0 && (trace.keep || (trace_sample != 0 && trace.id % trace_sample == 0))) {
+                trace_write(trace_file, &trace, name);
+            }
+            break;
+        case MSG_CAPACITY: {
+            int free_slots = 0;
+            unsigned int received = 0;
+            if (sscanf(msg->data, "%d %u", &free_slots, &received) == 2 && free_slots >= 0) {
+                set_capacity(id, restaurant_socket, free_slots, received);
+            }
+            break;
         }
+        case MSG_LEAVE:
+            pthread_mutex_lock(&restaurants_mutex);
+            for (int i = 0; i < MAX_RESTAURANTS; i++) {
+                if (restaurants[i].restaurant_socket == restaurant_socket) {
+                    printf("Restaurant %s left and its data has been cleared.\n", restaurants[i].name);
+                    PROBE2(restaurant_inactive, id, RESTAURANT_LEFT);
+                    clear_restaurant(&restaurants[i]);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&restaurants_mutex);
+            update_catalog(name);
+            publish_availability(name);
+            close_connection(restaurant_socket);
+            break;
+        default:
+            printf("In %s: Unexpected message type: %d\n", name, msg->type);
+            close_connection(restaurant_socket);
+            break;
     }
-
-    close(client->client_socket);   // Close client socket after client disconnects
-
-    pthread_mutex_lock(&clients_mutex); // Lock clients array to prevent from multiple threads accessing it simultaneously
-    memset(client, 0, sizeof(client_info_t));   // Clear client information after client disconnects
-    pthread_mutex_unlock(&clients_mutex);   // Unlock clients array
-
-    return NULL;    // Return NULL to exit thread
 }
 
 
+// Function to read the minutes out of "Your order will be ready in N minutes."
+int quoted_minutes(const char *estimated_time) {
+    const char *minutes = estimated_time;
+    while (*minutes != '\0' && (*minutes < '0' || *minutes > '9')) {
+        minutes++;
+    }
+    return atoi(minutes);
+}
 
+// Function to move the items a restaurant answered for into the history, caller holds clients_mutex
+void record_completed_order(const session_token_t *token, int id, const char *estimated_time) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    in_flight_t **link = &in_flight;
+    while (*link != NULL) {
+        in_flight_t *order = *link;
+        if (memcmp(&order->token, token, sizeof(session_token_t)) != 0 || order->restaurant != id) {
+            link = &order->next;
+            continue;
+        }
+        *link = order->next;
+
+        history_row_t row;
+        row.time = (uint32_t)time(NULL);
+        row.restaurant = order->restaurant;
+        row.item = order->item;
+        row.price_cents = order->price_cents;
+        row.quoted_eta = (uint32_t)quoted_minutes(estimated_time) * 60;
+        row.latency_ms = (uint32_t)((now.tv_sec - order->started.tv_sec) * 1000 + (now.tv_nsec - order->started.tv_nsec) / 1000000);
+        if (history_append(&row) < 0) {
+            printf("Could not record order in the history\n");
+        }
+        free(order);
+    }
+}
 
 // Function to manage client tokens
 void *token_manager(void *arg) {
@@ -328,11 +2144,26 @@ void *token_manager(void *arg) {
         time_t current_time = time(NULL);   // Get current time
 
         pthread_mutex_lock(&clients_mutex); // Lock clients array to prevent from multiple threads accessing it simultaneously
-        for (int i = 0; i < MAX_CLIENTS; i++) {  // Loop through clients array
-            if (clients[i].client_socket != 0 && difftime(current_time, clients[i].last_keep_alive) > TOKEN_TIMEOUT) {  // Check if token is expired
-                printf("Token expired for client: %s\n", clients[i].token);   // Print message for expired token
-                close(clients[i].client_socket);    // Close client socket
-                memset(&clients[i], 0, sizeof(client_info_t));  // Clear client information after token expires
+        for (uint32_t i = 0; i < session_capacity(); i++) {  // Loop through clients array
+            client_info_t *client = session_at(i);
+            if (client->client_socket == SESSION_DETACHED) {
+                if (difftime(current_time, client->last_keep_alive) > RESUME_TIMEOUT) {
+                    release_session(client);    // Client did not come back in time
+                }
+                continue;
+            }
+            if (client->client_socket != 0 && difftime(current_time, client->last_keep_alive) > TOKEN_TIMEOUT) {  // Check if token is expired
+                char token[2 * TOKEN_SIZE + 1];
+                token_to_hex(&client->token, token);
+                printf("Token expired for client: %s\n", token);   // Print message for expired token
+                PROBE1(token_expired, session_probe_id(&client->token));
+                if (client->flags & SESSION_STREAM) {
+                    end_stream(client);     // The gateway and its other streams stay
+                    continue;
+                }
+                client->flags |= SESSION_EXPIRED;
+                io_shutdown(client->client_socket);    // The event loop clears the client once the socket is closed
+                client->last_keep_alive = current_time;
             }
         }
         pthread_mutex_unlock(&clients_mutex);   // Unlock clients array
@@ -346,6 +2177,8 @@ void *active_restaurants_manager(void *arg) {
         sleep(5);
         time_t current_time = time(NULL);   // Get current time
 
+        const char *expired[MAX_RESTAURANTS];  // Restaurants that just closed, published after unlocking
+        int expired_count = 0;
         pthread_mutex_lock(&restaurants_mutex); // Lock restaurants array to prevent from multiple threads accessing it simultaneously
         for (int i = 0; i < MAX_RESTAURANTS; i++) {  // Loop through restaurants array
             printf("this is the scoekt ->> %d\n",restaurants[i].restaurant_socket);
@@ -353,489 +2186,440 @@ void *active_restaurants_manager(void *arg) {
             if ((restaurants[i].restaurant_socket != 0 && difftime(current_time, restaurants[i].last_keep_alive) > RESTAURANT_TIMEOUT && restaurants[i].active == 1) || restaurants[i].restaurant_socket == 0) {  // Check if keep-alive is expired
                 if (restaurants[i].active == 1){
                     printf("Keep-alive expired for restaurant: %s\n", restaurants[i].name);   // Print message for expired keep-alive
+                    PROBE2(restaurant_inactive, i + 1, RESTAURANT_SILENT);
+                    expired[expired_count++] = restaurants[i].name;
                 }
                 restaurants[i].active = 0;    // Set restaurant as inactive
             }
         }
         pthread_mutex_unlock(&restaurants_mutex);   // Unlock restaurants array
+        for (int i = 0; i < expired_count; i++) {
+            update_catalog(expired[i]);
+            publish_availability(expired[i]);
+        }
     }
     return NULL;
 }
 
-// Function to generate a random token
-char *generate_token() {
-    static char token[BUFFER_SIZE]; // Static buffer to store token
-    sprintf(token, "USER_%ld", time(NULL) + rand() % 10000);    // Generate token based on current time and random number
-    return token;   // Return generated token
+// Function to send a new client its token, caller holds clients_mutex
+void send_token_to_client(client_info_t *client) {
+    char token[2 * TOKEN_SIZE + 1];
+    token_to_hex(&client->token, token);
+    frame_t *frame = frame_text(MSG_TOKEN, &client->token, token);   // Printable copy for the client's logs
+    int ret = send_client_frame(client, frame);
+    frame_unref(frame);
+    if (ret < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+        return;
+    }
+    printf("Client connected with token: %s\n", token);   // Print message when client connects
 }
 
 // Function to send restaurant options to client
 void send_restaurant_options(client_info_t *client) {
-    message_t msg;
-    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-    msg.type = MSG_RESTAURANT_OPTIONS;
-    strcpy(msg.data, "Choose a restaurant:\n1. McDonalds\n2. Dominos\n3. Taco Bell\n");
-    ssize_t bytes_sent = send(client->client_socket, &msg, sizeof(message_t), 0);
-    if (bytes_sent <= 0) {
+    if (send_client_frame(client, options_frame) < 0) {
         perror("send");
-        close(client->client_socket);
-        pthread_exit(NULL);
+        close_connection(client->client_socket);
     }
 }
 
 // Function to send menu to client from database
 void send_menu_to_client(client_info_t *client, const char *restaurant) {
-    message_t msg;
-    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-    msg.type = MSG_MENU;
+    frame_t *frame = NULL;
 
     pthread_mutex_lock(&restaurants_mutex); // Lock restaurants array to prevent from multiple threads accessing it simultaneously
     for (int i = 0; i < MAX_RESTAURANTS; i++) {
-        if (strcmp(restaurants[i].name, restaurant) == 0) {
-            strncpy(msg.data, restaurants[i].menu, BUFFER_SIZE);
-            strcpy(msg.client_token, client->token); // Include the client's token in the message
+        if (restaurants[i].name == restaurant && restaurants[i].menu_frame != NULL) {
+            frame = frame_ref(restaurants[i].menu_frame);
             break;
         }
     }
     pthread_mutex_unlock(&restaurants_mutex);   // Unlock restaurants array
+    if (frame == NULL) {
+        frame = frame_new(MSG_MENU, NULL);  // Restaurant is gone, the client gets an empty menu
+    }
 
-    ssize_t bytes_sent = send(client->client_socket, &msg, sizeof(message_t), 0);
-    if (bytes_sent <= 0) {
+    if (send_client_frame(client, frame) < 0) {
         perror("send");
-        close(client->client_socket);
-        pthread_exit(NULL);
+        close_connection(client->client_socket);
     }
+    frame_unref(frame);
 }
+// Function to give an order a trace id when the client sent none and stamp when the server read it
+void receive_trace(message_t *msg) {
+    trace_context_t trace;
+    if (!trace_get(msg, &trace)) {
+        return;     // Text fills the frame, nothing to carry a trace in
+    }
+    if (trace.id == 0) {
+        trace.id = ++trace_next;
+    }
+    trace.stamps[TRACE_SERVER_RECEIVE] = trace_now();
+    trace_put(msg, &trace);
+    PROBE2(order_received, session_probe_id(&msg->client_token), trace.id);
+}
+
 // Function to forward order to restaurant
-void send_order_to_restaurant(client_info_t *client, const char *order, const char *restaurant) {
+void send_order_to_restaurant(client_info_t *client, const char *order, const char *restaurant, int wait_minutes, const trace_context_t *trace) {
     int restaurant_socket = -1;
-    restaurant_info_t *restaurant_info = NULL;
+    uint8_t id = restaurant_id(restaurant);
+    uint16_t items[CART_MAX_ITEMS];     // "ORDER: N", or "ORDER: N N ..." for a restaurant's share of a cart
+    uint32_t prices[CART_MAX_ITEMS];
+    int item_count = 0;
+    int offset = 0;
+
+    if (sscanf(order, "ORDER: %n", &offset) == 0 && offset > 0) {
+        const char *p = order + offset;
+        int used;
+        while (item_count < CART_MAX_ITEMS && sscanf(p, "%hu%n", &items[item_count], &used) == 1) {
+            prices[item_count++] = 0;
+            p += used;
+        }
+    }
 
     // Find the restaurant socket based on the name
     pthread_mutex_lock(&restaurants_mutex);
     for (int i = 0; i < MAX_RESTAURANTS; i++) {
-        if (strcmp(restaurants[i].name, restaurant) == 0) {
+        if (restaurants[i].name == restaurant) {
             restaurant_socket = restaurants[i].restaurant_socket;
-            restaurant_info = &restaurants[i];
+            for (int k = 0; k < item_count && restaurants[i].menu != NULL; k++) {
+                prices[k] = menu_price_cents(restaurants[i].menu, items[k]);
+            }
             break;
         }
     }
     pthread_mutex_unlock(&restaurants_mutex);
 
     if (restaurant_socket < 0) {
-        message_t msg;
-        memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-        msg.type = MSG_ESTIMATED_TIME;
-        snprintf(msg.data, BUFFER_SIZE, "Restaurant %s is not available.\n", restaurant);
-        strcpy(msg.client_token, client->token); // Include the client's token in the message
-        ssize_t bytes_sent = send(client->client_socket, &msg, sizeof(message_t), 0);
-        if (bytes_sent <= 0) {
+        frame_t *frame = frame_new(MSG_ESTIMATED_TIME, &client->token);    // Include the client's token in the message
+        if (frame != NULL) {
+            snprintf(frame->msg.data, BUFFER_SIZE, "Restaurant %s is not available.\n", restaurant);
+        }
+        if (send_client_frame(client, frame) < 0) {
             perror("send");
-            close(client->client_socket);
-            pthread_exit(NULL);
+            close_connection(client->client_socket);
         }
+        frame_unref(frame);
         return;
     }
 
     // Send the order to the restaurant
-    message_t msg;
-    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-    msg.type = MSG_ORDER;
-    strncpy(msg.data, order, BUFFER_SIZE);
-    strcpy(msg.client_token, client->token); // Include the client's token in the message
-    ssize_t bytes_sent = send(restaurant_socket, &msg, sizeof(message_t), 0);
-    if (bytes_sent <= 0) {
-        perror("send");
-        close(client->client_socket);
-        pthread_exit(NULL);
+    frame_t *frame = frame_text(MSG_ORDER, &client->token, order);  // Include the client's token in the message
+    if (frame != NULL && trace != NULL) {
+        trace_context_t hop = *trace;
+        hop.restaurant = id;
+        trace_put(&frame->msg, &hop);   // Stamped again when the order actually goes out
     }
+    pthread_mutex_lock(&clients_mutex);
+    client->flags |= SESSION_ORDER_PENDING;     // Cleared when the estimated time is delivered or parked
+    for (int k = 0; k < item_count; k++) {      // Each item goes into the history on its own
+        in_flight_t *pending = malloc(sizeof(in_flight_t));
+        if (pending != NULL) {
+            pending->token = client->token;
+            pending->restaurant = id;
+            pending->item = items[k];
+            pending->price_cents = prices[k];
+            clock_gettime(CLOCK_MONOTONIC, &pending->started);
+            pending->next = in_flight;
+            in_flight = pending;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    for (int k = 0; k < item_count; k++) {
+        analytics_record(id, items[k], prices[k]);  // Lock-free, analytics never hold up the order
+    }
+    // Journal the order first, once it is durable the writer queues it for the restaurant's kitchen
+    if (frame != NULL) {
+        pthread_mutex_lock(&admission_mutex);
+        admissions[id - 1].admitting++;     // Held from now on, so the next order sees it
+        pthread_mutex_unlock(&admission_mutex);
+    }
+    journal_append(JOURNAL_ORDER, &client->token, id, wait_minutes, order, frame != NULL ? restaurant_socket : -1, frame);
+    frame_unref(frame);     // The journal holds its own reference until the order is sent
 }
 
-// Function to send estimated time to client
-void send_estimated_time_to_client(int client_socket, const char *estimated_time) {
-    message_t msg;
-    memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-    msg.type = MSG_ESTIMATED_TIME;
-    strncpy(msg.data, estimated_time, BUFFER_SIZE);
-    // strcpy(msg.client_token, client->token); // Include the client's token in the message
-    ssize_t bytes_sent = send(client_socket, &msg, sizeof(message_t), 0);
-    if (bytes_sent <= 0) {
-        perror("send");
-        close(client_socket);
-        pthread_exit(NULL);
+// Function to hand an estimated time to its client, or park it until the client resumes, caller holds clients_mutex
+void deliver_estimated_time(client_info_t *client, const char *estimated_time, const trace_context_t *trace) {
+    client->flags &= ~SESSION_ORDER_PENDING;
+    if (client->client_socket != SESSION_DETACHED) {
+        send_estimated_time_to_client(client, estimated_time, trace);
+        return;
+    }
+    parked_eta_t *parked = malloc(sizeof(parked_eta_t));     // Delivered when the client resumes
+    if (parked != NULL) {
+        parked->slot = session_index(client);
+        strncpy(parked->data, estimated_time, BUFFER_SIZE - 1);
+        parked->data[BUFFER_SIZE - 1] = '\0';
+        parked->next = parked_etas;
+        parked_etas = parked;
     }
 }
 
-// Function to handle TCP communication with McDonald's
-void *restaurant_tcp_handler_mcdonalds(void *arg) {
-    int *tcp_socket = (int *)arg;
-    struct sockaddr_in tcp_addr;
-
-    if ((*tcp_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("TCP socket creation failed");
-        pthread_exit(NULL);
+// Function to tell a client its order was dropped before it reached the restaurant, caller holds clients_mutex
+void fail_order(const session_token_t *token, int id) {
+    client_info_t *client = session_lookup(token);
+    if (client == NULL) {
+        return;
     }
-
-    tcp_addr.sin_family = AF_INET;
-    tcp_addr.sin_addr.s_addr = INADDR_ANY;
-    tcp_addr.sin_port = htons(MCDONALDS_PORT);
-
-    if (bind(*tcp_socket, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
-        perror("TCP bind failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+    cart_t *cart = find_cart(session_index(client), 0);
+    if (cart != NULL) {
+        if (cart->minutes[id - 1] != CART_WAITING) {
+            return;     // Its part was answered or failed already
+        }
+        finish_cart_part(client, cart, id, CART_FAILED, NULL);
+    } else if (client->flags & SESSION_ORDER_PENDING) {
+        char estimated_time[BUFFER_SIZE];
+        snprintf(estimated_time, sizeof(estimated_time), "Restaurant %s is not available, your order was not placed.\n",
+                 restaurant_ports[id - 1].name);
+        deliver_estimated_time(client, estimated_time, NULL);   // Clears the pending order, the next one is taken
+    } else {
+        return;     // Told when another copy of the same order was dropped
     }
+    journal_append(JOURNAL_DONE, token, id, 0, NULL, -1, NULL);     // Not replayed after a restart either
+}
 
-    if (listen(*tcp_socket, 1) < 0) {
-        perror("TCP listen failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+// Function to queue an order for its restaurant once it is durable, other frames go straight out;
+// an order the journal could not write is not placed, a restart would not know it
+int order_durable(const journal_header_t *header, int fd, frame_t *frame, int durable) {
+    if (header->type != JOURNAL_ORDER || header->restaurant < 1 || header->restaurant > MAX_RESTAURANTS) {
+        return send_frame(fd, frame);
     }
+    pthread_mutex_lock(&admission_mutex);
+    admissions[header->restaurant - 1].admitting--;
+    pthread_mutex_unlock(&admission_mutex);
+    if (!durable) {
+        pthread_mutex_lock(&clients_mutex);
+        fail_order(&header->token, header->restaurant);
+        pthread_mutex_unlock(&clients_mutex);
+        return 0;
+    }
+    admit_order(header->restaurant, order_deadline(header->time, header->wait_minutes), frame);
+    return 0;
+}
 
-    printf("Server listening for McDonald's TCP connections on port %d\n", MCDONALDS_PORT);
-
-    while (1) {
-        int restaurant_socket;
-        struct sockaddr_in restaurant_addr;
-        socklen_t addrlen = sizeof(restaurant_addr);
+// Function to work out when an order placed at a time (seconds since the epoch) should be ready, in milliseconds
+uint64_t order_deadline(uint32_t placed, uint8_t wait_minutes) {
+    return ((uint64_t)placed + 60ULL * (wait_minutes != 0 ? wait_minutes : ADMISSION_DEFAULT_WAIT)) * 1000;
+}
 
-        if ((restaurant_socket = accept(*tcp_socket, (struct sockaddr *)&restaurant_addr, &addrlen)) < 0) {
-            perror("TCP accept failed");
-            continue;
-        }
-        printf("McDonald's connected to TCP\n");
-
-        message_t msg;
-        memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-        while (1) {
-            ssize_t bytes_received = recv(restaurant_socket, &msg, sizeof(message_t), 0);
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    printf("Restaurant disconnected\n");
-                } else {
-                    perror("recv");
-                }
-                close(restaurant_socket);
-                break;
-            }
-            printf("Received message type: %d from McDonald's\n", msg.type);
-
-            switch (msg.type) {
-                case MSG_MENU:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == 0) {
-                            restaurants[i].restaurant_socket = restaurant_socket;
-                            strncpy(restaurants[i].name, "McDonalds", BUFFER_SIZE);
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].address = restaurant_addr;
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                            break;
-                        }
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_KEEP_ALIVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].last_keep_alive = time(NULL);
-                            printf("Keep-alive received from %s\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_ESTIMATED_TIME:
-                    // Find the corresponding client and send the estimated time
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        if (clients[i].client_socket != 0) {
-                            send_estimated_time_to_client(clients[i].client_socket, msg.data);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                    break;
-                case MSG_LEAVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].active = 0;
-                            memset(&restaurants[i], 0, sizeof(restaurant_info_t));
-                            printf("Restaurant %s left and its data has been cleared.\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    close(restaurant_socket);
-                    pthread_exit(NULL);
-                    break;
-                default:
-                    printf("In McDonald's: Unexpected message type: %d\n", msg.type);
-                    close(restaurant_socket);
-                    break;
-            }
+// Function to queue an order by deadline and send the restaurant what its kitchen has room for
+void admit_order(int id, uint64_t deadline, frame_t *frame) {
+    admission_t *admission = &admissions[id - 1];
+    int dropped = 0;
+    pthread_mutex_lock(&admission_mutex);
+    if (admission->restaurant_socket == 0) {
+        admission->dropped++;   // Left before the order was durable
+        dropped = 1;
+    } else if (admission_push(&admission->queue, deadline, monotonic_us(), frame_ref(frame)) == 0) {
+        admission->waited += admission->credits <= 0;
+        release_orders(admission);
+    } else {
+        frame_unref(frame);
+        uint64_t order = trace_stamp(&frame->msg, TRACE_SERVER_FORWARD);
+        PROBE3(order_forwarded, session_probe_id(&frame->msg.client_token), order, id);
+        if (send_frame(admission->restaurant_socket, frame) < 0) {  // Out of memory, send it without waiting
+            perror("send");
         }
+        admission->released++;  // Spends a credit like any order sent, the next capacity report counts it
+        admission->credits--;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    if (dropped) {  // Not under admission_mutex, a hand-over takes clients_mutex first
+        pthread_mutex_lock(&clients_mutex);
+        fail_order(&frame->msg.client_token, id);
+        pthread_mutex_unlock(&clients_mutex);
     }
-
-    close(*tcp_socket);
-    pthread_exit(NULL);
 }
 
-
-// Function to handle TCP communication with Domino's
-void *restaurant_tcp_handler_dominos(void *arg) {
-    int *tcp_socket = (int *)arg;
-    struct sockaddr_in tcp_addr;
-
-    if ((*tcp_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("TCP socket creation failed");
-        pthread_exit(NULL);
+// Function to send queued orders, earliest deadline first, while credits last, caller holds admission_mutex
+void release_orders(admission_t *admission) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    uint64_t now_us = monotonic_us();
+    while (admission->queue.count > 0 && admission->credits > 0) {
+        uint64_t deadline, since;
+        frame_t *frame = admission_pop(&admission->queue, &deadline, &since);
+        codel_sample(&admission->hold, now_us - since, now_us);
+        uint64_t order = trace_stamp(&frame->msg, TRACE_SERVER_FORWARD);
+        PROBE3(order_forwarded, session_probe_id(&frame->msg.client_token), order, admission - admissions + 1);
+        if (send_frame(admission->restaurant_socket, frame) < 0) {  // Queued by the backend, never blocks
+            perror("send");
+        }
+        frame_unref(frame);
+        admission->released++;
+        admission->credits--;
+        admission->late += deadline < now_ms;
     }
+}
 
-    tcp_addr.sin_family = AF_INET;
-    tcp_addr.sin_addr.s_addr = INADDR_ANY;
-    tcp_addr.sin_port = htons(DOMINOS_PORT);
+// Function to start releasing orders to a restaurant that registered, a window of them until it reports its capacity
+void open_admission(int id, int restaurant_socket) {
+    pthread_mutex_lock(&admission_mutex);
+    admissions[id - 1].restaurant_socket = restaurant_socket;
+    admissions[id - 1].credits = ORDER_WINDOW;
+    admissions[id - 1].released = 0;
+    admissions[id - 1].reports = 0;
+    pthread_mutex_unlock(&admission_mutex);
+}
 
-    if (bind(*tcp_socket, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
-        perror("TCP bind failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+// Function to drop the orders a restaurant that went away was still holding and tell their clients
+void close_admission(int id, int restaurant_socket) {
+    admission_t *admission = &admissions[id - 1];
+    admission_queue_t dropped;
+    memset(&dropped, 0, sizeof(dropped));
+    pthread_mutex_lock(&admission_mutex);
+    if (admission->restaurant_socket == restaurant_socket) {
+        admission->restaurant_socket = 0;
+        dropped = admission->queue;     // Taken whole, the clients are told without admission_mutex
+        admission->queue.heap = NULL;
+        admission->queue.count = admission->queue.size = 0;
+        admission->dropped += dropped.count;
     }
-
-    if (listen(*tcp_socket, 1) < 0) {
-        perror("TCP listen failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+    pthread_mutex_unlock(&admission_mutex);
+    frame_t *frame;
+    pthread_mutex_lock(&clients_mutex);
+    while ((frame = admission_pop(&dropped, NULL, NULL)) != NULL) {
+        fail_order(&frame->msg.client_token, id);
+        frame_unref(frame);
     }
+    pthread_mutex_unlock(&clients_mutex);
+    admission_free(&dropped);
+}
 
-    printf("Server listening for Domino's TCP connections on port %d\n", DOMINOS_PORT);
-
-    while (1) {
-        int restaurant_socket;
-        struct sockaddr_in restaurant_addr;
-        socklen_t addrlen = sizeof(restaurant_addr);
-
-        if ((restaurant_socket = accept(*tcp_socket, (struct sockaddr *)&restaurant_addr, &addrlen)) < 0) {
-            perror("TCP accept failed");
-            continue;
-        }
-        printf("Domino's connected to TCP\n");
-
-        message_t msg;
-        memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-        while (1) {
-            ssize_t bytes_received = recv(restaurant_socket, &msg, sizeof(message_t), 0);
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    printf("Restaurant disconnected\n");
-                } else {
-                    perror("recv");
-                }
-                close(restaurant_socket);
-                break;
-            }
-            printf("Received message type: %d from Domino's\n", msg.type);
-
-            switch (msg.type) {
-                case MSG_MENU:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == 0) {
-                            restaurants[i].restaurant_socket = restaurant_socket;
-                            strncpy(restaurants[i].name, "Dominos", BUFFER_SIZE);
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].address = restaurant_addr;
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                            break;
-                        }
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_KEEP_ALIVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].last_keep_alive = time(NULL);
-                            printf("Keep-alive received from %s\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_ESTIMATED_TIME:
-                    // Find the corresponding client and send the estimated time
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        if (clients[i].client_socket != 0) {
-                            send_estimated_time_to_client(clients[i].client_socket, msg.data);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                    break;
-                case MSG_LEAVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].active = 0;
-                            memset(&restaurants[i], 0, sizeof(restaurant_info_t));
-                            printf("Restaurant %s left and its data has been cleared.\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    close(restaurant_socket);
-                    pthread_exit(NULL);
-                    break;
-                default:
-                    printf("In Domino's: Unexpected message type: %d\n", msg.type);
-                    close(restaurant_socket);
-                    break;
-            }
-        }
+// Function to take a restaurant's capacity report as its credits, orders it had not received yet count against it
+void set_capacity(int id, int restaurant_socket, int free_slots, uint32_t received) {
+    admission_t *admission = &admissions[id - 1];
+    pthread_mutex_lock(&admission_mutex);
+    if (admission->restaurant_socket == restaurant_socket) {
+        int32_t unseen = (int32_t)(admission->released - received);    // Sent before the report was, still on the wire
+        admission->credits = free_slots > unseen ? free_slots - unseen : 0;
+        admission->reports = 1;
+        release_orders(admission);
     }
+    pthread_mutex_unlock(&admission_mutex);
+}
 
-    close(*tcp_socket);
-    pthread_exit(NULL);
+// Function to give back the credit of an answered order to a restaurant that does not report its capacity
+void return_credit(int id, int restaurant_socket) {
+    admission_t *admission = &admissions[id - 1];
+    pthread_mutex_lock(&admission_mutex);
+    if (admission->restaurant_socket == restaurant_socket && !admission->reports && admission->credits < ORDER_WINDOW) {
+        admission->credits++;
+        release_orders(admission);
+    }
+    pthread_mutex_unlock(&admission_mutex);
 }
 
-// Function to handle TCP communication with Taco Bell
-void *restaurant_tcp_handler_taco_bell(void *arg) {
-    int *tcp_socket = (int *)arg;
-    struct sockaddr_in tcp_addr;
+// Function to tell whether a restaurant takes an order now, returns 0 or the milliseconds to wait, event loop only
+int admission_busy(int id) {
+    admission_t *admission = &admissions[id - 1];
+    uint64_t now = monotonic_us();
+    pthread_mutex_lock(&admission_mutex);
+    // Orders on their way through the journal that a credit will not cover are held as well
+    int full = (int64_t)admission->queue.count + admission->admitting - (admission->credits > 0 ? admission->credits : 0) >= max_held;
+    admission->refused += full;
+    int retry_ms = full ? BUSY_RETRY_MS : 0;
+    if (!full && codel_shed(&admission->hold, now)) {   // Held orders stand above target, shed before the hold fills
+        retry_ms = (int)(admission->hold.interval / 1000);
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    if (retry_ms == 0 && codel_shed(&loop_delay, now)) {    // Event loop falling behind, spare the orders it has
+        retry_ms = (int)(loop_delay.interval / 1000);
+    }
+    return retry_ms;
+}
 
-    if ((*tcp_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("TCP socket creation failed");
-        pthread_exit(NULL);
+// Function to turn away an order while the session still waits for the estimated time of its last one, returns 1 if so
+int refuse_pending_order(client_info_t *client) {
+    if (!(client->flags & SESSION_ORDER_PENDING)) {
+        return 0;
     }
+    printf("Order refused, the client is still waiting for its last one\n");
+    send_busy(client->client_socket, &client->token, BUSY_RETRY_MS, "Your last order is still being placed");
+    return 1;
+}
 
-    tcp_addr.sin_family = AF_INET;
-    tcp_addr.sin_addr.s_addr = INADDR_ANY;
-    tcp_addr.sin_port = htons(TACO_BELL_PORT);
+// Function to tell a client its order was not taken because the restaurant or the server is busy
+void refuse_order(client_info_t *client, int id, int retry_ms) {
+    char reason[64];
+    printf("%s is busy, order refused\n", restaurant_ports[id - 1].name);
+    snprintf(reason, sizeof(reason), "%s is busy", restaurant_ports[id - 1].name);
+    send_busy(client->client_socket, &client->token, retry_ms, reason);
+}
 
-    if (bind(*tcp_socket, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr)) < 0) {
-        perror("TCP bind failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+// Function to send a busy frame with when to try again, closing the connection when it cannot be queued
+void send_busy(int fd, const session_token_t *token, int retry_ms, const char *reason) {
+    frame_t *frame = frame_new(MSG_BUSY, token);
+    if (frame != NULL) {
+        snprintf(frame->msg.data, BUFFER_SIZE, "%d %s", retry_ms, reason);
     }
-
-    if (listen(*tcp_socket, 1) < 0) {
-        perror("TCP listen failed");
-        close(*tcp_socket);
-        pthread_exit(NULL);
+    if (send_frame(fd, frame) < 0) {
+        perror("send");
+        close_connection(fd);
     }
+    frame_unref(frame);
+}
 
-    printf("Server listening for Taco Bell TCP connections on port %d\n", TACO_BELL_PORT);
-
-    while (1) {
-        int restaurant_socket;
-        struct sockaddr_in restaurant_addr;
-        socklen_t addrlen = sizeof(restaurant_addr);
+// Function to read the monotonic clock in microseconds
+uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-        if ((restaurant_socket = accept(*tcp_socket, (struct sockaddr *)&restaurant_addr, &addrlen)) < 0) {
-            perror("TCP accept failed");
-            continue;
-        }
-        printf("Taco Bell connected to TCP\n");
-
-        message_t msg;
-        memset(&msg, 0, sizeof(message_t));  // Ensure message is zeroed out
-        while (1) {
-            ssize_t bytes_received = recv(restaurant_socket, &msg, sizeof(message_t), 0);
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    printf("Restaurant disconnected\n");
-                } else {
-                    perror("recv");
-                }
-                close(restaurant_socket);
-                break;
-            }
-            printf("Received message type: %d from Taco Bell\n", msg.type);
-
-            switch (msg.type) {
-                case MSG_MENU:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == 0) {
-                            restaurants[i].restaurant_socket = restaurant_socket;
-                            strncpy(restaurants[i].name, "Taco Bell", BUFFER_SIZE);
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].address = restaurant_addr;
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                            break;
-                        }
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            strncpy(restaurants[i].menu, msg.data, BUFFER_SIZE);
-                            restaurants[i].last_keep_alive = time(NULL);
-                            restaurants[i].active = 1; // Set restaurant as active
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_KEEP_ALIVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].last_keep_alive = time(NULL);
-                            printf("Keep-alive received from %s\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    break;
-                case MSG_ESTIMATED_TIME:
-                    // Find the corresponding client and send the estimated time
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        if (clients[i].client_socket != 0) {
-                            send_estimated_time_to_client(clients[i].client_socket, msg.data);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                    break;
-                case MSG_LEAVE:
-                    pthread_mutex_lock(&restaurants_mutex);
-                    for (int i = 0; i < MAX_RESTAURANTS; i++) {
-                        if (restaurants[i].restaurant_socket == restaurant_socket) {
-                            restaurants[i].active = 0;
-                            memset(&restaurants[i], 0, sizeof(restaurant_info_t));
-                            printf("Restaurant %s left and its data has been cleared.\n", restaurants[i].name);
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&restaurants_mutex);
-                    close(restaurant_socket);
-                    pthread_exit(NULL);
-                    break;
-                default:
-                    printf("In Taco Bell: Unexpected message type: %d\n", msg.type);
-                    close(restaurant_socket);
-                    break;
-            }
+// Function to write the credits and held orders of every restaurant for the admin report
+size_t flow_report(char *buf, size_t size) {
+    size_t len = 0;
+    len += snprintf(buf + len, size - len, "event loop: %s, %llu sessions and %llu orders shed\n",
+                    codel_overloaded(&loop_delay) ? "overloaded" : "ok", (unsigned long long)sessions_shed,
+                    (unsigned long long)loop_delay.shed);
+    len += snprintf(buf + len, size - len, "rate limits: %llu new sessions, %llu registrations and %llu requests turned away\n",
+                    (unsigned long long)accept_limit.limited, (unsigned long long)register_limit.limited,
+                    (unsigned long long)requests_throttled);
+    len += snprintf(buf + len, size - len, "order flow: credits held | waited late dropped refused shed\n");
+    pthread_mutex_lock(&admission_mutex);
+    for (int i = 0; i < MAX_RESTAURANTS && len < size; i++) {
+        admission_t *admission = &admissions[i];
+        char credits[24];
+        if (admission->restaurant_socket == 0) {
+            snprintf(credits, sizeof(credits), "away");
+        } else {
+            snprintf(credits, sizeof(credits), "%d%s", admission->credits, admission->reports ? "" : " (window)");
         }
+        len += snprintf(buf + len, size - len, "%s: %s %u | %llu %llu %llu %llu %llu%s\n", restaurant_ports[i].name, credits,
+                        admission->queue.count + admission->admitting, (unsigned long long)admission->waited,
+                        (unsigned long long)admission->late, (unsigned long long)admission->dropped,
+                        (unsigned long long)admission->refused, (unsigned long long)admission->hold.shed,
+                        codel_overloaded(&admission->hold) ? " (shedding)" : "");
     }
+    pthread_mutex_unlock(&admission_mutex);
+    return len < size ? len : size - 1;
+}
 
-    close(*tcp_socket);
-    pthread_exit(NULL);
+// Function to send estimated time to client
+void send_estimated_time_to_client(client_info_t *client, const char *estimated_time, const trace_context_t *trace) {
+    frame_t *frame = frame_text(MSG_ESTIMATED_TIME, NULL, estimated_time);
+    if (frame != NULL && trace != NULL) {
+        trace_put(&frame->msg, trace);  // The client stamps the last hop
+    }
+    if (send_client_frame(client, frame) < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+    }
+    frame_unref(frame);
 }
 
+// Function to tell a resuming client which session it has and where its order stands
+void send_resume_to_client(client_info_t *client, const char *state) {
+    frame_t *frame = frame_text(MSG_RESUME, &client->token, state);    // Old token when resumed, the new one otherwise
+    if (send_client_frame(client, frame) < 0) {
+        perror("send");
+        close_connection(client->client_socket);
+    }
+    frame_unref(frame);
+}
 
 // Function to periodically update menus from restaurants
 void *menu_update_manager(void *arg) {
@@ -878,3 +2662,421 @@ void *menu_update_manager(void *arg) {
     close(multicast_socket);
     return NULL;
 }
+
+// Function to write a list whose entries start with their next pointer, in list order
+void put_list(upgrade_state_t *state, void *head, size_t size) {
+    uint32_t count = 0;
+    for (void *entry = head; entry != NULL; entry = *(void **)entry) {
+        count++;
+    }
+    upgrade_put(state, &count, sizeof(count));
+    for (void *entry = head; entry != NULL; entry = *(void **)entry) {
+        upgrade_put(state, entry, size);
+    }
+}
+
+// Function to read a list written by put_list back in the same order
+void *get_list(upgrade_state_t *state, size_t size) {
+    uint32_t count;
+    void *head = NULL;
+    void **tail = &head;
+    upgrade_get(state, &count, sizeof(count));
+    for (uint32_t i = 0; i < count && !state->failed; i++) {
+        void *entry = malloc(size);
+        if (entry == NULL || upgrade_get(state, entry, size) < 0) {
+            free(entry);
+            state->failed = 1;
+            break;
+        }
+        *(void **)entry = NULL;
+        *tail = entry;
+        tail = (void **)entry;
+    }
+    return head;
+}
+
+// Function to pass the sockets and the state of this server to a new one, returns 0 once it has taken over, 1 when
+// nothing was handed over and this server serves on, or -1 when the new server may hold the sockets and did not answer
+int hand_off(int peer, const char *journal_path, uint32_t journal_batch, const char *history_dir) {
+    printf("New server connected, handing over\n");
+    fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) & ~O_NONBLOCK);   // Accepted by the loop, the hand-over itself blocks
+    int fd_cap = 3 * conns_size + UPGRADE_LISTENERS + 1;
+    int *fds = malloc(fd_cap * sizeof(int));    // Before anything stops, failing here costs nothing
+    if (fds == NULL) {
+        perror("malloc");
+        resume_serving();
+        return 1;
+    }
+    io_quiesce();       // Input already received is handled, the rest waits in the sockets
+    if (3 * conns_size + UPGRADE_LISTENERS + 1 > fd_cap) {  // Connections the loop accepted while it wound down
+        int *more = realloc(fds, (3 * conns_size + UPGRADE_LISTENERS + 1) * sizeof(int));
+        if (more == NULL) {
+            perror("realloc");
+            free(fds);
+            resume_serving();
+            return 1;
+        }
+        fds = more;
+    }
+    journal_close();    // Orders that turn durable now are queued for their kitchens
+    history_close();
+    for (int fd = 0; fd < conns_size; fd++) {   // Connections this server was closing end here
+        if (conns[fd] != NULL && conns[fd]->closing) {
+            on_close(fd);
+            io_detach_link(fd);
+        }
+    }
+    // Held until exit, the other threads change nothing from here on
+    pthread_mutex_lock(&subscribers_mutex);
+    pthread_mutex_lock(&restaurants_mutex);
+    pthread_mutex_lock(&clients_mutex);
+    pthread_mutex_lock(&admission_mutex);
+    io_drain();         // Sockets move with nothing of this server's still queued on them
+
+    upgrade_state_t state;
+    memset(&state, 0, sizeof(state));
+    int count = 0;
+    admission_queue_t kept[MAX_RESTAURANTS];    // Held orders move here as they are written, in case the hand-over fails
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        kept[i] = admissions[i].queue;
+        kept[i].count = 0;
+        kept[i].size = admissions[i].queue.count;
+        kept[i].heap = malloc((kept[i].size > 0 ? kept[i].size : 1) * sizeof(admission_entry_t));
+        state.failed |= kept[i].heap == NULL;
+    }
+
+    int sockets[UPGRADE_LISTENERS] = {welcome_socket, restaurant_ports[0].listener, restaurant_ports[1].listener,
+                                      restaurant_ports[2].listener, admin_socket, gateway_socket, local_socket, upgrade_socket};
+    for (int i = 0; i < UPGRADE_LISTENERS; i++) {
+        uint8_t present = sockets[i] >= 0;
+        upgrade_put(&state, &present, sizeof(present));
+        if (present) {
+            fds[count++] = sockets[i];
+        }
+    }
+    fds[count++] = io_wake_fd;  // Linked restaurants keep signalling it
+
+    uint32_t conn_count = 0;
+    for (int fd = 0; fd < conns_size; fd++) {
+        conn_count += conns[fd] != NULL;
+    }
+    upgrade_put(&state, &conns_size, sizeof(conns_size));
+    upgrade_put(&state, &conn_count, sizeof(conn_count));
+    for (int fd = 0; fd < conns_size; fd++) {
+        conn_t *conn = conns[fd];
+        if (conn == NULL) {
+            continue;
+        }
+        shm_link_t *link = io_link(fd);
+        upgrade_conn_t record = {fd, conn->kind, conn->subscribed, link != NULL, 0, conn->id, conn->rx_len};
+        upgrade_put(&state, &record, sizeof(record));
+        upgrade_put(&state, conn->rx, conn->rx_len);
+        fds[count++] = fd;
+        if (link != NULL) {
+            fds[count++] = link->memfd;
+            fds[count++] = link->tx_event;
+        }
+    }
+
+    uint8_t key[JOURNAL_KEY_SIZE];
+    uint32_t capacity = session_capacity();
+    session_get_key(key);
+    upgrade_put(&state, key, sizeof(key));
+    upgrade_put(&state, &capacity, sizeof(capacity));
+    upgrade_put(&state, session_at(0), capacity * sizeof(client_info_t));
+    upgrade_put(&state, &sessions_shed, sizeof(sessions_shed));
+
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        restaurant_info_t *restaurant = &restaurants[i];
+        upgrade_restaurant_t record;
+        memset(&record, 0, sizeof(record));
+        record.socket = restaurant->restaurant_socket;
+        record.id = restaurant_id(restaurant->name);
+        record.active = restaurant->active;
+        record.last_keep_alive = restaurant->last_keep_alive;
+        if (restaurant->menu != NULL) {
+            record.version = restaurant->menu->version;
+            record.menu_len = restaurant->menu->len;
+        }
+        upgrade_put(&state, &record, sizeof(record));
+        upgrade_put(&state, record.menu_len > 0 ? restaurant->menu->text : "", record.menu_len);
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        uint32_t len = menu_uploads[i].len;
+        upgrade_put(&state, &len, sizeof(len));
+        upgrade_put(&state, menu_uploads[i].text != NULL ? menu_uploads[i].text : "", len);
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        admission_t *admission = &admissions[i];
+        upgrade_admission_t record;
+        memset(&record, 0, sizeof(record));
+        record.socket = admission->restaurant_socket;
+        record.credits = admission->credits;
+        record.released = admission->released;
+        record.held = admission->queue.count;
+        record.reports = admission->reports;
+        record.waited = admission->waited;
+        record.late = admission->late;
+        record.dropped = admission->dropped;
+        record.refused = admission->refused;
+        upgrade_put(&state, &record, sizeof(record));
+        uint64_t deadline, since;
+        frame_t *frame;
+        while (!state.failed && (frame = admission_pop(&admission->queue, &deadline, &since)) != NULL) {  // Earliest first, pushed back in order
+            upgrade_put(&state, &deadline, sizeof(deadline));
+            upgrade_put(&state, &since, sizeof(since));
+            upgrade_put(&state, &frame->msg, sizeof(message_t));
+            admission_push(&kept[i], deadline, since, frame);   // Has room for all of them
+        }
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        if (kept[i].heap == NULL) {
+            continue;   // Nothing was taken out of any queue
+        }
+        uint64_t deadline, since;
+        frame_t *frame;
+        while ((frame = admission_pop(&admissions[i].queue, &deadline, &since)) != NULL) {    // Left when memory ran out
+            admission_push(&kept[i], deadline, since, frame);
+        }
+        admission_free(&admissions[i].queue);
+        admissions[i].queue = kept[i];
+    }
+    put_list(&state, parked_etas, sizeof(parked_eta_t));
+    put_list(&state, in_flight, sizeof(in_flight_t));
+    put_list(&state, carts, sizeof(cart_t));
+    put_list(&state, recovered_orders, sizeof(recovered_order_t));
+
+    char ack;
+    int ret = 1;    // Until the state is on its way, nothing has left this server
+    if (state.failed) {
+        fprintf(stderr, "Out of memory writing the state for the new server\n");
+    } else {
+        capture_finish();   // Complete before the new server opens the same file, a failed hand-over ends it
+        if (upgrade_send(peer, &state, fds, count) < 0) {
+            perror("upgrade send");     // The new server cannot read the state and exits, closing what it got
+        } else {
+            ret = -1;
+            if (recv(peer, &ack, 1, MSG_WAITALL) == 1) {
+                printf("Handed over %u connections and %u session slots\n", conn_count, capacity);
+                ret = 0;
+            }
+        }
+    }
+    upgrade_free(&state);
+    free(fds);
+    if (ret == 1) {
+        uint8_t key[JOURNAL_KEY_SIZE];
+        session_get_key(key);
+        // Pending orders are all still in memory, only appending starts again
+        if (journal_open(journal_path, journal_batch, key, NULL, order_durable) < 0 || history_open(history_dir) < 0) {
+            return -1;
+        }
+        pthread_mutex_unlock(&admission_mutex);
+        pthread_mutex_unlock(&clients_mutex);
+        pthread_mutex_unlock(&restaurants_mutex);
+        pthread_mutex_unlock(&subscribers_mutex);
+        resume_serving();
+    }
+    return ret;
+}
+
+// Function to accept and read again after a hand-over that stopped before the new server got anything
+void resume_serving(void) {
+    io_resume();
+    for (int fd = 0; fd < conns_size; fd++) {
+        if (conns[fd] != NULL && io_adopt(fd) < 0) {
+            perror("watch connection");
+        }
+    }
+}
+
+// Function to rebuild the state of the server this one takes over from, returns the listener count or -1
+int take_over(upgrade_state_t *state, const int *fds, int fd_count, int *listeners) {
+    int next = 0;   // Descriptors are taken in the order they were sent
+    int listener_count = 0;
+    int *sockets[UPGRADE_LISTENERS] = {&welcome_socket, &restaurant_ports[0].listener, &restaurant_ports[1].listener,
+                                       &restaurant_ports[2].listener, &admin_socket, &gateway_socket, &local_socket, &upgrade_socket};
+    for (int i = 0; i < UPGRADE_LISTENERS; i++) {
+        uint8_t present;
+        upgrade_get(state, &present, sizeof(present));
+        if (present && next < fd_count) {
+            *sockets[i] = listeners[listener_count++] = fds[next++];
+        }
+    }
+    io_wake_fd = next < fd_count ? fds[next++] : -1;
+
+    int old_size;
+    uint32_t conn_count;
+    upgrade_get(state, &old_size, sizeof(old_size));
+    upgrade_get(state, &conn_count, sizeof(conn_count));
+    int *fd_map = malloc((old_size > 0 ? old_size : 1) * sizeof(int));    // Socket numbers of the old server to ours
+    if (fd_map == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < old_size; i++) {
+        fd_map[i] = -1;
+    }
+    for (uint32_t i = 0; i < conn_count && !state->failed && next < fd_count; i++) {
+        upgrade_conn_t record;
+        upgrade_get(state, &record, sizeof(record));
+        int fd = fds[next++];
+        conn_t *conn = conn_new(fd, record.kind);
+        if (conn == NULL || record.fd < 0 || record.fd >= old_size || record.rx_len >= sizeof(message_t)) {
+            free(fd_map);
+            return -1;
+        }
+        fd_map[record.fd] = fd;
+        conn->id = record.id;
+        if (record.rx_len > 0 && (conn->rx = malloc(sizeof(message_t))) != NULL) {
+            conn->rx_len = record.rx_len;
+            upgrade_get(state, conn->rx, record.rx_len);
+        }
+        if (record.subscribed) {
+            if (subscriber_count == subscriber_capacity) {
+                int capacity = subscriber_capacity ? subscriber_capacity * 2 : 16;
+                int *grown = realloc(subscribers, capacity * sizeof(int));
+                if (grown != NULL) {
+                    subscribers = grown;
+                    subscriber_capacity = capacity;
+                }
+            }
+            if (subscriber_count < subscriber_capacity) {
+                subscribers[subscriber_count++] = fd;
+                conn->subscribed = 1;
+            }
+        }
+        if (record.linked && next + 1 < fd_count) {     // Same rings, same eventfds
+            shm_link_t *link = calloc(1, sizeof(shm_link_t));
+            int memfd = fds[next++];
+            int event = fds[next++];
+            if (link == NULL || shm_link_map(link, memfd, SHM_ACCEPTOR, -1, event) < 0 || io_attach_link(fd, link) < 0) {
+                free(link);
+                close(memfd);
+                close(event);
+                io_shutdown(fd);    // The restaurant reconnects
+                continue;
+            }
+            link->memfd = memfd;
+        }
+        capture_conn(fd);
+    }
+
+    uint8_t key[JOURNAL_KEY_SIZE];
+    uint32_t capacity;
+    upgrade_get(state, key, sizeof(key));
+    upgrade_get(state, &capacity, sizeof(capacity));
+    client_info_t *entries = malloc((capacity > 0 ? capacity : 1) * sizeof(client_info_t));
+    if (entries == NULL || upgrade_get(state, entries, capacity * sizeof(client_info_t)) < 0) {
+        free(entries);
+        free(fd_map);
+        return -1;
+    }
+    time_t now = time(NULL);
+    uint32_t attached = 0;
+    for (uint32_t i = 0; i < capacity; i++) {
+        int old_fd = entries[i].client_socket;
+        if (old_fd <= 0) {
+            continue;   // Free or detached
+        }
+        entries[i].client_socket = old_fd < old_size && fd_map[old_fd] >= 0 ? fd_map[old_fd] : SESSION_DETACHED;
+        if (entries[i].client_socket == SESSION_DETACHED) {
+            entries[i].last_keep_alive = now;   // Its connection did not make it, the client can resume
+        } else {
+            attached++;
+        }
+    }
+    session_set_key(key);
+    session_table_load(entries, capacity);
+    free(entries);
+    upgrade_get(state, &sessions_shed, sizeof(sessions_shed));
+
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        upgrade_restaurant_t record;
+        upgrade_get(state, &record, sizeof(record));
+        char *text = malloc(record.menu_len + 1);
+        if (text == NULL || upgrade_get(state, text, record.menu_len) < 0) {
+            free(text);
+            free(fd_map);
+            return -1;
+        }
+        text[record.menu_len] = '\0';
+        if (record.socket > 0 && record.socket < old_size && fd_map[record.socket] >= 0 &&
+            record.id >= 1 && record.id <= MAX_RESTAURANTS) {
+            restaurant_info_t *restaurant = &restaurants[i];
+            socklen_t addrlen = sizeof(restaurant->address);
+            restaurant->restaurant_socket = fd_map[record.socket];
+            restaurant->name = restaurant_ports[record.id - 1].name;
+            getpeername(restaurant->restaurant_socket, (struct sockaddr *)&restaurant->address, &addrlen);
+            restaurant->last_keep_alive = record.last_keep_alive;
+            restaurant->active = record.active;
+            if (record.menu_len > 0 && (restaurant->menu = menu_adopt(text, record.version)) != NULL) {
+                encode_menu(restaurant, record.id, restaurant->menu);   // Warm from the first client on
+            }
+        }
+        free(text);
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        uint32_t len;
+        upgrade_get(state, &len, sizeof(len));
+        if (len > MENU_MAX_LEN || (menu_uploads[i].text = malloc(len + 1)) == NULL) {
+            free(fd_map);
+            return -1;
+        }
+        upgrade_get(state, menu_uploads[i].text, len);
+        menu_uploads[i].text[len] = '\0';
+        menu_uploads[i].len = len;
+        if (len == 0) {
+            discard_menu_upload(i + 1);
+        }
+    }
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        admission_t *admission = &admissions[i];
+        upgrade_admission_t record;
+        upgrade_get(state, &record, sizeof(record));
+        admission->restaurant_socket = record.socket > 0 && record.socket < old_size ? fd_map[record.socket] : 0;
+        if (admission->restaurant_socket < 0) {
+            admission->restaurant_socket = 0;
+        }
+        admission->credits = record.credits;
+        admission->released = record.released;
+        admission->reports = record.reports;
+        admission->waited = record.waited;
+        admission->late = record.late;
+        admission->dropped = record.dropped;
+        admission->refused = record.refused;
+        for (uint32_t k = 0; k < record.held && !state->failed; k++) {
+            uint64_t deadline, since;
+            message_t msg;
+            upgrade_get(state, &deadline, sizeof(deadline));
+            upgrade_get(state, &since, sizeof(since));
+            upgrade_get(state, &msg, sizeof(message_t));
+            frame_t *frame = frame_new(msg.type, &msg.client_token);
+            if (frame == NULL) {
+                continue;   // Still journaled, replayed after the next restart
+            }
+            memcpy(frame->msg.data, msg.data, BUFFER_SIZE);
+            if (admission_push(&admission->queue, deadline, since, frame) < 0) {
+                frame_unref(frame);
+            }
+        }
+    }
+    while (recovered_orders != NULL) {  // The journal replayed orders the old server had already forwarded
+        recovered_order_t *order = recovered_orders;
+        recovered_orders = order->next;
+        free(order);
+    }
+    parked_etas = get_list(state, sizeof(parked_eta_t));
+    in_flight = get_list(state, sizeof(in_flight_t));
+    carts = get_list(state, sizeof(cart_t));
+    recovered_orders = get_list(state, sizeof(recovered_order_t));
+    free(fd_map);
+    if (state->failed) {
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_RESTAURANTS; i++) {
+        update_catalog(restaurant_ports[i].name);
+    }
+    printf("Took over %u connections and %u attached sessions from the running server\n", conn_count, attached);
+    return listener_count;
+}
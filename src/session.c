@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "session.h"
+
+static client_info_t *sessions = NULL;  // Session slots
+static uint32_t *free_slots = NULL;     // Stack of free slot indices
+static uint32_t free_count = 0;
+static uint32_t capacity = 0;
+static uint64_t mac_key[2];             // SipHash key for token MACs
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+// SipHash-2-4 of one 8-byte word
+static uint64_t siphash_word(uint64_t word) {
+    uint64_t v0 = mac_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = mac_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = mac_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = mac_key[1] ^ 0x7465646279746573ULL;
+    uint64_t last = 8ULL << 56;     // Message length in the top byte of the final block
+
+    v3 ^= word;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= word;
+    v3 ^= last;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// Function to build the token of a slot from its index and generation
+static void make_token(uint32_t slot, uint32_t generation, session_token_t *token) {
+    store32(token->bytes, slot);
+    store32(token->bytes + 4, generation);
+    uint64_t mac = siphash_word((uint64_t)generation << 32 | slot);
+    for (int i = 0; i < 8; i++) {
+        token->bytes[8 + i] = (uint8_t)(mac >> (8 * i));
+    }
+}
+
+// Function to allocate the session table
+int session_table_init(uint32_t size) {
+    sessions = calloc(size, sizeof(client_info_t));
+    free_slots = malloc(size * sizeof(uint32_t));
+    if (sessions == NULL || free_slots == NULL) {
+        perror("session table allocation");
+        return -1;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        free_slots[i] = size - 1 - i;   // Hand out low slots first
+    }
+    free_count = size;
+    capacity = size;
+
+    if (getrandom(mac_key, sizeof(mac_key), 0) != sizeof(mac_key)) {
+        perror("getrandom");
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t session_capacity(void) {
+    return capacity;
+}
+
+client_info_t *session_at(uint32_t index) {
+    return index < capacity ? &sessions[index] : NULL;
+}
+
+uint32_t session_index(const client_info_t *client) {
+    return (uint32_t)(client - sessions);
+}
+
+// Function to take a free slot for a new client
+client_info_t *session_alloc(int client_socket) {
+    if (free_count == 0) {
+        return NULL;
+    }
+    uint32_t slot = free_slots[--free_count];
+    client_info_t *client = &sessions[slot];
+    uint32_t generation = client->generation + 1;  // Tokens of earlier holders of the slot go stale
+    if (generation == 0) {
+        generation = 1;     // Generation 0 never validates
+    }
+    memset(client, 0, sizeof(client_info_t));
+    client->client_socket = client_socket;
+    client->generation = generation;
+    make_token(slot, generation, &client->token);
+    return client;
+}
+
+// Function to release the slot of a client that left
+void session_free(client_info_t *client) {
+    if (client->client_socket == 0) {
+        return;     // Already free
+    }
+    uint32_t generation = client->generation;
+    memset(client, 0, sizeof(client_info_t));
+    client->generation = generation;
+    free_slots[free_count++] = (uint32_t)(client - sessions);
+}
+
+// Function to take back the slot of a token issued before a restart
+client_info_t *session_restore(const session_token_t *token) {
+    uint32_t slot = load32(token->bytes);
+    uint32_t generation = load32(token->bytes + 4);
+    session_token_t expected;
+    if (slot >= capacity || generation == 0 || sessions[slot].client_socket != 0) {
+        return NULL;
+    }
+    make_token(slot, generation, &expected);
+    if (memcmp(expected.bytes, token->bytes, TOKEN_SIZE) != 0) {
+        return NULL;    // Issued under another key
+    }
+
+    for (uint32_t i = 0; i < free_count; i++) {     // Only used at startup, a scan is fine
+        if (free_slots[i] == slot) {
+            free_slots[i] = free_slots[--free_count];
+            break;
+        }
+    }
+    client_info_t *client = &sessions[slot];
+    memset(client, 0, sizeof(client_info_t));
+    client->client_socket = SESSION_DETACHED;   // Waits for its client to resume
+    client->generation = generation;
+    client->token = *token;
+    return client;
+}
+
+// Function to find the session a token belongs to without scanning the table
+client_info_t *session_lookup(const session_token_t *token) {
+    uint32_t slot = load32(token->bytes);
+    if (slot >= capacity) {
+        return NULL;
+    }
+    client_info_t *client = &sessions[slot];
+    if (client->client_socket == 0 || client->generation != load32(token->bytes + 4)) {
+        return NULL;    // Free slot or stale token
+    }
+
+    uint8_t diff = 0;   // Constant-time compare of the MAC
+    for (int i = 8; i < TOKEN_SIZE; i++) {
+        diff |= token->bytes[i] ^ client->token.bytes[i];
+    }
+    return diff == 0 ? client : NULL;
+}
+
+// Function to take over the slots of an earlier server, free ones keep their generation so old tokens stay stale
+void session_table_load(const client_info_t *entries, uint32_t count) {
+    if (count > capacity) {
+        printf("Dropping %u sessions beyond the table size\n", count - capacity);
+        count = capacity;
+    }
+    memcpy(sessions, entries, count * sizeof(client_info_t));
+    memset(sessions + count, 0, (capacity - count) * sizeof(client_info_t));
+    free_count = 0;
+    for (uint32_t i = capacity; i-- > 0;) {
+        if (sessions[i].client_socket == 0) {
+            free_slots[free_count++] = i;   // Low slots on top, handed out first
+        }
+    }
+}
+
+void session_get_key(uint8_t key[16]) {
+    memcpy(key, mac_key, sizeof(mac_key));
+}
+
+void session_set_key(const uint8_t key[16]) {
+    memcpy(mac_key, key, sizeof(mac_key));
+}
+
+void token_to_hex(const session_token_t *token, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < TOKEN_SIZE; i++) {
+        out[2 * i] = digits[token->bytes[i] >> 4];
+        out[2 * i + 1] = digits[token->bytes[i] & 0xf];
+    }
+    out[2 * TOKEN_SIZE] = '\0';
+}
@@ -0,0 +1,52 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Client session table. Entries are fixed-width so a million idle sessions
+// take a few tens of megabytes; callers serialize access with clients_mutex.
+//
+// A token is slot index (4 bytes) | slot generation (4 bytes) | MAC (8 bytes),
+// the MAC being SipHash-2-4 of the first 8 bytes under a key drawn at startup.
+// Looking a token up goes straight to its slot, rejects stale generations with
+// one compare and checks the MAC in constant time.
+//
+// When a client's connection drops its session is kept detached for a while so
+// the client can reconnect and resume it with the same token.
+
+#define SESSION_RATE_CLASSES 3      // Classes of client frames with a rate limit of their own, see rate_class() in server.c
+
+typedef struct {
+    session_token_t token;      // Token for client identification
+    int32_t client_socket;      // Socket for client connection, 0 when the slot is free, SESSION_DETACHED while resumable
+    uint32_t last_keep_alive;   // Last keep-alive time for the client (seconds)
+    uint32_t generation;        // Bumped each time the slot is handed out
+    uint8_t restaurant;         // Restaurant id the client is ordering from, 0 when idle
+    uint8_t flags;              // SESSION_* flags
+    uint8_t reserved[2];
+    uint32_t rate_due[SESSION_RATE_CLASSES];   // When the next frame of each rate-limited class is due, see ratelimit.h
+    uint32_t rate_quiet;        // Frames over the limit go unanswered until then, the client was told when to come back
+} client_info_t;                // Structure to store client information
+
+#define SESSION_DETACHED -1         // client_socket of a session whose connection dropped
+#define SESSION_ORDER_PENDING 0x01  // Order forwarded to a restaurant, estimated time not delivered yet
+#define SESSION_EXPIRED 0x02        // Token expired, do not keep the session when the connection closes
+#define SESSION_STREAM 0x04         // Session is a stream of a gateway connection, shared with other sessions
+
+int session_table_init(uint32_t capacity);
+uint32_t session_capacity(void);
+client_info_t *session_at(uint32_t index);
+uint32_t session_index(const client_info_t *client);
+client_info_t *session_alloc(int client_socket);    // NULL when the table is full
+void session_free(client_info_t *client);
+client_info_t *session_restore(const session_token_t *token);  // Take the slot a valid token names, NULL if it is in use
+client_info_t *session_lookup(const session_token_t *token);   // NULL for unknown, stale or forged tokens, detached sessions are found
+void session_table_load(const client_info_t *entries, uint32_t count);     // Take over the table of an earlier server
+
+void session_get_key(uint8_t key[16]);
+void session_set_key(const uint8_t key[16]);    // Tokens issued under an earlier key validate again
+void token_to_hex(const session_token_t *token, char *out);    // out holds 2 * TOKEN_SIZE + 1 chars
+
+#endif
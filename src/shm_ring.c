@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "shm_ring.h"
+
+#define SHM_NAME_SIZE 32            // Restaurant name sent with the setup
+#define SHM_SETUP_TIMEOUT_MS 1000   // How long the server waits for the setup of an accepted link
+
+// Function to send bytes together with file descriptors over a Unix domain socket
+static int send_fds(int sock, const void *data, size_t len, const int *fds, int count) {
+    struct iovec iov = {(void *)data, len};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// Function to receive bytes and the file descriptors sent with them, returns how many arrived or -1
+static int recv_fds(int sock, void *data, size_t len, int *fds, int max) {
+    struct iovec iov = {data, len};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(max * sizeof(int));
+    if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)len) {
+        return -1;
+    }
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    return count;
+}
+
+int shm_link_create(void) {
+    int memfd = memfd_create("food-link", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(memfd, 2 * sizeof(shm_ring_t)) < 0) {   // Zero filled, both rings start empty
+        perror("ftruncate");
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+int shm_link_map(shm_link_t *link, int memfd, shm_side_t side, int rx_event, int tx_event) {
+    shm_ring_t *rings = mmap(NULL, 2 * sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (rings == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    link->map = rings;
+    link->tx = side == SHM_CREATOR ? &rings[0] : &rings[1];    // The first ring carries frames to the server
+    link->rx = side == SHM_CREATOR ? &rings[1] : &rings[0];
+    link->rx_event = rx_event;
+    link->tx_event = tx_event;
+    link->memfd = -1;
+    return 0;
+}
+
+int shm_send(shm_link_t *link, const message_t *msg) {
+    shm_ring_t *ring = link->tx;
+    uint32_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS) {
+        return -1;
+    }
+    memcpy(&ring->slots[tail % SHM_RING_SLOTS], msg, sizeof(message_t));
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // A consumer that has taken everything before this frame may be asleep, one still draining will see it
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        uint64_t one = 1;
+        if (write(link->tx_event, &one, sizeof(one)) < 0) {
+            // Counter saturated, the consumer is awake anyway
+        }
+    }
+    return 0;
+}
+
+int shm_recv(shm_link_t *link, message_t *msg) {
+    shm_ring_t *ring = link->rx;
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    memcpy(msg, &ring->slots[head % SHM_RING_SLOTS], sizeof(message_t));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);   // Pairs with the producer's check for an empty ring
+    return 1;
+}
+
+int shm_wait(shm_link_t *link, int sock) {
+    static int spin = -1;   // On one CPU spinning only keeps the producer from running
+    if (spin < 0) {
+        spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    }
+    for (int i = 0; i < spin; i++) {        // A reply that is on its way is cheaper to wait for than to sleep for
+        if (link->rx->head != __atomic_load_n(&link->rx->tail, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    struct pollfd pfds[2] = {{link->rx_event, POLLIN, 0}, {sock, POLLIN, 0}};
+    while (poll(pfds, sock >= 0 ? 2 : 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (sock >= 0 && pfds[1].revents != 0) {
+        char byte;
+        if (recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            return -1;  // Peer closed the setup socket, the link is gone
+        }
+    }
+    uint64_t value;
+    if (pfds[0].revents & POLLIN && read(link->rx_event, &value, sizeof(value)) < 0) {
+        // Nonblocking, another waiter took the count
+    }
+    return 0;
+}
+
+void shm_link_close(shm_link_t *link) {
+    if (link->map != NULL) {
+        munmap(link->map, 2 * sizeof(shm_ring_t));
+        link->map = NULL;
+    }
+    if (link->rx_event >= 0) {
+        close(link->rx_event);
+    }
+    if (link->tx_event >= 0) {
+        close(link->tx_event);
+    }
+    if (link->memfd >= 0) {
+        close(link->memfd);
+    }
+    link->rx_event = -1;
+    link->tx_event = -1;
+    link->memfd = -1;
+}
+
+int shm_link_connect(const char *path, const char *name, shm_link_t *link) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    int memfd = shm_link_create();
+    int event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (memfd < 0 || event < 0 || shm_link_map(link, memfd, SHM_CREATOR, event, -1) < 0) {
+        perror("shared memory link");
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        if (event >= 0) {
+            close(event);
+        }
+        close(sock);
+        return -1;
+    }
+
+    char setup[SHM_NAME_SIZE];
+    memset(setup, 0, sizeof(setup));
+    strncpy(setup, name, sizeof(setup) - 1);
+    int fds[2] = {memfd, event};
+    char ack;
+    int wake_fd = -1;
+    if (send_fds(sock, setup, sizeof(setup), fds, 2) < 0 || recv_fds(sock, &ack, 1, &wake_fd, 1) != 1) {
+        printf("Server refused the shared memory link\n");
+        close(memfd);
+        shm_link_close(link);
+        close(sock);
+        return -1;
+    }
+    close(memfd);   // The mapping keeps the memory
+    link->tx_event = wake_fd;
+    return sock;
+}
+
+int shm_link_accept(int sock, char *name, size_t size, shm_link_t *link, int wake_fd) {
+    // The restaurant sends its setup right after connecting, wait a moment for it
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, SHM_SETUP_TIMEOUT_MS) <= 0) {
+        return -1;
+    }
+    char setup[SHM_NAME_SIZE];
+    int fds[2] = {-1, -1};
+    int count = recv_fds(sock, setup, sizeof(setup), fds, 2);
+    if (count != 2) {
+        for (int i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    setup[SHM_NAME_SIZE - 1] = '\0';
+    snprintf(name, size, "%s", setup);
+
+    if (shm_link_map(link, fds[0], SHM_ACCEPTOR, -1, fds[1]) < 0) {  // Frames from the restaurant wake the event loop
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    link->memfd = fds[0];
+    char ack = 1;
+    if (send_fds(sock, &ack, 1, &wake_fd, 1) < 0) {
+        shm_link_close(link);
+        return -1;
+    }
+    return 0;
+}
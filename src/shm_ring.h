@@ -0,0 +1,52 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Same-host link between the server and a restaurant: a pair of single
+// producer, single consumer rings of frames in a shared memfd, one ring per
+// direction, with eventfd wakeups. A producer signals the consumer's eventfd
+// only when the ring goes from empty to not empty; the consumer drains the
+// ring on every wakeup. Setup runs over a Unix domain socket that passes the
+// memfd and the eventfds, and the socket stays open so either side sees the
+// other go away.
+
+#define SHM_RING_SLOTS 64       // Frames per direction
+#define SHM_SPIN 2000           // Polls of an empty ring before sleeping on its eventfd, with more than one CPU
+
+typedef struct {
+    uint32_t head;              // Next slot to consume, written by the consumer
+    char pad1[60];              // Keep the indexes on their own cache lines
+    uint32_t tail;              // Next slot to fill, written by the producer
+    char pad2[60];
+    message_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+typedef struct {
+    shm_ring_t *rx;             // Frames from the peer
+    shm_ring_t *tx;             // Frames to the peer
+    int rx_event;               // eventfd the peer signals, -1 when the caller polls rx itself
+    int tx_event;               // eventfd of the peer
+    int memfd;                  // Kept by the server so a live upgrade can pass the rings on, -1 otherwise
+    void *map;
+} shm_link_t;
+
+typedef enum {
+    SHM_CREATOR,                // Side that created the memfd, the restaurant
+    SHM_ACCEPTOR                // Side that mapped it, the server
+} shm_side_t;
+
+int shm_link_create(void);                          // memfd sized for a ring pair, -1 on error
+int shm_link_map(shm_link_t *link, int memfd, shm_side_t side, int rx_event, int tx_event);
+int shm_send(shm_link_t *link, const message_t *msg);   // -1 when the ring is full, callers serialize
+int shm_recv(shm_link_t *link, message_t *msg);         // 1 with a frame, 0 when the ring is empty
+int shm_wait(shm_link_t *link, int sock);               // Block for frames, -1 when the socket closed
+void shm_link_close(shm_link_t *link);                  // Unmap and close the eventfds and the memfd
+
+int shm_link_connect(const char *path, const char *name, shm_link_t *link);     // Restaurant side, returns the socket
+int shm_link_accept(int sock, char *name, size_t size, shm_link_t *link, int wake_fd);     // Server side, 0 on success
+
+#endif
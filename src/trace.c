@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_CLIENT_PID 1
+#define TRACE_SERVER_PID 2
+#define TRACE_RESTAURANT_PID 3      // Plus the restaurant id minus one
+#define TRACE_MAX_LEG_NS 10000000000LL  // Longest client leg the server believes without the way back
+
+static uint32_t named;              // Processes whose name this program has written, by pid bit
+
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int trace_get(const message_t *msg, trace_context_t *trace) {
+    if (memchr(msg->data, '\0', TRACE_TEXT_SIZE) == NULL) {
+        memset(trace, 0, sizeof(trace_context_t));
+        return 0;
+    }
+    memcpy(trace, msg->data + TRACE_TEXT_SIZE, sizeof(trace_context_t));   // Unaligned in the frame, copied out
+    return 1;
+}
+
+void trace_put(message_t *msg, const trace_context_t *trace) {
+    if (memchr(msg->data, '\0', TRACE_TEXT_SIZE) != NULL) {
+        memcpy(msg->data + TRACE_TEXT_SIZE, trace, sizeof(trace_context_t));
+    }
+}
+
+uint64_t trace_stamp(message_t *msg, trace_hop_t hop) {
+    trace_context_t trace;
+    if (trace_get(msg, &trace) && trace.id != 0) {
+        trace.stamps[hop] = trace_now();
+        memcpy(msg->data + TRACE_TEXT_SIZE, &trace, sizeof(trace_context_t));
+    }
+    return trace.id;
+}
+
+FILE *trace_open(const char *path) {
+    FILE *file = fopen(path, "a");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);   // Where the array stands decides whether it needs opening
+    return file;
+}
+
+// Function to work out how far the clock of a peer is ahead, from a frame sent to it and its answer
+static int64_t clock_offset(uint64_t sent, uint64_t peer_received, uint64_t peer_replied, uint64_t received) {
+    if (sent == 0 || peer_received == 0 || peer_replied == 0 || received == 0 ||
+        (sent <= peer_received && peer_received <= peer_replied && peer_replied <= received)) {
+        return 0;   // Already in order, both read the same clock, or a hop is missing and nothing can be worked out
+    }
+    return ((int64_t)(peer_received - sent) + (int64_t)(peer_replied - received)) / 2;
+}
+
+// Function to write a span of the order, skipped when a hop did not stamp its end
+static void put_span(FILE *file, int pid, const char *name, int64_t start, int64_t end, uint64_t id) {
+    if (start == 0 || end == 0) {
+        return;
+    }
+    fputs(ftell(file) == 0 ? "[\n" : ",\n", file);
+    fprintf(file, "{\"name\":\"%s\",\"cat\":\"order\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"trace\":\"%016llx\"}}", name, pid, start / 1e3, (end > start ? end - start : 0) / 1e3,
+            (unsigned long long)id);
+}
+
+// Function to name a process the first time this program writes one of its spans
+static void put_name(FILE *file, int pid, const char *name) {
+    if (pid < 32 && named & 1u << pid) {
+        return;
+    }
+    named |= pid < 32 ? 1u << pid : 0;
+    fputs(ftell(file) == 0 ? "[\n" : ",\n", file);  // The first event in the file opens the array
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, name);
+}
+
+void trace_write(FILE *file, const trace_context_t *trace, const char *restaurant) {
+    const uint64_t *t = trace->stamps;
+    int by_client = t[TRACE_CLIENT_RECEIVE] != 0;   // The client is the last hop, the server writes before it
+
+    // Every stamp on the writer's clock, 0 where unknown
+    int64_t server_off = by_client ? clock_offset(t[TRACE_CLIENT_SEND], t[TRACE_SERVER_RECEIVE], t[TRACE_SERVER_REPLY], t[TRACE_CLIENT_RECEIVE]) : 0;
+    int64_t restaurant_off = clock_offset(t[TRACE_SERVER_FORWARD], t[TRACE_RESTAURANT_RECEIVE], t[TRACE_RESTAURANT_REPLY], t[TRACE_SERVER_REPLY]);
+    int64_t at[TRACE_HOPS];
+    for (int hop = 0; hop < TRACE_HOPS; hop++) {
+        int64_t off = 0;
+        if (hop >= TRACE_SERVER_RECEIVE && hop <= TRACE_SERVER_REPLY) {
+            off = server_off + (hop == TRACE_RESTAURANT_RECEIVE || hop == TRACE_RESTAURANT_REPLY ? restaurant_off : 0);
+        }
+        at[hop] = t[hop] != 0 ? (int64_t)t[hop] - off : 0;
+    }
+    if (!by_client && (at[TRACE_CLIENT_SEND] > at[TRACE_SERVER_RECEIVE] || at[TRACE_SERVER_RECEIVE] - at[TRACE_CLIENT_SEND] > TRACE_MAX_LEG_NS)) {
+        at[TRACE_CLIENT_SEND] = 0;  // Client on another host, its clock cannot be placed from one leg
+    }
+
+    int restaurant_pid = TRACE_RESTAURANT_PID + (trace->restaurant > 0 ? trace->restaurant - 1 : 0);
+    if (at[TRACE_CLIENT_SEND] != 0) {
+        put_name(file, TRACE_CLIENT_PID, "client");
+        put_span(file, TRACE_CLIENT_PID, "order", at[TRACE_CLIENT_SEND], at[TRACE_CLIENT_RECEIVE], trace->id);
+        put_span(file, TRACE_CLIENT_PID, "to server", at[TRACE_CLIENT_SEND], at[TRACE_SERVER_RECEIVE], trace->id);
+        put_span(file, TRACE_CLIENT_PID, "from server", at[TRACE_SERVER_REPLY], at[TRACE_CLIENT_RECEIVE], trace->id);
+    }
+    put_name(file, TRACE_SERVER_PID, "server");
+    put_span(file, TRACE_SERVER_PID, "order", at[TRACE_SERVER_RECEIVE], at[TRACE_SERVER_REPLY], trace->id);
+    put_span(file, TRACE_SERVER_PID, "journal and admission", at[TRACE_SERVER_RECEIVE], at[TRACE_SERVER_FORWARD], trace->id);
+    put_span(file, TRACE_SERVER_PID, "at restaurant", at[TRACE_SERVER_FORWARD], at[TRACE_SERVER_REPLY], trace->id);
+    if (at[TRACE_RESTAURANT_RECEIVE] != 0) {
+        put_name(file, restaurant_pid, restaurant);
+        put_span(file, restaurant_pid, "estimate", at[TRACE_RESTAURANT_RECEIVE], at[TRACE_RESTAURANT_REPLY], trace->id);
+    }
+    fflush(file);
+}
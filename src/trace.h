@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Per-order traces. Frames of an order carry a trace_context_t after their
+// text (see protocol.h) and every hop stamps its time into it, so whoever
+// sees the estimated time last holds the whole path. Traces are written as
+// Chrome trace events (JSON array format, the closing bracket is optional so
+// the file can be appended to across runs) with one process per program: the
+// client, the server and each restaurant. Stamps from another host are
+// placed on the writer's clock by assuming both network legs took equally
+// long; stamps that are already in order are taken to share one clock.
+
+uint64_t trace_now(void);   // CLOCK_MONOTONIC nanoseconds
+int trace_get(const message_t *msg, trace_context_t *trace);    // 1 when the text leaves room for a trace, zeroed otherwise
+void trace_put(message_t *msg, const trace_context_t *trace);   // Nothing when the text leaves no room
+uint64_t trace_stamp(message_t *msg, trace_hop_t hop);          // Stamps now into the trace the frame carries, returns its id or 0
+FILE *trace_open(const char *path);                             // Appends to path
+void trace_write(FILE *file, const trace_context_t *trace, const char *restaurant);    // Events of one order, flushed
+
+#endif
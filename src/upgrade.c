@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t fd_count;          // Descriptors sent after the header
+    uint64_t state_len;         // Bytes of state sent after the descriptors
+} upgrade_header_t;
+
+void upgrade_put(upgrade_state_t *state, const void *data, size_t len) {
+    if (state->failed) {
+        return;
+    }
+    if (state->len + len > state->cap) {
+        size_t cap = state->cap ? state->cap : 4096;
+        while (cap < state->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(state->data, cap);
+        if (grown == NULL) {
+            state->failed = 1;
+            return;
+        }
+        state->data = grown;
+        state->cap = cap;
+    }
+    memcpy(state->data + state->len, data, len);
+    state->len += len;
+}
+
+int upgrade_get(upgrade_state_t *state, void *data, size_t len) {
+    if (state->failed || len > state->len - state->off) {
+        state->failed = 1;
+        memset(data, 0, len);
+        return -1;
+    }
+    memcpy(data, state->data + state->off, len);
+    state->off += len;
+    return 0;
+}
+
+void upgrade_free(upgrade_state_t *state) {
+    free(state->data);
+    memset(state, 0, sizeof(upgrade_state_t));
+}
+
+// Function to connect to the upgrade socket of a running server
+int upgrade_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror(path);
+        }
+        close(sock);    // Nobody to take over from, start fresh
+        return -1;
+    }
+    return sock;
+}
+
+// Function to write all of a buffer to a blocking socket
+static int send_all(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Function to send one batch of descriptors riding on a single byte
+static int send_fd_batch(int sock, const int *fds, int count) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(UPGRADE_FD_BATCH * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Function to receive one batch of descriptors, returns how many arrived or -1
+static int recv_fd_batch(int sock, int *fds, int max) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(UPGRADE_FD_BATCH * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC || count > max) {
+        for (int i = 0; i < count && i < max; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return count;
+}
+
+int upgrade_send(int sock, const upgrade_state_t *state, const int *fds, int count) {
+    upgrade_header_t header = {UPGRADE_MAGIC, (uint32_t)count, state->len};
+    if (send_all(sock, &header, sizeof(header)) < 0) {
+        return -1;
+    }
+    for (int sent = 0; sent < count; sent += UPGRADE_FD_BATCH) {
+        int batch = count - sent < UPGRADE_FD_BATCH ? count - sent : UPGRADE_FD_BATCH;
+        if (send_fd_batch(sock, fds + sent, batch) < 0) {
+            return -1;
+        }
+    }
+    return send_all(sock, state->data, state->len);
+}
+
+int upgrade_recv(int sock, upgrade_state_t *state, int **fds, int *count) {
+    upgrade_header_t header;
+    memset(state, 0, sizeof(upgrade_state_t));
+    *fds = NULL;
+    *count = 0;
+    if (recv(sock, &header, sizeof(header), MSG_WAITALL) != sizeof(header) || header.magic != UPGRADE_MAGIC) {
+        fprintf(stderr, "Running server speaks another upgrade format\n");
+        return -1;
+    }
+    if ((*fds = malloc((header.fd_count + 1) * sizeof(int))) == NULL ||
+        (state->data = malloc(header.state_len + 1)) == NULL) {
+        perror("upgrade state allocation");
+        return -1;
+    }
+    while (*count < (int)header.fd_count) {
+        int batch = recv_fd_batch(sock, *fds + *count, header.fd_count - *count);
+        if (batch <= 0) {
+            fprintf(stderr, "Lost descriptors from the running server\n");
+            return -1;
+        }
+        *count += batch;
+    }
+    state->cap = header.state_len + 1;
+    if (header.state_len > 0 && recv(sock, state->data, header.state_len, MSG_WAITALL) != (ssize_t)header.state_len) {
+        fprintf(stderr, "Lost state from the running server\n");
+        return -1;
+    }
+    state->len = header.state_len;
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Live upgrade of the server. A new server started with the path of the
+// running one's upgrade socket connects to it; the old server stops reading,
+// writes out what it had queued and passes its listening sockets, its
+// connections and its serialized state over that socket, then exits once the
+// new server has taken over. Descriptors go first, as SCM_RIGHTS in batches,
+// and arrive in the order they were sent; the state follows as one blob.
+
+#define UPGRADE_MAGIC 0x55504732u   // "UPG2", changes with the layout of the state
+#define UPGRADE_FD_BATCH 200        // Descriptors per message, below the kernel's limit of 253
+
+typedef struct {
+    char *data;
+    size_t len;                 // Bytes written
+    size_t cap;
+    size_t off;                 // Bytes read back
+    int failed;                 // A write ran out of memory or a read ran past the end
+} upgrade_state_t;
+
+void upgrade_put(upgrade_state_t *state, const void *data, size_t len);
+int upgrade_get(upgrade_state_t *state, void *data, size_t len);   // -1 and zeroed data past the end
+void upgrade_free(upgrade_state_t *state);
+
+int upgrade_connect(const char *path);  // Socket to the running server, -1 when none listens on path
+int upgrade_send(int sock, const upgrade_state_t *state, const int *fds, int count);
+int upgrade_recv(int sock, upgrade_state_t *state, int **fds, int *count);     // fds is allocated for the caller
+
+#endif